@@ -0,0 +1,473 @@
+/*
+ * df_batch.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <avr_uart.h>
+
+#include "df_batch.h"
+#include "df_input.h"
+
+/* Of what each UART sent, what's kept for the report */
+#define DF_BATCH_TRANSCRIPT_MAX (64 * 1024)
+
+static const char * const df_batch_result_str[] = {
+    [DF_BATCH_RUNNING] = "running",
+    [DF_BATCH_PASS] = "pass",
+    [DF_BATCH_FAIL] = "fail",
+    [DF_BATCH_TIMEOUT] = "timeout",
+    [DF_BATCH_CRASH] = "crash",
+    [DF_BATCH_STOPPED] = "stopped",
+};
+
+static uint64_t
+df_batch_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * What's matched of 'm' after 'at' bytes of it and then 'c'. Matches
+ * are followed byte by byte, as a KMP automaton without the table, the
+ * patterns are short.
+ */
+static size_t
+df_batch_match_step(const struct df_batch_match *m, size_t at, uint8_t c)
+{
+    size_t k;
+
+    if (at < m->len && m->data[at] == c)
+        return at + 1;
+
+    /* Longest prefix of 'm' that's a suffix of what we've matched plus c */
+    for (k = at; k > 0; k--) {
+        if (m->data[k - 1] == c &&
+                memcmp(m->data, m->data + at - k + 1, k - 1) == 0)
+            return k;
+    }
+
+    return 0;
+}
+
+static void
+df_batch_free_test(struct df_batch_test *t)
+{
+    size_t i;
+
+    free(t->name);
+    for (i = 0; i < t->firmware_len; i++)
+        free(t->firmware[i]);
+    free(t->firmware);
+    free(t->input);
+    for (i = 0; i < 2; i++) {
+        free(t->expect[i].data);
+        free(t->fail[i].data);
+    }
+}
+
+void
+df_batch_free(struct df_batch *b)
+{
+    size_t i;
+
+    if (!b)
+        return;
+
+    for (i = 0; i < b->count; i++)
+        df_batch_free_test(&b->test[i]);
+    free(b->test);
+    free(b);
+}
+
+/* 'uartN DATA' */
+static int
+df_batch_parse_match(char *arg, struct df_batch_match *m)
+{
+    struct df_batch_match *which;
+    int n;
+    long len;
+
+    if (strncmp(arg, "uart", 4) || (arg[4] != '0' && arg[4] != '1') ||
+            !isspace((unsigned char)arg[5]))
+        return -1;
+    n = arg[4] - '0';
+    which = &m[n];
+
+    free(which->data);
+    which->data = malloc(strlen(arg) + 1);
+    if (!which->data)
+        return -1;
+
+    len = df_input_data(arg + 5, which->data);
+    if (len <= 0)
+        return -1;
+    which->len = len;
+
+    return 0;
+}
+
+static int
+df_batch_parse_line(struct df_batch_test *t, const char *key, char *arg)
+{
+    char **firmware;
+    char *end;
+
+    if (strcmp(key, "firmware") == 0) {
+        firmware = realloc(t->firmware,
+                (t->firmware_len + 1) * sizeof(*firmware));
+        if (!firmware)
+            return -1;
+        t->firmware = firmware;
+        if (!(t->firmware[t->firmware_len] = strdup(arg)))
+            return -1;
+        t->firmware_len++;
+    } else if (strcmp(key, "input") == 0) {
+        free(t->input);
+        if (!(t->input = strdup(arg)))
+            return -1;
+    } else if (strcmp(key, "expect") == 0) {
+        return df_batch_parse_match(arg, t->expect);
+    } else if (strcmp(key, "fail") == 0) {
+        return df_batch_parse_match(arg, t->fail);
+    } else if (strcmp(key, "cycles") == 0) {
+        errno = 0;
+        t->cycles = strtoull(arg, &end, 0);
+        if (errno || end == arg || *end || !t->cycles)
+            return -1;
+    } else if (strcmp(key, "timeout") == 0) {
+        t->timeout = strtod(arg, &end);
+        if (end == arg || *end || !(t->timeout > 0))
+            return -1;
+    } else if (strcmp(key, "resets") == 0) {
+        errno = 0;
+        t->resets = strtoul(arg, &end, 0);
+        if (errno || end == arg || *end || !t->resets)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+struct df_batch *
+df_batch_load(const char *path)
+{
+    struct df_batch *b;
+    struct df_batch_test *t = NULL;
+    unsigned int lineno = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    char *key;
+    char *arg;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open manifest '%s': %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        fprintf(stderr, "Failed to allocate memory for manifest.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    while ((len = getline(&line, &size, f)) != -1) {
+        lineno++;
+
+        while (len && isspace((unsigned char)line[len - 1]))
+            line[--len] = '\0';
+        for (key = line; isspace((unsigned char)*key); key++)
+            ;
+        if (!*key || *key == '#')
+            continue;
+
+        for (arg = key; *arg && !isspace((unsigned char)*arg); arg++)
+            ;
+        if (*arg)
+            *arg++ = '\0';
+        while (isspace((unsigned char)*arg))
+            arg++;
+        if (!*arg)
+            goto bad;
+
+        if (strcmp(key, "test") == 0) {
+            t = realloc(b->test, (b->count + 1) * sizeof(*t));
+            if (!t)
+                goto nomem;
+            b->test = t;
+            t = &b->test[b->count++];
+            memset(t, 0, sizeof(*t));
+            if (!(t->name = strdup(arg)))
+                goto nomem;
+            continue;
+        }
+
+        if (!t || df_batch_parse_line(t, key, arg))
+            goto bad;
+    }
+
+    for (t = b->test; t < b->test + b->count; t++) {
+        if (!t->cycles && !t->timeout) {
+            fprintf(stderr, "%s: test '%s' needs 'cycles' or 'timeout'.\n",
+                    path, t->name);
+            goto fail;
+        }
+    }
+
+    if (!b->count) {
+        fprintf(stderr, "%s: no tests.\n", path);
+        goto fail;
+    }
+
+    free(line);
+    fclose(f);
+    return b;
+
+bad:
+    fprintf(stderr, "%s:%u: invalid line, expected 'test NAME' or one of "
+            "its 'firmware', 'input', 'expect', 'fail', 'cycles', "
+            "'timeout' or 'resets'\n", path, lineno);
+    goto fail;
+nomem:
+    fprintf(stderr, "Failed to allocate memory for manifest.\n");
+fail:
+    free(line);
+    fclose(f);
+    df_batch_free(b);
+    return NULL;
+}
+
+/* Settle the test, the board stops after the instruction it's in */
+static void
+df_batch_end(struct df_batch_run *r, enum df_batch_result result,
+        const char *reason)
+{
+    if (r->result != DF_BATCH_RUNNING)
+        return;
+
+    r->result = result;
+    r->reason = reason;
+    r->wall_ns = r->start_ns ? df_batch_now_ns() - r->start_ns : 0;
+    r->avr->state = cpu_Done;
+}
+
+static void
+df_batch_uart_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    struct df_batch_uart *u = param;
+    struct df_batch_run *r = u->run;
+    const struct df_batch_test *t = r->test;
+    uint8_t c = value;
+    uint8_t *buf;
+    int n;
+
+    (void)irq;
+
+    if (r->result != DF_BATCH_RUNNING)
+        return;
+
+    if (u->len == u->size && u->size < DF_BATCH_TRANSCRIPT_MAX) {
+        buf = realloc(u->buf, u->size ? u->size * 2 : 256);
+        if (buf) {
+            u->buf = buf;
+            u->size = u->size ? u->size * 2 : 256;
+        }
+    }
+    if (u->len < u->size)
+        u->buf[u->len++] = c;
+    else
+        u->dropped++;
+
+    if (t->fail[u->n].len) {
+        u->fail_at = df_batch_match_step(&t->fail[u->n], u->fail_at, c);
+        if (u->fail_at == t->fail[u->n].len) {
+            df_batch_end(r, DF_BATCH_FAIL, u->n ? "uart1 sent the failure "
+                    "pattern" : "uart0 sent the failure pattern");
+            return;
+        }
+    }
+
+    if (t->expect[u->n].len && !u->seen) {
+        u->expect_at = df_batch_match_step(&t->expect[u->n], u->expect_at,
+                c);
+        u->seen = u->expect_at == t->expect[u->n].len;
+    }
+
+    if (!t->expect[u->n].len || !u->seen)
+        return;
+
+    /* Every UART we were waiting on has said what it should */
+    for (n = 0; n < 2; n++) {
+        if (t->expect[n].len && !r->uart[n].seen)
+            return;
+    }
+    df_batch_end(r, DF_BATCH_PASS, "expected output seen");
+}
+
+static avr_cycle_count_t
+df_batch_budget(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct df_batch_run *r = param;
+
+    (void)avr;
+    (void)when;
+
+    if (r->test->expect[0].len || r->test->expect[1].len)
+        df_batch_end(r, DF_BATCH_TIMEOUT, "cycle budget ran out");
+    else
+        df_batch_end(r, DF_BATCH_PASS, "ran its cycles");
+    return 0;
+}
+
+struct df_batch_run *
+df_batch_start(const struct df_batch_test *test, struct avr_t *avr)
+{
+    struct df_batch_run *r;
+    avr_irq_t *irq;
+    int n;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        fprintf(stderr, "Failed to allocate memory for test.\n");
+        return NULL;
+    }
+    r->test = test;
+    r->avr = avr;
+
+    for (n = 0; n < 2; n++) {
+        r->uart[n].run = r;
+        r->uart[n].n = n;
+        irq = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0' + n),
+                UART_IRQ_OUTPUT);
+        if (irq)
+            avr_irq_register_notify(irq, df_batch_uart_hook, &r->uart[n]);
+    }
+
+    if (test->cycles)
+        avr_cycle_timer_register(avr, test->cycles, df_batch_budget, r);
+
+    return r;
+}
+
+int
+df_batch_check(struct df_batch_run *r, unsigned int resets)
+{
+    uint64_t now = df_batch_now_ns();
+
+    /* Timed from when it first ran */
+    if (!r->start_ns)
+        r->start_ns = now;
+
+    r->resets = resets;
+    if (r->test->resets && resets >= r->test->resets)
+        df_batch_end(r, DF_BATCH_CRASH, "reset too many times");
+    else if (r->test->timeout &&
+            now - r->start_ns >= r->test->timeout * 1e9)
+        df_batch_end(r, DF_BATCH_TIMEOUT, "time budget ran out");
+
+    return r->result != DF_BATCH_RUNNING;
+}
+
+void
+df_batch_finish(struct df_batch_run *r, int quit)
+{
+    if (quit)
+        df_batch_end(r, DF_BATCH_STOPPED, "drumfish was stopped");
+    else if (r->test->expect[0].len || r->test->expect[1].len)
+        df_batch_end(r, DF_BATCH_FAIL, "firmware stopped");
+    else
+        df_batch_end(r, DF_BATCH_PASS, "firmware stopped");
+}
+
+/* 'len' bytes of 'buf' as a JSON string */
+static void
+df_batch_json(FILE *f, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    putc('"', f);
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '"' || buf[i] == '\\')
+            fprintf(f, "\\%c", buf[i]);
+        else if (buf[i] == '\n')
+            fputs("\\n", f);
+        else if (buf[i] == '\r')
+            fputs("\\r", f);
+        else if (buf[i] < 0x20 || buf[i] >= 0x7f)
+            fprintf(f, "\\u%04x", buf[i]);
+        else
+            putc(buf[i], f);
+    }
+    putc('"', f);
+}
+
+void
+df_batch_report(FILE *f, const struct df_batch_run *r, unsigned int id)
+{
+    const struct df_batch_uart *u;
+    int n;
+
+    fputs("{\"test\": ", f);
+    df_batch_json(f, (const uint8_t *)r->test->name, strlen(r->test->name));
+    fprintf(f, ", \"board\": %u, \"result\": \"%s\", \"reason\": \"%s\""
+            ", \"cycles\": %" PRIu64 ", \"sim_s\": %.6f, \"wall_s\": %.3f"
+            ", \"resets\": %u", id, df_batch_result_str[r->result],
+            r->reason ? r->reason : "", (uint64_t)r->avr->cycle,
+            (double)r->avr->cycle / r->avr->frequency, r->wall_ns / 1e9,
+            r->resets);
+    for (n = 0; n < 2; n++) {
+        u = &r->uart[n];
+        fprintf(f, ", \"uart%d\": ", n);
+        df_batch_json(f, u->buf, u->len);
+        if (u->dropped)
+            fprintf(f, ", \"uart%d_dropped\": %" PRIu64, n, u->dropped);
+    }
+    fputs("}\n", f);
+}
+
+void
+df_batch_run_free(struct df_batch_run *r)
+{
+    if (!r)
+        return;
+
+    free(r->uart[0].buf);
+    free(r->uart[1].buf);
+    free(r);
+}
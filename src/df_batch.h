@@ -0,0 +1,117 @@
+/*
+ * df_batch.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_BATCH_H__
+#define __DF_BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct avr_t;
+
+/* How a test ended */
+enum df_batch_result {
+    DF_BATCH_RUNNING,
+    DF_BATCH_PASS,
+    DF_BATCH_FAIL,
+    DF_BATCH_TIMEOUT,
+    DF_BATCH_CRASH,
+    DF_BATCH_STOPPED,       /**< drumfish was asked to quit */
+};
+
+/* Something to look for in what a UART sends */
+struct df_batch_match {
+    uint8_t *data;
+    size_t len;
+};
+
+/* One test of a manifest */
+struct df_batch_test {
+    char *name;
+    char **firmware;        /**< loaded after any '-f' */
+    size_t firmware_len;
+    char *input;            /**< as '--input', or NULL */
+    struct df_batch_match expect[2];    /**< per UART, passes once seen */
+    struct df_batch_match fail[2];      /**< per UART, fails once seen */
+    uint64_t cycles;        /**< budget, 0 for none */
+    double timeout;         /**< wall clock budget in seconds, 0 for none */
+    unsigned int resets;    /**< fail at this many resets, 0 never */
+};
+
+struct df_batch {
+    struct df_batch_test *test;
+    size_t count;
+};
+
+/* What a UART sent during a test */
+struct df_batch_uart {
+    struct df_batch_run *run;
+    int n;
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+    uint64_t dropped;       /**< bytes past what we keep */
+    size_t expect_at;       /**< bytes of 'expect' matched so far */
+    size_t fail_at;         /**< and of 'fail' */
+    int seen;               /**< the expected output went by */
+};
+
+/* A test running on a board */
+struct df_batch_run {
+    const struct df_batch_test *test;
+    struct avr_t *avr;
+    enum df_batch_result result;
+    const char *reason;
+    uint64_t start_ns;
+    uint64_t wall_ns;
+    unsigned int resets;
+    struct df_batch_uart uart[2];
+};
+
+/*
+ * Read a manifest, a stanza per test of 'test NAME' followed by lines of
+ * 'firmware FILE', 'input FILE', 'expect uartN DATA', 'fail uartN DATA',
+ * 'cycles N', 'timeout SECONDS' and 'resets N'.
+ */
+struct df_batch *df_batch_load(const char *path);
+
+void df_batch_free(struct df_batch *b);
+
+/* Watch the board running 'test', from its first cycle */
+struct df_batch_run *df_batch_start(const struct df_batch_test *test,
+        struct avr_t *avr);
+
+/*
+ * Between slices, with the board's reset count. Returns non-zero once the
+ * test is over.
+ */
+int df_batch_check(struct df_batch_run *r, unsigned int resets);
+
+/* The board stopped, or we were asked to, before a verdict */
+void df_batch_finish(struct df_batch_run *r, int quit);
+
+/* A JSON line of how it went */
+void df_batch_report(FILE *f, const struct df_batch_run *r, unsigned int id);
+
+void df_batch_run_free(struct df_batch_run *r);
+
+#endif /* __DF_BATCH_H__ */
@@ -0,0 +1,995 @@
+/*
+ * df_board.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_cycle_timers.h>
+#include <sim_gdb.h>
+
+#include "drumfish.h"
+#include "df_batch.h"
+#include "df_board.h"
+#include "df_clock.h"
+#include "df_cores.h"
+#include "df_cov.h"
+#include "df_decode.h"
+#include "df_log.h"
+#include "df_medium.h"
+#include "df_prof.h"
+#include "df_snapshot.h"
+#include "flash.h"
+#include "uart_pty.h"
+
+/* How many instructions a worker runs on one board before moving on
+ * to the next board it owns.
+ */
+#define DF_BOARD_SLICE 4096
+
+/* A worker's floor when none of its boards is holding anyone back */
+#define DF_FLOOR_IDLE UINT64_MAX
+
+/* When paced, how far ahead of the wall clock boards may run */
+#define DF_PACE_AHEAD_NS    1000000
+/* and how far behind they may fall before we stop trying to catch up */
+#define DF_PACE_BEHIND_NS   100000000
+
+/* Set from signal handlers, polled by the workers */
+static volatile sig_atomic_t df_quit = 0;
+static volatile sig_atomic_t df_reset_gen = 0;
+
+struct df_worker {
+    /* the lowest cycle of any board we step, read by the other workers */
+    uint64_t floor __attribute__ ((aligned (64)));
+    pthread_t thread;
+    struct df_board *boards;
+    unsigned int count;
+    unsigned int first;
+    unsigned int stride;
+    struct df_worker *all;          /**< every worker, ourselves included */
+    unsigned int nworkers;
+    uint64_t lookahead;             /**< cycles, 0 to let boards run free */
+    int paced;                      /**< keep to the wall clock */
+    double cycle_ns;                /**< wall time per cycle */
+    uint64_t origin_ns;             /**< wall clock when 'origin_cycle' */
+    uint64_t origin_cycle;          /**< was due */
+};
+
+int
+df_mac_parse(const char *str, uint64_t *mac, int *octets)
+{
+    const char *p = str;
+    char *end;
+    unsigned long val;
+    int n = 0;
+
+    *mac = 0;
+
+    while (*p) {
+        errno = 0;
+        val = strtoul(p, &end, 16);
+        if (errno || end == p || end - p > 2 || val > 0xff || n == 8)
+            return -1;
+
+        *mac = (*mac << 8) | val;
+        n++;
+
+        if (*end == '\0')
+            break;
+        if (*end != ':')
+            return -1;
+        p = end + 1;
+    }
+
+    if (!n)
+        return -1;
+
+    *octets = n;
+    return 0;
+}
+
+int
+df_mac_check(const char *str, unsigned int count)
+{
+    uint64_t mac;
+    uint64_t max;
+    int octets;
+
+    if (df_mac_parse(str, &mac, &octets)) {
+        fprintf(stderr, "Invalid MAC address '%s'\n", str);
+        return -1;
+    }
+
+    max = octets == 8 ? UINT64_MAX : (1ULL << (octets * 8)) - 1;
+    if (count && max - mac < count - 1) {
+        fprintf(stderr, "MAC address '%s' leaves no room for %u boards "
+                "in %d octets.\n", str, count, octets);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *
+df_mac_format(uint64_t mac, int octets)
+{
+    char *str;
+    char *p;
+    int i;
+
+    str = malloc(octets * 3);
+    if (!str)
+        return NULL;
+
+    p = str;
+    for (i = octets - 1; i >= 0; i--) {
+        sprintf(p, "%02" PRIX64 "%s", (mac >> (i * 8)) & 0xff, i ? ":" : "");
+        p += 3;
+    }
+
+    return str;
+}
+
+static char *
+df_board_path(const char *path, unsigned int id)
+{
+    char *str;
+
+    if (asprintf(&str, "%s.%u", path, id) < 0)
+        return NULL;
+
+    return str;
+}
+
+static char *
+df_board_uart_path(const char *path, unsigned int id, char uart)
+{
+    unsigned long port;
+    char *end;
+    char *str;
+
+    if (strcmp(path, "off") == 0)
+        return strdup(path);
+
+    /* Keep the default location, but make it unique per board */
+    if (strcmp(path, "on") == 0) {
+        if (asprintf(&str, "/tmp/drumfish-%d-%u-uart%c",
+                    getpid(), id, uart) < 0)
+            return NULL;
+        return str;
+    }
+
+    /* Ports count up from the first, like GDB's. One that doesn't parse
+     * is left for the UART to complain about.
+     */
+    if (strncmp(path, "tcp:", 4) == 0) {
+        port = strtoul(path + 4, &end, 10);
+        if (end != path + 4 && *end == '\0') {
+            if (asprintf(&str, "tcp:%lu", port + id) < 0)
+                return NULL;
+            return str;
+        }
+    }
+
+    return df_board_path(path, id);
+}
+
+/*
+ * Each board gets its own copy of the configuration. With a single board
+ * it's used as is, with more than one ('multi') every file, MAC and port
+ * the boards would otherwise share is made unique using the board's id.
+ */
+static int
+df_board_config(struct df_board *board, const struct drumfish_cfg *base,
+        int multi)
+{
+    struct drumfish_cfg *config = &board->config;
+    uint64_t mac;
+    int octets;
+    int i;
+
+    *config = *base;
+    config->mac = NULL;
+    config->pflash = NULL;
+    config->save_snapshot = NULL;
+    config->restore_snapshot = NULL;
+    config->profile = NULL;
+    config->coverage = NULL;
+    config->stats = NULL;
+    config->uart_record = NULL;
+    config->uart_replay = NULL;
+    config->uart_trace = NULL;
+    config->input = NULL;
+    for (i = 0; i < DF_PERIPHERAL_MAX; i++)
+        config->peripherals[i] = NULL;
+
+    if (!multi) {
+        config->pflash = strdup(base->pflash);
+        if (base->mac)
+            config->mac = strdup(base->mac);
+        for (i = 0; i < DF_PERIPHERAL_MAX; i++)
+            config->peripherals[i] = strdup(base->peripherals[i]);
+        if (base->save_snapshot &&
+                !(config->save_snapshot = strdup(base->save_snapshot)))
+            goto nomem;
+        if (base->restore_snapshot &&
+                !(config->restore_snapshot = strdup(base->restore_snapshot)))
+            goto nomem;
+        if (base->profile && !(config->profile = strdup(base->profile)))
+            goto nomem;
+        if (base->coverage && !(config->coverage = strdup(base->coverage)))
+            goto nomem;
+        if (base->stats && !(config->stats = strdup(base->stats)))
+            goto nomem;
+        if (base->uart_record &&
+                !(config->uart_record = strdup(base->uart_record)))
+            goto nomem;
+        if (base->uart_replay &&
+                !(config->uart_replay = strdup(base->uart_replay)))
+            goto nomem;
+        if (base->uart_trace &&
+                !(config->uart_trace = strdup(base->uart_trace)))
+            goto nomem;
+        if (base->input && !(config->input = strdup(base->input)))
+            goto nomem;
+        goto check;
+    }
+
+    config->pflash = df_board_path(base->pflash, board->id);
+
+    if (base->save_snapshot && !(config->save_snapshot =
+                df_board_path(base->save_snapshot, board->id)))
+        goto nomem;
+    if (base->restore_snapshot && !(config->restore_snapshot =
+                df_board_path(base->restore_snapshot, board->id)))
+        goto nomem;
+    if (base->profile && !(config->profile =
+                df_board_path(base->profile, board->id)))
+        goto nomem;
+    if (base->coverage && !(config->coverage =
+                df_board_path(base->coverage, board->id)))
+        goto nomem;
+    if (base->stats && !(config->stats =
+                df_board_path(base->stats, board->id)))
+        goto nomem;
+    if (base->uart_record && !(config->uart_record =
+                df_board_path(base->uart_record, board->id)))
+        goto nomem;
+    if (base->uart_replay && !(config->uart_replay =
+                df_board_path(base->uart_replay, board->id)))
+        goto nomem;
+    if (base->uart_trace && !(config->uart_trace =
+                df_board_path(base->uart_trace, board->id)))
+        goto nomem;
+    if (base->input && !(config->input =
+                df_board_path(base->input, board->id)))
+        goto nomem;
+
+    if (base->mac) {
+        if (df_mac_parse(base->mac, &mac, &octets)) {
+            fprintf(stderr, "Invalid MAC address '%s'\n", base->mac);
+            return -1;
+        }
+        config->mac = df_mac_format(mac + board->id, octets);
+        if (!config->mac)
+            goto nomem;
+    }
+
+    for (i = 0; i < DF_PERIPHERAL_MAX; i++) {
+        if (i == DF_PERIPHERAL_UART0 || i == DF_PERIPHERAL_UART1)
+            config->peripherals[i] = df_board_uart_path(base->peripherals[i],
+                    board->id, '0' + (i - DF_PERIPHERAL_UART0));
+        else
+            config->peripherals[i] = strdup(base->peripherals[i]);
+    }
+
+    if (config->gdb)
+        config->gdb += board->id;
+
+check:
+    /* A test brings its own input */
+    if (base->batch && base->batch->test[board->id].input &&
+            !(config->input = strdup(base->batch->test[board->id].input)))
+        goto nomem;
+
+    if (!config->pflash)
+        goto nomem;
+    for (i = 0; i < DF_PERIPHERAL_MAX; i++) {
+        if (!config->peripherals[i])
+            goto nomem;
+    }
+
+    return 0;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for board %u config.\n",
+            board->id);
+    return -1;
+}
+
+static void
+df_board_config_free(struct drumfish_cfg *config)
+{
+    int i;
+
+    free(config->mac);
+    free(config->pflash);
+    free(config->save_snapshot);
+    free(config->restore_snapshot);
+    free(config->profile);
+    free(config->coverage);
+    free(config->stats);
+    free(config->uart_record);
+    free(config->uart_replay);
+    free(config->uart_trace);
+    free(config->input);
+    for (i = 0; i < DF_PERIPHERAL_MAX; i++)
+        free(config->peripherals[i]);
+}
+
+static void
+df_board_sleep(avr_t *avr, avr_cycle_count_t how_long)
+{
+    (void)avr;
+    (void)how_long;
+}
+
+/* If the user wants to run the core with GDB server enabled, set that up */
+static void
+df_board_gdb(struct df_board *board)
+{
+    avr_t *avr = board->avr;
+
+    if (board->config.gdb) {
+        avr->gdb_port = board->config.gdb;
+        /* Normally starting the CPU should be in limbo, but the
+         * GDB code of simavr wants it to be stopped.
+         */
+        avr->state = cpu_Stopped;
+
+        avr_gdb_init(avr);
+    } else {
+        /* Idle time is accounted for by the workers, not slept away */
+        avr->sleep = df_board_sleep;
+    }
+}
+
+int
+df_board_create(struct df_board *board, unsigned int id,
+        const struct drumfish_cfg *base,
+        char * const *flash_file, size_t flash_file_len)
+{
+    const struct df_batch_test *test;
+    avr_t *avr;
+
+    memset(board, 0, sizeof(*board));
+    board->id = id;
+    board->state = cpu_Limbo;
+
+    if (df_board_config(board, base, base->boards > 1))
+        return -1;
+
+    if (board->config.pflash_private)
+        printf("Board %u Programmable Flash Storage: in memory\n", id);
+    else if (base->boards > 1)
+        printf("Board %u Programmable Flash Storage: %s\n", id,
+                board->config.pflash);
+    else
+        printf("Programmable Flash Storage: %s\n", board->config.pflash);
+
+    avr = m128rfa1_create(&board->config);
+    if (!avr) {
+        fprintf(stderr, "Unable to initialize board %u.\n", id);
+        return -1;
+    }
+    board->avr = avr;
+    board->clock = m128rfa1_clock(avr);
+
+    if (board->config.profile) {
+        board->prof = df_prof_create(avr);
+        if (!board->prof)
+            return -1;
+    }
+
+    if (board->config.coverage) {
+        board->cov = df_cov_create(avr);
+        if (!board->cov)
+            return -1;
+    }
+
+    /* Flash in any requested firmware */
+    for (size_t i = 0; i < flash_file_len; i++) {
+        if (flash_load(flash_file[i], avr->flash, avr->flashend + 1)) {
+            fprintf(stderr, "Failed to load '%s' into flash.\n",
+                    flash_file[i]);
+            return -1;
+        }
+    }
+
+    /* And the test's own */
+    test = base->batch ? &base->batch->test[id] : NULL;
+    for (size_t i = 0; test && i < test->firmware_len; i++) {
+        if (flash_load(test->firmware[i], avr->flash, avr->flashend + 1)) {
+            fprintf(stderr, "Failed to load '%s' into flash.\n",
+                    test->firmware[i]);
+            return -1;
+        }
+    }
+
+    /* Don't leave new firmware to the sync policy */
+    if ((flash_file_len || (test && test->firmware_len)) &&
+            m128rfa1_flash_sync(avr))
+        return -1;
+
+    /* Pick up where the snapshot left off, rather than booting */
+    if (board->config.restore_snapshot &&
+            df_snapshot_restore(avr, board->config.restore_snapshot)) {
+        fprintf(stderr, "Failed to restore board %u from '%s'.\n", id,
+                board->config.restore_snapshot);
+        return -1;
+    }
+
+    /* Ensure the instruction we're about to execute is legit */
+    if (avr->flash[avr->pc] == 0xff) {
+        fprintf(stderr, "No firmware loaded in programmable flash, unable "
+                "to boot.\n");
+        fprintf(stderr, "Try using '-f firmware.hex' to supply one.\n");
+        return -1;
+    }
+
+    if (test) {
+        board->batch = df_batch_start(test, avr);
+        if (!board->batch)
+            return -1;
+    }
+
+    /* A template's clones get their own GDB servers */
+    if (!base->clones)
+        df_board_gdb(board);
+
+    return 0;
+}
+
+/* Let go of the board's threads and host resources before a fork() */
+void
+df_board_unplug(struct df_board *board)
+{
+    m128rfa1_unplug(board->avr);
+}
+
+/*
+ * Turn the board we were forked off of, after df_board_unplug(), into
+ * clone 'id'. It gets its own files, UARTs, MAC and GDB port as though it
+ * were board 'id' of many, but keeps its state and, until it writes to
+ * them, shares its memory and flash with every other clone.
+ */
+int
+df_board_clone(struct df_board *board, unsigned int id,
+        const struct drumfish_cfg *base)
+{
+    df_board_config_free(&board->config);
+    board->id = id;
+
+    /* The core points at 'board->config', so this is the clone's now */
+    if (df_board_config(board, base, 1))
+        return -1;
+
+    printf("Clone %u Programmable Flash Storage: %s\n", id,
+            board->config.pflash);
+
+    if (m128rfa1_replug(board->avr)) {
+        fprintf(stderr, "Unable to set up clone %u.\n", id);
+        return -1;
+    }
+
+    df_board_gdb(board);
+
+    return 0;
+}
+
+void
+df_board_destroy(struct df_board *board)
+{
+    if (board->prof && df_prof_dump(board->prof, board->config.profile))
+        fprintf(stderr, "Failed to save board %u's profile.\n", board->id);
+    df_prof_free(board->prof);
+    board->prof = NULL;
+    if (board->cov && df_cov_dump(board->cov, board->avr,
+                board->config.coverage))
+        fprintf(stderr, "Failed to save board %u's coverage.\n", board->id);
+    df_cov_free(board->cov);
+    board->cov = NULL;
+    df_batch_run_free(board->batch);
+    board->batch = NULL;
+
+    if (board->avr) {
+        avr_terminate(board->avr);
+        board->avr = NULL;
+    }
+
+    df_board_config_free(&board->config);
+}
+
+static avr_cycle_count_t
+df_board_sync(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    /* Only here so a sleeping core can't skip past the end of its slice */
+    (void)avr;
+    (void)when;
+    (void)param;
+
+    return 0;
+}
+
+/* Save a board that's done running, if asked to */
+int
+df_board_save(struct df_board *board)
+{
+    if (!board->avr || !board->config.save_snapshot)
+        return 0;
+
+    /* Slice ends are ours, not the board's */
+    avr_cycle_timer_cancel(board->avr, df_board_sync, board);
+
+    if (df_snapshot_save(board->avr, board->config.save_snapshot)) {
+        fprintf(stderr, "Failed to save board %u to '%s'.\n", board->id,
+                board->config.save_snapshot);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint16_t
+df_board_sp(const avr_t *avr)
+{
+    return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+/*
+ * Run one board for a slice, without letting it get to cycle 'limit'.
+ * Returns non-zero once the board is done.
+ */
+static int
+df_board_slice(struct df_board *board, uint64_t limit)
+{
+    avr_t *avr = board->avr;
+    struct df_decode *dc = m128rfa1_decode(avr);
+    unsigned int gen = df_reset_gen;
+    unsigned int n;
+    int i;
+
+    df_log_set_clock(board->clock);
+
+    if (board->reset_gen != gen) {
+        board->reset_gen = gen;
+        df_log_msg(DF_LOG_INFO, "Board %u reset\n", board->id);
+        avr_reset(avr);
+    }
+
+    if (limit != DF_FLOOR_IDLE) {
+        if (avr->cycle >= limit)
+            return 0;
+        avr_cycle_timer_register(avr, limit - avr->cycle, df_board_sync,
+                board);
+    }
+
+    for (i = 0; i < DF_BOARD_SLICE && avr->cycle < limit; i++) {
+        /* As far as the pre-decoded flash takes it, avr_run() for the rest */
+        if (dc) {
+            n = df_decode_run(dc, avr, DF_BOARD_SLICE - i);
+            board->insns += n;
+            i += n;
+        }
+        if (board->state != cpu_Sleeping)
+            board->insns++;
+        if (board->prof)
+            df_prof_before(board->prof, avr);
+        if (board->cov)
+            df_cov_before(board->cov, avr->pc, df_board_sp(avr),
+                    avr->sreg[S_I], avr->state == cpu_Sleeping);
+        board->state = avr_run(avr);
+        if (board->prof)
+            df_prof_after(board->prof, avr);
+        if (board->cov)
+            df_cov_after(board->cov, avr->pc, df_board_sp(avr),
+                    avr->sreg[S_I]);
+        df_clock_publish(board->clock, avr->cycle);
+
+        if (board->state == cpu_Done) {
+            board->done = 1;
+            break;
+        } else if (board->state == cpu_Crashed) {
+            /* many firmwares disable interrupts and enable the watchdog
+             * to cause the MCU to reboot. simavr treats that state as
+             * cpu_Crashed
+             */
+            df_log_msg(DF_LOG_INFO, "Board %u CPU rebooted\n", board->id);
+            board->resets++;
+            if (board->batch && df_batch_check(board->batch, board->resets)) {
+                board->done = 1;
+                break;
+            }
+            avr_reset(avr);
+        }
+    }
+
+    if (board->batch) {
+        if (board->done)
+            df_batch_finish(board->batch, 0);
+        else if (df_batch_check(board->batch, board->resets))
+            board->done = 1;
+    }
+
+    m128rfa1_uart_tick(avr);
+
+    if (m128rfa1_flash_tick(avr))
+        df_log_msg(DF_LOG_ERR, "Board %u failed to sync flash\n", board->id);
+
+    return board->done;
+}
+
+/*
+ * How far our boards may run: 'lookahead' past the slowest board of any
+ * worker, since nothing that board does can reach another board sooner.
+ */
+static uint64_t
+df_worker_limit(struct df_worker *w)
+{
+    uint64_t floor = DF_FLOOR_IDLE;
+    uint64_t f;
+    unsigned int i;
+
+    if (!w->lookahead)
+        return DF_FLOOR_IDLE;
+
+    for (i = 0; i < w->nworkers; i++) {
+        f = __atomic_load_n(&w->all[i].floor, __ATOMIC_ACQUIRE);
+        if (f < floor)
+            floor = f;
+    }
+
+    return floor == DF_FLOOR_IDLE ? floor : floor + w->lookahead;
+}
+
+static uint64_t
+df_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * When paced, the cycle our boards may run up to right now. Deadlines
+ * are always worked out from a fixed origin so rounding and oversleeping
+ * never accumulate.
+ */
+static uint64_t
+df_worker_pace(struct df_worker *w, uint64_t now)
+{
+    return w->origin_cycle +
+        (uint64_t)((now - w->origin_ns + DF_PACE_AHEAD_NS) / w->cycle_ns);
+}
+
+/* Nothing of ours can run until the wall clock catches up to 'floor' */
+static void
+df_worker_wait(struct df_worker *w, uint64_t floor)
+{
+    uint64_t due = w->origin_ns +
+        (uint64_t)((floor - w->origin_cycle) * w->cycle_ns);
+    uint64_t now = df_now_ns();
+    struct timespec ts;
+
+    if (due <= now) {
+        /* Stopped in gdb or just can't keep up. Start over from here
+         * rather than sprinting to make up for it.
+         */
+        if (now - due > DF_PACE_BEHIND_NS) {
+            w->origin_ns = now;
+            w->origin_cycle = floor;
+        }
+        return;
+    }
+
+    ts.tv_sec = due / 1000000000ULL;
+    ts.tv_nsec = due % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+            EINTR && !df_quit)
+        ;
+}
+
+static void *
+df_worker_run(void *param)
+{
+    struct df_worker *w = param;
+    struct df_board *board;
+    uint64_t limit;
+    uint64_t pace = DF_FLOOR_IDLE;
+    uint64_t floor;
+    uint64_t before;
+    unsigned int live;
+    unsigned int i;
+    int moved;
+
+    /* Restored boards don't start at cycle 0 */
+    w->origin_ns = df_now_ns();
+    w->origin_cycle = DF_FLOOR_IDLE;
+    for (i = w->first; i < w->count; i += w->stride) {
+        if (w->boards[i].avr->cycle < w->origin_cycle)
+            w->origin_cycle = w->boards[i].avr->cycle;
+    }
+
+    do {
+        limit = df_worker_limit(w);
+        if (w->paced) {
+            pace = df_worker_pace(w, df_now_ns());
+            if (pace < limit)
+                limit = pace;
+        }
+        floor = DF_FLOOR_IDLE;
+        live = 0;
+        moved = 0;
+
+        for (i = w->first; i < w->count; i += w->stride) {
+            board = &w->boards[i];
+            if (board->done)
+                continue;
+
+            before = board->avr->cycle;
+            if (!df_board_slice(board, limit)) {
+                live++;
+                if (board->avr->cycle < floor)
+                    floor = board->avr->cycle;
+            }
+            moved |= board->avr->cycle != before;
+        }
+
+        if (w->lookahead) {
+            /* Our boards only ever move forward, so a floor that's out of
+             * date by the time someone reads it is merely conservative.
+             */
+            __atomic_store_n(&w->floor, floor, __ATOMIC_RELEASE);
+
+            /* Everything we own is waiting on another worker */
+            if (live && !moved && limit != pace)
+                sched_yield();
+        }
+
+        if (w->paced && live && (floor >= pace || !moved))
+            df_worker_wait(w, floor);
+    } while (live && !df_quit);
+
+    /* Don't hold anyone back once we're gone */
+    __atomic_store_n(&w->floor, DF_FLOOR_IDLE, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Step every board until they've all stopped or we're asked to quit.
+ * Board 'i' is owned by worker 'i % threads' for its whole life so a
+ * core is only ever touched by a single thread. The calling thread acts
+ * as the first worker.
+ *
+ * In lockstep every worker publishes the lowest cycle among its boards
+ * and no board may get more than the radio's lookahead past the lowest
+ * of those. That's a conservative parallel simulation without barriers:
+ * a board only waits when it's actually too far ahead, and the slowest
+ * board can always run. Given the same inputs every board then hears the
+ * same frames at the same cycles however the threads are scheduled.
+ */
+int
+df_boards_run(struct df_board *boards, const struct drumfish_cfg *config)
+{
+    struct df_worker *workers;
+    unsigned int count = config->boards;
+    unsigned int threads = config->threads;
+    unsigned int started;
+    unsigned int i;
+    int ret;
+
+    if (threads > count)
+        threads = count;
+    if (!threads)
+        threads = 1;
+
+    /* Keep each worker's floor on its own cache line */
+    if (posix_memalign((void **)&workers, __alignof__(*workers),
+                threads * sizeof(*workers))) {
+        fprintf(stderr, "Failed to allocate memory for workers.\n");
+        return -1;
+    }
+    memset(workers, 0, threads * sizeof(*workers));
+
+    for (i = 0; i < threads; i++) {
+        workers[i].boards = boards;
+        workers[i].count = count;
+        workers[i].first = i;
+        workers[i].stride = threads;
+        workers[i].all = workers;
+        workers[i].nworkers = threads;
+        if (config->lockstep && count > 1)
+            workers[i].lookahead = avr_usec_to_cycles(boards[0].avr,
+                    DF_MEDIUM_LOOKAHEAD_US);
+        workers[i].paced = config->speed > 0;
+        if (workers[i].paced)
+            workers[i].cycle_ns = 1e9 /
+                (boards[0].avr->frequency * config->speed);
+    }
+
+    for (started = 1; started < threads; started++) {
+        ret = pthread_create(&workers[started].thread, NULL, df_worker_run,
+                &workers[started]);
+        if (ret) {
+            df_log_msg(DF_LOG_ERR, "Failed to start worker %u: %s\n",
+                    started, strerror(ret));
+            df_quit = 1;
+            break;
+        }
+    }
+
+    df_worker_run(&workers[0]);
+
+    for (i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free(workers);
+
+    return df_quit ? -1 : 0;
+}
+
+/* Bytes a second, over 'span' units of which a second has 'per_s' */
+static double
+df_rate(uint64_t bytes, uint64_t span, double per_s)
+{
+    return span ? (double)bytes * per_s / (double)span : 0;
+}
+
+/* What running the boards for 'run_ns' took, as JSON for benchmarks */
+int
+df_boards_stats(const struct df_board *boards, unsigned int count,
+        const char *path, uint64_t run_ns)
+{
+    struct rusage ru;
+    uint64_t cpu_ns;
+    const uart_pty_t *p;
+    const char *sep;
+    unsigned int i;
+    int n;
+    FILE *f;
+
+    if (getrusage(RUSAGE_SELF, &ru)) {
+        fprintf(stderr, "Unable to get resource usage: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to create stats '%s': %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\"run_ns\": %" PRIu64 ", \"cpu_ns\": %" PRIu64
+            ", \"max_rss_kb\": %ld, \"boards\": [", run_ns, cpu_ns,
+            ru.ru_maxrss);
+    for (i = 0; i < count; i++) {
+        fprintf(f, "%s{\"id\": %u, \"cycles\": %" PRIu64
+                ", \"instructions\": %" PRIu64 ", \"frequency\": %u"
+                ", \"uarts\": [", i ? ", " : "", boards[i].id,
+                (uint64_t)boards[i].avr->cycle, boards[i].insns,
+                boards[i].avr->frequency);
+        sep = "";
+        for (n = 0; n < 2; n++) {
+            p = m128rfa1_uart(boards[i].avr, n);
+            if (!p)
+                continue;
+            fprintf(f, "%s{\"uart\": %c, \"timing\": \"%s\""
+                    ", \"tx_bytes\": %" PRIu64 ", \"tx_drops\": %" PRIu64
+                    ", \"rx_bytes\": %" PRIu64 ", \"rx_bytes_per_s\": %.0f"
+                    ", \"rx_bytes_per_sim_s\": %.0f, \"xon\": %" PRIu64
+                    ", \"xoff\": %" PRIu64 ", \"replay_diffs\": %" PRIu64
+                    "}", sep, p->uart,
+                    p->timing == DF_UART_TIMING_ACCURATE ? "accurate" :
+                    "turbo", p->tx_bytes, p->tx_drops, p->rx_bytes,
+                    df_rate(p->rx_bytes, p->rx_last_ns - p->rx_first_ns,
+                        1e9),
+                    df_rate(p->rx_bytes, p->rx_last_cycle - p->rx_first_cycle,
+                        boards[i].avr->frequency),
+                    p->xon_count, p->xoff_count, p->replay_diffs);
+            sep = ", ";
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "]}\n");
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write stats '%s': %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+df_boards_results(struct df_board *boards, unsigned int count,
+        const char *path)
+{
+    unsigned int i;
+    int failed = 0;
+    FILE *f = stdout;
+
+    if (path && !(f = fopen(path, "w"))) {
+        fprintf(stderr, "Unable to create results '%s': %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        /* Whatever's still going was cut short */
+        df_batch_finish(boards[i].batch, 1);
+        df_batch_report(f, boards[i].batch, boards[i].id);
+        if (boards[i].batch->result != DF_BATCH_PASS)
+            failed = 1;
+    }
+
+    if (path && fclose(f)) {
+        fprintf(stderr, "Failed to write results '%s': %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+
+    return failed;
+}
+
+/* Async-signal-safe, used from the signal handlers */
+void
+df_boards_quit(void)
+{
+    df_quit = 1;
+}
+
+void
+df_boards_reset(void)
+{
+    df_reset_gen++;
+}
@@ -0,0 +1,79 @@
+/*
+ * df_board.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_BOARD_H__
+#define __DF_BOARD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drumfish.h"
+
+struct avr_t;
+
+/* One emulated board and everything it owns */
+struct df_board {
+    unsigned int id;
+    struct drumfish_cfg config;     /**< this board's own copy */
+    struct avr_t *avr;
+    struct df_clock *clock;         /**< the cycle, for other threads */
+    struct df_prof *prof;           /**< with --profile */
+    struct df_cov *cov;             /**< with --coverage */
+    struct df_batch_run *batch;     /**< the test we run, with --batch */
+    unsigned int resets;            /**< by the firmware, e.g. watchdog */
+    uint64_t insns;                 /**< avr_run()s awake, and df_decode's */
+    int state;                      /**< last state returned by avr_run() */
+    int done;                       /**< the CPU has stopped for good */
+    unsigned int reset_gen;         /**< last reset request handled */
+};
+
+int df_mac_parse(const char *str, uint64_t *mac, int *octets);
+
+/* Check the 'count' MACs from 'str' up, one per board, all fit its octets */
+int df_mac_check(const char *str, unsigned int count);
+
+int df_board_create(struct df_board *board, unsigned int id,
+        const struct drumfish_cfg *base,
+        char * const *flash_file, size_t flash_file_len);
+
+void df_board_unplug(struct df_board *board);
+
+int df_board_clone(struct df_board *board, unsigned int id,
+        const struct drumfish_cfg *base);
+
+void df_board_destroy(struct df_board *board);
+
+int df_board_save(struct df_board *board);
+
+int df_boards_run(struct df_board *boards, const struct drumfish_cfg *config);
+
+int df_boards_stats(const struct df_board *boards, unsigned int count,
+        const char *path, uint64_t run_ns);
+
+/* Write how each board's test went, returns non-zero if any didn't pass */
+int df_boards_results(struct df_board *boards, unsigned int count,
+        const char *path);
+
+void df_boards_quit(void);
+
+void df_boards_reset(void);
+
+#endif /* __DF_BOARD_H__ */
@@ -0,0 +1,49 @@
+/*
+ * df_clock.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_CLOCK_H__
+#define __DF_CLOCK_H__
+
+#include <stdint.h>
+
+/*
+ * Where a board's CPU is at, for threads other than the one running it.
+ * The running thread publishes the cycle as it goes, others get a whole
+ * value from some point in the recent past, never a torn one.
+ */
+struct df_clock {
+    uint64_t cycle;
+    uint32_t frequency;         /**< of the CPU, in Hz */
+};
+
+static inline void
+df_clock_publish(struct df_clock *c, uint64_t cycle)
+{
+    __atomic_store_n(&c->cycle, cycle, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t
+df_clock_cycle(const struct df_clock *c)
+{
+    return __atomic_load_n(&c->cycle, __ATOMIC_ACQUIRE);
+}
+
+#endif /* __DF_CLOCK_H__ */
@@ -22,7 +22,43 @@
 #ifndef __DF_CORES_H__
 #define __DF_CORES_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct df_decode;
+struct uart_pty_t;
+
 /* Cores */
 avr_t *m128rfa1_create(struct drumfish_cfg *config);
 
+/* Cloning a board with fork() */
+void m128rfa1_unplug(avr_t *avr);
+
+int m128rfa1_replug(avr_t *avr);
+
+/* Snapshot sections of a core's own peripherals */
+int m128rfa1_save(avr_t *avr, FILE *f);
+
+int m128rfa1_restore(avr_t *avr, FILE *f);
+
+struct df_clock *m128rfa1_clock(avr_t *avr);
+
+/* The board's flash pre-decoded, NULL if every instruction is simavr's */
+struct df_decode *m128rfa1_decode(avr_t *avr);
+
+/* UART 'n' if it's enabled, for its counters */
+const struct uart_pty_t *m128rfa1_uart(avr_t *avr, int n);
+
+/* Queue bytes for UART 'n' of a deterministic board, -1 if it's off */
+int m128rfa1_uart_inject(avr_t *avr, int n, const uint8_t *buf, size_t len);
+
+/* Between slices of running, for bytes the AVR hasn't asked for */
+void m128rfa1_uart_tick(avr_t *avr);
+
+/* Writing programmed flash back to its file */
+int m128rfa1_flash_sync(avr_t *avr);
+
+int m128rfa1_flash_tick(avr_t *avr);
+
 #endif /* __DF_CORES_H__ */
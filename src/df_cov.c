@@ -0,0 +1,251 @@
+/*
+ * df_cov.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "df_cov.h"
+#include "df_elf.h"
+
+/* Instructions that go one of two ways: BRBS/BRBC, CPSE, SBRC/SBRS and
+ * SBIC/SBIS. They're all one word, so not taken is always the next.
+ */
+#define OP_IS_BRANCH(op) \
+    (((op) & 0xf800) == 0xf000 || ((op) & 0xfc00) == 0x1000 || \
+     ((op) & 0xfc08) == 0xfc00 || ((op) & 0xfd00) == 0x9900)
+
+/* A function and the line it starts at */
+struct df_cov_func {
+    const struct df_elf_sym *sym;
+    const struct df_elf_line *line;
+};
+
+struct df_cov *
+df_cov_create(avr_t *avr)
+{
+    struct df_cov *c;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        goto nomem;
+
+    c->words = (avr->flashend + 1) / 2;
+    c->map = calloc(c->words, sizeof(*c->map));
+    if (!c->map)
+        goto nomem;
+
+    return c;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for coverage.\n");
+    df_cov_free(c);
+    return NULL;
+}
+
+static int
+df_cov_line_cmp(const void *a, const void *b)
+{
+    const struct df_elf_line *la = *(const struct df_elf_line * const *)a;
+    const struct df_elf_line *lb = *(const struct df_elf_line * const *)b;
+    int ret;
+
+    if ((ret = strcmp(la->file, lb->file)))
+        return ret;
+    if (la->line != lb->line)
+        return la->line < lb->line ? -1 : 1;
+    return la->addr < lb->addr ? -1 : la->addr > lb->addr ? 1 : 0;
+}
+
+static int
+df_cov_func_cmp(const void *a, const void *b)
+{
+    const struct df_cov_func *fa = a;
+    const struct df_cov_func *fb = b;
+
+    return df_cov_line_cmp(&fa->line, &fb->line);
+}
+
+/* One source file's record, its functions then its lines */
+static void
+df_cov_file(struct df_cov *c, avr_t *avr, FILE *f,
+        const struct df_elf_line * const *lines, size_t nlines,
+        const struct df_cov_func *funcs, size_t nfuncs)
+{
+    unsigned int found = 0, hit = 0, br_found = 0, br_hit = 0;
+    unsigned int branch;
+    const struct df_elf_line *l;
+    uint32_t addr, line;
+    uint16_t op;
+    uint8_t seen;
+    size_t i, j;
+    int ran;
+
+    fprintf(f, "TN:\nSF:%s\n", lines[0]->file);
+
+    for (i = 0; i < nfuncs; i++) {
+        fprintf(f, "FN:%u,%s\n", funcs[i].line->line, funcs[i].sym->name);
+        ran = !!(c->map[funcs[i].sym->addr / 2] & DF_COV_EXEC);
+        fprintf(f, "FNDA:%d,%s\n", ran, funcs[i].sym->name);
+        hit += ran;
+    }
+    fprintf(f, "FNF:%zu\nFNH:%u\n", nfuncs, hit);
+    hit = 0;
+
+    for (i = 0; i < nlines; i = j) {
+        line = lines[i]->line;
+
+        /* Every range made of this line, whether any of it ran */
+        ran = 0;
+        for (j = i; j < nlines && lines[j]->line == line; j++) {
+            l = lines[j];
+            for (addr = l->addr; addr < l->end && addr / 2 < c->words;
+                    addr += 2)
+                ran |= c->map[addr / 2] & DF_COV_EXEC;
+        }
+        fprintf(f, "DA:%u,%d\n", line, !!ran);
+        found++;
+        hit += !!ran;
+
+        /* Each branch as taken, then not, '-' if it never ran */
+        branch = 0;
+        for (j = i; j < nlines && lines[j]->line == line; j++) {
+            l = lines[j];
+            for (addr = l->addr; addr < l->end && addr / 2 < c->words;
+                    addr += 2) {
+                op = avr->flash[addr] | (avr->flash[addr + 1] << 8);
+                if (!OP_IS_BRANCH(op))
+                    continue;
+
+                seen = c->map[addr / 2];
+                if (seen & DF_COV_EXEC) {
+                    fprintf(f, "BRDA:%u,0,%u,%d\nBRDA:%u,0,%u,%d\n",
+                            line, branch, !!(seen &
+                                (DF_COV_SKIP | DF_COV_JUMP)),
+                            line, branch + 1, !!(seen & DF_COV_NEXT));
+                    br_hit += !!(seen & (DF_COV_SKIP | DF_COV_JUMP)) +
+                        !!(seen & DF_COV_NEXT);
+                } else {
+                    fprintf(f, "BRDA:%u,0,%u,-\nBRDA:%u,0,%u,-\n",
+                            line, branch, line, branch + 1);
+                }
+                branch += 2;
+                br_found += 2;
+            }
+        }
+    }
+
+    fprintf(f, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n",
+            br_found, br_hit, found, hit);
+}
+
+int
+df_cov_dump(struct df_cov *c, avr_t *avr, const char *path)
+{
+    const struct df_elf_lines *lines = df_elf_lines();
+    const struct df_elf_syms *syms = df_elf_symbols();
+    const struct df_elf_line **order = NULL;
+    struct df_cov_func *funcs = NULL;
+    size_t nfuncs = 0;
+    size_t i, j, k, n;
+    int ret = -1;
+    FILE *f;
+
+    /* A board that never ran, like the template of clones, has nothing */
+    for (i = 0; i < c->words && !c->map[i]; i++)
+        ;
+    if (i == c->words)
+        return 0;
+
+    if (!lines->count) {
+        fprintf(stderr, "Coverage is by source line, it needs the firmware "
+                "as an ELF built with -g.\n");
+        return -1;
+    }
+
+    order = malloc(lines->count * sizeof(*order));
+    funcs = calloc(syms->count ? syms->count : 1, sizeof(*funcs));
+    if (!order || !funcs) {
+        fprintf(stderr, "Failed to allocate memory for coverage.\n");
+        goto cleanup;
+    }
+
+    for (i = 0; i < lines->count; i++)
+        order[i] = &lines->line[i];
+    qsort(order, lines->count, sizeof(*order), df_cov_line_cmp);
+
+    /* Functions are wherever their first instruction came from, objects
+     * in flash have no line so are left out
+     */
+    for (i = 0; i < syms->count; i++) {
+        funcs[nfuncs].line = df_elf_line_lookup(syms->sym[i].addr);
+        if (!funcs[nfuncs].line || syms->sym[i].addr / 2 >= c->words)
+            continue;
+        funcs[nfuncs].sym = &syms->sym[i];
+        nfuncs++;
+    }
+    qsort(funcs, nfuncs, sizeof(*funcs), df_cov_func_cmp);
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to create coverage '%s': %s\n", path,
+                strerror(errno));
+        goto cleanup;
+    }
+
+    /* Both are sorted by file, so each file's functions follow on */
+    for (i = 0, k = 0; i < lines->count; i = j) {
+        for (j = i; j < lines->count &&
+                !strcmp(order[j]->file, order[i]->file); j++)
+            ;
+        for (n = k; n < nfuncs &&
+                !strcmp(funcs[n].line->file, order[i]->file); n++)
+            ;
+        df_cov_file(c, avr, f, &order[i], j - i, &funcs[k], n - k);
+        k = n;
+    }
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write coverage '%s': %s\n", path,
+                strerror(errno));
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    free(order);
+    free(funcs);
+
+    return ret;
+}
+
+void
+df_cov_free(struct df_cov *c)
+{
+    if (!c)
+        return;
+
+    free(c->map);
+    free(c);
+}
@@ -0,0 +1,91 @@
+/*
+ * df_cov.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_COV_H__
+#define __DF_COV_H__
+
+#include <stdint.h>
+
+struct avr_t;
+
+/* What's been seen of the instruction at a flash word */
+#define DF_COV_EXEC     (1 << 0)    /**< it ran */
+#define DF_COV_NEXT     (1 << 1)    /**< then the word after it did */
+#define DF_COV_SKIP     (1 << 2)    /**< then the word after that */
+#define DF_COV_JUMP     (1 << 3)    /**< then something else */
+
+/*
+ * Coverage of the firmware: a byte of DF_COV_* per flash word. Where each
+ * instruction went is all it keeps, which is enough to tell branches
+ * taken from not, so it's cheap enough to leave on.
+ */
+struct df_cov {
+    uint8_t *map;
+    uint32_t words;
+    uint32_t pc;            /**< before the avr_run() */
+    uint16_t sp;            /**< and the stack pointer */
+    int irq_on;             /**< and whether interrupts were enabled */
+    int awake;              /**< an instruction ran, not sleep */
+};
+
+struct df_cov *df_cov_create(struct avr_t *avr);
+
+/* Around every avr_run(), inlined as they're on every instruction */
+static inline void
+df_cov_before(struct df_cov *c, uint32_t pc, uint16_t sp, int irq_on,
+        int sleeping)
+{
+    c->pc = pc;
+    c->sp = sp;
+    c->irq_on = irq_on;
+    c->awake = !sleeping;
+}
+
+static inline void
+df_cov_after(struct df_cov *c, uint32_t pc, uint16_t sp, int irq_on)
+{
+    uint32_t delta = pc - c->pc;
+
+    if (!c->awake || c->pc / 2 >= c->words)
+        return;
+
+    /* An interrupt taken straight after hides where it went, as the
+     * profiler sees it: the stack grew and the I flag went.
+     */
+    if (sp < c->sp && c->irq_on && !irq_on) {
+        c->map[c->pc / 2] |= DF_COV_EXEC;
+        return;
+    }
+
+    c->map[c->pc / 2] |= DF_COV_EXEC | (delta == 2 ? DF_COV_NEXT :
+            delta == 4 ? DF_COV_SKIP : DF_COV_JUMP);
+}
+
+/*
+ * Write what ran, by source line from the firmware's ELF line info, as
+ * an lcov tracefile to 'path', with the functions from its symbols and
+ * the conditional branches and skips either way.
+ */
+int df_cov_dump(struct df_cov *c, struct avr_t *avr, const char *path);
+
+void df_cov_free(struct df_cov *c);
+
+#endif /* __DF_COV_H__ */
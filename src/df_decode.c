@@ -0,0 +1,622 @@
+/*
+ * df_decode.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sim_avr.h>
+#include <sim_cycle_timers.h>
+
+#include "df_decode.h"
+
+/* What a flash word decodes to, a case of df_decode_run() each */
+enum df_op {
+    DF_OP_NONE,         /* not decoded yet */
+    DF_OP_CORE,         /* simavr's to run */
+    DF_OP_NOP,
+    DF_OP_MOVW,
+    DF_OP_MULS,
+    DF_OP_MULSU,
+    DF_OP_CPC,
+    DF_OP_SBC,
+    DF_OP_ADD,
+    DF_OP_CPSE,
+    DF_OP_CP,
+    DF_OP_SUB,
+    DF_OP_ADC,
+    DF_OP_AND,
+    DF_OP_EOR,
+    DF_OP_OR,
+    DF_OP_MOV,
+    DF_OP_CPI,
+    DF_OP_SBCI,
+    DF_OP_SUBI,
+    DF_OP_ORI,
+    DF_OP_ANDI,
+    DF_OP_LDI,
+    DF_OP_RJMP,
+    DF_OP_JMP,
+    DF_OP_IJMP,
+    DF_OP_COM,
+    DF_OP_NEG,
+    DF_OP_SWAP,
+    DF_OP_INC,
+    DF_OP_ASR,
+    DF_OP_LSR,
+    DF_OP_ROR,
+    DF_OP_DEC,
+    DF_OP_BSET,
+    DF_OP_BCLR,
+    DF_OP_ADIW,
+    DF_OP_SBIW,
+    DF_OP_MUL,
+    DF_OP_BRBS,
+    DF_OP_BRBC,
+    DF_OP_BLD,
+    DF_OP_BST,
+    DF_OP_SBRC,
+    DF_OP_SBRS,
+};
+
+/* The most any of them take, a skip over a two word instruction */
+#define DF_DECODE_MAX_CYCLES    3
+
+/* What SPM erases and writes at a time */
+#define DF_DECODE_PAGE_SIZE     256
+
+struct df_decode_insn {
+    uint8_t op;             /**< DF_OP_* */
+    uint8_t d;              /**< destination register, or SREG bit */
+    uint8_t r;              /**< source register, immediate or bit */
+    uint32_t k;             /**< jump or branch target, a byte address */
+};
+
+struct df_decode {
+    struct df_decode_insn *insn;    /**< one per flash word */
+    uint32_t words;
+};
+
+struct df_decode *
+df_decode_create(avr_t *avr)
+{
+    struct df_decode *dc;
+
+    dc = calloc(1, sizeof(*dc));
+    if (!dc) {
+        fprintf(stderr, "Failed to allocate memory for decoded flash.\n");
+        return NULL;
+    }
+
+    /* Left to calloc() so it's only the code that runs that's paged in */
+    dc->words = (avr->flashend + 1) / 2;
+    dc->insn = calloc(dc->words, sizeof(*dc->insn));
+    if (!dc->insn) {
+        fprintf(stderr, "Failed to allocate memory for decoded flash.\n");
+        free(dc);
+        return NULL;
+    }
+
+    return dc;
+}
+
+void
+df_decode_free(struct df_decode *dc)
+{
+    if (!dc)
+        return;
+
+    free(dc->insn);
+    free(dc);
+}
+
+void
+df_decode_invalidate(struct df_decode *dc, uint32_t addr)
+{
+    uint32_t first = (addr & ~(DF_DECODE_PAGE_SIZE - 1)) / 2;
+    uint32_t last = first + DF_DECODE_PAGE_SIZE / 2;
+    uint32_t i;
+
+    /* A JMP at the end of the page before reaches into this one */
+    if (first)
+        first--;
+    if (last > dc->words)
+        last = dc->words;
+
+    for (i = first; i < last; i++)
+        dc->insn[i].op = DF_OP_NONE;
+}
+
+static inline uint16_t
+df_decode_word(const avr_t *avr, uint32_t pc)
+{
+    return avr->flash[pc] | (avr->flash[pc + 1] << 8);
+}
+
+/* LDS, STS, JMP and CALL, what a skip has to skip two words of */
+static inline int
+df_decode_is_32(uint16_t op)
+{
+    op &= 0xfc0f;
+    return op == 0x9000 || op == 0x9200 || op == 0x940c || op == 0x940d ||
+        op == 0x940e || op == 0x940f;
+}
+
+static void
+df_decode_insn(struct df_decode_insn *in, const avr_t *avr, uint32_t pc)
+{
+    uint16_t op = df_decode_word(avr, pc);
+    uint32_t next = pc + 2;
+
+    in->op = DF_OP_CORE;
+    in->d = (op >> 4) & 0x1f;
+    in->r = ((op >> 5) & 0x10) | (op & 0x0f);
+    in->k = 0;
+
+    if (op == 0x0000) {
+        in->op = DF_OP_NOP;
+        return;
+    }
+
+    switch (op & 0xff00) {
+    case 0x0100:
+        in->op = DF_OP_MOVW;
+        in->d = ((op >> 4) & 0x0f) * 2;
+        in->r = (op & 0x0f) * 2;
+        return;
+    case 0x0200:
+        in->op = DF_OP_MULS;
+        in->d = 16 + ((op >> 4) & 0x0f);
+        in->r = 16 + (op & 0x0f);
+        return;
+    case 0x0300:
+        /* The FMULs are simavr's */
+        if (op & 0x88)
+            return;
+        in->op = DF_OP_MULSU;
+        in->d = 16 + ((op >> 4) & 0x07);
+        in->r = 16 + (op & 0x07);
+        return;
+    case 0x9600:
+    case 0x9700:
+        in->op = (op & 0x0100) ? DF_OP_SBIW : DF_OP_ADIW;
+        in->d = 24 + ((op >> 3) & 0x06);
+        in->r = ((op >> 2) & 0x30) | (op & 0x0f);
+        return;
+    }
+
+    switch (op & 0xfc00) {
+    case 0x0400: in->op = DF_OP_CPC; return;
+    case 0x0800: in->op = DF_OP_SBC; return;
+    case 0x0c00: in->op = DF_OP_ADD; return;
+    case 0x1000: in->op = DF_OP_CPSE; return;
+    case 0x1400: in->op = DF_OP_CP; return;
+    case 0x1800: in->op = DF_OP_SUB; return;
+    case 0x1c00: in->op = DF_OP_ADC; return;
+    case 0x2000: in->op = DF_OP_AND; return;
+    case 0x2400: in->op = DF_OP_EOR; return;
+    case 0x2800: in->op = DF_OP_OR; return;
+    case 0x2c00: in->op = DF_OP_MOV; return;
+    case 0x9c00: in->op = DF_OP_MUL; return;
+    case 0xf000:
+    case 0xf400:
+        in->op = (op & 0x0400) ? DF_OP_BRBC : DF_OP_BRBS;
+        in->d = op & 0x07;
+        in->k = next + ((int16_t)(op << 6) >> 9) * 2;
+        return;
+    }
+
+    switch (op & 0xf000) {
+    case 0x3000: in->op = DF_OP_CPI; break;
+    case 0x4000: in->op = DF_OP_SBCI; break;
+    case 0x5000: in->op = DF_OP_SUBI; break;
+    case 0x6000: in->op = DF_OP_ORI; break;
+    case 0x7000: in->op = DF_OP_ANDI; break;
+    case 0xe000: in->op = DF_OP_LDI; break;
+    case 0xc000:
+        /* Wrapping around flash, as simavr does */
+        in->op = DF_OP_RJMP;
+        in->k = (next + ((int16_t)(op << 4) >> 3)) % (avr->flashend + 1);
+        return;
+    }
+    if (in->op != DF_OP_CORE) {
+        in->d = 16 + ((op >> 4) & 0x0f);
+        in->r = ((op >> 4) & 0xf0) | (op & 0x0f);
+        return;
+    }
+
+    switch (op & 0xfe08) {
+    case 0xf800: in->op = DF_OP_BLD; break;
+    case 0xfa00: in->op = DF_OP_BST; break;
+    case 0xfc00: in->op = DF_OP_SBRC; break;
+    case 0xfe00: in->op = DF_OP_SBRS; break;
+    }
+    if (in->op != DF_OP_CORE) {
+        in->r = op & 0x07;
+        return;
+    }
+
+    switch (op & 0xfe0f) {
+    case 0x9400: in->op = DF_OP_COM; return;
+    case 0x9401: in->op = DF_OP_NEG; return;
+    case 0x9402: in->op = DF_OP_SWAP; return;
+    case 0x9403: in->op = DF_OP_INC; return;
+    case 0x9405: in->op = DF_OP_ASR; return;
+    case 0x9406: in->op = DF_OP_LSR; return;
+    case 0x9407: in->op = DF_OP_ROR; return;
+    case 0x940a: in->op = DF_OP_DEC; return;
+    case 0x940c:
+    case 0x940d:
+        if (next + 1 > avr->flashend)
+            return;
+        in->op = DF_OP_JMP;
+        in->k = ((((op >> 3) & 0x3e) | (op & 0x01)) << 16 |
+                df_decode_word(avr, next)) << 1;
+        return;
+    }
+
+    if (op == 0x9409) {
+        in->op = DF_OP_IJMP;
+        return;
+    }
+
+    /* Setting or clearing I is for simavr, interrupts hang off of it */
+    switch (op & 0xff8f) {
+    case 0x9408:
+    case 0x9488:
+        in->d = (op >> 4) & 0x07;
+        if (in->d != S_I)
+            in->op = (op & 0x0080) ? DF_OP_BCLR : DF_OP_BSET;
+        return;
+    }
+}
+
+/* Z, N and S from a result, V has to be set first */
+static inline void
+df_decode_zns(uint8_t *sreg, uint8_t res)
+{
+    sreg[S_Z] = res == 0;
+    sreg[S_N] = res >> 7;
+    sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+/* The same for ADIW and SBIW's word */
+static inline void
+df_decode_zns16(uint8_t *sreg, uint16_t res)
+{
+    sreg[S_Z] = res == 0;
+    sreg[S_N] = res >> 15;
+    sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+static inline void
+df_decode_add(uint8_t *sreg, uint8_t d, uint8_t r, uint8_t res)
+{
+    unsigned int c = (d & r) | (r & ~res) | (~res & d);
+
+    sreg[S_H] = (c >> 3) & 1;
+    sreg[S_C] = (c >> 7) & 1;
+    sreg[S_V] = (((d & r & ~res) | (~d & ~r & res)) >> 7) & 1;
+    df_decode_zns(sreg, res);
+}
+
+static inline void
+df_decode_sub(uint8_t *sreg, uint8_t d, uint8_t r, uint8_t res)
+{
+    unsigned int c = (~d & r) | (r & res) | (res & ~d);
+
+    sreg[S_H] = (c >> 3) & 1;
+    sreg[S_C] = (c >> 7) & 1;
+    sreg[S_V] = (((d & ~r & ~res) | (~d & r & res)) >> 7) & 1;
+    df_decode_zns(sreg, res);
+}
+
+/* And with the carry, Z only stays set if it was */
+static inline void
+df_decode_sbc(uint8_t *sreg, uint8_t d, uint8_t r, uint8_t res)
+{
+    uint8_t z = sreg[S_Z];
+
+    df_decode_sub(sreg, d, r, res);
+    sreg[S_Z] &= z;
+}
+
+static inline void
+df_decode_logic(uint8_t *sreg, uint8_t res)
+{
+    sreg[S_V] = 0;
+    df_decode_zns(sreg, res);
+}
+
+/* ASR, LSR and ROR, once C is set */
+static inline void
+df_decode_shift(uint8_t *sreg, uint8_t res)
+{
+    sreg[S_Z] = res == 0;
+    sreg[S_N] = res >> 7;
+    sreg[S_V] = sreg[S_N] ^ sreg[S_C];
+    sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+static inline void
+df_decode_mul(uint8_t *reg, uint8_t *sreg, uint16_t res)
+{
+    reg[0] = res;
+    reg[1] = res >> 8;
+    sreg[S_C] = res >> 15;
+    sreg[S_Z] = res == 0;
+}
+
+unsigned int
+df_decode_run(struct df_decode *dc, avr_t *avr, unsigned int max)
+{
+    uint8_t *reg = avr->data;
+    uint8_t *sreg = avr->sreg;
+    const struct df_decode_insn *in;
+    uint64_t cycle = avr->cycle;
+    uint64_t due = UINT64_MAX;
+    uint32_t pc = avr->pc;
+    unsigned int n;
+    uint16_t w, wres;
+    uint8_t d, r, res;
+
+    /* simavr checks these before every instruction, they're its to act
+     * on. None of ours change them, so once is enough.
+     */
+    if (avr->state != cpu_Running || avr->interrupt_state ||
+            (avr->data[R_SPL] | (avr->data[R_SPH] << 8)) > avr->ramend)
+        return 0;
+
+    /* Leave the instruction that gets to the next timer to avr_run() */
+    if (avr->cycle_timers.timer)
+        due = avr->cycle_timers.timer->when;
+
+    for (n = 0; n < max; n++) {
+        if (cycle + DF_DECODE_MAX_CYCLES >= due || !pc ||
+                pc >= avr->codeend)
+            break;
+
+        in = &dc->insn[pc / 2];
+        if (in->op == DF_OP_NONE)
+            df_decode_insn(&dc->insn[pc / 2], avr, pc);
+
+        d = reg[in->d];
+        r = reg[in->r];
+        pc += 2;
+        cycle++;
+
+        switch (in->op) {
+        case DF_OP_NOP:
+            break;
+        case DF_OP_MOVW:
+            reg[in->d] = r;
+            reg[in->d + 1] = reg[in->r + 1];
+            break;
+        case DF_OP_MULS:
+            df_decode_mul(reg, sreg, (int8_t)d * (int8_t)r);
+            cycle++;
+            break;
+        case DF_OP_MULSU:
+            df_decode_mul(reg, sreg, (int8_t)d * r);
+            cycle++;
+            break;
+        case DF_OP_MUL:
+            df_decode_mul(reg, sreg, d * r);
+            cycle++;
+            break;
+        case DF_OP_CPC:
+            df_decode_sbc(sreg, d, r, d - r - sreg[S_C]);
+            break;
+        case DF_OP_SBC:
+            res = d - r - sreg[S_C];
+            df_decode_sbc(sreg, d, r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_ADD:
+            res = d + r;
+            df_decode_add(sreg, d, r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_ADC:
+            res = d + r + sreg[S_C];
+            df_decode_add(sreg, d, r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_CP:
+            df_decode_sub(sreg, d, r, d - r);
+            break;
+        case DF_OP_SUB:
+            res = d - r;
+            df_decode_sub(sreg, d, r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_AND:
+            reg[in->d] = d & r;
+            df_decode_logic(sreg, d & r);
+            break;
+        case DF_OP_EOR:
+            reg[in->d] = d ^ r;
+            df_decode_logic(sreg, d ^ r);
+            break;
+        case DF_OP_OR:
+            reg[in->d] = d | r;
+            df_decode_logic(sreg, d | r);
+            break;
+        case DF_OP_MOV:
+            reg[in->d] = r;
+            break;
+        case DF_OP_CPI:
+            df_decode_sub(sreg, d, in->r, d - in->r);
+            break;
+        case DF_OP_SBCI:
+            res = d - in->r - sreg[S_C];
+            df_decode_sbc(sreg, d, in->r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_SUBI:
+            res = d - in->r;
+            df_decode_sub(sreg, d, in->r, res);
+            reg[in->d] = res;
+            break;
+        case DF_OP_ORI:
+            reg[in->d] = d | in->r;
+            df_decode_logic(sreg, d | in->r);
+            break;
+        case DF_OP_ANDI:
+            reg[in->d] = d & in->r;
+            df_decode_logic(sreg, d & in->r);
+            break;
+        case DF_OP_LDI:
+            reg[in->d] = in->r;
+            break;
+        case DF_OP_RJMP:
+            pc = in->k;
+            cycle++;
+            break;
+        case DF_OP_JMP:
+            pc = in->k;
+            cycle += 2;
+            break;
+        case DF_OP_IJMP:
+            pc = (reg[30] | (reg[31] << 8)) << 1;
+            cycle++;
+            break;
+        case DF_OP_COM:
+            res = ~d;
+            reg[in->d] = res;
+            sreg[S_C] = 1;
+            df_decode_logic(sreg, res);
+            break;
+        case DF_OP_NEG:
+            res = 0 - d;
+            reg[in->d] = res;
+            sreg[S_H] = ((res | d) >> 3) & 1;
+            sreg[S_V] = res == 0x80;
+            sreg[S_C] = res != 0;
+            df_decode_zns(sreg, res);
+            break;
+        case DF_OP_SWAP:
+            reg[in->d] = (d >> 4) | (d << 4);
+            break;
+        case DF_OP_INC:
+            res = d + 1;
+            reg[in->d] = res;
+            sreg[S_V] = res == 0x80;
+            df_decode_zns(sreg, res);
+            break;
+        case DF_OP_DEC:
+            res = d - 1;
+            reg[in->d] = res;
+            sreg[S_V] = res == 0x7f;
+            df_decode_zns(sreg, res);
+            break;
+        case DF_OP_ASR:
+            res = (d >> 1) | (d & 0x80);
+            reg[in->d] = res;
+            sreg[S_C] = d & 1;
+            df_decode_shift(sreg, res);
+            break;
+        case DF_OP_LSR:
+            res = d >> 1;
+            reg[in->d] = res;
+            sreg[S_C] = d & 1;
+            df_decode_shift(sreg, res);
+            break;
+        case DF_OP_ROR:
+            res = (d >> 1) | (sreg[S_C] << 7);
+            reg[in->d] = res;
+            sreg[S_C] = d & 1;
+            df_decode_shift(sreg, res);
+            break;
+        case DF_OP_BSET:
+            sreg[in->d] = 1;
+            break;
+        case DF_OP_BCLR:
+            sreg[in->d] = 0;
+            break;
+        case DF_OP_ADIW:
+            w = d | (reg[in->d + 1] << 8);
+            wres = w + in->r;
+            reg[in->d] = wres;
+            reg[in->d + 1] = wres >> 8;
+            sreg[S_V] = ((~w & wres) >> 15) & 1;
+            sreg[S_C] = ((~wres & w) >> 15) & 1;
+            df_decode_zns16(sreg, wres);
+            cycle++;
+            break;
+        case DF_OP_SBIW:
+            w = d | (reg[in->d + 1] << 8);
+            wres = w - in->r;
+            reg[in->d] = wres;
+            reg[in->d + 1] = wres >> 8;
+            sreg[S_V] = ((w & ~wres) >> 15) & 1;
+            sreg[S_C] = ((wres & ~w) >> 15) & 1;
+            df_decode_zns16(sreg, wres);
+            cycle++;
+            break;
+        case DF_OP_BRBS:
+        case DF_OP_BRBC:
+            if (sreg[in->d] == (in->op == DF_OP_BRBS)) {
+                pc = in->k;
+                cycle++;
+            }
+            break;
+        case DF_OP_BLD:
+            reg[in->d] = (d & ~(1 << in->r)) | (sreg[S_T] << in->r);
+            break;
+        case DF_OP_BST:
+            sreg[S_T] = (d >> in->r) & 1;
+            break;
+        case DF_OP_CPSE:
+        case DF_OP_SBRC:
+        case DF_OP_SBRS:
+            if (in->op == DF_OP_CPSE ? d == r :
+                    ((d >> in->r) & 1) == (in->op == DF_OP_SBRS)) {
+                if (pc < avr->flashend &&
+                        df_decode_is_32(df_decode_word(avr, pc))) {
+                    pc += 4;
+                    cycle += 2;
+                } else {
+                    pc += 2;
+                    cycle++;
+                }
+            }
+            break;
+        default:
+            /* simavr's, it runs it from where we are */
+            pc -= 2;
+            cycle--;
+            goto out;
+        }
+    }
+
+out:
+    /* Or simavr would run on without looking at its timers */
+    if (avr->run_cycle_count > cycle - avr->cycle)
+        avr->run_cycle_count -= cycle - avr->cycle;
+    else
+        avr->run_cycle_count = 0;
+
+    avr->cycle = cycle;
+    avr->pc = pc;
+
+    return n;
+}
@@ -0,0 +1,52 @@
+/*
+ * df_decode.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_DECODE_H__
+#define __DF_DECODE_H__
+
+#include <stdint.h>
+
+struct avr_t;
+
+/*
+ * Flash pre-decoded, an entry per word of which instruction it is and its
+ * operands, decoded the first time it runs. Only instructions that work
+ * on registers and SREG, and jumps, are run from it; anything that could
+ * touch I/O, the stack or interrupts is left to simavr.
+ */
+struct df_decode;
+
+struct df_decode *df_decode_create(struct avr_t *avr);
+
+/*
+ * Run up to 'max' instructions from the cache, stopping short of the
+ * next cycle timer and at the first one simavr has to run. Returns how
+ * many ran, avr_run() carries on from there.
+ */
+unsigned int df_decode_run(struct df_decode *dc, struct avr_t *avr,
+        unsigned int max);
+
+/* The SPM page holding byte address 'addr' was erased or written */
+void df_decode_invalidate(struct df_decode *dc, uint32_t addr);
+
+void df_decode_free(struct df_decode *dc);
+
+#endif /* __DF_DECODE_H__ */
@@ -0,0 +1,828 @@
+/*
+ * df_elf.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "df_elf.h"
+#include "flash.h"
+
+#ifndef EM_AVR
+#define EM_AVR 83
+#endif
+
+/* avr-gcc puts SRAM, EEPROM and fuses at these offsets, flash is below */
+#define AVR_DATA_OFFSET 0x800000
+
+/* An ELF we've taken symbols from, they point into its string table */
+struct df_elf_file {
+    char *path;
+    char *strtab;
+};
+
+static struct df_elf_file *df_elf_files = NULL;
+static size_t df_elf_nfiles = 0;
+static struct df_elf_syms df_elf_syms = { NULL, 0 };
+static struct df_elf_lines df_elf_lines_tab = { NULL, 0 };
+static char **df_elf_paths = NULL;  /**< of the source files lines are in */
+static size_t df_elf_npaths = 0;
+
+int
+df_elf_is_elf(const uint8_t *img, size_t img_len)
+{
+    return img_len >= SELFMAG && memcmp(img, ELFMAG, SELFMAG) == 0;
+}
+
+/* Headers are copied out, nothing promises the image keeps them aligned */
+static int
+df_elf_shdr(const uint8_t *img, size_t img_len, const Elf32_Ehdr *ehdr,
+        unsigned int i, Elf32_Shdr *shdr)
+{
+    size_t off = ehdr->e_shoff + (size_t)i * ehdr->e_shentsize;
+
+    if (i >= ehdr->e_shnum || off + sizeof(*shdr) > img_len)
+        return -1;
+
+    memcpy(shdr, img + off, sizeof(*shdr));
+    return 0;
+}
+
+static int
+df_elf_sym_cmp(const void *a, const void *b)
+{
+    const struct df_elf_sym *sa = a;
+    const struct df_elf_sym *sb = b;
+
+    if (sa->addr != sb->addr)
+        return sa->addr < sb->addr ? -1 : 1;
+    /* lookups take the last of a run, so have the largest size last */
+    return sa->size < sb->size ? -1 : sa->size > sb->size ? 1 : 0;
+}
+
+static int
+df_elf_load_symbols(const char *file, const uint8_t *img, size_t img_len,
+        const Elf32_Ehdr *ehdr)
+{
+    Elf32_Shdr symtab, strtab;
+    Elf32_Sym sym;
+    struct df_elf_file *files;
+    struct df_elf_sym *syms;
+    char *strs;
+    size_t n, i;
+    unsigned int s;
+
+    for (s = 0; !df_elf_shdr(img, img_len, ehdr, s, &symtab); s++)
+        if (symtab.sh_type == SHT_SYMTAB)
+            break;
+
+    /* Stripped, there's nothing to keep */
+    if (s >= ehdr->e_shnum)
+        return 0;
+
+    if (df_elf_shdr(img, img_len, ehdr, symtab.sh_link, &strtab) ||
+            strtab.sh_type != SHT_STRTAB ||
+            (size_t)strtab.sh_offset + strtab.sh_size > img_len ||
+            (size_t)symtab.sh_offset + symtab.sh_size > img_len ||
+            symtab.sh_entsize != sizeof(sym) || !strtab.sh_size) {
+        fprintf(stderr, "Ignoring malformed symbol table in '%s'\n", file);
+        return 0;
+    }
+
+    files = realloc(df_elf_files, (df_elf_nfiles + 1) * sizeof(*files));
+    if (!files)
+        goto nomem;
+    df_elf_files = files;
+
+    n = symtab.sh_size / sizeof(sym);
+    syms = realloc(df_elf_syms.sym, (df_elf_syms.count + n) * sizeof(*syms));
+    if (!syms)
+        goto nomem;
+    df_elf_syms.sym = syms;
+
+    strs = malloc(strtab.sh_size);
+    if (!strs)
+        goto nomem;
+    memcpy(strs, img + strtab.sh_offset, strtab.sh_size);
+    strs[strtab.sh_size - 1] = '\0';
+
+    files[df_elf_nfiles].path = strdup(file);
+    if (!files[df_elf_nfiles].path) {
+        free(strs);
+        goto nomem;
+    }
+    files[df_elf_nfiles].strtab = strs;
+    df_elf_nfiles++;
+
+    for (i = 0; i < n; i++) {
+        memcpy(&sym, img + symtab.sh_offset + i * sizeof(sym), sizeof(sym));
+
+        if (ELF32_ST_TYPE(sym.st_info) != STT_FUNC &&
+                ELF32_ST_TYPE(sym.st_info) != STT_OBJECT)
+            continue;
+        if (sym.st_shndx == SHN_UNDEF || sym.st_value >= AVR_DATA_OFFSET ||
+                !sym.st_name || sym.st_name >= strtab.sh_size)
+            continue;
+
+        syms[df_elf_syms.count].addr = sym.st_value;
+        syms[df_elf_syms.count].size = sym.st_size;
+        syms[df_elf_syms.count].name = strs + sym.st_name;
+        df_elf_syms.count++;
+    }
+
+    qsort(df_elf_syms.sym, df_elf_syms.count, sizeof(*df_elf_syms.sym),
+            df_elf_sym_cmp);
+
+    return 0;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for symbols of '%s'.\n", file);
+    return -1;
+}
+
+/* DWARF forms and opcodes the line table reader knows */
+#define DW_FORM_block       0x09
+#define DW_FORM_data1       0x0b
+#define DW_FORM_data2       0x05
+#define DW_FORM_data4       0x06
+#define DW_FORM_data8       0x07
+#define DW_FORM_data16      0x1e
+#define DW_FORM_string      0x08
+#define DW_FORM_strp        0x0e
+#define DW_FORM_udata       0x0f
+#define DW_FORM_line_strp   0x1f
+
+#define DW_LNCT_path            1
+#define DW_LNCT_directory_index 2
+
+#define DW_LNS_copy             1
+#define DW_LNS_advance_pc       2
+#define DW_LNS_advance_line     3
+#define DW_LNS_set_file         4
+#define DW_LNS_const_add_pc     8
+#define DW_LNS_fixed_advance_pc 9
+
+#define DW_LNE_end_sequence     1
+#define DW_LNE_set_address      2
+
+/* Most line tables name fewer files than this */
+#define DF_ELF_MAX_FILES 1024
+
+/* A section being read, reads past its end give zeros and set 'bad' */
+struct df_elf_buf {
+    const uint8_t *p;
+    const uint8_t *end;
+    int bad;
+};
+
+/* The sections line tables refer to */
+struct df_elf_debug {
+    struct df_elf_buf line;
+    struct df_elf_buf line_str;
+    struct df_elf_buf str;
+};
+
+/* A row of a line table, where the state machine was */
+struct df_elf_row {
+    uint32_t addr;
+    uint32_t line;
+    const char *file;
+    int valid;
+};
+
+static uint64_t
+df_elf_get(struct df_elf_buf *b, size_t n)
+{
+    uint64_t val = 0;
+    size_t i;
+
+    if ((size_t)(b->end - b->p) < n) {
+        b->bad = 1;
+        b->p = b->end;
+        return 0;
+    }
+
+    for (i = 0; i < n; i++)
+        val |= (uint64_t)b->p[i] << (8 * i);
+    b->p += n;
+
+    return val;
+}
+
+static uint64_t
+df_elf_uleb(struct df_elf_buf *b)
+{
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t c;
+
+    do {
+        c = df_elf_get(b, 1);
+        if (shift < 64)
+            val |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while ((c & 0x80) && !b->bad);
+
+    return val;
+}
+
+static int64_t
+df_elf_sleb(struct df_elf_buf *b)
+{
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t c;
+
+    do {
+        c = df_elf_get(b, 1);
+        if (shift < 64)
+            val |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while ((c & 0x80) && !b->bad);
+
+    if (shift < 64 && (c & 0x40))
+        val |= ~(uint64_t)0 << shift;
+
+    return (int64_t)val;
+}
+
+static const char *
+df_elf_str(struct df_elf_buf *b)
+{
+    const char *s = (const char *)b->p;
+    const uint8_t *nul = memchr(b->p, '\0', b->end - b->p);
+
+    if (!nul) {
+        b->bad = 1;
+        b->p = b->end;
+        return NULL;
+    }
+
+    b->p = nul + 1;
+    return s;
+}
+
+/* A string at 'off' in one of the string sections */
+static const char *
+df_elf_str_at(const struct df_elf_buf *sec, uint64_t off)
+{
+    struct df_elf_buf b = *sec;
+
+    if (off >= (uint64_t)(b.end - b.p))
+        return NULL;
+    b.p += off;
+
+    return df_elf_str(&b);
+}
+
+/* Paths are kept once, line ranges point at them */
+static const char *
+df_elf_path(const char *dir, const char *name)
+{
+    char **paths;
+    char *path;
+    size_t i;
+
+    if (!name)
+        return NULL;
+
+    if (name[0] == '/' || !dir || !dir[0])
+        path = strdup(name);
+    else if (asprintf(&path, "%s/%s", dir, name) < 0)
+        path = NULL;
+    if (!path)
+        return NULL;
+
+    for (i = 0; i < df_elf_npaths; i++) {
+        if (!strcmp(df_elf_paths[i], path)) {
+            free(path);
+            return df_elf_paths[i];
+        }
+    }
+
+    paths = realloc(df_elf_paths, (df_elf_npaths + 1) * sizeof(*paths));
+    if (!paths) {
+        free(path);
+        return NULL;
+    }
+    df_elf_paths = paths;
+    df_elf_paths[df_elf_npaths++] = path;
+
+    return path;
+}
+
+/* A directory or file entry of a version 5 line table */
+static void
+df_elf_entry(struct df_elf_buf *b, const struct df_elf_debug *dbg,
+        const uint64_t *fmt, unsigned int nfmt, int offset_size,
+        const char **name, uint64_t *dir)
+{
+    unsigned int i;
+    uint64_t form;
+    uint64_t val;
+
+    *name = NULL;
+    *dir = 0;
+
+    for (i = 0; i < nfmt && !b->bad; i++) {
+        form = fmt[i * 2 + 1];
+        val = 0;
+
+        switch (form) {
+            case DW_FORM_string:
+                if (fmt[i * 2] == DW_LNCT_path)
+                    *name = df_elf_str(b);
+                else
+                    df_elf_str(b);
+                continue;
+            case DW_FORM_line_strp:
+            case DW_FORM_strp:
+                val = df_elf_get(b, offset_size);
+                if (fmt[i * 2] == DW_LNCT_path)
+                    *name = df_elf_str_at(form == DW_FORM_strp ?
+                            &dbg->str : &dbg->line_str, val);
+                continue;
+            case DW_FORM_udata:
+                val = df_elf_uleb(b);
+                break;
+            case DW_FORM_data1:
+                val = df_elf_get(b, 1);
+                break;
+            case DW_FORM_data2:
+                val = df_elf_get(b, 2);
+                break;
+            case DW_FORM_data4:
+                val = df_elf_get(b, 4);
+                break;
+            case DW_FORM_data8:
+                val = df_elf_get(b, 8);
+                break;
+            case DW_FORM_data16:
+                df_elf_get(b, 8);
+                df_elf_get(b, 8);
+                break;
+            case DW_FORM_block:
+                val = df_elf_uleb(b);
+                if (val > (uint64_t)(b->end - b->p))
+                    b->bad = 1;
+                else
+                    b->p += val;
+                val = 0;
+                break;
+            default:
+                /* Nothing else is expected here */
+                b->bad = 1;
+                continue;
+        }
+
+        if (fmt[i * 2] == DW_LNCT_directory_index)
+            *dir = val;
+    }
+}
+
+static int
+df_elf_line_add(const struct df_elf_row *from, uint32_t end)
+{
+    struct df_elf_line *lines;
+    size_t n = df_elf_lines_tab.count;
+
+    if (!from->valid || !from->file || !from->line || end <= from->addr ||
+            from->addr >= AVR_DATA_OFFSET)
+        return 0;
+
+    if ((n & (n - 1)) == 0) {
+        lines = realloc(df_elf_lines_tab.line, (n ? n * 2 : 256) *
+                sizeof(*lines));
+        if (!lines)
+            return -1;
+        df_elf_lines_tab.line = lines;
+    }
+
+    df_elf_lines_tab.line[n].addr = from->addr;
+    df_elf_lines_tab.line[n].end = end;
+    df_elf_lines_tab.line[n].line = from->line;
+    df_elf_lines_tab.line[n].file = from->file;
+    df_elf_lines_tab.count++;
+
+    return 0;
+}
+
+/* One unit of .debug_line, 'b' is just past its length */
+static int
+df_elf_line_unit(struct df_elf_buf *b, const struct df_elf_debug *dbg,
+        int offset_size)
+{
+    const char *dirs[DF_ELF_MAX_FILES];
+    const char *files[DF_ELF_MAX_FILES];
+    uint8_t lengths[256];
+    uint64_t fmt[2 * 256];
+    struct df_elf_buf prog;
+    struct df_elf_row row, prev;
+    const char *name;
+    uint64_t dir, len, i, n;
+    unsigned int version, min_len, line_range, opcode_base, nfmt;
+    unsigned int nfiles = 0, ndirs = 0;
+    int line_base;
+    uint8_t op;
+
+    version = df_elf_get(b, 2);
+    if (version < 2 || version > 5)
+        return 0;
+    if (version >= 5)
+        df_elf_get(b, 2);       /* address and segment selector sizes */
+    len = df_elf_get(b, offset_size);
+    if (len > (uint64_t)(b->end - b->p))
+        return 0;
+    prog.p = b->p + len;
+    prog.end = b->end;
+    prog.bad = 0;
+
+    min_len = df_elf_get(b, 1);
+    if (version >= 4)
+        df_elf_get(b, 1);       /* operations per instruction, for VLIW */
+    df_elf_get(b, 1);           /* default_is_stmt */
+    line_base = (int8_t)df_elf_get(b, 1);
+    line_range = df_elf_get(b, 1);
+    opcode_base = df_elf_get(b, 1);
+    if (!line_range || !opcode_base)
+        return 0;
+
+    memset(lengths, 0, sizeof(lengths));
+    for (i = 1; i < opcode_base; i++)
+        lengths[i] = df_elf_get(b, 1);
+
+    if (version < 5) {
+        /* Directory 0 is where it was compiled, which we don't know */
+        dirs[ndirs++] = NULL;
+        while (!b->bad && (name = df_elf_str(b)) && name[0]) {
+            if (ndirs < DF_ELF_MAX_FILES)
+                dirs[ndirs++] = name;
+        }
+
+        /* Files count from 1 */
+        files[nfiles++] = NULL;
+        while (!b->bad && (name = df_elf_str(b)) && name[0]) {
+            dir = df_elf_uleb(b);
+            df_elf_uleb(b);     /* modification time */
+            df_elf_uleb(b);     /* length */
+            if (nfiles < DF_ELF_MAX_FILES)
+                files[nfiles++] = df_elf_path(dir < ndirs ? dirs[dir] : NULL,
+                        name);
+        }
+    } else {
+        nfmt = df_elf_get(b, 1);
+        for (i = 0; i < nfmt * 2; i++)
+            fmt[i] = df_elf_uleb(b);
+        n = df_elf_uleb(b);
+        for (i = 0; i < n && !b->bad; i++) {
+            df_elf_entry(b, dbg, fmt, nfmt, offset_size, &name, &dir);
+            if (ndirs < DF_ELF_MAX_FILES)
+                dirs[ndirs++] = name;
+        }
+
+        nfmt = df_elf_get(b, 1);
+        for (i = 0; i < nfmt * 2; i++)
+            fmt[i] = df_elf_uleb(b);
+        n = df_elf_uleb(b);
+        for (i = 0; i < n && !b->bad; i++) {
+            df_elf_entry(b, dbg, fmt, nfmt, offset_size, &name, &dir);
+            if (nfiles < DF_ELF_MAX_FILES)
+                files[nfiles++] = df_elf_path(dir < ndirs ? dirs[dir] : NULL,
+                        name);
+        }
+    }
+
+    if (b->bad)
+        return 0;
+
+    /* The line number program, a state machine emitting rows */
+    memset(&row, 0, sizeof(row));
+    memset(&prev, 0, sizeof(prev));
+    row.line = 1;
+    row.file = nfiles > 1 ? files[1] : NULL;
+
+    while (!prog.bad && prog.p < prog.end) {
+        op = df_elf_get(&prog, 1);
+
+        if (op >= opcode_base) {
+            op -= opcode_base;
+            row.addr += (op / line_range) * min_len;
+            row.line += line_base + op % line_range;
+            goto emit;
+        }
+
+        switch (op) {
+            case 0:
+                len = df_elf_uleb(&prog);
+                if (!len || len > (uint64_t)(prog.end - prog.p)) {
+                    prog.bad = 1;
+                    break;
+                }
+                op = df_elf_get(&prog, 1);
+                if (op == DW_LNE_end_sequence) {
+                    if (prev.valid && df_elf_line_add(&prev, row.addr))
+                        return -1;
+                    memset(&prev, 0, sizeof(prev));
+                    row.addr = 0;
+                    row.line = 1;
+                    row.file = nfiles > 1 ? files[1] : NULL;
+                } else if (op == DW_LNE_set_address && len - 1 <= 8) {
+                    row.addr = df_elf_get(&prog, len - 1);
+                } else {
+                    prog.p += len - 1;
+                }
+                continue;
+            case DW_LNS_copy:
+                goto emit;
+            case DW_LNS_advance_pc:
+                row.addr += df_elf_uleb(&prog) * min_len;
+                continue;
+            case DW_LNS_advance_line:
+                row.line += df_elf_sleb(&prog);
+                continue;
+            case DW_LNS_set_file:
+                n = df_elf_uleb(&prog);
+                row.file = n < nfiles ? files[n] : NULL;
+                continue;
+            case DW_LNS_const_add_pc:
+                row.addr += ((255 - opcode_base) / line_range) * min_len;
+                continue;
+            case DW_LNS_fixed_advance_pc:
+                row.addr += df_elf_get(&prog, 2);
+                continue;
+            default:
+                /* Operands we've no use for */
+                for (i = 0; i < lengths[op]; i++)
+                    df_elf_uleb(&prog);
+                continue;
+        }
+        continue;
+
+emit:
+        if (prev.valid && df_elf_line_add(&prev, row.addr))
+            return -1;
+        prev = row;
+        prev.valid = 1;
+    }
+
+    return 0;
+}
+
+static int
+df_elf_line_cmp(const void *a, const void *b)
+{
+    const struct df_elf_line *la = a;
+    const struct df_elf_line *lb = b;
+
+    if (la->addr != lb->addr)
+        return la->addr < lb->addr ? -1 : 1;
+    return 0;
+}
+
+/* Find a section by name, e.g. ".debug_line" */
+static int
+df_elf_section(const uint8_t *img, size_t img_len, const Elf32_Ehdr *ehdr,
+        const char *name, struct df_elf_buf *b)
+{
+    Elf32_Shdr names, shdr;
+    const char *s;
+    unsigned int i;
+
+    if (df_elf_shdr(img, img_len, ehdr, ehdr->e_shstrndx, &names) ||
+            (size_t)names.sh_offset + names.sh_size > img_len)
+        return -1;
+
+    for (i = 0; !df_elf_shdr(img, img_len, ehdr, i, &shdr); i++) {
+        if (shdr.sh_name >= names.sh_size ||
+                (size_t)shdr.sh_offset + shdr.sh_size > img_len ||
+                shdr.sh_type == SHT_NOBITS)
+            continue;
+        s = (const char *)img + names.sh_offset + shdr.sh_name;
+        if (strnlen(s, names.sh_size - shdr.sh_name) ==
+                names.sh_size - shdr.sh_name || strcmp(s, name))
+            continue;
+
+        b->p = img + shdr.sh_offset;
+        b->end = b->p + shdr.sh_size;
+        b->bad = 0;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* What address each line of source became, from .debug_line */
+static int
+df_elf_load_lines(const char *file, const uint8_t *img, size_t img_len,
+        const Elf32_Ehdr *ehdr)
+{
+    struct df_elf_debug dbg;
+    struct df_elf_buf unit;
+    uint64_t len;
+    int offset_size;
+
+    memset(&dbg, 0, sizeof(dbg));
+    if (df_elf_section(img, img_len, ehdr, ".debug_line", &dbg.line))
+        return 0;
+    df_elf_section(img, img_len, ehdr, ".debug_line_str", &dbg.line_str);
+    df_elf_section(img, img_len, ehdr, ".debug_str", &dbg.str);
+
+    while (!dbg.line.bad && dbg.line.p < dbg.line.end) {
+        offset_size = 4;
+        len = df_elf_get(&dbg.line, 4);
+        if (len == 0xffffffff) {
+            offset_size = 8;
+            len = df_elf_get(&dbg.line, 8);
+        }
+        if (dbg.line.bad || len > (uint64_t)(dbg.line.end - dbg.line.p))
+            break;
+
+        unit.p = dbg.line.p;
+        unit.end = dbg.line.p + len;
+        unit.bad = 0;
+        if (df_elf_line_unit(&unit, &dbg, offset_size)) {
+            fprintf(stderr, "Failed to allocate memory for line info of "
+                    "'%s'.\n", file);
+            return -1;
+        }
+        dbg.line.p += len;
+    }
+
+    qsort(df_elf_lines_tab.line, df_elf_lines_tab.count,
+            sizeof(*df_elf_lines_tab.line), df_elf_line_cmp);
+
+    return 0;
+}
+
+int
+df_elf_load(const char *file, const uint8_t *img, size_t img_len,
+        uint8_t *flash, size_t len)
+{
+    Elf32_Ehdr ehdr;
+    Elf32_Phdr phdr;
+    size_t off;
+    unsigned int i;
+
+    if (img_len < sizeof(ehdr)) {
+        fprintf(stderr, "'%s' is too short to be an ELF file.\n", file);
+        return -1;
+    }
+    memcpy(&ehdr, img, sizeof(ehdr));
+
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS32 ||
+            ehdr.e_ident[EI_DATA] != ELFDATA2LSB ||
+            ehdr.e_machine != EM_AVR ||
+            ehdr.e_phentsize != sizeof(phdr)) {
+        fprintf(stderr, "'%s' is not an AVR ELF file.\n", file);
+        return -1;
+    }
+
+    /* Flash contents are the segments' load addresses, .data included */
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        off = ehdr.e_phoff + (size_t)i * sizeof(phdr);
+        if (off + sizeof(phdr) > img_len) {
+            fprintf(stderr, "'%s' is truncated.\n", file);
+            return -1;
+        }
+        memcpy(&phdr, img + off, sizeof(phdr));
+
+        if (phdr.p_type != PT_LOAD || !phdr.p_filesz ||
+                phdr.p_paddr >= AVR_DATA_OFFSET)
+            continue;
+
+        if ((size_t)phdr.p_offset + phdr.p_filesz > img_len) {
+            fprintf(stderr, "'%s' is truncated.\n", file);
+            return -1;
+        }
+
+        if ((size_t)phdr.p_paddr + phdr.p_filesz > len) {
+            fprintf(stderr, "Firmware file would exceed max size of flash. "
+                    "Max size: %zu. Firmware baseaddr: %04x, size: %u\n",
+                    len, phdr.p_paddr, phdr.p_filesz);
+            return -1;
+        }
+
+        flash_copy(flash, phdr.p_paddr, img + phdr.p_offset, phdr.p_filesz);
+        printf("Loading '%s' into flash at %04x, size %u\n",
+                file, phdr.p_paddr, phdr.p_filesz);
+    }
+
+    /* Every board loads the same files, their symbols are only kept once */
+    for (i = 0; i < df_elf_nfiles; i++)
+        if (!strcmp(df_elf_files[i].path, file))
+            return 0;
+
+    if (df_elf_load_symbols(file, img, img_len, &ehdr))
+        return -1;
+
+    return df_elf_load_lines(file, img, img_len, &ehdr);
+}
+
+const struct df_elf_syms *
+df_elf_symbols(void)
+{
+    return &df_elf_syms;
+}
+
+const struct df_elf_sym *
+df_elf_lookup(uint32_t addr)
+{
+    const struct df_elf_sym *sym = df_elf_syms.sym;
+    size_t lo = 0;
+    size_t hi = df_elf_syms.count;
+    size_t mid;
+
+    /* Find the last symbol starting at or before 'addr' */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sym[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!lo)
+        return NULL;
+
+    sym = &sym[lo - 1];
+    if (addr == sym->addr || addr < sym->addr + sym->size)
+        return sym;
+
+    return NULL;
+}
+
+const struct df_elf_lines *
+df_elf_lines(void)
+{
+    return &df_elf_lines_tab;
+}
+
+const struct df_elf_line *
+df_elf_line_lookup(uint32_t addr)
+{
+    const struct df_elf_line *line = df_elf_lines_tab.line;
+    size_t lo = 0;
+    size_t hi = df_elf_lines_tab.count;
+    size_t mid;
+
+    /* Find the last range starting at or before 'addr' */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (line[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!lo || addr >= line[lo - 1].end)
+        return NULL;
+
+    return &line[lo - 1];
+}
+
+void
+df_elf_free(void)
+{
+    size_t i;
+
+    for (i = 0; i < df_elf_nfiles; i++) {
+        free(df_elf_files[i].path);
+        free(df_elf_files[i].strtab);
+    }
+    free(df_elf_files);
+    free(df_elf_syms.sym);
+    for (i = 0; i < df_elf_npaths; i++)
+        free(df_elf_paths[i]);
+    free(df_elf_paths);
+    free(df_elf_lines_tab.line);
+
+    df_elf_files = NULL;
+    df_elf_nfiles = 0;
+    df_elf_syms.sym = NULL;
+    df_elf_syms.count = 0;
+    df_elf_paths = NULL;
+    df_elf_npaths = 0;
+    df_elf_lines_tab.line = NULL;
+    df_elf_lines_tab.count = 0;
+}
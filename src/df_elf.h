@@ -0,0 +1,76 @@
+/*
+ * df_elf.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_ELF_H__
+#define __DF_ELF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A function or object in flash, from the firmware's symbol table */
+struct df_elf_sym {
+    uint32_t addr;          /**< byte address in flash */
+    uint32_t size;
+    const char *name;
+};
+
+/* Symbols of every ELF firmware loaded, sorted by address */
+struct df_elf_syms {
+    struct df_elf_sym *sym;
+    size_t count;
+};
+
+/* A range of flash the compiler made of one line of source */
+struct df_elf_line {
+    uint32_t addr;          /**< byte address in flash */
+    uint32_t end;           /**< first address past it */
+    uint32_t line;
+    const char *file;
+};
+
+/* Line info of every ELF firmware loaded, sorted by address */
+struct df_elf_lines {
+    struct df_elf_line *line;
+    size_t count;
+};
+
+int df_elf_is_elf(const uint8_t *img, size_t img_len);
+
+/*
+ * Copy the loadable segments of the ELF image 'img' into 'flash' and
+ * remember its symbols and line info, the first time 'file' is seen.
+ */
+int df_elf_load(const char *file, const uint8_t *img, size_t img_len,
+        uint8_t *flash, size_t len);
+
+const struct df_elf_syms *df_elf_symbols(void);
+
+/* The symbol covering flash address 'addr', if any */
+const struct df_elf_sym *df_elf_lookup(uint32_t addr);
+
+const struct df_elf_lines *df_elf_lines(void);
+
+/* The line flash address 'addr' was compiled from, if any */
+const struct df_elf_line *df_elf_line_lookup(uint32_t addr);
+
+void df_elf_free(void);
+
+#endif /* __DF_ELF_H__ */
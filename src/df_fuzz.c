@@ -0,0 +1,344 @@
+/*
+ * df_fuzz.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_cycle_timers.h>
+
+#include "drumfish.h"
+#include "df_board.h"
+#include "df_cores.h"
+#include "df_fuzz.h"
+#include "df_log.h"
+#include "df_snapshot.h"
+#include "uart_pty.h"
+
+/* Edge counters, one byte each as libFuzzer and AFL have them */
+#define DF_FUZZ_MAP_SIZE (1 << 16)
+
+/* How many inputs AFL runs before starting us afresh */
+#define DF_FUZZ_AFL_LOOPS 10000
+
+enum df_fuzz_result {
+    DF_FUZZ_OK,
+    DF_FUZZ_CRASHED,        /**< cpu_Crashed, e.g. the watchdog fired */
+    DF_FUZZ_BAD_PC,         /**< jumped past the end of flash */
+    DF_FUZZ_ERASED,         /**< ran into erased flash */
+};
+
+static const char * const df_fuzz_result_str[] = {
+    [DF_FUZZ_OK] = "ok",
+    [DF_FUZZ_CRASHED] = "crashed",
+    [DF_FUZZ_BAD_PC] = "jumped out of flash",
+    [DF_FUZZ_ERASED] = "ran into erased flash",
+};
+
+struct df_fuzz {
+    struct df_board *board;
+    struct df_snapshot_image *image;    /**< the booted board */
+    int uart;
+    uint64_t cycles;        /**< budget for each input */
+};
+
+/* The fuzzers' callbacks have nowhere to pass it */
+static struct df_fuzz df_fuzz;
+
+/* libFuzzer picks up counters in this section as coverage */
+static uint8_t df_fuzz_map[DF_FUZZ_MAP_SIZE]
+    __attribute__((used, section("__libfuzzer_extra_counters")));
+
+/* AFL's map, when we're built with afl-cc */
+extern uint8_t *__afl_area_ptr __attribute__((weak));
+extern uint32_t __afl_map_size __attribute__((weak));
+
+#ifdef DF_LIBFUZZER
+int LLVMFuzzerRunDriver(int *argc, char ***argv,
+        int (*cb)(const uint8_t *data, size_t len));
+#endif
+
+static avr_cycle_count_t
+df_fuzz_budget(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    /* Only here so a sleeping core can't skip past the budget */
+    (void)avr;
+    (void)when;
+    (void)param;
+
+    return 0;
+}
+
+/* An instruction went from 'from' to 'to', both byte addresses */
+static inline void
+df_fuzz_edge(uint32_t from, uint32_t to)
+{
+    uint32_t i = (from * 0x9e3779b1u ^ to * 0x85ebca6bu) >> 16;
+
+    if (df_fuzz_map[i] != 0xff)
+        df_fuzz_map[i]++;
+}
+
+/* Hand what we counted over to AFL, if it's there to take it */
+static void
+df_fuzz_afl(void)
+{
+    uint32_t size;
+    uint32_t i;
+
+    if (!&__afl_area_ptr || !__afl_area_ptr)
+        return;
+
+    size = &__afl_map_size && __afl_map_size ? __afl_map_size :
+        DF_FUZZ_MAP_SIZE;
+    for (i = 0; i < DF_FUZZ_MAP_SIZE; i++) {
+        if (df_fuzz_map[i])
+            __afl_area_ptr[i % size] += df_fuzz_map[i];
+    }
+}
+
+static enum df_fuzz_result
+df_fuzz_run(struct df_fuzz *f, size_t len)
+{
+    avr_t *avr = f->board->avr;
+    const uart_pty_t *p = m128rfa1_uart(avr, f->uart);
+    uint64_t end = avr->cycle + f->cycles;
+    uint64_t taken = p->rx_bytes + len;
+    uint32_t pc;
+    int state;
+
+    while (avr->cycle < end) {
+        pc = avr->pc;
+        state = avr_run(avr);
+
+        if (state == cpu_Done)
+            break;
+        if (state == cpu_Crashed)
+            return DF_FUZZ_CRASHED;
+        if (avr->pc > avr->flashend)
+            return DF_FUZZ_BAD_PC;
+
+        /* Asleep with the whole input taken, there's nothing more */
+        if (state == cpu_Sleeping) {
+            if (p->rx_bytes >= taken)
+                break;
+            continue;
+        }
+
+        df_fuzz_edge(pc, avr->pc);
+        if (avr->flash[avr->pc] == 0xff && avr->flash[avr->pc + 1] == 0xff)
+            return DF_FUZZ_ERASED;
+    }
+
+    return DF_FUZZ_OK;
+}
+
+/* Put the board back as it booted and run one input */
+static enum df_fuzz_result
+df_fuzz_exec(struct df_fuzz *f, const uint8_t *data, size_t len)
+{
+    avr_t *avr = f->board->avr;
+    enum df_fuzz_result r;
+
+    df_snapshot_put(f->image, avr);
+    memset(df_fuzz_map, 0, sizeof(df_fuzz_map));
+
+    /* Any more and it wouldn't fit the UART's ring */
+    if (len > UART_PTY_RING_SIZE)
+        len = UART_PTY_RING_SIZE;
+
+    avr_cycle_timer_register(avr, f->cycles, df_fuzz_budget, f);
+    m128rfa1_uart_inject(avr, f->uart, data, len);
+
+    r = df_fuzz_run(f, len);
+
+    /* The next df_snapshot_put() would drop it too, but don't leave
+     * the budget armed on a board we're about to hand back */
+    avr_cycle_timer_cancel(avr, df_fuzz_budget, f);
+
+    if (r != DF_FUZZ_OK)
+        df_log_msg(DF_LOG_ERR, "Firmware %s at PC 0x%x, cycle %" PRIu64
+                "\n", df_fuzz_result_str[r], avr->pc, avr->cycle);
+
+    df_fuzz_afl();
+
+    return r;
+}
+
+#if defined(DF_LIBFUZZER) || defined(__AFL_LOOP)
+/* For a fuzzer, a crash has to take us down for it to notice */
+static int
+df_fuzz_one(const uint8_t *data, size_t len)
+{
+    if (df_fuzz_exec(&df_fuzz, data, len) != DF_FUZZ_OK)
+        abort();
+
+    return 0;
+}
+#endif
+
+/* Run the board up to where the snapshot is taken */
+static int
+df_fuzz_boot(struct df_fuzz *f, uint64_t cycles)
+{
+    avr_t *avr = f->board->avr;
+    uint64_t end = avr->cycle + cycles;
+    int state;
+
+    if (!cycles)
+        return 0;
+
+    avr_cycle_timer_register(avr, cycles, df_fuzz_budget, f);
+    while (avr->cycle < end) {
+        state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "The firmware stopped at cycle %" PRIu64
+                    ", before booting.\n", avr->cycle);
+            return -1;
+        }
+    }
+
+    /* Or every input would start with one */
+    avr_cycle_timer_cancel(avr, df_fuzz_budget, f);
+
+    return 0;
+}
+
+#if !defined(DF_LIBFUZZER) && !defined(__AFL_LOOP)
+/* Without a fuzzer, run each input once, for reproducing crashes */
+static int
+df_fuzz_files(struct df_fuzz *f, int argc, char **argv)
+{
+    uint8_t buf[UART_PTY_RING_SIZE];
+    enum df_fuzz_result r;
+    const char *name;
+    uint64_t start = df_log_host_ns();
+    uint64_t execs = 0;
+    double secs;
+    size_t len;
+    FILE *in;
+    int ret = 0;
+    int i;
+
+    for (i = 1; i < argc || i == 1; i++) {
+        name = i < argc ? argv[i] : "-";
+        in = strcmp(name, "-") ? fopen(name, "rb") : stdin;
+        if (!in) {
+            fprintf(stderr, "Unable to open input '%s': %s\n", name,
+                    strerror(errno));
+            ret = -1;
+            continue;
+        }
+
+        len = fread(buf, 1, sizeof(buf), in);
+        if (in != stdin)
+            fclose(in);
+
+        r = df_fuzz_exec(f, buf, len);
+        execs++;
+        printf("%s: %s\n", name, df_fuzz_result_str[r]);
+        if (r != DF_FUZZ_OK)
+            ret = -1;
+    }
+
+    /* libFuzzer and AFL report their own, this is ours */
+    secs = (df_log_host_ns() - start) / 1e9;
+    df_log_msg(DF_LOG_INFO, "Ran %" PRIu64 " inputs in %.3f s, %.0f "
+            "execs/s\n", execs, secs, secs > 0 ? execs / secs : 0.0);
+
+    return ret;
+}
+#endif
+
+int
+df_fuzz_main(struct df_board *board, char *argv0, int argc,
+        char **argv)
+{
+    struct df_fuzz *f = &df_fuzz;
+    char **args;
+    int ret;
+
+    f->board = board;
+    f->uart = board->config.fuzz;
+    f->cycles = board->config.fuzz_cycles;
+
+    if (!m128rfa1_uart(board->avr, f->uart)) {
+        fprintf(stderr, "UART%d is off, there's nowhere for the fuzzed "
+                "input to go.\n", f->uart);
+        return -1;
+    }
+
+    if (df_fuzz_boot(f, board->config.fuzz_boot))
+        return -1;
+
+    f->image = df_snapshot_take(board->avr);
+    if (!f->image)
+        return -1;
+
+    df_log_msg(DF_LOG_INFO, "Fuzzing UART%d from cycle %" PRIu64 ", %"
+            PRIu64 " cycles per input\n", f->uart, board->avr->cycle,
+            f->cycles);
+
+    /* The fuzzer gets our name and whatever followed '--' */
+    args = calloc(argc + 2, sizeof(*args));
+    if (!args) {
+        fprintf(stderr, "Failed to allocate memory for fuzzer.\n");
+        df_snapshot_image_free(f->image);
+        return -1;
+    }
+    args[0] = argv0;
+    memcpy(&args[1], argv, argc * sizeof(*argv));
+    argc++;
+
+#if defined(DF_LIBFUZZER)
+    ret = LLVMFuzzerRunDriver(&argc, &args, df_fuzz_one);
+#elif defined(__AFL_LOOP)
+    {
+        uint8_t buf[UART_PTY_RING_SIZE];
+        ssize_t len;
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+        /* Fork from here on, not from the top of main() */
+        __AFL_INIT();
+#endif
+        while (__AFL_LOOP(DF_FUZZ_AFL_LOOPS)) {
+            len = read(STDIN_FILENO, buf, sizeof(buf));
+            df_fuzz_one(buf, len > 0 ? len : 0);
+        }
+        ret = 0;
+    }
+#else
+    ret = df_fuzz_files(f, argc, args);
+#endif
+
+    /* Leave the board as it booted */
+    df_snapshot_put(f->image, board->avr);
+    df_snapshot_image_free(f->image);
+    f->image = NULL;
+    free(args);
+
+    return ret;
+}
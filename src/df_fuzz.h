@@ -0,0 +1,38 @@
+/*
+ * df_fuzz.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_FUZZ_H__
+#define __DF_FUZZ_H__
+
+struct df_board;
+
+/*
+ * Fuzz the firmware on 'board' through a UART, from a snapshot taken
+ * once it has booted. Each input is fed to the UART and run for the
+ * cycle budget, or until the firmware sleeps having taken all of it,
+ * with the edges it took counted for the fuzzer. 'argv' is for the
+ * fuzzer, or the inputs to run once each when there's no fuzzer. Returns
+ * non-zero if an input crashed the firmware.
+ */
+int df_fuzz_main(struct df_board *board, char *argv0, int argc,
+        char **argv);
+
+#endif /* __DF_FUZZ_H__ */
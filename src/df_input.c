@@ -0,0 +1,228 @@
+/*
+ * df_input.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "df_input.h"
+
+static const char * const df_input_target_str[] = {
+    "uart0",
+    "uart1",
+    NULL
+};
+
+static int
+df_input_hex(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+long
+df_input_data(const char *s, uint8_t *data)
+{
+    long len = 0;
+    unsigned long v;
+    char *end;
+    int h;
+
+    for (;;) {
+        while (isspace((unsigned char)*s))
+            s++;
+        if (!*s || *s == '#')
+            return len;
+
+        if (*s != '"') {
+            errno = 0;
+            v = strtoul(s, &end, 0);
+            if (errno || end == s || v > 0xff ||
+                    (*end && !isspace((unsigned char)*end)))
+                return -1;
+            data[len++] = v;
+            s = end;
+            continue;
+        }
+
+        for (s++; *s != '"'; s++) {
+            if (!*s)
+                return -1;
+            if (*s != '\\') {
+                data[len++] = *s;
+                continue;
+            }
+
+            switch (*++s) {
+                case 'n': data[len++] = '\n'; break;
+                case 'r': data[len++] = '\r'; break;
+                case 't': data[len++] = '\t'; break;
+                case '0': data[len++] = '\0'; break;
+                case '\\': data[len++] = '\\'; break;
+                case '"': data[len++] = '"'; break;
+                case 'x':
+                    if ((h = df_input_hex(s[1])) < 0 ||
+                            df_input_hex(s[2]) < 0)
+                        return -1;
+                    data[len++] = (h << 4) | df_input_hex(s[2]);
+                    s += 2;
+                    break;
+                default:
+                    return -1;
+            }
+        }
+        s++;
+    }
+}
+
+/* Queued after every event up to its cycle, scripts are mostly in order */
+static int
+df_input_add(struct df_input *in, uint64_t cycle, int target,
+        const uint8_t *data, size_t len)
+{
+    struct df_input_event *ev;
+    size_t pos;
+
+    if ((in->count & (in->count - 1)) == 0) {
+        ev = realloc(in->ev, (in->count ? in->count * 2 : 16) * sizeof(*ev));
+        if (!ev)
+            return -1;
+        in->ev = ev;
+    }
+
+    for (pos = in->count; pos && in->ev[pos - 1].cycle > cycle; pos--)
+        ;
+    ev = &in->ev[pos];
+
+    memmove(ev + 1, ev, (in->count - pos) * sizeof(*ev));
+    ev->data = malloc(len ? len : 1);
+    if (!ev->data) {
+        memmove(ev, ev + 1, (in->count - pos) * sizeof(*ev));
+        return -1;
+    }
+    memcpy(ev->data, data, len);
+    ev->cycle = cycle;
+    ev->target = target;
+    ev->len = len;
+    in->count++;
+
+    return 0;
+}
+
+struct df_input *
+df_input_load(const char *path)
+{
+    struct df_input *in;
+    unsigned long long cycle;
+    unsigned int lineno = 0;
+    char target[16];
+    char *line = NULL;
+    size_t size = 0;
+    uint8_t *data = NULL;
+    long len;
+    int off;
+    int t;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open input '%s': %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    in = calloc(1, sizeof(*in));
+    if (!in) {
+        fprintf(stderr, "Failed to allocate memory for input.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    while (getline(&line, &size, f) != -1) {
+        lineno++;
+
+        off = 0;
+        if (sscanf(line, " %n", &off) != EOF && (!line[off] ||
+                    line[off] == '#'))
+            continue;
+
+        if (sscanf(line, "%llu %15s %n", &cycle, target, &off) != 2)
+            goto bad;
+
+        for (t = 0; df_input_target_str[t]; t++) {
+            if (strcmp(target, df_input_target_str[t]) == 0)
+                break;
+        }
+        if (!df_input_target_str[t])
+            goto bad;
+
+        /* The data is never longer than how it's written */
+        free(data);
+        data = malloc(strlen(line + off) + 1);
+        if (!data)
+            goto nomem;
+        len = df_input_data(line + off, data);
+        if (len < 0)
+            goto bad;
+
+        if (df_input_add(in, cycle, t, data, len))
+            goto nomem;
+    }
+
+    free(data);
+    free(line);
+    fclose(f);
+    return in;
+
+bad:
+    fprintf(stderr, "%s:%u: invalid input event, expected 'CYCLE uartN "
+            "DATA'\n", path, lineno);
+    goto fail;
+nomem:
+    fprintf(stderr, "Failed to allocate memory for input.\n");
+fail:
+    free(data);
+    free(line);
+    fclose(f);
+    df_input_free(in);
+    return NULL;
+}
+
+void
+df_input_free(struct df_input *in)
+{
+    size_t i;
+
+    if (!in)
+        return;
+
+    for (i = 0; i < in->count; i++)
+        free(in->ev[i].data);
+    free(in->ev);
+    free(in);
+}
@@ -0,0 +1,76 @@
+/*
+ * df_input.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_INPUT_H__
+#define __DF_INPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What an input event is for */
+enum df_input_target {
+    DF_INPUT_UART0,
+    DF_INPUT_UART1,
+};
+
+struct df_input_event {
+    uint64_t cycle;         /**< the board's, when it's applied */
+    enum df_input_target target;
+    uint32_t len;
+    uint8_t *data;
+};
+
+/*
+ * A board's external input for deterministic mode, one queue ordered by
+ * cycle, events at the same cycle in the order they were given.
+ */
+struct df_input {
+    struct df_input_event *ev;
+    size_t count;
+    size_t next;            /**< applied up to here */
+};
+
+/*
+ * Read an input script, a line per event of the cycle, the target and
+ * its data as quoted strings and byte values, e.g.
+ *
+ *   16000 uart1 "AT\r" 0x0a
+ */
+struct df_input *df_input_load(const char *path);
+
+/*
+ * Parse data written as in an input script into 'data', which is at
+ * least as long as 's'. Returns its length or -1.
+ */
+long df_input_data(const char *s, uint8_t *data);
+
+/* The next event due at or before 'cycle', which is then applied */
+static inline const struct df_input_event *
+df_input_next(struct df_input *in, uint64_t cycle)
+{
+    if (in->next == in->count || in->ev[in->next].cycle > cycle)
+        return NULL;
+    return &in->ev[in->next++];
+}
+
+void df_input_free(struct df_input *in);
+
+#endif /* __DF_INPUT_H__ */
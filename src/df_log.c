@@ -21,63 +21,116 @@
 
 #define _GNU_SOURCE
 
-#include <sys/time.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "drumfish.h"
+#include "df_clock.h"
 #include "df_log.h"
 
 static enum df_log_lvl verbosity = 0;
-static struct timeval start_time;
+static enum df_log_clock log_clock = DF_LOG_CLOCK_HOST;
+static struct timespec start_time;
+static uint32_t log_frequency = 0;  /**< of the last clock set, for traces */
+
+/* The board the calling thread is running or serving, if any */
+static __thread const struct df_clock *thread_clock = NULL;
 
 void
 df_log_init(struct drumfish_cfg *config)
 {
     verbosity = (enum df_log_lvl) config->verbose;
-    timerclear(&start_time);
+    log_clock = config->log_clock;
+    start_time.tv_sec = 0;
+    start_time.tv_nsec = 0;
 }
 
 void
 df_log_start_time(void)
 {
-    if (gettimeofday(&start_time, NULL))
-        timerclear(&start_time);
+    if (clock_gettime(CLOCK_MONOTONIC, &start_time)) {
+        start_time.tv_sec = 0;
+        start_time.tv_nsec = 0;
+    }
+}
+
+/* Host time since the CPU started, which NTP can't make jump */
+uint64_t
+df_log_host_ns(void)
+{
+    struct timespec now;
+
+    if (!start_time.tv_sec && !start_time.tv_nsec)
+        return 0;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        fprintf(stderr, "Failed to get current time: %s\n",
+                strerror(errno));
+        return 0;
+    }
+
+    return (uint64_t)(now.tv_sec - start_time.tv_sec) * 1000000000ULL +
+        now.tv_nsec - start_time.tv_nsec;
+}
+
+void
+df_log_set_clock(const struct df_clock *clock)
+{
+    thread_clock = clock;
+    if (clock)
+        __atomic_store_n(&log_frequency, clock->frequency, __ATOMIC_RELAXED);
+}
+
+/*
+ * The time stamp messages start with: host time, and with the 'sim' log
+ * clock the board's cycle and the simulated time that works out to.
+ */
+void
+df_log_stamp(char *buf, size_t len, uint64_t host_ns, int has_cycle,
+        uint64_t cycle)
+{
+    uint32_t freq = __atomic_load_n(&log_frequency, __ATOMIC_RELAXED);
+    uint64_t host_us = host_ns / 1000;
+
+    if (log_clock == DF_LOG_CLOCK_HOST) {
+        snprintf(buf, len, "[%5" PRIu64 ".%06" PRIu64 "] ",
+                host_us / 1000000, host_us % 1000000);
+    } else if (!has_cycle || !freq) {
+        snprintf(buf, len, "[%5" PRIu64 ".%06" PRIu64 " %12s %12s] ",
+                host_us / 1000000, host_us % 1000000, "-", "-");
+    } else {
+        snprintf(buf, len, "[%5" PRIu64 ".%06" PRIu64 " %12" PRIu64
+                " %5" PRIu64 ".%06" PRIu64 "] ",
+                host_us / 1000000, host_us % 1000000, cycle,
+                cycle / freq, cycle % freq * 1000000 / freq);
+    }
 }
 
 void
 df_log_msg(enum df_log_lvl level, const char *format, ...)
 {
     va_list ap;
-    struct timeval now;
-    struct timeval offset;
+    char stamp[DF_LOG_STAMP_MAX];
     char *msg;
 
     va_start(ap, format);
 
     /* If its a message we will not print, skip it */
     if (level <= verbosity) {
-        /* Get our current time for stamping the message */
-        if (gettimeofday(&now, NULL)) {
-            fprintf(stderr, "Failed to get current time: %s\n",
-                    strerror(errno));
-            timerclear(&now);
-        }
-
-        /* Compute time since the CPU started */
-        if (timerisset(&start_time))
-            timersub(&now, &start_time, &offset);
-        else
-            timerclear(&offset);
+        df_log_stamp(stamp, sizeof(stamp), df_log_host_ns(),
+                thread_clock != NULL,
+                thread_clock ? df_clock_cycle(thread_clock) : 0);
 
         /* Build the message and print it with the time stamp */
-        vasprintf(&msg, format, ap);
-        fprintf(stderr, "[%5ld.%06ld] %s", offset.tv_sec, offset.tv_usec,
-                msg);
-        free(msg);
+        if (vasprintf(&msg, format, ap) >= 0) {
+            fprintf(stderr, "%s%s", stamp, msg);
+            free(msg);
+        }
     }
 
     va_end(ap);
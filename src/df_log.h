@@ -23,6 +23,9 @@
 #ifndef __DF_LOG_H__
 #define __DF_LOG_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Possible logging levels */
 enum df_log_lvl {
     DF_LOG_ERR = 0,
@@ -33,11 +36,23 @@ enum df_log_lvl {
 
 /* Forward declaration */
 struct drumfish_cfg;
+struct df_clock;
+
+/* Room for the longest time stamp */
+#define DF_LOG_STAMP_MAX 64
 
 void df_log_init(struct drumfish_cfg *config);
 
 void df_log_start_time(void);
 
+uint64_t df_log_host_ns(void);
+
+/* Stamp this thread's messages with where 'clock's board is at */
+void df_log_set_clock(const struct df_clock *clock);
+
+void df_log_stamp(char *buf, size_t len, uint64_t host_ns, int has_cycle,
+        uint64_t cycle);
+
 void df_log_msg(enum df_log_lvl level, const char *format, ...)
     __attribute__ ((format (printf, 2, 3)));
 
@@ -0,0 +1,811 @@
+/*
+ * df_medium.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "df_log.h"
+#include "df_medium.h"
+
+/*
+ * In process medium
+ *
+ * Every board in this process shares the air. Radios are kept in a list
+ * per channel so sending a frame only ever touches the radios that can
+ * hear it. A frame is allocated once per transmission and shared by
+ * reference between everyone it's delivered to, each receiver having its
+ * own small inbox kept in start cycle order.
+ *
+ * Boards don't run in step, so a radio can tune in after another board
+ * has already sent a frame that, in simulated time, starts later. Each
+ * channel remembers its last few frames and hands them to radios tuning
+ * in so they hear the same thing no matter which board ran first.
+ */
+
+/* Frames a radio can have queued before we start dropping them */
+#define INPROC_INBOX_LEN 32
+/* Frames each channel remembers for radios tuning in */
+#define INPROC_RECENT_LEN 16
+
+struct inproc_frame {
+    int refs;
+    struct df_air_frame air;
+};
+
+struct inproc_port {
+    struct df_radio_port *port;
+    struct inproc_port *next;       /**< next radio on the same channel */
+    pthread_mutex_t lock;           /**< protects the inbox */
+    struct inproc_frame *inbox[INPROC_INBOX_LEN];
+    unsigned int head;
+    unsigned int count;             /**< read locklessly as a hint */
+};
+
+static struct {
+    pthread_rwlock_t lock;          /**< protects the channel lists */
+    struct inproc_port *channel[DF_MEDIUM_CHANNELS];
+    pthread_mutex_t recent_lock;    /**< protects 'recent' among senders */
+    struct inproc_frame *recent[DF_MEDIUM_CHANNELS][INPROC_RECENT_LEN];
+    unsigned int recent_next[DF_MEDIUM_CHANNELS];
+} inproc = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .recent_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+inproc_frame_unref(struct inproc_frame *f)
+{
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(f);
+}
+
+static int
+inproc_attach(struct df_radio_port *port, const char *arg)
+{
+    struct inproc_port *ip;
+
+    (void)arg;
+
+    ip = calloc(1, sizeof(*ip));
+    if (!ip) {
+        fprintf(stderr, "Failed to allocate memory for radio.\n");
+        return -1;
+    }
+
+    ip->port = port;
+    pthread_mutex_init(&ip->lock, NULL);
+    port->priv = ip;
+
+    return 0;
+}
+
+/* Must be called with the medium write locked */
+static void
+inproc_unlink(struct inproc_port *ip)
+{
+    struct inproc_port **pp;
+
+    if (!ip->port->channel)
+        return;
+
+    for (pp = &inproc.channel[ip->port->channel]; *pp; pp = &(*pp)->next) {
+        if (*pp == ip) {
+            *pp = ip->next;
+            break;
+        }
+    }
+    ip->next = NULL;
+}
+
+/* Queue 'f' for 'ip', keeping the inbox ordered by start cycle and then
+ * sender so every receiver sees the same order. With 'once' set nothing
+ * happens if it's already queued.
+ */
+static void
+inproc_deliver(struct inproc_port *ip, struct inproc_frame *f, int once)
+{
+    unsigned int i;
+    unsigned int slot;
+    unsigned int prev;
+
+    pthread_mutex_lock(&ip->lock);
+
+    for (i = 0; once && i < ip->count; i++) {
+        if (ip->inbox[(ip->head + i) % INPROC_INBOX_LEN] == f) {
+            pthread_mutex_unlock(&ip->lock);
+            return;
+        }
+    }
+
+    if (ip->count == INPROC_INBOX_LEN) {
+        ip->port->dropped++;
+        pthread_mutex_unlock(&ip->lock);
+        return;
+    }
+
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+
+    /* Frames almost always arrive in order so walk back from the tail */
+    for (i = ip->count; i > 0; i--) {
+        slot = (ip->head + i) % INPROC_INBOX_LEN;
+        prev = (ip->head + i - 1) % INPROC_INBOX_LEN;
+
+        if (ip->inbox[prev]->air.start < f->air.start ||
+                (ip->inbox[prev]->air.start == f->air.start &&
+                 ip->inbox[prev]->air.src < f->air.src))
+            break;
+
+        ip->inbox[slot] = ip->inbox[prev];
+    }
+
+    ip->inbox[(ip->head + i) % INPROC_INBOX_LEN] = f;
+    __atomic_store_n(&ip->count, ip->count + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&ip->lock);
+}
+
+static void
+inproc_tune(struct df_radio_port *port, uint8_t channel)
+{
+    struct inproc_port *ip = port->priv;
+    struct inproc_frame *f;
+    unsigned int i;
+
+    if (channel >= DF_MEDIUM_CHANNELS)
+        channel = 0;
+
+    pthread_rwlock_wrlock(&inproc.lock);
+
+    inproc_unlink(ip);
+    port->channel = channel;
+    if (channel) {
+        ip->next = inproc.channel[channel];
+        inproc.channel[channel] = ip;
+
+        /* Senders are locked out, so 'recent' is ours to look at */
+        for (i = 0; i < INPROC_RECENT_LEN; i++) {
+            f = inproc.recent[channel][i];
+            if (f && f->air.src != port->mac &&
+                    f->air.start >= port->tuned_at)
+                inproc_deliver(ip, f, 1);
+        }
+    }
+
+    pthread_rwlock_unlock(&inproc.lock);
+}
+
+static void
+inproc_detach(struct df_radio_port *port)
+{
+    struct inproc_port *ip = port->priv;
+
+    inproc_tune(port, 0);
+
+    while (ip->count) {
+        inproc_frame_unref(ip->inbox[ip->head]);
+        ip->head = (ip->head + 1) % INPROC_INBOX_LEN;
+        ip->count--;
+    }
+
+    pthread_mutex_destroy(&ip->lock);
+    free(ip);
+    port->priv = NULL;
+}
+
+static void
+inproc_send(struct df_radio_port *port, const struct df_air_frame *air)
+{
+    struct inproc_port *ip;
+    struct inproc_frame *f;
+    struct inproc_frame *old;
+    unsigned int *next;
+
+    if (!air->channel || air->channel >= DF_MEDIUM_CHANNELS)
+        return;
+
+    f = malloc(sizeof(*f));
+    if (!f) {
+        df_log_msg(DF_LOG_ERR, "Failed to allocate memory for frame.\n");
+        return;
+    }
+
+    /* Hold our own reference while handing it out */
+    f->refs = 1;
+    memcpy(&f->air, air, sizeof(*air));
+
+    pthread_rwlock_rdlock(&inproc.lock);
+
+    /* Remember it for anyone tuning in after us */
+    pthread_mutex_lock(&inproc.recent_lock);
+    next = &inproc.recent_next[air->channel];
+    old = inproc.recent[air->channel][*next];
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    inproc.recent[air->channel][*next] = f;
+    *next = (*next + 1) % INPROC_RECENT_LEN;
+    pthread_mutex_unlock(&inproc.recent_lock);
+
+    for (ip = inproc.channel[air->channel]; ip; ip = ip->next) {
+        if (ip->port != port)
+            inproc_deliver(ip, f, 0);
+    }
+
+    pthread_rwlock_unlock(&inproc.lock);
+
+    if (old)
+        inproc_frame_unref(old);
+    inproc_frame_unref(f);
+}
+
+static const struct df_air_frame *
+inproc_peek(struct df_radio_port *port)
+{
+    struct inproc_port *ip = port->priv;
+    struct inproc_frame *f;
+
+    /* Cheap check first, this is called from the emulation loop */
+    if (!__atomic_load_n(&ip->count, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    pthread_mutex_lock(&ip->lock);
+    f = ip->count ? ip->inbox[ip->head] : NULL;
+    pthread_mutex_unlock(&ip->lock);
+
+    /* We hold a reference to it until it's popped */
+    return f ? &f->air : NULL;
+}
+
+static void
+inproc_pop(struct df_radio_port *port)
+{
+    struct inproc_port *ip = port->priv;
+    struct inproc_frame *f = NULL;
+
+    pthread_mutex_lock(&ip->lock);
+    if (ip->count) {
+        f = ip->inbox[ip->head];
+        ip->head = (ip->head + 1) % INPROC_INBOX_LEN;
+        __atomic_store_n(&ip->count, ip->count - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ip->lock);
+
+    if (f)
+        inproc_frame_unref(f);
+}
+
+static const struct df_medium_ops inproc_ops = {
+    .name = "in-process",
+    .attach = inproc_attach,
+    .detach = inproc_detach,
+    .tune = inproc_tune,
+    .send = inproc_send,
+    .peek = inproc_peek,
+    .pop = inproc_pop,
+};
+
+/*
+ * Shared memory medium
+ *
+ * Lets drumfish processes on one host share the air through a segment in
+ * /dev/shm. Every transmission claims the next slot of a single broadcast
+ * ring and every radio, in whichever process, follows the ring with its
+ * own cursor. A frame is written once no matter how many radios hear it
+ * and neither sending nor receiving makes a system call.
+ *
+ * Each slot carries a sequence number which is odd while frame n is being
+ * written and 2 * n + 2 once it's complete. Readers check it before and
+ * after copying a frame out, which catches both frames that aren't done
+ * yet and slots the writers have lapped us on. The copy can't be avoided:
+ * the radio may hold on to a frame over several polls while writers reuse
+ * its slot, and a frame from another process gets our start cycle. Only
+ * frames that are for us are copied, and only as much PSDU as they have.
+ *
+ * Radios register their MAC in the segment when they join so two nodes
+ * can't come up with the same address. The last to leave unlinks the
+ * segment; joining and leaving hold a lock on it so nobody joins one
+ * that's on its way out.
+ */
+
+#define SHM_MAGIC           0x647266697368ULL   /* "drfish" */
+#define SHM_VERSION         1
+#define SHM_SLOTS           4096                /* must be a power of 2 */
+#define SHM_NODES           1024
+#define SHM_NAME_PREFIX     "/drumfish-"
+#define SHM_NAME_DEFAULT    "air"
+#define SHM_NAME_MAX        64
+/* How long we wait on whoever is creating the segment, in 10ms steps */
+#define SHM_OPEN_TRIES      100
+
+struct shm_slot {
+    uint64_t seq;
+    int32_t pid;                    /**< process the sender lives in */
+    struct df_air_frame air;
+} __attribute__ ((aligned (64)));
+
+struct shm_node {
+    uint64_t mac;                   /**< 0 when the entry is free */
+    int32_t pid;                    /**< 0 while being claimed */
+};
+
+struct shm_air {
+    uint64_t magic;                 /**< set last by the creator */
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t nnodes;
+    uint64_t head __attribute__ ((aligned (64)));   /**< next frame number */
+    struct shm_node node[SHM_NODES] __attribute__ ((aligned (64)));
+    struct shm_slot slot[SHM_SLOTS];
+};
+
+struct shm_port {
+    struct shm_air *air;
+    struct shm_node *node;
+    int fd;                         /**< the segment, for locking it */
+    char path[sizeof(SHM_NAME_PREFIX) + SHM_NAME_MAX];
+    pid_t pid;
+    uint64_t cursor;                /**< next frame number we look at */
+    int have;                       /**< 'cur' holds an unpopped frame */
+    struct df_air_frame cur;
+};
+
+static int
+shm_pid_alive(int32_t pid)
+{
+    /* 0 is someone in the middle of claiming the entry */
+    if (pid <= 0)
+        return 1;
+
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* Map the segment at 'path', its descriptor is left in 'fdp' */
+static struct shm_air *
+shm_map(const char *path, int *fdp)
+{
+    struct shm_air *air = NULL;
+    struct stat st;
+    int creator = 0;
+    int tries;
+    int fd;
+
+    for (tries = 0; ; tries++) {
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            creator = 1;
+            break;
+        }
+        if (errno != EEXIST)
+            break;
+
+        /* Unless the last node out unlinked it in between */
+        fd = shm_open(path, O_RDWR, 0);
+        if (fd >= 0 || errno != ENOENT || tries == SHM_OPEN_TRIES)
+            break;
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open radio medium '%s': %s\n",
+                path, strerror(errno));
+        return NULL;
+    }
+
+    if (creator && ftruncate(fd, sizeof(*air))) {
+        fprintf(stderr, "Failed to size radio medium '%s': %s\n",
+                path, strerror(errno));
+        goto err;
+    }
+
+    /* The creator may not have sized it yet */
+    for (tries = 0; ; tries++) {
+        if (fstat(fd, &st)) {
+            fprintf(stderr, "Failed to stat radio medium '%s': %s\n",
+                    path, strerror(errno));
+            goto err;
+        }
+        if ((size_t)st.st_size >= sizeof(*air))
+            break;
+        if (tries == SHM_OPEN_TRIES) {
+            fprintf(stderr, "Radio medium '%s' is too small.\n", path);
+            goto err;
+        }
+        usleep(10000);
+    }
+
+    air = mmap(NULL, sizeof(*air), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (air == MAP_FAILED) {
+        fprintf(stderr, "Failed to map radio medium '%s': %s\n",
+                path, strerror(errno));
+        air = NULL;
+        goto err;
+    }
+
+    if (creator) {
+        /* ftruncate() gave us zeros which is an empty ring */
+        air->version = SHM_VERSION;
+        air->nslots = SHM_SLOTS;
+        air->nnodes = SHM_NODES;
+        __atomic_store_n(&air->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+        *fdp = fd;
+        return air;
+    }
+
+    for (tries = 0; __atomic_load_n(&air->magic, __ATOMIC_ACQUIRE) !=
+            SHM_MAGIC; tries++) {
+        if (tries == SHM_OPEN_TRIES) {
+            fprintf(stderr, "Radio medium '%s' was never set up.\n", path);
+            goto err;
+        }
+        usleep(10000);
+    }
+
+    if (air->version != SHM_VERSION || air->nslots != SHM_SLOTS ||
+            air->nnodes != SHM_NODES) {
+        fprintf(stderr, "Radio medium '%s' was created by an incompatible "
+                "drumfish.\n", path);
+        goto err;
+    }
+
+    *fdp = fd;
+    return air;
+
+err:
+    if (air)
+        munmap(air, sizeof(*air));
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/* Claim an entry for 'mac' in the node table, refusing duplicates */
+static struct shm_node *
+shm_node_claim(struct shm_air *air, uint64_t mac, pid_t pid)
+{
+    struct shm_node *node = NULL;
+    int32_t owner;
+    uint64_t free_mac;
+    unsigned int i;
+
+    /* Take over the entry of a node that went away without leaving */
+    for (i = 0; i < SHM_NODES && !node; i++) {
+        if (__atomic_load_n(&air->node[i].mac, __ATOMIC_ACQUIRE) != mac)
+            continue;
+
+        owner = __atomic_load_n(&air->node[i].pid, __ATOMIC_ACQUIRE);
+        if (shm_pid_alive(owner))
+            return NULL;
+
+        if (__atomic_compare_exchange_n(&air->node[i].pid, &owner, pid, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            node = &air->node[i];
+        else
+            return NULL;
+    }
+
+    for (i = 0; i < SHM_NODES && !node; i++) {
+        free_mac = 0;
+        if (__atomic_compare_exchange_n(&air->node[i].mac, &free_mac, mac,
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            node = &air->node[i];
+            __atomic_store_n(&node->pid, pid, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (!node)
+        return NULL;
+
+    /* If someone raced us for the same MAC, the lower entry wins */
+    for (i = 0; &air->node[i] < node; i++) {
+        if (__atomic_load_n(&air->node[i].mac, __ATOMIC_ACQUIRE) == mac &&
+                shm_pid_alive(__atomic_load_n(&air->node[i].pid,
+                        __ATOMIC_ACQUIRE))) {
+            __atomic_store_n(&node->pid, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&node->mac, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+    }
+
+    return node;
+}
+
+static int
+shm_attach(struct df_radio_port *port, const char *arg)
+{
+    struct shm_port *sp;
+    const char *name = (arg && *arg) ? arg : SHM_NAME_DEFAULT;
+    struct stat st;
+    int tries;
+
+    if (strchr(name, '/') || strlen(name) > SHM_NAME_MAX) {
+        fprintf(stderr, "Invalid radio medium name '%s'\n", name);
+        return -1;
+    }
+
+    sp = calloc(1, sizeof(*sp));
+    if (!sp) {
+        fprintf(stderr, "Failed to allocate memory for radio.\n");
+        return -1;
+    }
+
+    sp->pid = getpid();
+    sp->fd = -1;
+    snprintf(sp->path, sizeof(sp->path), SHM_NAME_PREFIX "%s", name);
+
+    /* Until we get one the last node isn't unlinking as we join */
+    for (tries = 0; ; tries++) {
+        sp->air = shm_map(sp->path, &sp->fd);
+        if (!sp->air)
+            goto err;
+
+        if (flock(sp->fd, LOCK_EX)) {
+            fprintf(stderr, "Failed to lock radio medium '%s': %s\n",
+                    sp->path, strerror(errno));
+            goto err;
+        }
+        if (fstat(sp->fd, &st)) {
+            fprintf(stderr, "Failed to stat radio medium '%s': %s\n",
+                    sp->path, strerror(errno));
+            goto err;
+        }
+        if (st.st_nlink)
+            break;
+
+        munmap(sp->air, sizeof(*sp->air));
+        close(sp->fd);
+        sp->air = NULL;
+        sp->fd = -1;
+        if (tries == SHM_OPEN_TRIES) {
+            fprintf(stderr, "Radio medium '%s' keeps going away.\n",
+                    sp->path);
+            goto err;
+        }
+    }
+
+    sp->node = shm_node_claim(sp->air, port->mac, sp->pid);
+    flock(sp->fd, LOCK_UN);
+    if (!sp->node) {
+        fprintf(stderr, "Radio %016llx is already on medium '%s' or "
+                "it's full.\n", (unsigned long long)port->mac, name);
+        goto err;
+    }
+
+    /* We only hear what's sent after we show up */
+    sp->cursor = __atomic_load_n(&sp->air->head, __ATOMIC_ACQUIRE);
+    port->priv = sp;
+
+    return 0;
+
+err:
+    if (sp->air)
+        munmap(sp->air, sizeof(*sp->air));
+    if (sp->fd >= 0)
+        close(sp->fd);
+    free(sp);
+    return -1;
+}
+
+static void
+shm_detach(struct df_radio_port *port)
+{
+    struct shm_port *sp = port->priv;
+    struct stat st;
+    unsigned int i;
+    int locked;
+
+    locked = flock(sp->fd, LOCK_EX) == 0;
+
+    __atomic_store_n(&sp->node->pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&sp->node->mac, 0, __ATOMIC_RELEASE);
+
+    /* Last one out takes the segment with it, nodes that went away
+     * without leaving don't count
+     */
+    for (i = 0; i < SHM_NODES; i++) {
+        if (__atomic_load_n(&sp->air->node[i].mac, __ATOMIC_ACQUIRE) &&
+                shm_pid_alive(__atomic_load_n(&sp->air->node[i].pid,
+                        __ATOMIC_ACQUIRE)))
+            break;
+    }
+    if (locked && i == SHM_NODES && !fstat(sp->fd, &st) && st.st_nlink &&
+            shm_unlink(sp->path))
+        df_log_msg(DF_LOG_WARN, "Failed to remove radio medium '%s': %s\n",
+                sp->path, strerror(errno));
+
+    munmap(sp->air, sizeof(*sp->air));
+    close(sp->fd);
+    free(sp);
+    port->priv = NULL;
+}
+
+static void
+shm_tune(struct df_radio_port *port, uint8_t channel)
+{
+    /* Everyone reads the whole ring so this is just our filter */
+    port->channel = channel < DF_MEDIUM_CHANNELS ? channel : 0;
+}
+
+static void
+shm_send(struct df_radio_port *port, const struct df_air_frame *air)
+{
+    struct shm_port *sp = port->priv;
+    struct shm_slot *slot;
+    uint64_t n;
+
+    if (!air->channel || air->channel >= DF_MEDIUM_CHANNELS)
+        return;
+
+    n = __atomic_fetch_add(&sp->air->head, 1, __ATOMIC_RELAXED);
+    slot = &sp->air->slot[n & (SHM_SLOTS - 1)];
+
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->pid = sp->pid;
+    memcpy(&slot->air, air, offsetof(struct df_air_frame, psdu) + air->len);
+
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+}
+
+static const struct df_air_frame *
+shm_peek(struct df_radio_port *port)
+{
+    struct shm_port *sp = port->priv;
+    struct shm_slot *slot;
+    uint64_t head;
+    uint64_t want;
+    uint64_t seq;
+    int32_t pid;
+    uint8_t len;
+    int ours;
+
+    if (sp->have)
+        return &sp->cur;
+
+    head = __atomic_load_n(&sp->air->head, __ATOMIC_ACQUIRE);
+
+    while (sp->cursor < head) {
+        slot = &sp->air->slot[sp->cursor & (SHM_SLOTS - 1)];
+        want = 2 * sp->cursor + 2;
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq < want) {
+            /* Still being written, unless the writer died at it */
+            if (head - sp->cursor < SHM_SLOTS / 2)
+                break;
+            port->dropped++;
+            sp->cursor++;
+            continue;
+        }
+
+        if (seq == want) {
+            /* Look before copying, only frames for us are */
+            pid = slot->pid;
+            len = __atomic_load_n(&slot->air.len, __ATOMIC_RELAXED);
+            ours = slot->air.src != port->mac &&
+                slot->air.channel == port->channel &&
+                len <= DF_AIR_MAX_PSDU;
+            if (ours)
+                memcpy(&sp->cur, &slot->air,
+                        offsetof(struct df_air_frame, psdu) + len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == want) {
+                sp->cursor++;
+
+                /* Only now is the copy known to be whole */
+                if (!ours || sp->cur.len != len ||
+                        sp->cur.src == port->mac ||
+                        sp->cur.channel != port->channel)
+                    continue;
+
+                /* Another process's cycles mean nothing to us, the frame
+                 * starts as soon as we notice it.
+                 */
+                if (pid != sp->pid)
+                    sp->cur.start = port->now;
+
+                sp->have = 1;
+                return &sp->cur;
+            }
+        }
+
+        /* We've been lapped, skip ahead to where it's safe to read */
+        head = __atomic_load_n(&sp->air->head, __ATOMIC_ACQUIRE);
+        want = head - SHM_SLOTS / 2;
+        if (head < SHM_SLOTS / 2 || want <= sp->cursor)
+            want = sp->cursor + 1;
+        port->dropped += want - sp->cursor;
+        sp->cursor = want;
+    }
+
+    return NULL;
+}
+
+static void
+shm_pop(struct df_radio_port *port)
+{
+    struct shm_port *sp = port->priv;
+
+    sp->have = 0;
+}
+
+static const struct df_medium_ops shm_ops = {
+    .name = "shared memory",
+    .attach = shm_attach,
+    .detach = shm_detach,
+    .tune = shm_tune,
+    .send = shm_send,
+    .peek = shm_peek,
+    .pop = shm_pop,
+};
+
+int
+df_medium_attach(struct df_radio_port *port, const char *spec, uint64_t mac)
+{
+    const struct df_medium_ops *ops = NULL;
+    const char *arg = NULL;
+
+    memset(port, 0, sizeof(*port));
+    port->mac = mac;
+
+    if (strcmp(spec, "on") == 0) {
+        ops = &inproc_ops;
+    } else if (strcmp(spec, "shm") == 0) {
+        ops = &shm_ops;
+    } else if (strncmp(spec, "shm:", 4) == 0) {
+        ops = &shm_ops;
+        arg = spec + 4;
+    }
+
+    if (!ops) {
+        fprintf(stderr, "Unknown radio medium '%s'\n", spec);
+        return -1;
+    }
+
+    if (ops->attach(port, arg))
+        return -1;
+
+    port->ops = ops;
+
+    df_log_msg(DF_LOG_INFO, "Radio %016llx joined the %s medium\n",
+            (unsigned long long)mac, ops->name);
+
+    return 0;
+}
+
+void
+df_medium_detach(struct df_radio_port *port)
+{
+    if (!port->ops)
+        return;
+
+    port->ops->detach(port);
+    port->ops = NULL;
+}
@@ -0,0 +1,135 @@
+/*
+ * df_medium.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_MEDIUM_H__
+#define __DF_MEDIUM_H__
+
+#include <stdint.h>
+
+/* 802.15.4 2.4GHz channels are numbered 11 through 26, 0 means deaf */
+#define DF_MEDIUM_CHANNEL_MIN 11
+#define DF_MEDIUM_CHANNEL_MAX 26
+#define DF_MEDIUM_CHANNELS (DF_MEDIUM_CHANNEL_MAX + 1)
+
+#define DF_AIR_MAX_PSDU 127
+
+/*
+ * The soonest a frame can make a difference to another radio: its SHR and
+ * PHR (192us) have to be on the air before a receiver acts on it, less two
+ * of the receiver's polls for slack. Boards running in lockstep may get
+ * this far ahead of each other.
+ */
+#define DF_MEDIUM_LOOKAHEAD_US 160
+
+/* A frame as it travels through the air */
+struct df_air_frame {
+    uint64_t start;     /**< sender's cycle when the SHR went out */
+    uint64_t src;       /**< MAC of the sender */
+    uint8_t channel;
+    uint8_t len;        /**< PSDU length, FCS included */
+    uint8_t psdu[DF_AIR_MAX_PSDU];
+};
+
+struct df_radio_port;
+
+struct df_medium_ops {
+    const char *name;
+    int (*attach)(struct df_radio_port *port, const char *arg);
+    void (*detach)(struct df_radio_port *port);
+    void (*tune)(struct df_radio_port *port, uint8_t channel);
+    void (*send)(struct df_radio_port *port, const struct df_air_frame *f);
+    const struct df_air_frame *(*peek)(struct df_radio_port *port);
+    void (*pop)(struct df_radio_port *port);
+};
+
+/* A radio's connection to a medium */
+struct df_radio_port {
+    const struct df_medium_ops *ops;
+    void *priv;                 /**< backend private data */
+    uint64_t mac;
+    uint8_t channel;            /**< channel we're listening on */
+    unsigned long dropped;      /**< frames lost to a full inbox */
+    uint64_t now;               /**< our cycle as of the last peek, used to
+                                  *  place frames from other processes on
+                                  *  our timeline */
+    uint64_t tuned_at;          /**< our cycle when we tuned to 'channel' */
+};
+
+int df_medium_attach(struct df_radio_port *port, const char *spec,
+        uint64_t mac);
+
+void df_medium_detach(struct df_radio_port *port);
+
+/*
+ * Start listening on 'channel' (or stop with 0) as of cycle 'now'. Only
+ * frames sent on the channel we're tuned to after we tuned in are heard.
+ */
+static inline void
+df_medium_tune(struct df_radio_port *port, uint8_t channel, uint64_t now)
+{
+    if (port->ops && port->channel != channel) {
+        port->now = now;
+        port->tuned_at = now;
+        port->ops->tune(port, channel);
+    }
+}
+
+/* Put a frame on the air, it's delivered to everyone but us */
+static inline void
+df_medium_send(struct df_radio_port *port, const struct df_air_frame *f)
+{
+    if (port->ops)
+        port->ops->send(port, f);
+}
+
+/*
+ * Look at the oldest frame delivered to us as of cycle 'now', ordered by
+ * start cycle. It stays valid until df_medium_pop().
+ */
+static inline const struct df_air_frame *
+df_medium_peek(struct df_radio_port *port, uint64_t now)
+{
+    const struct df_air_frame *f;
+
+    if (!port->ops)
+        return NULL;
+
+    port->now = now;
+
+    /* Frames can be delivered to us before or after a channel change,
+     * depending on which board got there first, so this has to be the
+     * final word on what we hear.
+     */
+    while ((f = port->ops->peek(port)) &&
+            (f->channel != port->channel || f->start < port->tuned_at))
+        port->ops->pop(port);
+
+    return f;
+}
+
+static inline void
+df_medium_pop(struct df_radio_port *port)
+{
+    if (port->ops)
+        port->ops->pop(port);
+}
+
+#endif /* __DF_MEDIUM_H__ */
@@ -0,0 +1,376 @@
+/*
+ * df_prof.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+
+#include "df_elf.h"
+#include "df_prof.h"
+
+/* Deeper than this and we stop following calls */
+#define DF_PROF_DEPTH   64
+
+/* Node addresses that aren't functions */
+#define DF_PROF_IRQ     0x80000000U     /**< | vector number */
+#define DF_PROF_SLEEP   0x40000000U
+#define DF_PROF_ROOT    0x20000000U
+
+#define OP_IS_CALL(op) \
+    (((op) & 0xfe0e) == 0x940e || ((op) & 0xf000) == 0xd000 || \
+     (op) == 0x9509 || (op) == 0x9519)
+#define OP_IS_RET(op) ((op) == 0x9508 || (op) == 0x9518)
+
+/*
+ * One per call path, a tree of who called whom from reset. A node's
+ * cycles are the ones spent in it, not its callees.
+ */
+struct df_prof_node {
+    uint32_t addr;          /**< of the function called */
+    uint32_t parent;
+    uint32_t child;         /**< first of a list linked by 'sibling' */
+    uint32_t sibling;
+    uint64_t cycles;
+};
+
+struct df_prof_frame {
+    uint32_t node;
+    uint16_t sp;            /**< with the return address pushed */
+};
+
+struct df_prof {
+    struct df_prof_node *node;
+    uint32_t nodes;
+    uint32_t alloc;
+
+    struct df_prof_frame stack[DF_PROF_DEPTH];
+    unsigned int depth;
+    uint32_t cur;           /**< node of the frame running */
+
+    uint64_t *pc_cycles;    /**< by flash word */
+    uint32_t words;
+    uint64_t sleep_cycles;
+
+    /* As things were before the avr_run() */
+    uint64_t cycle;
+    uint32_t pc;
+    uint16_t sp;
+    uint16_t op;
+    uint8_t irq_on;
+    uint8_t sleeping;
+};
+
+static uint32_t
+df_prof_node_get(struct df_prof *p, uint32_t parent, uint32_t addr)
+{
+    struct df_prof_node *n;
+    uint32_t i;
+
+    for (i = p->node[parent].child; i; i = p->node[i].sibling)
+        if (p->node[i].addr == addr)
+            return i;
+
+    if (p->nodes == p->alloc) {
+        n = realloc(p->node, p->alloc * 2 * sizeof(*n));
+        /* Out of memory, charge it to the caller */
+        if (!n)
+            return parent;
+        p->node = n;
+        p->alloc *= 2;
+    }
+
+    i = p->nodes++;
+    n = &p->node[i];
+    n->addr = addr;
+    n->parent = parent;
+    n->child = 0;
+    n->sibling = p->node[parent].child;
+    n->cycles = 0;
+    p->node[parent].child = i;
+
+    return i;
+}
+
+struct df_prof *
+df_prof_create(avr_t *avr)
+{
+    struct df_prof *p;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        goto nomem;
+
+    p->words = (avr->flashend + 1) / 2;
+    p->pc_cycles = calloc(p->words, sizeof(*p->pc_cycles));
+    p->alloc = 256;
+    p->node = calloc(p->alloc, sizeof(*p->node));
+    if (!p->pc_cycles || !p->node)
+        goto nomem;
+
+    /* Node 0 is wherever reset left us */
+    p->node[0].addr = DF_PROF_ROOT;
+    p->nodes = 1;
+
+    return p;
+
+nomem:
+    fprintf(stderr, "Failed to allocate memory for the profiler.\n");
+    df_prof_free(p);
+    return NULL;
+}
+
+static uint16_t
+df_prof_sp(const avr_t *avr)
+{
+    return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+void
+df_prof_before(struct df_prof *p, avr_t *avr)
+{
+    p->cycle = avr->cycle;
+    p->pc = avr->pc;
+    p->sp = df_prof_sp(avr);
+    p->irq_on = avr->sreg[S_I];
+    p->sleeping = avr->state == cpu_Sleeping;
+    p->op = p->pc + 1 <= avr->flashend ?
+        avr->flash[p->pc] | (avr->flash[p->pc + 1] << 8) : 0;
+}
+
+static void
+df_prof_push(struct df_prof *p, uint32_t addr, uint16_t sp)
+{
+    if (p->depth == DF_PROF_DEPTH)
+        return;
+
+    p->cur = df_prof_node_get(p, p->cur, addr);
+    p->stack[p->depth].node = p->cur;
+    p->stack[p->depth].sp = sp;
+    p->depth++;
+}
+
+/* An interrupt was taken, vectors are 1K aligned wherever IVSEL puts them */
+static void
+df_prof_push_irq(struct df_prof *p, const avr_t *avr, uint16_t sp)
+{
+    df_prof_push(p, DF_PROF_IRQ | ((avr->pc & 0x3ff) / avr->vector_size), sp);
+}
+
+void
+df_prof_after(struct df_prof *p, avr_t *avr)
+{
+    uint64_t cycles = avr->cycle - p->cycle;
+    uint16_t sp = df_prof_sp(avr);
+    uint16_t ret_sp;
+    uint32_t i;
+
+    /* The cycles belong to where we were, not where we went */
+    if (p->sleeping) {
+        p->sleep_cycles += cycles;
+        i = df_prof_node_get(p, p->cur, DF_PROF_SLEEP);
+        p->node[i].cycles += cycles;
+    } else {
+        if (p->pc / 2 < p->words)
+            p->pc_cycles[p->pc / 2] += cycles;
+        p->node[p->cur].cycles += cycles;
+    }
+
+    if (OP_IS_RET(p->op) && !p->sleeping) {
+        /* Unwind everything this returned past, longjmp()s included */
+        ret_sp = p->sp + avr->address_size;
+        while (p->depth && p->stack[p->depth - 1].sp < ret_sp)
+            p->depth--;
+        p->cur = p->depth ? p->stack[p->depth - 1].node : 0;
+
+        /* An interrupt taken straight after, pushing what was popped */
+        if (sp < ret_sp && !avr->sreg[S_I])
+            df_prof_push_irq(p, avr, sp);
+    } else if (sp < p->sp && p->irq_on && !avr->sreg[S_I]) {
+        /* A CALL the interrupt followed goes unseen, which is harmless
+         * since frames are popped by their stack pointer.
+         */
+        df_prof_push_irq(p, avr, sp);
+    } else if (sp < p->sp && OP_IS_CALL(p->op)) {
+        df_prof_push(p, avr->pc, sp);
+    }
+}
+
+static void
+df_prof_name(FILE *f, uint32_t addr)
+{
+    const struct df_elf_sym *sym;
+
+    if (addr == DF_PROF_ROOT)
+        fprintf(f, "[reset]");
+    else if (addr == DF_PROF_SLEEP)
+        fprintf(f, "[sleep]");
+    else if (addr & DF_PROF_IRQ)
+        fprintf(f, "[irq %u]", addr & ~DF_PROF_IRQ);
+    else if ((sym = df_elf_lookup(addr)))
+        fprintf(f, "%s", sym->name);
+    else
+        fprintf(f, "0x%05x", addr);
+}
+
+static void
+df_prof_path(struct df_prof *p, FILE *f, uint32_t i)
+{
+    if (i) {
+        df_prof_path(p, f, p->node[i].parent);
+        fputc(';', f);
+    }
+    df_prof_name(f, p->node[i].addr);
+}
+
+struct df_prof_func {
+    const struct df_elf_sym *sym;   /**< or NULL for code without one */
+    uint64_t cycles;
+};
+
+static int
+df_prof_func_cmp(const void *a, const void *b)
+{
+    const struct df_prof_func *fa = a;
+    const struct df_prof_func *fb = b;
+
+    return fa->cycles < fb->cycles ? 1 : fa->cycles > fb->cycles ? -1 : 0;
+}
+
+static int
+df_prof_dump_flat(struct df_prof *p, FILE *f)
+{
+    const struct df_elf_syms *syms = df_elf_symbols();
+    const struct df_elf_sym *sym;
+    struct df_prof_func *funcs;
+    uint64_t total = p->sleep_cycles;
+    size_t nfuncs = syms->count + 1;
+    size_t i;
+
+    /* One per symbol, and the last for code outside any */
+    funcs = calloc(nfuncs, sizeof(*funcs));
+    if (!funcs) {
+        fprintf(stderr, "Failed to allocate memory for the profile.\n");
+        return -1;
+    }
+
+    for (i = 0; i < nfuncs - 1; i++)
+        funcs[i].sym = &syms->sym[i];
+
+    for (i = 0; i < p->words; i++) {
+        if (!p->pc_cycles[i])
+            continue;
+        sym = df_elf_lookup(i * 2);
+        funcs[sym ? (size_t)(sym - syms->sym) : nfuncs - 1].cycles +=
+            p->pc_cycles[i];
+        total += p->pc_cycles[i];
+    }
+
+    qsort(funcs, nfuncs, sizeof(*funcs), df_prof_func_cmp);
+
+    fprintf(f, "# cycles percent function\n");
+    if (p->sleep_cycles)
+        fprintf(f, "%" PRIu64 " %.2f [sleep]\n", p->sleep_cycles,
+                100.0 * p->sleep_cycles / total);
+    for (i = 0; i < nfuncs && funcs[i].cycles; i++)
+        fprintf(f, "%" PRIu64 " %.2f %s\n", funcs[i].cycles,
+                100.0 * funcs[i].cycles / total,
+                funcs[i].sym ? funcs[i].sym->name : "[unknown]");
+
+    free(funcs);
+    return 0;
+}
+
+int
+df_prof_dump(struct df_prof *p, const char *path)
+{
+    char *flat;
+    FILE *f;
+    uint32_t i;
+    int ret = 0;
+
+    /* A board that never ran, like the template of clones, has nothing */
+    for (i = 0; i < p->nodes && !p->node[i].cycles; i++)
+        ;
+    if (i == p->nodes)
+        return 0;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to create profile '%s': %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < p->nodes; i++) {
+        if (!p->node[i].cycles)
+            continue;
+        df_prof_path(p, f, i);
+        fprintf(f, " %" PRIu64 "\n", p->node[i].cycles);
+    }
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write profile '%s': %s\n", path,
+                strerror(errno));
+        ret = -1;
+    }
+
+    if (asprintf(&flat, "%s.flat", path) < 0) {
+        fprintf(stderr, "Failed to allocate memory for the profile.\n");
+        return -1;
+    }
+
+    f = fopen(flat, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to create profile '%s': %s\n", flat,
+                strerror(errno));
+        free(flat);
+        return -1;
+    }
+
+    if (df_prof_dump_flat(p, f))
+        ret = -1;
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write profile '%s': %s\n", flat,
+                strerror(errno));
+        ret = -1;
+    }
+    free(flat);
+
+    return ret;
+}
+
+void
+df_prof_free(struct df_prof *p)
+{
+    if (!p)
+        return;
+
+    free(p->node);
+    free(p->pc_cycles);
+    free(p);
+}
@@ -0,0 +1,48 @@
+/*
+ * df_prof.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_PROF_H__
+#define __DF_PROF_H__
+
+struct avr_t;
+struct df_prof;
+
+/*
+ * Exact profiler of the firmware: every instruction's cycles go to the
+ * PC it ran at, and to the call stack it ran under, which is followed
+ * through CALLs, RETs and interrupts.
+ */
+struct df_prof *df_prof_create(struct avr_t *avr);
+
+/* Around every avr_run() */
+void df_prof_before(struct df_prof *p, struct avr_t *avr);
+
+void df_prof_after(struct df_prof *p, struct avr_t *avr);
+
+/*
+ * Write cycle weighted folded stacks, for flamegraph.pl, to 'path' and
+ * the cycles spent in each function to 'path.flat'.
+ */
+int df_prof_dump(struct df_prof *p, const char *path);
+
+void df_prof_free(struct df_prof *p);
+
+#endif /* __DF_PROF_H__ */
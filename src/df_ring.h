@@ -0,0 +1,208 @@
+/*
+ * df_ring.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_RING_H__
+#define __DF_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Single producer, single consumer byte ring.
+ *
+ * The producer only ever stores 'head' and the consumer only ever stores
+ * 'tail'. Each side publishes its cursor with a release store after it is
+ * done touching the data and reads the other side's cursor with an acquire
+ * load, so the ring is safe to share between exactly two threads without
+ * any locking. The cursors run freely and are masked on use, which lets
+ * the ring use every byte of its buffer.
+ *
+ * Besides copying in and out, each side can ask for the largest contiguous
+ * span it may touch and commit it afterwards, so callers can read() or
+ * write() straight to and from the ring.
+ */
+
+#define DF_RING_CACHELINE 64
+
+typedef struct df_ring {
+    /* written by the producer */
+    uint32_t head __attribute__ ((aligned (DF_RING_CACHELINE)));
+    /* written by the consumer */
+    uint32_t tail __attribute__ ((aligned (DF_RING_CACHELINE)));
+    /* read only after df_ring_init() */
+    uint8_t *buf __attribute__ ((aligned (DF_RING_CACHELINE)));
+    uint32_t mask;
+} df_ring_t;
+
+/* 'size' must be a power of 2 */
+static inline void
+df_ring_init(df_ring_t *r, uint8_t *buf, uint32_t size)
+{
+    r->buf = buf;
+    r->mask = size - 1;
+    __atomic_store_n(&r->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->tail, 0, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t
+df_ring_size(const df_ring_t *r)
+{
+    return r->mask + 1;
+}
+
+/* Bytes available to the consumer */
+static inline uint32_t
+df_ring_count(df_ring_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+/* Bytes available to the producer */
+static inline uint32_t
+df_ring_space(df_ring_t *r)
+{
+    return df_ring_size(r) - (__atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+        __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline int
+df_ring_isempty(df_ring_t *r)
+{
+    return df_ring_count(r) == 0;
+}
+
+static inline int
+df_ring_isfull(df_ring_t *r)
+{
+    return df_ring_space(r) == 0;
+}
+
+/*
+ * Producer: returns the largest contiguous writable span at '*ptr'.
+ * Follow up with df_ring_commit_write() for however much was filled.
+ */
+static inline uint32_t
+df_ring_peek_write(df_ring_t *r, uint8_t **ptr)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint32_t space = df_ring_space(r);
+    uint32_t off = head & r->mask;
+    uint32_t contig = df_ring_size(r) - off;
+
+    *ptr = r->buf + off;
+    return space < contig ? space : contig;
+}
+
+static inline void
+df_ring_commit_write(df_ring_t *r, uint32_t len)
+{
+    __atomic_store_n(&r->head,
+            __atomic_load_n(&r->head, __ATOMIC_RELAXED) + len,
+            __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer: returns the largest contiguous readable span at '*ptr'.
+ * Follow up with df_ring_commit_read() for however much was used.
+ */
+static inline uint32_t
+df_ring_peek_read(df_ring_t *r, uint8_t **ptr)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t count = df_ring_count(r);
+    uint32_t off = tail & r->mask;
+    uint32_t contig = df_ring_size(r) - off;
+
+    *ptr = r->buf + off;
+    return count < contig ? count : contig;
+}
+
+static inline void
+df_ring_commit_read(df_ring_t *r, uint32_t len)
+{
+    __atomic_store_n(&r->tail,
+            __atomic_load_n(&r->tail, __ATOMIC_RELAXED) + len,
+            __ATOMIC_RELEASE);
+}
+
+/* Producer: queue a single byte, returns 0 if the ring is full */
+static inline int
+df_ring_put(df_ring_t *r, uint8_t byte)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == df_ring_size(r))
+        return 0;
+
+    r->buf[head & r->mask] = byte;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Producer: copy in up to 'len' bytes, returns how many were queued */
+static inline size_t
+df_ring_write(df_ring_t *r, const uint8_t *src, size_t len)
+{
+    size_t done = 0;
+    uint8_t *dst;
+    uint32_t n;
+
+    /* at most two spans, before and after the wrap */
+    while (done < len && (n = df_ring_peek_write(r, &dst))) {
+        if (n > len - done)
+            n = len - done;
+        memcpy(dst, src + done, n);
+        df_ring_commit_write(r, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Consumer: copy out up to 'len' bytes, returns how many were dequeued */
+static inline size_t
+df_ring_read(df_ring_t *r, uint8_t *dst, size_t len)
+{
+    size_t done = 0;
+    uint8_t *src;
+    uint32_t n;
+
+    while (done < len && (n = df_ring_peek_read(r, &src))) {
+        if (n > len - done)
+            n = len - done;
+        memcpy(dst + done, src, n);
+        df_ring_commit_read(r, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Consumer: drop everything currently queued */
+static inline void
+df_ring_discard(df_ring_t *r)
+{
+    df_ring_commit_read(r, df_ring_count(r));
+}
+
+#endif /* __DF_RING_H__ */
@@ -0,0 +1,807 @@
+/*
+ * df_snapshot.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_interrupts.h>
+#include <sim_cycle_timers.h>
+#include <avr_eeprom.h>
+
+#include "drumfish.h"
+#include "df_cores.h"
+#include "df_log.h"
+#include "df_snapshot.h"
+
+/*
+ * A snapshot is a series of sections, each a tag, a length and that many
+ * bytes, always in the same order. Sections are read back in the order
+ * they were written and must match in tag and length, which is all the
+ * versioning we need since only the binary that wrote a snapshot can
+ * restore it anyway.
+ *
+ * Cycle timers are the tricky part, they're a callback and a parameter.
+ * Callbacks are saved as an offset into drumfish or libsimavr and
+ * parameters as an offset into one of the allocations a core is made of:
+ * the core itself, which simavr's own peripherals are part of, the
+ * board's private data and any peripheral allocated on its own.
+ *
+ * Those parameters are mostly simavr's peripherals, whose callbacks need
+ * the state behind the I/O registers too: a timer's mode and cycles per
+ * overflow, a UART's cycles per byte and its FIFO. That's saved as the
+ * bytes of the peripherals following the core in its allocation, with a
+ * map of which words held pointers. Restoring takes every word that was
+ * a pointer neither then nor now, leaving the fresh core's pointers be.
+ */
+
+#define DF_SNAPSHOT_MAGIC   DF_SNAPSHOT_TAG('D', 'F', 'S', 'N')
+#define DF_SNAPSHOT_VERSION 2
+
+#define DF_SNAPSHOT_FLASH   DF_SNAPSHOT_TAG('F', 'L', 'S', 'H')
+#define DF_SNAPSHOT_CPU     DF_SNAPSHOT_TAG('C', 'P', 'U', ' ')
+#define DF_SNAPSHOT_DATA    DF_SNAPSHOT_TAG('D', 'A', 'T', 'A')
+#define DF_SNAPSHOT_EEPROM  DF_SNAPSHOT_TAG('E', 'E', 'P', 'R')
+#define DF_SNAPSHOT_IRQS    DF_SNAPSHOT_TAG('I', 'R', 'Q', 'S')
+#define DF_SNAPSHOT_TIMERS  DF_SNAPSHOT_TAG('T', 'M', 'R', 'N')
+#define DF_SNAPSHOT_TIMER   DF_SNAPSHOT_TAG('T', 'I', 'M', 'R')
+#define DF_SNAPSHOT_PERIPH  DF_SNAPSHOT_TAG('P', 'E', 'R', 'I')
+#define DF_SNAPSHOT_PTRS    DF_SNAPSHOT_TAG('P', 'T', 'R', 'S')
+
+/* Where a timer callback lives */
+enum {
+    DF_SNAPSHOT_OBJ_DRUMFISH = 0,
+    DF_SNAPSHOT_OBJ_SIMAVR,
+    DF_SNAPSHOT_OBJ_COUNT
+};
+
+/* A timer parameter that's not a pointer into the core */
+#define DF_SNAPSHOT_REGION_NONE UINT32_MAX
+
+/* Allocations a core is made of, at most one per peripheral */
+#define DF_SNAPSHOT_MAX_REGIONS 64
+
+struct df_snapshot_header {
+    uint32_t version;
+    uint32_t data_len;
+    uint32_t flash_len;
+    uint32_t eeprom_len;
+    uint32_t vectors;
+};
+
+struct df_snapshot_cpu {
+    uint64_t cycle;
+    uint32_t pc;
+    int32_t state;
+    int32_t interrupt_state;
+    uint8_t sreg[8];
+};
+
+struct df_snapshot_timer {
+    uint64_t when;          /**< absolute cycle it's due */
+    uint64_t fn;            /**< offset into 'obj' */
+    uint64_t param;         /**< offset into 'region' */
+    uint32_t obj;
+    uint32_t region;
+};
+
+struct df_snapshot_region {
+    uint8_t *base;
+    size_t len;
+};
+
+/* What's mapped into this process, a word pointing into it is a pointer */
+struct df_snapshot_maps {
+    uintptr_t (*range)[2];
+    size_t count;
+};
+
+int
+df_snapshot_write(FILE *f, uint32_t tag, const void *buf, size_t len)
+{
+    uint32_t hdr[2] = { tag, len };
+
+    if (fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+            (len && fwrite(buf, len, 1, f) != 1))
+        return -1;
+
+    return 0;
+}
+
+int
+df_snapshot_read(FILE *f, uint32_t tag, void *buf, size_t len)
+{
+    uint32_t hdr[2];
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+        fprintf(stderr, "Snapshot is truncated.\n");
+        return -1;
+    }
+
+    if (hdr[0] != tag || hdr[1] != len) {
+        fprintf(stderr, "Snapshot section %08x of %u bytes found where "
+                "%08x of %zu was expected. It was made by a different "
+                "drumfish or with different options.\n",
+                hdr[0], hdr[1], tag, len);
+        return -1;
+    }
+
+    if (len && fread(buf, len, 1, f) != 1) {
+        fprintf(stderr, "Snapshot is truncated.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* FNV-1a, to tell if flash still holds what the snapshot ran */
+static uint64_t
+df_snapshot_hash(const uint8_t *buf, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        hash ^= *buf++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Load address of the object holding each kind of timer callback */
+static int
+df_snapshot_objs(uintptr_t *base)
+{
+    const void *anchor[DF_SNAPSHOT_OBJ_COUNT] = {
+        [DF_SNAPSHOT_OBJ_DRUMFISH] = (const void *)df_snapshot_save,
+        [DF_SNAPSHOT_OBJ_SIMAVR] = (const void *)avr_run,
+    };
+    Dl_info info;
+    int i;
+
+    for (i = 0; i < DF_SNAPSHOT_OBJ_COUNT; i++) {
+        if (!dladdr(anchor[i], &info)) {
+            fprintf(stderr, "Unable to find where drumfish is loaded.\n");
+            return -1;
+        }
+        base[i] = (uintptr_t)info.dli_fbase;
+    }
+
+    return 0;
+}
+
+/*
+ * The allocations a cycle timer's parameter may point into. They're
+ * listed in the same order on any core set up with the same options.
+ */
+static int
+df_snapshot_regions(avr_t *avr, struct df_snapshot_region *r)
+{
+    avr_io_t *io;
+    int n = 0;
+
+    r[n].base = (uint8_t *)avr;
+    r[n].len = malloc_usable_size(avr);
+    n++;
+
+    if (avr->special_data) {
+        r[n].base = avr->special_data;
+        r[n].len = malloc_usable_size(avr->special_data);
+        n++;
+    }
+
+    /* Most peripherals are part of the core, the rest are their own */
+    for (io = avr->io_port; io && n < DF_SNAPSHOT_MAX_REGIONS;
+            io = io->next) {
+        if ((const uint8_t *)io >= r[0].base &&
+                (const uint8_t *)io < r[0].base + r[0].len)
+            continue;
+        r[n].base = (uint8_t *)io;
+        r[n].len = malloc_usable_size(io);
+        n++;
+    }
+
+    return n;
+}
+
+static void
+df_snapshot_maps_free(struct df_snapshot_maps *m)
+{
+    free(m->range);
+    m->range = NULL;
+    m->count = 0;
+}
+
+static int
+df_snapshot_maps_load(struct df_snapshot_maps *m)
+{
+    uintptr_t (*range)[2];
+    unsigned long start, end;
+    size_t size = 0;
+    char line[512];
+    FILE *f;
+
+    m->range = NULL;
+    m->count = 0;
+
+    f = fopen("/proc/self/maps", "r");
+    if (!f) {
+        fprintf(stderr, "Unable to read this process's mappings: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+            continue;
+        if (m->count == size) {
+            size = size ? size * 2 : 64;
+            range = realloc(m->range, size * sizeof(*range));
+            if (!range) {
+                fprintf(stderr, "Failed to allocate memory for "
+                        "snapshot.\n");
+                fclose(f);
+                df_snapshot_maps_free(m);
+                return -1;
+            }
+            m->range = range;
+        }
+        m->range[m->count][0] = start;
+        m->range[m->count][1] = end;
+        m->count++;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int
+df_snapshot_is_ptr(const struct df_snapshot_maps *m, uint64_t v)
+{
+    size_t i;
+
+    for (i = 0; i < m->count; i++) {
+        if (v >= m->range[i][0] && v < m->range[i][1])
+            return 1;
+    }
+
+    return 0;
+}
+
+/* simavr's peripherals, where they follow the core in its allocation */
+static uint8_t *
+df_snapshot_periph(avr_t *avr, const struct df_snapshot_region *r,
+        size_t *len)
+{
+    size_t off = (sizeof(*avr) + sizeof(uint64_t) - 1) &
+        ~(sizeof(uint64_t) - 1);
+
+    *len = r[0].len > off ? (r[0].len - off) & ~(sizeof(uint64_t) - 1) : 0;
+    return r[0].base + off;
+}
+
+/* A bit per word of 'buf', set where it holds a pointer */
+static void
+df_snapshot_ptr_map(const struct df_snapshot_maps *m, const uint8_t *buf,
+        size_t len, uint8_t *map)
+{
+    uint64_t v;
+    size_t i;
+
+    memset(map, 0, (len / sizeof(v) + 7) / 8);
+    for (i = 0; i < len / sizeof(v); i++) {
+        memcpy(&v, buf + i * sizeof(v), sizeof(v));
+        if (v && df_snapshot_is_ptr(m, v))
+            map[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static int
+df_snapshot_timer_save(const avr_cycle_timer_slot_t *slot,
+        const uintptr_t *objs, const struct df_snapshot_region *regions,
+        int nregions, struct df_snapshot_timer *st)
+{
+    uintptr_t fn = (uintptr_t)slot->timer;
+    const uint8_t *param = slot->param;
+    Dl_info info;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->when = slot->when;
+
+    if (!dladdr((const void *)fn, &info))
+        goto unknown;
+    for (i = 0; i < DF_SNAPSHOT_OBJ_COUNT; i++) {
+        if ((uintptr_t)info.dli_fbase == objs[i])
+            break;
+    }
+    if (i == DF_SNAPSHOT_OBJ_COUNT)
+        goto unknown;
+    st->obj = i;
+    st->fn = fn - objs[i];
+
+    if (!param) {
+        st->region = DF_SNAPSHOT_REGION_NONE;
+        return 0;
+    }
+
+    for (i = 0; i < nregions; i++) {
+        if (param >= regions[i].base &&
+                param < regions[i].base + regions[i].len) {
+            st->region = i;
+            st->param = param - regions[i].base;
+            return 0;
+        }
+    }
+
+unknown:
+    fprintf(stderr, "Unable to save cycle timer %p(%p), it doesn't belong "
+            "to the core.\n", (void *)fn, slot->param);
+    return -1;
+}
+
+static int
+df_snapshot_timer_restore(avr_t *avr, const struct df_snapshot_timer *st,
+        const uintptr_t *objs, const struct df_snapshot_region *regions,
+        int nregions)
+{
+    avr_cycle_timer_t fn;
+    void *param = NULL;
+
+    if (st->obj >= DF_SNAPSHOT_OBJ_COUNT ||
+            (st->region != DF_SNAPSHOT_REGION_NONE &&
+             (st->region >= (uint32_t)nregions ||
+              st->param >= regions[st->region].len))) {
+        fprintf(stderr, "Snapshot has a cycle timer that doesn't belong "
+                "to this core.\n");
+        return -1;
+    }
+
+    fn = (avr_cycle_timer_t)(objs[st->obj] + st->fn);
+    if (st->region != DF_SNAPSHOT_REGION_NONE)
+        param = regions[st->region].base + st->param;
+
+    avr_cycle_timer_register(avr,
+            st->when > avr->cycle ? st->when - avr->cycle : 0, fn, param);
+
+    return 0;
+}
+
+static void
+df_snapshot_header_init(avr_t *avr, struct df_snapshot_header *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = DF_SNAPSHOT_VERSION;
+    hdr->data_len = avr->ramend + 1;
+    hdr->flash_len = avr->flashend + 1;
+    hdr->eeprom_len = avr->e2end + 1;
+    hdr->vectors = avr->interrupts.vector_count;
+}
+
+int
+df_snapshot_save(avr_t *avr, const char *path)
+{
+    struct df_snapshot_header hdr;
+    struct df_snapshot_cpu cpu;
+    struct df_snapshot_region regions[DF_SNAPSHOT_MAX_REGIONS];
+    struct df_snapshot_timer *timers = NULL;
+    avr_cycle_timer_slot_t *slot;
+    avr_eeprom_desc_t ee;
+    uintptr_t objs[DF_SNAPSHOT_OBJ_COUNT];
+    uint8_t *eeprom = NULL;
+    struct df_snapshot_maps maps;
+    uint8_t *periph;
+    uint8_t *ptrs = NULL;
+    size_t periph_len;
+    uint8_t pending[256];
+    uint64_t hash;
+    uint32_t count = 0;
+    uint32_t i;
+    int nregions;
+    int ret = -1;
+    FILE *f;
+
+    if (df_snapshot_objs(objs) || df_snapshot_maps_load(&maps))
+        return -1;
+    nregions = df_snapshot_regions(avr, regions);
+    periph = df_snapshot_periph(avr, regions, &periph_len);
+
+    df_snapshot_header_init(avr, &hdr);
+
+    memset(&cpu, 0, sizeof(cpu));
+    cpu.cycle = avr->cycle;
+    cpu.pc = avr->pc;
+    cpu.state = avr->state;
+    cpu.interrupt_state = avr->interrupt_state;
+    memcpy(cpu.sreg, avr->sreg, sizeof(cpu.sreg));
+
+    /* Which interrupts are waiting to be serviced */
+    memset(pending, 0, sizeof(pending));
+    for (i = 0; i < hdr.vectors && i < sizeof(pending); i++)
+        pending[i] = avr->interrupts.vector[i]->pending;
+
+    eeprom = malloc(hdr.eeprom_len);
+    for (slot = avr->cycle_timers.timer; slot; slot = slot->next)
+        count++;
+    timers = calloc(count ? count : 1, sizeof(*timers));
+    ptrs = malloc(periph_len / sizeof(uint64_t) / 8 + 1);
+    if (!eeprom || !timers || !ptrs) {
+        fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+        goto cleanup;
+    }
+
+    ee.ee = eeprom;
+    ee.offset = 0;
+    ee.size = hdr.eeprom_len;
+    if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee)) {
+        fprintf(stderr, "Unable to read EEPROM for snapshot.\n");
+        goto cleanup;
+    }
+
+    for (i = 0, slot = avr->cycle_timers.timer; slot; slot = slot->next, i++) {
+        if (df_snapshot_timer_save(slot, objs, regions, nregions,
+                    &timers[i]))
+            goto cleanup;
+    }
+
+    hash = df_snapshot_hash(avr->flash, hdr.flash_len);
+    df_snapshot_ptr_map(&maps, periph, periph_len, ptrs);
+
+    f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Unable to create snapshot '%s': %s\n",
+                path, strerror(errno));
+        goto cleanup;
+    }
+
+    if (df_snapshot_write(f, DF_SNAPSHOT_MAGIC, &hdr, sizeof(hdr)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_FLASH, &hash, sizeof(hash)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_CPU, &cpu, sizeof(cpu)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_DATA, avr->data,
+                hdr.data_len) ||
+            df_snapshot_write(f, DF_SNAPSHOT_EEPROM, eeprom,
+                hdr.eeprom_len) ||
+            df_snapshot_write(f, DF_SNAPSHOT_IRQS, pending,
+                sizeof(pending)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_TIMERS, &count,
+                sizeof(count)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_TIMER, timers,
+                count * sizeof(*timers)) ||
+            df_snapshot_write(f, DF_SNAPSHOT_PERIPH, periph, periph_len) ||
+            df_snapshot_write(f, DF_SNAPSHOT_PTRS, ptrs,
+                periph_len / sizeof(uint64_t) / 8 + 1) ||
+            m128rfa1_save(avr, f)) {
+        fprintf(stderr, "Failed to write snapshot '%s': %s\n",
+                path, strerror(errno));
+        fclose(f);
+        goto cleanup;
+    }
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write snapshot '%s': %s\n",
+                path, strerror(errno));
+        goto cleanup;
+    }
+
+    df_log_msg(DF_LOG_INFO, "Saved snapshot '%s' at cycle %" PRIu64 "\n",
+            path, cpu.cycle);
+    ret = 0;
+
+cleanup:
+    df_snapshot_maps_free(&maps);
+    free(ptrs);
+    free(timers);
+    free(eeprom);
+
+    return ret;
+}
+
+/*
+ * Put back the saved peripheral state, a word at a time, unless it was a
+ * pointer when saved or is one now.
+ */
+static void
+df_snapshot_periph_restore(const struct df_snapshot_maps *maps,
+        uint8_t *periph, const uint8_t *saved, const uint8_t *ptrs,
+        size_t len)
+{
+    uint64_t v;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(v); i++) {
+        if (ptrs[i / 8] & (1 << (i % 8)))
+            continue;
+        memcpy(&v, periph + i * sizeof(v), sizeof(v));
+        if (v && df_snapshot_is_ptr(maps, v))
+            continue;
+        memcpy(periph + i * sizeof(v), saved + i * sizeof(v), sizeof(v));
+    }
+}
+
+int
+df_snapshot_restore(avr_t *avr, const char *path)
+{
+    struct df_snapshot_header hdr;
+    struct df_snapshot_header want;
+    struct df_snapshot_cpu cpu;
+    struct df_snapshot_region regions[DF_SNAPSHOT_MAX_REGIONS];
+    struct df_snapshot_timer *timers = NULL;
+    avr_eeprom_desc_t ee;
+    uintptr_t objs[DF_SNAPSHOT_OBJ_COUNT];
+    uint8_t *eeprom = NULL;
+    struct df_snapshot_maps maps;
+    uint8_t *periph;
+    uint8_t *saved = NULL;
+    uint8_t *ptrs = NULL;
+    size_t periph_len;
+    uint8_t pending[256];
+    uint64_t hash;
+    uint32_t count;
+    uint32_t i;
+    int nregions;
+    int ret = -1;
+    FILE *f;
+
+    if (df_snapshot_objs(objs) || df_snapshot_maps_load(&maps))
+        return -1;
+    nregions = df_snapshot_regions(avr, regions);
+    periph = df_snapshot_periph(avr, regions, &periph_len);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to open snapshot '%s': %s\n",
+                path, strerror(errno));
+        df_snapshot_maps_free(&maps);
+        return -1;
+    }
+
+    df_snapshot_header_init(avr, &want);
+    if (df_snapshot_read(f, DF_SNAPSHOT_MAGIC, &hdr, sizeof(hdr)))
+        goto cleanup;
+    if (memcmp(&hdr, &want, sizeof(hdr))) {
+        fprintf(stderr, "Snapshot '%s' is for a different core.\n", path);
+        goto cleanup;
+    }
+
+    if (df_snapshot_read(f, DF_SNAPSHOT_FLASH, &hash, sizeof(hash)))
+        goto cleanup;
+    if (hash != df_snapshot_hash(avr->flash, hdr.flash_len)) {
+        fprintf(stderr, "Flash has changed since snapshot '%s' was "
+                "made.\n", path);
+        goto cleanup;
+    }
+
+    eeprom = malloc(hdr.eeprom_len);
+    if (!eeprom) {
+        fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+        goto cleanup;
+    }
+
+    if (df_snapshot_read(f, DF_SNAPSHOT_CPU, &cpu, sizeof(cpu)) ||
+            df_snapshot_read(f, DF_SNAPSHOT_DATA, avr->data,
+                hdr.data_len) ||
+            df_snapshot_read(f, DF_SNAPSHOT_EEPROM, eeprom,
+                hdr.eeprom_len) ||
+            df_snapshot_read(f, DF_SNAPSHOT_IRQS, pending,
+                sizeof(pending)) ||
+            df_snapshot_read(f, DF_SNAPSHOT_TIMERS, &count, sizeof(count)))
+        goto cleanup;
+
+    timers = calloc(count ? count : 1, sizeof(*timers));
+    saved = malloc(periph_len ? periph_len : 1);
+    ptrs = malloc(periph_len / sizeof(uint64_t) / 8 + 1);
+    if (!timers || !saved || !ptrs) {
+        fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+        goto cleanup;
+    }
+    if (df_snapshot_read(f, DF_SNAPSHOT_TIMER, timers,
+                count * sizeof(*timers)) ||
+            df_snapshot_read(f, DF_SNAPSHOT_PERIPH, saved, periph_len) ||
+            df_snapshot_read(f, DF_SNAPSHOT_PTRS, ptrs,
+                periph_len / sizeof(uint64_t) / 8 + 1))
+        goto cleanup;
+
+    /* Before the timers come back, their callbacks go by this state */
+    df_snapshot_periph_restore(&maps, periph, saved, ptrs, periph_len);
+
+    ee.ee = eeprom;
+    ee.offset = 0;
+    ee.size = hdr.eeprom_len;
+    if (avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee)) {
+        fprintf(stderr, "Unable to restore EEPROM from snapshot.\n");
+        goto cleanup;
+    }
+
+    /* Drop whatever the fresh core had scheduled and bring back what
+     * was scheduled then, relative to the restored cycle.
+     */
+    avr_cycle_timer_reset(avr);
+    avr->cycle = cpu.cycle;
+    avr->pc = cpu.pc;
+    memcpy(avr->sreg, cpu.sreg, sizeof(avr->sreg));
+
+    for (i = 0; i < count; i++) {
+        if (df_snapshot_timer_restore(avr, &timers[i], objs, regions,
+                    nregions))
+            goto cleanup;
+    }
+
+    /* The flags are in the restored I/O registers already, this queues
+     * each one up again in vector order. The vectors' own pending flags
+     * came back with the peripherals, but not the core's queue of them.
+     */
+    for (i = 0; i < hdr.vectors; i++)
+        avr->interrupts.vector[i]->pending = 0;
+    for (i = 0; i < hdr.vectors && i < sizeof(pending); i++) {
+        if (pending[i])
+            avr_raise_interrupt(avr, avr->interrupts.vector[i]);
+    }
+
+    /* Raising interrupts can wake the core, so these go last */
+    avr->interrupt_state = cpu.interrupt_state;
+    avr->state = cpu.state;
+
+    if (m128rfa1_restore(avr, f))
+        goto cleanup;
+
+    df_log_msg(DF_LOG_INFO, "Restored snapshot '%s' at cycle %" PRIu64 "\n",
+            path, cpu.cycle);
+    ret = 0;
+
+cleanup:
+    fclose(f);
+    df_snapshot_maps_free(&maps);
+    free(ptrs);
+    free(saved);
+    free(timers);
+    free(eeprom);
+
+    return ret;
+}
+
+struct df_snapshot_image {
+    struct df_snapshot_region regions[DF_SNAPSHOT_MAX_REGIONS];
+    int nregions;
+    uint8_t *copy;          /**< each region, one after the other */
+    uint8_t *data;
+    uint8_t *eeprom;
+    uint8_t *flash;         /**< in case the firmware programs it */
+    uint32_t data_len;
+    uint32_t eeprom_len;
+    uint32_t flash_len;
+    uint32_t *irq_values;   /**< IRQs are each their own allocation */
+    uint8_t *irq_flags;
+    int irqs;
+};
+
+void
+df_snapshot_image_free(struct df_snapshot_image *img)
+{
+    if (!img)
+        return;
+
+    free(img->copy);
+    free(img->data);
+    free(img->eeprom);
+    free(img->flash);
+    free(img->irq_values);
+    free(img->irq_flags);
+    free(img);
+}
+
+struct df_snapshot_image *
+df_snapshot_take(avr_t *avr)
+{
+    struct df_snapshot_image *img;
+    avr_eeprom_desc_t ee;
+    size_t len = 0;
+    uint8_t *p;
+    int i;
+
+    img = calloc(1, sizeof(*img));
+    if (!img) {
+        fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+        return NULL;
+    }
+
+    img->nregions = df_snapshot_regions(avr, img->regions);
+    for (i = 0; i < img->nregions; i++)
+        len += img->regions[i].len;
+
+    img->data_len = avr->ramend + 1;
+    img->eeprom_len = avr->e2end + 1;
+    img->flash_len = avr->flashend + 1;
+    img->irqs = avr->irq_pool.count;
+
+    img->copy = malloc(len);
+    img->data = malloc(img->data_len);
+    img->eeprom = malloc(img->eeprom_len);
+    img->flash = malloc(img->flash_len);
+    img->irq_values = calloc(img->irqs ? img->irqs : 1,
+            sizeof(*img->irq_values));
+    img->irq_flags = calloc(img->irqs ? img->irqs : 1,
+            sizeof(*img->irq_flags));
+    if (!img->copy || !img->data || !img->eeprom || !img->flash ||
+            !img->irq_values || !img->irq_flags) {
+        fprintf(stderr, "Failed to allocate memory for snapshot.\n");
+        df_snapshot_image_free(img);
+        return NULL;
+    }
+
+    ee.ee = img->eeprom;
+    ee.offset = 0;
+    ee.size = img->eeprom_len;
+    if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee)) {
+        fprintf(stderr, "Unable to read EEPROM for snapshot.\n");
+        df_snapshot_image_free(img);
+        return NULL;
+    }
+
+    for (i = 0, p = img->copy; i < img->nregions; i++) {
+        memcpy(p, img->regions[i].base, img->regions[i].len);
+        p += img->regions[i].len;
+    }
+    memcpy(img->data, avr->data, img->data_len);
+    memcpy(img->flash, avr->flash, img->flash_len);
+
+    for (i = 0; i < img->irqs; i++) {
+        img->irq_values[i] = avr->irq_pool.irq[i]->value;
+        img->irq_flags[i] = avr->irq_pool.irq[i]->flags;
+    }
+
+    return img;
+}
+
+void
+df_snapshot_put(const struct df_snapshot_image *img, avr_t *avr)
+{
+    avr_eeprom_desc_t ee;
+    const uint8_t *p;
+    int i;
+
+    for (i = 0, p = img->copy; i < img->nregions; i++) {
+        memcpy(img->regions[i].base, p, img->regions[i].len);
+        p += img->regions[i].len;
+    }
+    memcpy(avr->data, img->data, img->data_len);
+
+    ee.ee = img->eeprom;
+    ee.offset = 0;
+    ee.size = img->eeprom_len;
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
+
+    /* Mostly it's untouched, and copying would dirty every page */
+    if (memcmp(avr->flash, img->flash, img->flash_len))
+        memcpy(avr->flash, img->flash, img->flash_len);
+
+    for (i = 0; i < img->irqs && i < avr->irq_pool.count; i++) {
+        avr->irq_pool.irq[i]->value = img->irq_values[i];
+        avr->irq_pool.irq[i]->flags = img->irq_flags[i];
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * df_snapshot.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_SNAPSHOT_H__
+#define __DF_SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct avr_t;
+
+/* Every section of a snapshot starts with one of these */
+#define DF_SNAPSHOT_TAG(_a, _b, _c, _d) \
+    (((uint32_t)(_a) << 24) | ((_b) << 16) | ((_c) << 8) | (_d))
+
+/*
+ * Save the state of a board that isn't running right now. Flash isn't
+ * included, it stays in its file and has to be unchanged to restore.
+ */
+int df_snapshot_save(struct avr_t *avr, const char *path);
+
+/*
+ * Put a freshly created board, set up with the same options by the same
+ * drumfish binary, back into the state saved in 'path'.
+ */
+int df_snapshot_restore(struct avr_t *avr, const char *path);
+
+/*
+ * A byte for byte copy of a board, in memory, for putting that same
+ * board back the way it was over and over. It's much faster than a
+ * snapshot and, as nothing moves in between, covers the private state of
+ * simavr's peripherals too.
+ */
+struct df_snapshot_image;
+
+struct df_snapshot_image *df_snapshot_take(struct avr_t *avr);
+
+void df_snapshot_put(const struct df_snapshot_image *img,
+        struct avr_t *avr);
+
+void df_snapshot_image_free(struct df_snapshot_image *img);
+
+/* For cores adding their own sections */
+int df_snapshot_write(FILE *f, uint32_t tag, const void *buf, size_t len);
+
+int df_snapshot_read(FILE *f, uint32_t tag, void *buf, size_t len);
+
+#endif /* __DF_SNAPSHOT_H__ */
@@ -0,0 +1,273 @@
+/*
+ * df_trace.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "drumfish.h"
+#include "df_log.h"
+#include "df_ring.h"
+#include "df_trace.h"
+
+/* Per thread, enough for ~8k events between drains */
+#define DF_TRACE_RING_SIZE  (256 * 1024)
+#define DF_TRACE_DRAIN_NS   (10 * 1000 * 1000)
+
+struct df_trace_ring {
+    df_ring_t ring;
+    uint32_t dropped;           /**< by the producer, events that didn't fit */
+    uint32_t reported;          /**< by the drainer, drops already logged */
+    int gone;                   /**< its thread exited */
+    int drained;                /**< by the drainer, gone and emptied */
+    struct df_trace_ring *next;
+    uint8_t buf[DF_TRACE_RING_SIZE];
+};
+
+static const enum df_log_lvl df_trace_lvl[DF_TRACE_MAX] = {
+    [DF_TRACE_UART_TX] = DF_LOG_DEBUG,
+    [DF_TRACE_UART_TX_DROP] = DF_LOG_DEBUG,
+    [DF_TRACE_UART_RX] = DF_LOG_DEBUG,
+    [DF_TRACE_UART_PTY_READ] = DF_LOG_DEBUG,
+};
+
+uint8_t df_trace_on[DF_TRACE_MAX];
+
+static __thread struct df_trace_ring *df_trace_mine = NULL;
+static struct df_trace_ring *df_trace_rings = NULL;
+static pthread_mutex_t df_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t df_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t df_trace_key;
+static pthread_t df_trace_thread;
+static int df_trace_running = 0;
+static int df_trace_stopping = 0;
+
+void
+df_trace_init(const struct drumfish_cfg *config)
+{
+    int i;
+
+    for (i = 0; i < DF_TRACE_MAX; i++)
+        df_trace_on[i] = (int)df_trace_lvl[i] <= config->verbose;
+}
+
+/* Leave the ring for the drainer, which frees it once it's empty */
+static void
+df_trace_thread_exit(void *data)
+{
+    struct df_trace_ring *t = data;
+
+    __atomic_store_n(&t->gone, 1, __ATOMIC_RELEASE);
+}
+
+static void
+df_trace_key_init(void)
+{
+    pthread_key_create(&df_trace_key, df_trace_thread_exit);
+}
+
+static struct df_trace_ring *
+df_trace_ring_new(void)
+{
+    struct df_trace_ring *t;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    df_ring_init(&t->ring, t->buf, sizeof(t->buf));
+
+    pthread_once(&df_trace_once, df_trace_key_init);
+    pthread_setspecific(df_trace_key, t);
+
+    pthread_mutex_lock(&df_trace_lock);
+    t->next = df_trace_rings;
+    df_trace_rings = t;
+    pthread_mutex_unlock(&df_trace_lock);
+
+    return t;
+}
+
+void
+df_trace_put(enum df_trace_id id, uint64_t cycle, uint32_t a0, uint32_t a1,
+        uint32_t a2)
+{
+    struct df_trace_ring *t = df_trace_mine;
+    struct df_trace_rec rec;
+
+    if (!t) {
+        t = df_trace_ring_new();
+        if (!t)
+            return;
+        df_trace_mine = t;
+    }
+
+    if (df_ring_space(&t->ring) < sizeof(rec)) {
+        __atomic_store_n(&t->dropped, t->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec.cycle = cycle;
+    rec.host_ns = df_log_host_ns();
+    rec.id = id;
+    rec.arg[0] = a0;
+    rec.arg[1] = a1;
+    rec.arg[2] = a2;
+    df_ring_write(&t->ring, (const uint8_t *)&rec, sizeof(rec));
+}
+
+static void
+df_trace_print(const struct df_trace_rec *rec)
+{
+    const uint32_t *a = rec->arg;
+    char stamp[DF_LOG_STAMP_MAX];
+
+    df_log_stamp(stamp, sizeof(stamp), rec->host_ns, 1, rec->cycle);
+    fputs(stamp, stderr);
+
+    switch ((enum df_trace_id)rec->id) {
+        case DF_TRACE_UART_TX:
+            fprintf(stderr, "AVR UART%c -> out fifo (towards pty) %02x\n",
+                    a[0], a[1]);
+            break;
+        case DF_TRACE_UART_TX_DROP:
+            fprintf(stderr, "UART%c: pty ring full, dropped %02x\n",
+                    a[0], a[1]);
+            break;
+        case DF_TRACE_UART_RX:
+            fprintf(stderr, "UART%c: send %02x to AVR\n", a[0], a[1]);
+            break;
+        case DF_TRACE_UART_PTY_READ:
+            fprintf(stderr, "UART%c: %u bytes from pty\n", a[0], a[1]);
+            break;
+        case DF_TRACE_MAX:
+        default:
+            fprintf(stderr, "unknown trace event %u\n", rec->id);
+            break;
+    }
+}
+
+/*
+ * Format everything recorded so far, freeing the rings of dead threads.
+ * New rings only ever go on the front of the list and only we take them
+ * off, so the lock is just held to look at the front and to unlink.
+ */
+static void
+df_trace_drain(void)
+{
+    struct df_trace_ring **pt;
+    struct df_trace_ring *t;
+    struct df_trace_ring *dead = NULL;
+    struct df_trace_rec rec;
+    uint32_t dropped;
+    int gone;
+
+    pthread_mutex_lock(&df_trace_lock);
+    t = df_trace_rings;
+    pthread_mutex_unlock(&df_trace_lock);
+
+    for (; t; t = t->next) {
+        gone = __atomic_load_n(&t->gone, __ATOMIC_ACQUIRE);
+
+        while (df_ring_read(&t->ring, (uint8_t *)&rec, sizeof(rec)) ==
+                sizeof(rec))
+            df_trace_print(&rec);
+
+        dropped = __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+        if (dropped != t->reported) {
+            df_log_msg(DF_LOG_WARN, "%u trace events dropped\n",
+                    dropped - t->reported);
+            t->reported = dropped;
+        }
+
+        t->drained = gone;
+    }
+
+    pthread_mutex_lock(&df_trace_lock);
+    pt = &df_trace_rings;
+    while ((t = *pt)) {
+        if (t->drained) {
+            *pt = t->next;
+            t->next = dead;
+            dead = t;
+        } else {
+            pt = &t->next;
+        }
+    }
+    pthread_mutex_unlock(&df_trace_lock);
+
+    while ((t = dead)) {
+        dead = t->next;
+        free(t);
+    }
+}
+
+static void *
+df_trace_run(void *arg)
+{
+    struct timespec ts = { 0, DF_TRACE_DRAIN_NS };
+
+    (void)arg;
+
+    while (!__atomic_load_n(&df_trace_stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        df_trace_drain();
+    }
+
+    return NULL;
+}
+
+int
+df_trace_start(void)
+{
+    int ret;
+    int i;
+
+    for (i = 0; i < DF_TRACE_MAX && !df_trace_on[i]; i++)
+        ;
+    if (i == DF_TRACE_MAX || df_trace_running)
+        return 0;
+
+    __atomic_store_n(&df_trace_stopping, 0, __ATOMIC_RELEASE);
+    ret = pthread_create(&df_trace_thread, NULL, df_trace_run, NULL);
+    if (ret) {
+        fprintf(stderr, "Unable to start trace thread: %s\n",
+                strerror(ret));
+        return -1;
+    }
+    df_trace_running = 1;
+
+    return 0;
+}
+
+void
+df_trace_stop(void)
+{
+    if (df_trace_running) {
+        __atomic_store_n(&df_trace_stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(df_trace_thread, NULL);
+        df_trace_running = 0;
+    }
+
+    /* Whatever came in after the thread's last look */
+    df_trace_drain();
+}
@@ -0,0 +1,72 @@
+/*
+ * df_trace.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_TRACE_H__
+#define __DF_TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Binary trace events, for DEBUG logging on paths too hot for
+ * df_log_msg(). Recording one copies a fixed size record into a ring
+ * owned by the calling thread, no locks, allocations or formatting. A
+ * background thread formats them into the log.
+ */
+enum df_trace_id {
+    DF_TRACE_UART_TX,           /**< uart, byte the AVR sent */
+    DF_TRACE_UART_TX_DROP,      /**< uart, byte lost to a full ring */
+    DF_TRACE_UART_RX,           /**< uart, byte handed to the AVR */
+    DF_TRACE_UART_PTY_READ,     /**< uart, bytes read from the pty */
+
+    DF_TRACE_MAX /**< must always be the last value */
+};
+
+struct df_trace_rec {
+    uint64_t cycle;             /**< of the board, when it happened */
+    uint64_t host_ns;           /**< as df_log_host_ns() */
+    uint32_t id;
+    uint32_t arg[3];
+};
+
+struct drumfish_cfg;
+
+/* Which events are recorded, by the log's verbosity */
+extern uint8_t df_trace_on[DF_TRACE_MAX];
+
+void df_trace_init(const struct drumfish_cfg *config);
+
+/* Start and stop formatting events into the log */
+int df_trace_start(void);
+
+void df_trace_stop(void);
+
+void df_trace_put(enum df_trace_id id, uint64_t cycle, uint32_t a0,
+        uint32_t a1, uint32_t a2);
+
+static inline void
+df_trace(enum df_trace_id id, uint64_t cycle, uint32_t a0, uint32_t a1,
+        uint32_t a2)
+{
+    if (__builtin_expect(df_trace_on[id], 0))
+        df_trace_put(id, cycle, a0, a1, a2);
+}
+
+#endif /* __DF_TRACE_H__ */
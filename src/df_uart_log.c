@@ -0,0 +1,263 @@
+/*
+ * df_uart_log.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "df_uart_log.h"
+
+/*
+ * The file is a header followed by records of a tag byte, the cycles
+ * since the last record as a LEB128 varint and, unless it's the end, the
+ * byte. Most records take 3 bytes.
+ */
+#define DF_UART_LOG_MAGIC   "DFUL"
+#define DF_UART_LOG_VERSION 1
+
+#define DF_UART_LOG_UART    (1 << 0)    /**< UART1, otherwise UART0 */
+#define DF_UART_LOG_TX      (1 << 1)    /**< AVR -> host */
+#define DF_UART_LOG_END     (1 << 2)    /**< the recording stopped here */
+
+struct df_uart_log_hdr {
+    char magic[4];
+    uint32_t version;
+};
+
+struct df_uart_log *
+df_uart_log_record(const char *path)
+{
+    struct df_uart_log_hdr hdr;
+    struct df_uart_log *l;
+
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        fprintf(stderr, "Failed to allocate memory for UART log.\n");
+        return NULL;
+    }
+
+    l->f = fopen(path, "wb");
+    if (!l->f) {
+        fprintf(stderr, "Unable to create UART log '%s': %s\n", path,
+                strerror(errno));
+        free(l);
+        return NULL;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DF_UART_LOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = DF_UART_LOG_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, l->f);
+
+    return l;
+}
+
+struct df_uart_log *
+df_uart_log_trace(const char *path)
+{
+    struct df_uart_log *l;
+
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        fprintf(stderr, "Failed to allocate memory for UART trace.\n");
+        return NULL;
+    }
+
+    l->f = fopen(path, "w");
+    if (!l->f) {
+        fprintf(stderr, "Unable to create UART trace '%s': %s\n", path,
+                strerror(errno));
+        free(l);
+        return NULL;
+    }
+    l->text = 1;
+
+    return l;
+}
+
+static void
+df_uart_log_write(struct df_uart_log *l, uint8_t tag, uint64_t cycle)
+{
+    uint64_t delta = cycle - l->last;
+
+    putc_unlocked(tag, l->f);
+    while (delta >= 0x80) {
+        putc_unlocked((delta & 0x7f) | 0x80, l->f);
+        delta >>= 7;
+    }
+    putc_unlocked(delta, l->f);
+
+    l->last = cycle;
+}
+
+void
+df_uart_log_put(struct df_uart_log *l, int uart, enum df_uart_dir dir,
+        uint64_t cycle, uint8_t byte)
+{
+    if (l->text) {
+        fprintf(l->f, "%" PRIu64 " uart%d %s 0x%02x\n", cycle, uart,
+                dir == DF_UART_TX ? "tx" : "rx", byte);
+        return;
+    }
+
+    df_uart_log_write(l, (uart ? DF_UART_LOG_UART : 0) |
+            (dir == DF_UART_TX ? DF_UART_LOG_TX : 0), cycle);
+    putc_unlocked(byte, l->f);
+}
+
+static int
+df_uart_log_add(struct df_uart_log_recs *r, uint64_t cycle, uint8_t byte)
+{
+    struct df_uart_log_rec *rec;
+
+    if ((r->count & (r->count - 1)) == 0) {
+        rec = realloc(r->rec, (r->count ? r->count * 2 : 64) *
+                sizeof(*rec));
+        if (!rec)
+            return -1;
+        r->rec = rec;
+    }
+
+    r->rec[r->count].cycle = cycle;
+    r->rec[r->count].byte = byte;
+    r->count++;
+
+    return 0;
+}
+
+static void
+df_uart_log_free(struct df_uart_log *l)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        free(l->recs[i / 2][i % 2].rec);
+    free(l);
+}
+
+static int
+df_uart_log_varint(FILE *f, uint64_t *val)
+{
+    int shift = 0;
+    int c;
+
+    *val = 0;
+    do {
+        c = getc_unlocked(f);
+        if (c == EOF || shift > 63)
+            return -1;
+        *val |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    return 0;
+}
+
+struct df_uart_log *
+df_uart_log_replay(const char *path)
+{
+    struct df_uart_log_hdr hdr;
+    struct df_uart_log *l;
+    uint64_t delta;
+    int ended = 0;
+    int tag;
+    int c;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to open UART log '%s': %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            memcmp(hdr.magic, DF_UART_LOG_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != DF_UART_LOG_VERSION) {
+        fprintf(stderr, "'%s' isn't a UART log.\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        fprintf(stderr, "Failed to allocate memory for UART log.\n");
+        fclose(f);
+        return NULL;
+    }
+
+    while (!ended && (tag = getc_unlocked(f)) != EOF) {
+        if (df_uart_log_varint(f, &delta))
+            break;
+        l->last += delta;
+
+        if (tag & DF_UART_LOG_END) {
+            ended = 1;
+            continue;
+        }
+
+        if ((c = getc_unlocked(f)) == EOF)
+            break;
+        if (df_uart_log_add(&l->recs[tag & DF_UART_LOG_UART]
+                    [(tag & DF_UART_LOG_TX) ? DF_UART_TX : DF_UART_RX],
+                    l->last, c)) {
+            fprintf(stderr, "Failed to allocate memory for UART log.\n");
+            df_uart_log_free(l);
+            fclose(f);
+            return NULL;
+        }
+    }
+
+    /* drumfish died recording, run up to the last byte */
+    if (!ended)
+        fprintf(stderr, "UART log '%s' stops short, replaying what's "
+                "there.\n", path);
+    l->end = l->last;
+
+    fclose(f);
+    return l;
+}
+
+int
+df_uart_log_close(struct df_uart_log *l, uint64_t cycle)
+{
+    int ret = 0;
+
+    if (!l)
+        return 0;
+
+    if (l->f) {
+        if (l->text)
+            fprintf(l->f, "%" PRIu64 " end\n", cycle);
+        else
+            df_uart_log_write(l, DF_UART_LOG_END, cycle);
+        if (ferror(l->f) | fclose(l->f)) {
+            fprintf(stderr, "Failed to write UART log: %s\n",
+                    strerror(errno));
+            ret = -1;
+        }
+    }
+
+    df_uart_log_free(l);
+    return ret;
+}
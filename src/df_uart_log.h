@@ -0,0 +1,75 @@
+/*
+ * df_uart_log.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DF_UART_LOG_H__
+#define __DF_UART_LOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Which way a byte went, as the AVR sees it */
+enum df_uart_dir {
+    DF_UART_RX,     /**< host -> AVR */
+    DF_UART_TX,     /**< AVR -> host */
+};
+
+struct df_uart_log_rec {
+    uint64_t cycle;
+    uint8_t byte;
+};
+
+/* One UART's bytes one way, in cycle order */
+struct df_uart_log_recs {
+    struct df_uart_log_rec *rec;
+    size_t count;
+    size_t next;            /**< replayed up to here */
+};
+
+/*
+ * Every byte a board's UARTs moved, stamped with the cycle it happened
+ * at. Written as it goes when recording, read in whole for a replay.
+ */
+struct df_uart_log {
+    FILE *f;                /**< recording to, NULL when replaying */
+    int text;               /**< a trace to read, not to replay */
+    uint64_t last;          /**< cycle of the last record */
+    uint64_t end;           /**< cycle the recording stopped at */
+    struct df_uart_log_recs recs[2][2]; /**< [uart][dir], replaying */
+};
+
+struct df_uart_log *df_uart_log_record(const char *path);
+
+struct df_uart_log *df_uart_log_replay(const char *path);
+
+/*
+ * Like a recording, but as text, a line per byte of the cycle, the UART,
+ * 'rx' or 'tx' and the byte, for comparing runs with diff.
+ */
+struct df_uart_log *df_uart_log_trace(const char *path);
+
+void df_uart_log_put(struct df_uart_log *l, int uart, enum df_uart_dir dir,
+        uint64_t cycle, uint8_t byte);
+
+/* A recording is finished off as having stopped at 'cycle' */
+int df_uart_log_close(struct df_uart_log *l, uint64_t cycle);
+
+#endif /* __DF_UART_LOG_H__ */
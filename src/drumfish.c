@@ -22,6 +22,7 @@
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <getopt.h>
 #include <stdint.h>
@@ -32,24 +33,94 @@
 #include <unistd.h>
 
 #include <sim_avr.h>
-#include <sim_gdb.h>
 
 #include "drumfish.h"
-#include "flash.h"
-#include "df_cores.h"
+#include "df_batch.h"
+#include "df_board.h"
+#include "df_elf.h"
+#include "df_fuzz.h"
 #include "df_log.h"
+#include "df_trace.h"
 
 #define DEFAULT_PFLASH_PATH "/.drumfish/pflash.dat"
 #define MAX_FLASH_FILES 1024
+#define MAX_BOARDS 4096
 
-/* We have 1 emulated board and here's the handle to
- * the AVR core.
- */
-avr_t *avr = NULL;
+/* Set in the template while its clones run, for passing signals on */
+static pid_t *clone_pids = NULL;
+static volatile sig_atomic_t clone_count = 0;
+static volatile sig_atomic_t clones_stopping = 0;
+static int clones_short = 0;    /**< not every clone could be started */
+
+/* Long only options */
+enum {
+    OPT_SPEED = 256,
+    OPT_SAVE_SNAPSHOT,
+    OPT_RESTORE_SNAPSHOT,
+    OPT_PFLASH_BASE,
+    OPT_CLONES,
+    OPT_FLASH_SYNC,
+    OPT_FLASH_JOURNAL,
+    OPT_LOG_CLOCK,
+    OPT_PROFILE,
+    OPT_COVERAGE,
+    OPT_STATS,
+    OPT_NO_DECODE_CACHE,
+    OPT_UART_TIMING,
+    OPT_UART_RECORD,
+    OPT_UART_REPLAY,
+    OPT_UART_TRACE,
+    OPT_DETERMINISTIC,
+    OPT_INPUT,
+    OPT_BATCH,
+    OPT_RESULTS,
+    OPT_FUZZ,
+    OPT_FUZZ_BOOT,
+    OPT_FUZZ_CYCLES,
+};
+
+static const struct option df_long_opts[] = {
+    { "erase",      no_argument,        NULL, 'e' },
+    { "flash",      required_argument,  NULL, 'f' },
+    { "peripheral", required_argument,  NULL, 'p' },
+    { "mac",        required_argument,  NULL, 'm' },
+    { "verbose",    no_argument,        NULL, 'v' },
+    { "gdb",        required_argument,  NULL, 'g' },
+    { "pflash",     required_argument,  NULL, 's' },
+    { "boards",     required_argument,  NULL, 'n' },
+    { "threads",    required_argument,  NULL, 'j' },
+    { "lockstep",   no_argument,        NULL, 'l' },
+    { "speed",      required_argument,  NULL, OPT_SPEED },
+    { "save-snapshot",      required_argument, NULL, OPT_SAVE_SNAPSHOT },
+    { "restore-snapshot",   required_argument, NULL, OPT_RESTORE_SNAPSHOT },
+    { "pflash-base",        required_argument, NULL, OPT_PFLASH_BASE },
+    { "clones",             required_argument, NULL, OPT_CLONES },
+    { "flash-sync",         required_argument, NULL, OPT_FLASH_SYNC },
+    { "flash-journal",      no_argument,       NULL, OPT_FLASH_JOURNAL },
+    { "log-clock",          required_argument, NULL, OPT_LOG_CLOCK },
+    { "profile",            required_argument, NULL, OPT_PROFILE },
+    { "coverage",           required_argument, NULL, OPT_COVERAGE },
+    { "stats",              required_argument, NULL, OPT_STATS },
+    { "no-decode-cache",    no_argument,       NULL, OPT_NO_DECODE_CACHE },
+    { "uart-timing",        required_argument, NULL, OPT_UART_TIMING },
+    { "uart-record",        required_argument, NULL, OPT_UART_RECORD },
+    { "uart-replay",        required_argument, NULL, OPT_UART_REPLAY },
+    { "uart-trace",         required_argument, NULL, OPT_UART_TRACE },
+    { "deterministic",      no_argument,       NULL, OPT_DETERMINISTIC },
+    { "input",              required_argument, NULL, OPT_INPUT },
+    { "batch",              required_argument, NULL, OPT_BATCH },
+    { "results",            required_argument, NULL, OPT_RESULTS },
+    { "fuzz",               required_argument, NULL, OPT_FUZZ },
+    { "fuzz-boot",          required_argument, NULL, OPT_FUZZ_BOOT },
+    { "fuzz-cycles",        required_argument, NULL, OPT_FUZZ_CYCLES },
+    { "help",       no_argument,        NULL, 'h' },
+    { NULL,         0,                  NULL, 0 },
+};
 
 static const char * const df_peripheral_str[] = {
     "uart0",
     "uart1",
+    "radio",
     NULL
 };
 
@@ -102,17 +173,270 @@ df_peripheral_parse(struct drumfish_cfg *config, const char *arg)
 static void
 handler(int sig)
 {
+    sig_atomic_t i;
+
+    /* The template doesn't run, its clones do */
+    if (clone_pids) {
+        if (sig != SIGHUP)
+            clones_stopping = 1;
+        for (i = 0; i < clone_count; i++)
+            kill(clone_pids[i], sig);
+        return;
+    }
+
+    /* The boards are owned by the worker threads, so just ask them
+     * to stop or reset and let them do it between slices.
+     */
     switch (sig) {
         case SIGINT:
         case SIGTERM:
-            avr_terminate(avr);
-            exit(EXIT_FAILURE);
+            df_boards_quit();
             break;
 
         case SIGHUP:
-            avr_reset(avr);
+            df_boards_reset();
+            break;
+    }
+}
+
+/*
+ * Fork off a clone of the template board per '--clones'. Returns the
+ * clone's id in each clone and 'clones' in the template.
+ */
+static unsigned int
+spawn_clones(struct df_board *board, const struct drumfish_cfg *config)
+{
+    sigset_t set;
+    sigset_t old;
+    unsigned int i;
+    pid_t pid;
+
+    clone_pids = calloc(config->clones, sizeof(*clone_pids));
+    if (!clone_pids) {
+        fprintf(stderr, "Failed to allocate memory for clones.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* fork() only keeps the calling thread */
+    df_board_unplug(board);
+    fflush(stdout);
+    fflush(stderr);
+
+    /* A clone mustn't act on a signal before it knows it's a clone */
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    for (i = 0; i < config->clones; i++) {
+        pid = fork();
+        if (pid == 0) {
+            free(clone_pids);
+            clone_pids = NULL;
+            clone_count = 0;
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            return i;
+        }
+
+        if (pid < 0) {
+            fprintf(stderr, "Unable to start clone %u: %s\n", i,
+                    strerror(errno));
+            clones_short = 1;
+            break;
+        }
+
+        clone_pids[i] = pid;
+        clone_count = i + 1;
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    /* Don't leave half a fleet running */
+    if (i < config->clones)
+        handler(SIGTERM);
+
+    return config->clones;
+}
+
+/*
+ * Wait for every clone to exit. Being stopped by our signals is how
+ * clones normally finish, otherwise they must have succeeded.
+ */
+static int
+wait_clones(void)
+{
+    sig_atomic_t left = clone_count;
+    int failed = clones_short;
+    int status;
+    pid_t pid;
+
+    while (left) {
+        pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            failed = 1;
             break;
+        }
+
+        left--;
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS &&
+                    !clones_stopping)) {
+            df_log_msg(DF_LOG_ERR, "Clone with pid %d failed\n", (int)pid);
+            failed = 1;
+        }
     }
+
+    return failed ? -1 : 0;
+}
+
+static unsigned int
+parse_count(const char *arg, const char *what, unsigned long max)
+{
+    unsigned long val;
+    char *end;
+
+    errno = 0;
+    val = strtoul(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || val == 0 || val > max) {
+        fprintf(stderr, "Invalid supplied %s '%s'. Must be 1 to %lu\n",
+                what, arg, max);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
+/* Returns the multiple of real time to run at, 0 being as fast as we can */
+static double
+parse_speed(const char *arg)
+{
+    double val;
+    char *end;
+
+    if (strcmp(arg, "max") == 0)
+        return 0;
+    if (strcmp(arg, "realtime") == 0)
+        return 1;
+
+    errno = 0;
+    val = strtod(arg, &end);
+    if (errno != 0 || end == arg || *end != '\0' || !(val > 0)) {
+        fprintf(stderr, "Invalid supplied speed '%s'. Must be 'max', "
+                "'realtime' or a factor greater than 0\n", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
+static void
+parse_flash_sync(struct drumfish_cfg *config, const char *arg)
+{
+    unsigned long val;
+    char *end;
+
+    if (strcmp(arg, "exit") == 0) {
+        config->flash_sync = DF_FLASH_SYNC_EXIT;
+        return;
+    }
+    if (strcmp(arg, "page") == 0) {
+        config->flash_sync = DF_FLASH_SYNC_PAGE;
+        return;
+    }
+
+    if (strncmp(arg, "periodic", 8) == 0) {
+        config->flash_sync = DF_FLASH_SYNC_PERIODIC;
+        if (arg[8] == '\0')
+            return;
+
+        if (arg[8] == ':') {
+            errno = 0;
+            val = strtoul(arg + 9, &end, 10);
+            if (errno == 0 && end != arg + 9 && *end == '\0' &&
+                    val > 0 && val <= UINT32_MAX) {
+                config->flash_sync_ms = val;
+                return;
+            }
+        }
+    }
+
+    fprintf(stderr, "Invalid supplied flash sync '%s'. Must be 'exit', "
+            "'page' or 'periodic[:MS]'\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+parse_cycles(const char *arg, const char *what, int zero)
+{
+    unsigned long long val;
+    char *end;
+
+    errno = 0;
+    val = strtoull(arg, &end, 0);
+    if (errno != 0 || end == arg || *end != '\0' || (!zero && val == 0)) {
+        fprintf(stderr, "Invalid supplied %s '%s'. Must be a number of "
+                "cycles\n", what, arg);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
+/* uart0 or uart1 */
+static int
+parse_uart(const char *arg, const char *what)
+{
+    if (strncmp(arg, "uart", 4) == 0 && (arg[4] == '0' || arg[4] == '1') &&
+            arg[5] == '\0')
+        return arg[4] - '0';
+
+    fprintf(stderr, "Invalid supplied %s '%s'. Must be 'uart0' or "
+            "'uart1'\n", what, arg);
+    exit(EXIT_FAILURE);
+}
+
+/* Some modes want to hear nothing from outside the board */
+static void
+radio_off(struct drumfish_cfg *config)
+{
+    free(config->peripherals[DF_PERIPHERAL_RADIO]);
+    config->peripherals[DF_PERIPHERAL_RADIO] = strdup("off");
+    if (!config->peripherals[DF_PERIPHERAL_RADIO]) {
+        fprintf(stderr, "Failed to allocate memory for radio.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* [uartN=]accurate|turbo, without a UART it's for both */
+static void
+parse_uart_timing(struct drumfish_cfg *config, const char *arg)
+{
+    enum df_uart_timing timing;
+    const char *mode = arg;
+    int first = 0;
+    int last = 1;
+    int i;
+
+    if (strncmp(arg, "uart", 4) == 0 && (arg[4] == '0' || arg[4] == '1') &&
+            arg[5] == '=') {
+        first = last = arg[4] - '0';
+        mode = arg + 6;
+    }
+
+    if (strcmp(mode, "accurate") == 0) {
+        timing = DF_UART_TIMING_ACCURATE;
+    } else if (strcmp(mode, "turbo") == 0) {
+        timing = DF_UART_TIMING_TURBO;
+    } else {
+        fprintf(stderr, "Invalid supplied UART timing '%s'. Must be "
+                "'[uartN=]accurate' or '[uartN=]turbo'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = first; i <= last; i++)
+        config->uart_timing[i] = timing;
 }
 
 static void
@@ -120,14 +444,186 @@ usage(const char *argv0)
 {
     fprintf(stderr,
 "Usage: %s [-v] [-s pflash] [-f firmware.hex] [-g port] [-m MAC] [-p config]\n"
+"          [-n boards] [-j threads] [-l] [--speed=max|realtime|factor]\n"
+"          [--save-snapshot=file] [--restore-snapshot=file]\n"
+"          [--pflash-base=file] [--clones=N]\n"
+"          [--flash-sync=exit|page|periodic[:MS]] [--flash-journal]\n"
+"          [--log-clock=host|sim] [--profile=file] [--stats=file]\n"
+"          [--coverage=file] [--no-decode-cache]\n"
+"          [--uart-timing=[uartN=]accurate|turbo]\n"
+"          [--uart-record=file] [--uart-replay=file] [--uart-trace=file]\n"
+"          [--deterministic] [--input=file]\n"
+"          [--batch=manifest] [--results=file]\n"
+"          [--fuzz=uartN] [--fuzz-boot=cycles] [--fuzz-cycles=cycles]\n"
+"          [-- fuzzer arguments or inputs]\n"
 "\n"
 "  -s pflash    - Path to device's progammable flash storage\n"
-"  -f ihex      - Load the requested 'ihex' file into the device's flash\n"
+"  -f firmware  - Load the requested Intel HEX, ELF or raw '.bin' image\n"
+"                 into the device's flash\n"
 "  -e           - Erase all of progammable flash prior to loading any data\n"
 "  -p config    - Configures a peripheral\n"
 "  -g port      - Runs the AVR CPU under gdbserver on 'port'\n"
 "  -v           - Increase verbosity of messages\n"
-"  -m           - Radio MAC address\n"
+"  -m           - Radio MAC address, preloaded into IEEE_ADDR\n"
+"  -n boards    - Number of boards to run in this process\n"
+"  -j threads   - Number of threads stepping those boards\n"
+"  -l           - Run the boards in lockstep\n"
+"  --speed=SPEED - 'max' (the default) runs as fast as possible, skipping\n"
+"                 idle time, 'realtime' runs at the CPU's clock rate and\n"
+"                 a number runs at that multiple of it, e.g. 0.5 or 10\n"
+"  --save-snapshot=FILE - Save the board's state to FILE when it stops\n"
+"  --restore-snapshot=FILE - Start the board from the state in FILE\n"
+"  --pflash-base=FILE - Share the read only flash image FILE, keeping only\n"
+"                 the pages that differ from it in pflash\n"
+"  --clones=N   - Start one board and run N copies of it\n"
+"  --flash-sync=WHEN - When flash the firmware programmed is written to\n"
+"                 pflash: on 'exit', after every 'page' or 'periodic'ally,\n"
+"                 every MS milliseconds (default 1000)\n"
+"  --flash-journal - Journal flash writes so a crash can't tear pflash\n"
+"  --log-clock=CLOCK - Stamp messages with the 'host' time since boot\n"
+"                 (default) or with 'sim', that and the board's cycle\n"
+"                 and simulated time\n"
+"  --profile=FILE - Profile the firmware, writing folded stacks to FILE\n"
+"                 and cycles per function to FILE.flat\n"
+"  --coverage=FILE - Write what of the firmware ran to FILE, for lcov\n"
+"  --stats=FILE - Write the cycles and instructions run, the time and\n"
+"                 memory it took and the UARTs' byte and xon/xoff counts\n"
+"                 to FILE as JSON on exit\n"
+"  --no-decode-cache - Run every instruction through simavr, rather than\n"
+"                 from pre-decoded flash where it can, to compare them\n"
+"  --uart-timing=[uartN=]MODE - How bytes a UART is sent reach the AVR:\n"
+"                 'turbo' (the default) as fast as it takes them, or\n"
+"                 'accurate', one per frame at the baud rate and frame\n"
+"                 format it programmed. Without 'uartN=' it's for both\n"
+"  --uart-record=FILE - Record every byte through the UARTs, and the cycle\n"
+"                 it went at, to FILE\n"
+"  --uart-replay=FILE - Feed the UARTs what FILE recorded instead of\n"
+"                 their host side and check what they send against it\n"
+"  --uart-trace=FILE - Write every byte through the UARTs to FILE as text\n"
+"  --deterministic - Run exactly the same way every time, see below\n"
+"  --input=FILE - What the UARTs get, and when, in deterministic mode\n"
+"  --batch=MANIFEST - Run the tests in MANIFEST, a board each, and exit\n"
+"  --results=FILE - Write how each test went to FILE, not stdout\n"
+"  --fuzz=uartN - Fuzz the firmware through UART N, see below\n"
+"  --fuzz-boot=CYCLES - Cycles to boot for before fuzzing (default 0)\n"
+"  --fuzz-cycles=CYCLES - Cycles each fuzzed input may run for\n"
+"                 (default 100000)\n"
+"\n"
+"Multiple Boards:\n"
+"  With '-n' greater than 1, board N uses 'pflash.N' for its flash storage,\n"
+"  the MAC address plus N, 'path.N' for UARTs given a path, 'PORT + N'\n"
+"  for 'tcp:PORT' and /tmp/drumfish-$PID-N-uartX for UARTs that are 'on'.\n"
+"  A GDB port given with '-g' becomes 'port + N'. Every '-f' image is\n"
+"  loaded into every board. By default one thread per CPU steps the\n"
+"  boards.\n"
+"\n"
+"  Normally each board runs as fast as its thread can take it. With '-l'\n"
+"  no board gets more than a radio lookahead (160us) of simulated time\n"
+"  ahead of the slowest one, so what the radios hear doesn't depend on\n"
+"  how the threads were scheduled. A board stopped in gdb stops them all.\n"
+"  Snapshots are saved to and restored from 'file.N'.\n"
+"\n"
+"Snapshots:\n"
+"  A snapshot holds everything but flash, which stays in its storage\n"
+"  file and must be unchanged when restoring. It's taken when drumfish\n"
+"  is stopped with SIGINT or SIGTERM, e.g. once firmware has booted, and\n"
+"  can only be restored by the same drumfish binary given the same\n"
+"  options. Boards that share the air should be saved together.\n"
+"\n"
+"Clones:\n"
+"  With '--pflash-base' flash is FILE mapped copy-on-write, and pflash,\n"
+"  written on exit, only holds the pages the board changed. Boards then\n"
+"  share one firmware image without each needing a full copy.\n"
+"\n"
+"  '--clones' sets up a single template board, restoring it from a\n"
+"  snapshot if asked to, and fork()s N copies of it that share its\n"
+"  memory until they change it. Clone N is named and numbered like\n"
+"  board N of '-n', the template only waits for them and passes its\n"
+"  signals on. It requires '--pflash-base'.\n"
+"\n"
+"Flash Storage:\n"
+"  The firmware runs from a private copy of pflash, and only pages it\n"
+"  erased or wrote with SPM are written back, as '--flash-sync' says and\n"
+"  always on exit. With '--flash-journal' they go to 'pflash.journal'\n"
+"  first, which is replayed on the next start if drumfish died part way\n"
+"  through writing pflash.\n"
+"\n"
+"Profiling:\n"
+"  Every instruction's cycles are counted against the function it's in\n"
+"  and the call stack, followed through CALLs, RETs and interrupts, it\n"
+"  ran under. Functions are named by the symbols of '-f' ELF files.\n"
+"  Cycles spent asleep are '[sleep]'. FILE can be fed to flamegraph.pl.\n"
+"  With '-n' each board's profile goes to 'FILE.N'.\n"
+"\n"
+"Coverage:\n"
+"  Every instruction that runs is marked, and whether it went on to the\n"
+"  next one or elsewhere. On exit that's written out by source line, as\n"
+"  an lcov tracefile of lines, functions and both ways of every branch\n"
+"  and skip, using the line info and symbols of '-f' ELF files built\n"
+"  with -g. It's cheap enough to leave on. Tracefiles of several runs\n"
+"  can be merged with 'lcov -a' and made into HTML with genhtml. With\n"
+"  '-n' each board's coverage goes to 'FILE.N'.\n"
+"\n"
+"Record and Replay:\n"
+"  A replay hands each byte to the AVR at the very cycle it got it while\n"
+"  recording, so a run that took input from a terminal or a test can be\n"
+"  repeated exactly, e.g. to debug it. It needs the firmware, pflash and\n"
+"  options the recording was made with, and stops the board at the cycle\n"
+"  the recording did. Unless '--speed' is given it runs at 'max'. Any\n"
+"  byte the firmware sends that differs from the recording is reported.\n"
+"  While recording, bytes in 'turbo' mode reach the AVR between\n"
+"  instructions. With '-n' board N uses 'FILE.N', as does the recording\n"
+"  of clone N.\n"
+"\n"
+"Deterministic Mode:\n"
+"  Nothing from outside the process reaches the boards, so the same\n"
+"  firmware, flash and options always run the same. The UARTs have no\n"
+"  host side, they get what '--input' says at the cycle it says, with a\n"
+"  line per event of the cycle, 'uart0' or 'uart1' and quoted strings\n"
+"  (with \\r, \\n, \\t, \\0 and \\xHH escapes) and byte values:\n"
+"\n"
+"    # cycle  uart   data\n"
+"    16000    uart1  \"AT\\r\" 0x0a\n"
+"\n"
+"  '--uart-trace' writes what they send, and were sent, with the cycle\n"
+"  it went at. Radios must be 'on' or 'off', '-n' boards run in lockstep\n"
+"  and, unless '--speed' is given, at 'max'. With '-n' board N uses\n"
+"  'FILE.N' for both, clone N its own trace.\n"
+"\n"
+"Batch Mode:\n"
+"  For test farms, '--batch' runs every test of a manifest at once, a\n"
+"  board per test spread over the '-j' threads, in deterministic mode\n"
+"  from freshly erased flash and with radios off. That flash is kept in\n"
+"  memory, pflash is never touched. A test is a stanza:\n"
+"\n"
+"    test boot                      # starts a test, named 'boot'\n"
+"    firmware bootloader.hex        # loaded after any '-f'\n"
+"    input boot.in                  # as '--input'\n"
+"    expect uart1 \"Bootloader\"     # passes once UART1 sends it\n"
+"    fail uart1 \"panic\"            # fails once UART1 sends it\n"
+"    cycles 16000000                # cycle budget\n"
+"    timeout 10                     # wall clock budget, in seconds\n"
+"    resets 1                       # fails after this many resets\n"
+"\n"
+"  It needs a budget. A test that expects nothing passes when its\n"
+"  cycles run out. Each test's result, reason, cycles, resets and what\n"
+"  its UARTs sent are written as a JSON line and drumfish exits 0 if\n"
+"  every test passed.\n"
+"\n"
+"Fuzzing:\n"
+"  '--fuzz' boots a single board, in deterministic mode with the radio\n"
+"  off, then keeps a copy of it in memory. Every input is run from that\n"
+"  copy: it's fed to the UART and run until the firmware sleeps having\n"
+"  taken it all or its cycles run out. The edges between instructions\n"
+"  it ran are the fuzzer's coverage and cpu_Crashed, a jump past the\n"
+"  end of flash or into erased flash count as crashes. Built with\n"
+"  'make fuzz', drumfish-fuzz runs libFuzzer, with the arguments after\n"
+"  '--'. Built with afl-cc, drumfish runs in AFL's persistent mode,\n"
+"  reading inputs from stdin. Otherwise drumfish runs each input file\n"
+"  after '--' once, or stdin, and reports how it went, e.g.\n"
+"\n"
+"    drumfish-fuzz -f fw.hex --fuzz=uart1 --fuzz-boot=160000 -- corpus/\n"
+"    drumfish -f fw.hex --fuzz=uart1 --fuzz-boot=160000 -- crash-1234\n"
 "\n"
 "Peripheral Config:\n"
 "  Specifies a peripheral name and a value in the form of 'name=value'\n"
@@ -139,12 +635,24 @@ usage(const char *argv0)
 "      specified then there will be no ability to communicate with this\n"
 "      peripheral but the MCU can still have it enabled. Should 'on' be\n"
 "      specified then the default path of /tmp/drumfish-$PID-uartX will\n"
-"      be used.\n"
+"      be used. A path links to a pty, unless it's 'unix:PATH', a Unix\n"
+"      domain socket at PATH, or 'tcp:PORT', a TCP socket on PORT of the\n"
+"      loopback. Sockets serve one client at a time, the next one that\n"
+"      connects once it leaves.\n"
+"    radio\n"
+"      Value can be 'off', 'on' or 'shm[:NAME]'. When 'on' the board's\n"
+"      802.15.4 radio shares the air with every other board in this\n"
+"      process. With 'shm' it shares the air with every drumfish process\n"
+"      on this host using the same NAME, through /dev/shm/drumfish-NAME\n"
+"      (default 'air'). Each radio on a medium needs its own MAC. The\n"
+"      last to leave removes it, after a crash it can be deleted by hand.\n"
 "\n"
 "Defaults:\n"
 "  Programmable Flash Storage: $HOME/.drumfish/pflash.dat\n"
 "  UART0: off\n"
 "  UART1: /tmp/drumfish-$PID-uart1\n"
+"  Radio: on\n"
+"  MAC: derived from the programmable flash storage path\n"
 "\n"
 "Examples:\n"
 "  %s -g 1234 -m 00:11:22:00:9E:35\n"
@@ -153,8 +661,11 @@ usage(const char *argv0)
 "    Loads the 'bootloader.hex' blob into flash before starting the CPU\n"
 "\n"
 "  %s -f bootloader.hex -f payload.hex\n"
-"    Would load 2 firmware blobs into flash before starting the CPU\n",
-argv0, argv0, argv0, argv0);
+"    Would load 2 firmware blobs into flash before starting the CPU\n"
+"\n"
+"  %s -n 32 -j 4 -m 00:11:22:00:9E:00 -f bootloader.hex\n"
+"    Runs 32 boards with 4 threads, MAC addresses ending 00 through 1F\n",
+argv0, argv0, argv0, argv0, argv0);
 
 }
 
@@ -166,22 +677,56 @@ main(int argc, char *argv[])
     char *env;
     struct drumfish_cfg config;
     struct sigaction act;
-    int state = cpu_Limbo;
+    struct df_board *boards;
+    unsigned int i;
     int opt;
     char **flash_file = NULL;
     size_t flash_file_len = 0;
     long  port;
+    long  cpus;
+    uint64_t run_ns;
 
     config.mac = NULL;
     config.pflash = NULL;
     config.foreground = 1;
     config.verbose = 0;
+    config.log_clock = DF_LOG_CLOCK_HOST;
     config.gdb = 0;
     config.erase_pflash = 0;
+    config.pflash_private = 0;
+    config.flash_sync = DF_FLASH_SYNC_PERIODIC;
+    config.flash_sync_ms = 1000;
+    config.flash_journal = 0;
     config.peripherals[DF_PERIPHERAL_UART0] = strdup("off");
     config.peripherals[DF_PERIPHERAL_UART1] = strdup("on");
+    config.peripherals[DF_PERIPHERAL_RADIO] = strdup("on");
+    config.uart_timing[0] = DF_UART_TIMING_TURBO;
+    config.uart_timing[1] = DF_UART_TIMING_TURBO;
+    config.boards = 1;
+    config.threads = 0;
+    config.lockstep = 0;
+    config.speed = 0;
+    config.save_snapshot = NULL;
+    config.restore_snapshot = NULL;
+    config.pflash_base = NULL;
+    config.clones = 0;
+    config.profile = NULL;
+    config.coverage = NULL;
+    config.stats = NULL;
+    config.decode_cache = 1;
+    config.uart_record = NULL;
+    config.uart_replay = NULL;
+    config.uart_trace = NULL;
+    config.deterministic = 0;
+    config.input = NULL;
+    config.batch = NULL;
+    config.results = NULL;
+    config.fuzz = -1;
+    config.fuzz_boot = 0;
+    config.fuzz_cycles = 100000;
 
-    while ((opt = getopt(argc, argv, "ef:p:m:vg:s:h")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ef:p:m:vg:s:n:j:lh", df_long_opts,
+                    NULL)) != -1) {
         switch (opt) {
             case 'e':
                 config.erase_pflash = 1;
@@ -256,6 +801,163 @@ main(int argc, char *argv[])
                /* store requested port (UART) path */
                df_peripheral_parse(&config, optarg);
                break;
+            case 'n':
+               config.boards = parse_count(optarg, "board count", MAX_BOARDS);
+               break;
+            case 'j':
+               config.threads = parse_count(optarg, "thread count",
+                       MAX_BOARDS);
+               break;
+            case 'l':
+               config.lockstep = 1;
+               break;
+            case OPT_SPEED:
+               config.speed = parse_speed(optarg);
+               break;
+            case OPT_SAVE_SNAPSHOT:
+               free(config.save_snapshot);
+               config.save_snapshot = strdup(optarg);
+               if (!config.save_snapshot) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "snapshot path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_RESTORE_SNAPSHOT:
+               free(config.restore_snapshot);
+               config.restore_snapshot = strdup(optarg);
+               if (!config.restore_snapshot) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "snapshot path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_PFLASH_BASE:
+               free(config.pflash_base);
+               config.pflash_base = strdup(optarg);
+               if (!config.pflash_base) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "flash base path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_CLONES:
+               config.clones = parse_count(optarg, "clone count",
+                       MAX_BOARDS);
+               break;
+            case OPT_FLASH_SYNC:
+               parse_flash_sync(&config, optarg);
+               break;
+            case OPT_FLASH_JOURNAL:
+               config.flash_journal = 1;
+               break;
+            case OPT_PROFILE:
+               free(config.profile);
+               config.profile = strdup(optarg);
+               if (!config.profile) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "profile path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_COVERAGE:
+               free(config.coverage);
+               config.coverage = strdup(optarg);
+               if (!config.coverage) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "coverage path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_STATS:
+               free(config.stats);
+               config.stats = strdup(optarg);
+               if (!config.stats) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "stats path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_NO_DECODE_CACHE:
+               config.decode_cache = 0;
+               break;
+            case OPT_LOG_CLOCK:
+               if (strcmp(optarg, "host") == 0) {
+                   config.log_clock = DF_LOG_CLOCK_HOST;
+               } else if (strcmp(optarg, "sim") == 0) {
+                   config.log_clock = DF_LOG_CLOCK_SIM;
+               } else {
+                   fprintf(stderr, "Invalid supplied log clock '%s'. Must "
+                           "be 'host' or 'sim'\n", optarg);
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_UART_TIMING:
+               parse_uart_timing(&config, optarg);
+               break;
+            case OPT_UART_RECORD:
+               free(config.uart_record);
+               config.uart_record = strdup(optarg);
+               if (!config.uart_record) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "UART recording path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_UART_TRACE:
+               free(config.uart_trace);
+               config.uart_trace = strdup(optarg);
+               if (!config.uart_trace) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "UART trace path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_DETERMINISTIC:
+               config.deterministic = 1;
+               break;
+            case OPT_INPUT:
+               free(config.input);
+               config.input = strdup(optarg);
+               if (!config.input) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "input path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_BATCH:
+               df_batch_free(config.batch);
+               config.batch = df_batch_load(optarg);
+               if (!config.batch)
+                   exit(EXIT_FAILURE);
+               break;
+            case OPT_RESULTS:
+               free(config.results);
+               config.results = strdup(optarg);
+               if (!config.results) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "results path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
+            case OPT_FUZZ:
+               config.fuzz = parse_uart(optarg, "fuzzed UART");
+               break;
+            case OPT_FUZZ_BOOT:
+               config.fuzz_boot = parse_cycles(optarg, "boot", 1);
+               break;
+            case OPT_FUZZ_CYCLES:
+               config.fuzz_cycles = parse_cycles(optarg, "cycle budget", 0);
+               break;
+            case OPT_UART_REPLAY:
+               free(config.uart_replay);
+               config.uart_replay = strdup(optarg);
+               if (!config.uart_replay) {
+                   fprintf(stderr, "Failed to allocate memory for "
+                           "UART replay path.\n");
+                   exit(EXIT_FAILURE);
+               }
+               break;
             case 'V':
                /* print version */
                break;
@@ -269,8 +971,68 @@ main(int argc, char *argv[])
         }
     }
 
+    /* Clones would otherwise all write to the same flash */
+    if (config.clones && (!config.pflash_base || config.boards > 1)) {
+        fprintf(stderr, "'--clones' needs '--pflash-base' and a single "
+                "board.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A board per test, each independent of the others */
+    if (config.batch) {
+        if (config.boards > 1 || config.clones || config.input) {
+            fprintf(stderr, "'--batch' runs a board per test, with its own "
+                    "input, it can't be given '-n', '--clones' or "
+                    "'--input'.\n");
+            exit(EXIT_FAILURE);
+        }
+        config.boards = config.batch->count;
+        config.deterministic = 1;
+        config.pflash_private = 1;
+        radio_off(&config);
+    }
+
+    /* Each board, or clone, takes the MAC after the last's */
+    if (config.mac && df_mac_check(config.mac, config.clones > config.boards ?
+                config.clones : config.boards))
+        exit(EXIT_FAILURE);
+
+    /* A board fed by the fuzzer alone, the arguments left are for it */
+    if (config.fuzz >= 0) {
+        if (config.boards > 1 || config.clones || config.batch ||
+                config.input || config.gdb || config.uart_record ||
+                config.uart_replay || config.uart_trace) {
+            fprintf(stderr, "'--fuzz' runs a single board fed only by the "
+                    "fuzzer, it can't be given '-n', '--clones', "
+                    "'--batch', '--input', '-g' or a UART log.\n");
+            exit(EXIT_FAILURE);
+        }
+        config.deterministic = 1;
+        radio_off(&config);
+    }
+
+    /* Input comes from a UART's host side otherwise */
+    if (config.input && !config.deterministic) {
+        fprintf(stderr, "'--input' needs '--deterministic'.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Other processes share the air on their own time */
+    if (config.deterministic &&
+            strncmp(config.peripherals[DF_PERIPHERAL_RADIO], "shm", 3) == 0) {
+        fprintf(stderr, "'--deterministic' needs the radio 'on' or "
+                "'off'.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Boards hear each other's radios at the same cycles in lockstep */
+    if (config.deterministic &&
+            strcmp(config.peripherals[DF_PERIPHERAL_RADIO], "off"))
+        config.lockstep = 1;
+
     /* Initialize our logging support */
     df_log_init(&config);
+    df_trace_init(&config);
 
     /* If the user did not override the default location of the
      * programmable flash storage, then set the default
@@ -281,12 +1043,17 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (asprintf(&config.pflash, "%s%s", env, DEFAULT_PFLASH_PATH) < 0) {
+    if (!config.pflash &&
+            asprintf(&config.pflash, "%s%s", env, DEFAULT_PFLASH_PATH) < 0) {
         fprintf(stderr, "Failed to allocate memory for pflash filename.\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("Programmable Flash Storage: %s\n", config.pflash);
+    /* Default to a worker thread per CPU */
+    if (!config.threads) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = cpus > 0 ? cpus : 1;
+    }
 
     /* Handle the bare minimum signals */
     /* Yes I should use sigset_t here and use sigemptyset() */
@@ -306,71 +1073,108 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    avr = m128rfa1_create(&config);
-    if (!avr) {
-        fprintf(stderr, "Unable to initialize requested board.\n");
+    boards = calloc(config.boards, sizeof(*boards));
+    if (!boards) {
+        fprintf(stderr, "Failed to allocate memory for boards.\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Flash in any requested firmware, while cleaning up our memory */
-    for (size_t i = 0; i < flash_file_len; i++) {
-        if (flash_load(flash_file[i], avr->flash, avr->flashend + 1)) {
-            fprintf(stderr, "Failed to load '%s' into flash.\n", flash_file[i]);
+    /* Bring up each board, flashing in any requested firmware */
+    for (i = 0; i < config.boards; i++) {
+        if (df_board_create(&boards[i], i, &config, flash_file,
+                    flash_file_len)) {
+            fprintf(stderr, "Unable to initialize requested board.\n");
             exit(EXIT_FAILURE);
         }
-        /* Don't need this memory anymore */
-        free(flash_file[i]);
     }
-    free(flash_file);
 
-    /* Ensure the instruction we're about to execute is legit */
-    if (avr->flash[avr->pc] == 0xff) {
-        fprintf(stderr, "No firmware loaded in programmable flash, unable "
-                "to boot.\n");
-        fprintf(stderr, "Try using '-f firmware.hex' to supply one.\n");
-        exit(EXIT_FAILURE);
-    }
+    /* Clean up our memory */
+    for (size_t j = 0; j < flash_file_len; j++)
+        free(flash_file[j]);
+    free(flash_file);
 
-    /* If the user wants to run the core with GDB server enabled,
-     * set that up.
-     */
-    if (config.gdb) {
-        avr->gdb_port = config.gdb;
-        /* Normally starting the CPU should be in limbo, but the
-         * GDB code of simavr wants it to be stopped.
-         */
-        state = cpu_Stopped;
+    /* The template hands the running over to its clones */
+    if (config.clones) {
+        i = spawn_clones(&boards[0], &config);
+        if (i == config.clones) {
+            if (wait_clones() == 0)
+                exit_state = EXIT_SUCCESS;
+            goto done;
+        }
 
-        avr_gdb_init(avr);
+        if (df_board_clone(&boards[0], i, &config)) {
+            fprintf(stderr, "Unable to initialize clone %u.\n", i);
+            exit(EXIT_FAILURE);
+        }
     }
 
     /* Capture the current time to be used as when our CPU started */
     df_log_start_time();
+    if (df_trace_start())
+        exit(EXIT_FAILURE);
 
-    df_log_msg(DF_LOG_INFO, "Booting CPU from 0x%x.\n", avr->pc);
+    df_log_msg(DF_LOG_INFO, "Booting %u board(s) from 0x%x.\n",
+            config.boards, boards[0].avr->pc);
+
+    /* Fuzzing runs the board itself, an input at a time */
+    if (config.fuzz >= 0) {
+        if (df_fuzz_main(&boards[0], argv[0], argc - optind,
+                    &argv[optind]) == 0)
+            exit_state = EXIT_SUCCESS;
+        goto done;
+    }
 
     /* Our main event loop */
-    for (;;) {
-        state = avr_run(avr);
+    run_ns = df_log_host_ns();
+    if (df_boards_run(boards, &config) == 0)
+        exit_state = EXIT_SUCCESS;
+    run_ns = df_log_host_ns() - run_ns;
 
-        if (state == cpu_Done) {
-            exit_state = EXIT_SUCCESS;
-            break;
-        } else if (state == cpu_Crashed) {
-            /* many firmwares disable interrupts and enable the watchdog
-             * to cause the MCU to reboot. simavr treats that state as
-             * cpu_Crashed
-             */
-            df_log_msg(DF_LOG_INFO, "CPU rebooted\n");
-            avr_reset(avr);
+    /* Being asked to stop is how a snapshot gets taken, so a failed save
+     * is the only thing that counts against us here.
+     */
+    if (config.save_snapshot) {
+        exit_state = EXIT_SUCCESS;
+        for (i = 0; i < config.boards; i++) {
+            if (df_board_save(&boards[i]))
+                exit_state = EXIT_FAILURE;
         }
     }
 
-    avr_terminate(avr);
+    /* In a batch it's the tests that decide */
+    if (config.batch) {
+        exit_state = df_boards_results(boards, config.boards,
+                config.results) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* A clone is board 0 of its own process, but named as board N */
+    if (config.stats && df_boards_stats(boards, config.boards,
+                config.clones ? boards[0].config.stats : config.stats,
+                run_ns))
+        exit_state = EXIT_FAILURE;
+
+done:
+    for (i = 0; i < config.boards; i++)
+        df_board_destroy(&boards[i]);
+    free(boards);
 
+    df_trace_stop();
     df_log_msg(DF_LOG_INFO, "Terminated.\n");
 
     free(config.pflash);
+    free(config.pflash_base);
+    df_elf_free();
+    free(config.save_snapshot);
+    free(config.restore_snapshot);
+    free(config.profile);
+    free(config.coverage);
+    free(config.stats);
+    free(config.uart_record);
+    free(config.uart_replay);
+    free(config.uart_trace);
+    free(config.input);
+    df_batch_free(config.batch);
+    free(config.results);
 
     return exit_state;
 }
@@ -23,21 +23,73 @@
 #ifndef __DRUMFISH_H__
 #define __DRUMFISH_H__
 
+#include <stdint.h>
+
 enum df_peripherals {
     DF_PERIPHERAL_UART0,
     DF_PERIPHERAL_UART1,
+    DF_PERIPHERAL_RADIO,
 
     DF_PERIPHERAL_MAX /**< must always be the last value */
 };
 
+/* When flash the AVR programmed is written back to pflash */
+enum df_flash_sync {
+    DF_FLASH_SYNC_EXIT,
+    DF_FLASH_SYNC_PERIODIC,
+    DF_FLASH_SYNC_PAGE,
+};
+
+/* How bytes from a UART's pty are paced into the AVR */
+enum df_uart_timing {
+    DF_UART_TIMING_TURBO,       /**< as fast as the AVR takes them */
+    DF_UART_TIMING_ACCURATE,    /**< one per frame at the AVR's baud rate */
+};
+
+/* What log messages are stamped with */
+enum df_log_clock {
+    DF_LOG_CLOCK_HOST,      /**< monotonic host time since boot */
+    DF_LOG_CLOCK_SIM,       /**< that, plus the board's cycle and time */
+};
+
+struct df_batch;
+
 struct drumfish_cfg {
     char *mac;
     char *pflash;
+    char *pflash_base;      /**< read only image 'pflash' overlays */
     int foreground;
     int verbose;
+    enum df_log_clock log_clock;
     short gdb;
     int erase_pflash;
+    int pflash_private;     /**< flash in memory only, never written back */
+    enum df_flash_sync flash_sync;
+    unsigned int flash_sync_ms; /**< interval for DF_FLASH_SYNC_PERIODIC */
+    int flash_journal;      /**< journal flash write back */
     char *peripherals[DF_PERIPHERAL_MAX];
+    enum df_uart_timing uart_timing[2]; /**< UART0 and UART1 */
+    unsigned int boards;    /**< number of boards hosted by this process */
+    unsigned int threads;   /**< worker threads stepping those boards */
+    int lockstep;           /**< keep the boards within a lookahead */
+    double speed;           /**< multiple of real time, 0 for flat out */
+    char *save_snapshot;    /**< where to save the board when we stop */
+    char *restore_snapshot; /**< snapshot to start the board from */
+    unsigned int clones;    /**< fork() this many copies of the board */
+    char *profile;          /**< where to write the firmware's profile */
+    char *coverage;         /**< where to write the firmware's coverage */
+    char *stats;            /**< where to write run statistics */
+    int decode_cache;       /**< run from pre-decoded flash where it can */
+    char *uart_record;      /**< where to record the UARTs' bytes */
+    char *uart_replay;      /**< recording to feed the UARTs from */
+    char *uart_trace;       /**< where to trace the UARTs' bytes as text */
+    int deterministic;      /**< run the same every time */
+    char *input;            /**< cycle scheduled input, deterministic */
+    struct df_batch *batch; /**< a board per test, from --batch */
+    char *results;          /**< where to write how the tests went */
+    int fuzz;               /**< UART fuzzed input goes to, -1 for none */
+    uint64_t fuzz_boot;     /**< cycles to run before the snapshot */
+    uint64_t fuzz_cycles;   /**< budget for each input */
 };
 
 #endif /* __DRUMFISH_H__ */
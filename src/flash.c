@@ -19,6 +19,8 @@
  *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -30,13 +32,114 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sim_hex.h>
 
 #include "drumfish.h"
+#include "df_elf.h"
+#include "df_log.h"
 #include "flash.h"
 
+/*
+ * With a base image, flash is the base mapped privately, so any number of
+ * boards share its pages until they write to them, and the board's own
+ * storage file is just an overlay of the pages that differ from it. The
+ * overlay is a header followed by records of a page number and the page,
+ * at the AVR's SPM page size. It's only rewritten when its digest changes.
+ */
+#define FLASH_PAGE_SIZE     256
+#define FLASH_OVERLAY_MAGIC 0x44464f56      /* "DFOV" */
+
+struct flash_overlay_hdr {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t len;           /**< size of flash it applies to */
+    uint32_t pages;         /**< records that follow */
+};
+
+struct flash_overlay_page {
+    uint32_t page;
+    uint8_t data[FLASH_PAGE_SIZE];
+};
+
+/*
+ * Otherwise pflash is mapped privately as well, with a second read only
+ * shared mapping of it showing what's on disk. Pages the AVR programmed
+ * are the ones that differ between the two, and they're only written back
+ * when the sync policy says so rather than whenever the kernel likes.
+ *
+ * With a journal, dirty pages are first written to 'pflash.journal',
+ * using the overlay's page records, and only once that's on disk are
+ * they written to pflash. A journal that's whole when we start is
+ * replayed, one that isn't is thrown away, leaving pflash as it was.
+ */
+#define FLASH_JOURNAL_MAGIC 0x44464a4e      /* "DFJN" */
+
+struct flash_journal_end {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t hash;          /**< of everything before us */
+};
+
+static uint64_t
+flash_hash(uint64_t hash, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+#define FLASH_HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+ * Writing to a page of a private mapping gives us our own copy of it, and
+ * pages that differ from pflash get written back. So firmware that's
+ * already there is compared rather than copied, page by page, leaving
+ * pages it doesn't change alone.
+ */
+void
+flash_copy(uint8_t *flash, size_t addr, const uint8_t *src, size_t n)
+{
+    size_t chunk;
+
+    while (n) {
+        chunk = FLASH_PAGE_SIZE - addr % FLASH_PAGE_SIZE;
+        if (chunk > n)
+            chunk = n;
+
+        if (memcmp(flash + addr, src, chunk))
+            memcpy(flash + addr, src, chunk);
+
+        addr += chunk;
+        src += chunk;
+        n -= chunk;
+    }
+}
+
+/* Erase flash to 0xFF, skipping pages that already are */
+void
+flash_erase(uint8_t *flash, size_t len)
+{
+    static const uint8_t erased[FLASH_PAGE_SIZE] = {
+        [0 ... FLASH_PAGE_SIZE - 1] = 0xFF
+    };
+    size_t addr;
+    size_t chunk;
+
+    for (addr = 0; addr < len; addr += chunk) {
+        chunk = len - addr < FLASH_PAGE_SIZE ? len - addr : FLASH_PAGE_SIZE;
+        flash_copy(flash, addr, erased, chunk);
+    }
+}
+
 static int
 flash_create_dir(const char *path)
 {
@@ -72,13 +175,429 @@ try_again:
     return 0;
 }
 
-uint8_t *
-flash_open_or_create(const struct drumfish_cfg *config, off_t len)
+/* Apply the overlay in 'file', if there is one, on top of the base */
+static int
+flash_overlay_load(const char *file, uint8_t *buf, off_t len, uint64_t *hash)
+{
+    struct flash_overlay_hdr hdr;
+    struct flash_overlay_page rec;
+    uint32_t i;
+    FILE *f;
+    int ret = -1;
+
+    /* Nothing ever matches a missing overlay, so one gets written */
+    *hash = 0;
+
+    f = fopen(file, "rb");
+    if (!f) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Unable to open flash overlay '%s': %s\n",
+                file, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            hdr.magic != FLASH_OVERLAY_MAGIC ||
+            hdr.page_size != FLASH_PAGE_SIZE || hdr.len != len) {
+        fprintf(stderr, "'%s' isn't a flash overlay for this board.\n",
+                file);
+        goto cleanup;
+    }
+
+    *hash = FLASH_HASH_INIT;
+    for (i = 0; i < hdr.pages; i++) {
+        if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+                (off_t)(rec.page + 1) * FLASH_PAGE_SIZE > len) {
+            fprintf(stderr, "Flash overlay '%s' is corrupt.\n", file);
+            goto cleanup;
+        }
+        memcpy(buf + rec.page * FLASH_PAGE_SIZE, rec.data, FLASH_PAGE_SIZE);
+        *hash = flash_hash(*hash, &rec, sizeof(rec));
+    }
+
+    ret = 0;
+
+cleanup:
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Find the pages of flash that differ from 'clean', the base or pflash as
+ * it's on disk, and a digest of them laid out as overlay records.
+ */
+static uint32_t
+flash_dirty(const struct flash *fl, uint32_t *pages, uint64_t *hash)
+{
+    uint32_t n = 0;
+    uint32_t i;
+    size_t off;
+
+    *hash = FLASH_HASH_INIT;
+    for (i = 0; i < fl->len / FLASH_PAGE_SIZE; i++) {
+        off = (size_t)i * FLASH_PAGE_SIZE;
+        if (!memcmp(fl->buf + off, fl->clean + off, FLASH_PAGE_SIZE))
+            continue;
+
+        pages[n++] = i;
+        *hash = flash_hash(*hash, &i, sizeof(i));
+        *hash = flash_hash(*hash, fl->buf + off, FLASH_PAGE_SIZE);
+    }
+
+    return n;
+}
+
+/*
+ * Write the pages that differ from the base out to the overlay. It's
+ * written aside and renamed into place so it's always whole.
+ */
+static int
+flash_overlay_save(const struct flash *fl, const uint32_t *pages,
+        uint32_t n)
+{
+    const char *file = fl->config->pflash;
+    struct flash_overlay_hdr hdr;
+    struct flash_overlay_page rec;
+    char *tmp = NULL;
+    FILE *f = NULL;
+    uint32_t i;
+    int ret = -1;
+
+    if (asprintf(&tmp, "%s.tmp", file) < 0) {
+        fprintf(stderr, "Failed to allocate memory for flash overlay.\n");
+        return -1;
+    }
+
+try_again:
+    f = fopen(tmp, "wb");
+    if (!f) {
+        if (errno == ENOENT && !flash_create_dir(tmp))
+            goto try_again;
+        fprintf(stderr, "Unable to create flash overlay '%s': %s\n",
+                tmp, strerror(errno));
+        goto cleanup;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FLASH_OVERLAY_MAGIC;
+    hdr.page_size = FLASH_PAGE_SIZE;
+    hdr.len = fl->len;
+    hdr.pages = n;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        goto write_err;
+
+    for (i = 0; i < n; i++) {
+        rec.page = pages[i];
+        memcpy(rec.data, fl->buf + pages[i] * FLASH_PAGE_SIZE,
+                sizeof(rec.data));
+        if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+            goto write_err;
+    }
+
+    if (fflush(f) || fsync(fileno(f)))
+        goto write_err;
+
+    if (fclose(f)) {
+        f = NULL;
+        goto write_err;
+    }
+    f = NULL;
+
+    if (rename(tmp, file)) {
+        fprintf(stderr, "Unable to replace flash overlay '%s': %s\n",
+                file, strerror(errno));
+        goto cleanup;
+    }
+
+    ret = 0;
+    goto cleanup;
+
+write_err:
+    fprintf(stderr, "Failed to write flash overlay '%s': %s\n",
+            tmp, strerror(errno));
+
+cleanup:
+    if (f)
+        fclose(f);
+    if (ret)
+        unlink(tmp);
+    free(tmp);
+
+    return ret;
+}
+
+static struct flash *
+flash_open_base(const struct drumfish_cfg *config, off_t len)
+{
+    int fd;
+    struct stat st;
+    struct flash *fl;
+
+    fd = open(config->pflash_base, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open flash base '%s': %s\n",
+                config->pflash_base, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Unable to get file info for '%s': %s\n",
+                config->pflash_base, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* Past the end of the file a private mapping would fault */
+    if (st.st_size < len) {
+        fprintf(stderr, "The flash base '%s' is smaller than the %zu "
+                "bytes of flash.\n", config->pflash_base, (size_t)len);
+        close(fd);
+        return NULL;
+    }
+
+    fl = calloc(1, sizeof(*fl));
+    if (!fl) {
+        fprintf(stderr, "Failed to allocate memory for flash.\n");
+        close(fd);
+        return NULL;
+    }
+    fl->len = len;
+    fl->fd = -1;
+    fl->config = config;
+
+    /* Writable, but our writes stay ours */
+    fl->buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    fl->clean = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (fl->buf == MAP_FAILED || fl->clean == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", config->pflash_base,
+                strerror(errno));
+        goto err;
+    }
+
+    if (config->erase_pflash)
+        flash_erase(fl->buf, len);
+    else if (flash_overlay_load(config->pflash, fl->buf, len,
+                &fl->overlay_hash))
+        goto err;
+
+    return fl;
+
+err:
+    if (fl->buf != MAP_FAILED)
+        munmap(fl->buf, len);
+    if (fl->clean != MAP_FAILED)
+        munmap(fl->clean, len);
+    free(fl);
+
+    return NULL;
+}
+
+static char *
+flash_journal_path(const char *file)
+{
+    char *path;
+
+    if (asprintf(&path, "%s.journal", file) < 0) {
+        fprintf(stderr, "Failed to allocate memory for flash journal.\n");
+        return NULL;
+    }
+
+    return path;
+}
+
+/* Finish the write back a previous run was in the middle of, if any */
+static int
+flash_journal_replay(const char *file, int fd, off_t len)
+{
+    struct flash_overlay_hdr hdr;
+    struct flash_overlay_page *rec = NULL;
+    struct flash_journal_end end;
+    uint64_t hash;
+    char *path;
+    FILE *f;
+    uint32_t i;
+    int ret = -1;
+
+    path = flash_journal_path(file);
+    if (!path)
+        return -1;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        ret = errno == ENOENT ? 0 : -1;
+        if (ret)
+            fprintf(stderr, "Unable to open flash journal '%s': %s\n",
+                    path, strerror(errno));
+        free(path);
+        return ret;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            hdr.magic != FLASH_JOURNAL_MAGIC ||
+            hdr.page_size != FLASH_PAGE_SIZE || hdr.len != len ||
+            hdr.pages > len / FLASH_PAGE_SIZE)
+        goto torn;
+
+    rec = calloc(hdr.pages ? hdr.pages : 1, sizeof(*rec));
+    if (!rec) {
+        fprintf(stderr, "Failed to allocate memory for flash journal.\n");
+        goto cleanup;
+    }
+
+    if ((hdr.pages && fread(rec, sizeof(*rec), hdr.pages, f) != hdr.pages) ||
+            fread(&end, sizeof(end), 1, f) != 1)
+        goto torn;
+
+    hash = flash_hash(FLASH_HASH_INIT, &hdr, sizeof(hdr));
+    hash = flash_hash(hash, rec, hdr.pages * sizeof(*rec));
+    if (end.magic != FLASH_JOURNAL_MAGIC || end.hash != hash)
+        goto torn;
+
+    for (i = 0; i < hdr.pages; i++) {
+        if ((off_t)(rec[i].page + 1) * FLASH_PAGE_SIZE > len)
+            goto torn;
+        if (pwrite(fd, rec[i].data, FLASH_PAGE_SIZE,
+                    (off_t)rec[i].page * FLASH_PAGE_SIZE) != FLASH_PAGE_SIZE) {
+            fprintf(stderr, "Unable to replay flash journal into '%s': "
+                    "%s\n", file, strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    if (fdatasync(fd)) {
+        fprintf(stderr, "Unable to replay flash journal into '%s': %s\n",
+                file, strerror(errno));
+        goto cleanup;
+    }
+
+    printf("Replayed %u page(s) from flash journal '%s'\n", hdr.pages, path);
+    unlink(path);
+    ret = 0;
+    goto cleanup;
+
+torn:
+    /* It never made it to disk whole, so pflash was never touched */
+    printf("Discarding incomplete flash journal '%s'\n", path);
+    unlink(path);
+    ret = 0;
+
+cleanup:
+    fclose(f);
+    free(rec);
+    free(path);
+
+    return ret;
+}
+
+static int
+flash_journal_write(struct flash *fl, const uint32_t *pages, uint32_t n)
+{
+    struct flash_overlay_hdr hdr;
+    struct flash_overlay_page rec;
+    struct flash_journal_end end;
+    uint64_t hash;
+    char *path;
+    uint32_t i;
+    FILE *f;
+    int ret = -1;
+
+    path = flash_journal_path(fl->config->pflash);
+    if (!path)
+        return -1;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Unable to create flash journal '%s': %s\n",
+                path, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FLASH_JOURNAL_MAGIC;
+    hdr.page_size = FLASH_PAGE_SIZE;
+    hdr.len = fl->len;
+    hdr.pages = n;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        goto cleanup;
+    hash = flash_hash(FLASH_HASH_INIT, &hdr, sizeof(hdr));
+
+    for (i = 0; i < n; i++) {
+        rec.page = pages[i];
+        memcpy(rec.data, fl->buf + pages[i] * FLASH_PAGE_SIZE,
+                sizeof(rec.data));
+        if (fwrite(&rec, sizeof(rec), 1, f) != 1)
+            goto cleanup;
+        hash = flash_hash(hash, &rec, sizeof(rec));
+    }
+
+    memset(&end, 0, sizeof(end));
+    end.magic = FLASH_JOURNAL_MAGIC;
+    end.hash = hash;
+    if (fwrite(&end, sizeof(end), 1, f) != 1 || fflush(f) ||
+            fsync(fileno(f)))
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (fclose(f))
+        ret = -1;
+    if (ret)
+        fprintf(stderr, "Failed to write flash journal '%s': %s\n",
+                path, strerror(errno));
+    free(path);
+
+    return ret;
+}
+
+/* Write the pages the AVR changed back to pflash */
+static int
+flash_writeback(struct flash *fl, const uint32_t *pages, uint32_t n)
+{
+    uint32_t i;
+    size_t off;
+    char *path;
+
+    if (fl->config->flash_journal && flash_journal_write(fl, pages, n))
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        off = (size_t)pages[i] * FLASH_PAGE_SIZE;
+        if (pwrite(fl->fd, fl->buf + off, FLASH_PAGE_SIZE, off) !=
+                FLASH_PAGE_SIZE)
+            goto write_err;
+    }
+
+    if (fdatasync(fl->fd))
+        goto write_err;
+
+    if (fl->config->flash_journal) {
+        path = flash_journal_path(fl->config->pflash);
+        if (path)
+            unlink(path);
+        free(path);
+    }
+
+    return 0;
+
+write_err:
+    fprintf(stderr, "Failed to write flash back to '%s': %s\n",
+            fl->config->pflash, strerror(errno));
+    return -1;
+}
+
+static struct flash *
+flash_open_file(const struct drumfish_cfg *config, off_t len)
 {
     int fd = -1;
     struct stat st;
     int ret;
     int must_ff = config->erase_pflash;
+    struct flash *fl = NULL;
+    uint8_t *clean = MAP_FAILED;
     uint8_t *buf;
     const char *file = config->pflash;
 
@@ -126,31 +645,92 @@ try_again:
                 "when it should pizza.\n", file, len);
     }
 
-    buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
+    if (flash_journal_replay(file, fd, len))
+        goto err;
+
+    clean = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (clean == MAP_FAILED) {
         fprintf(stderr, "Failed to map '%s': %s\n", file, strerror(errno));
         goto err;
     }
 
-    /* Once the file is mapped we can drop the fd */
-    close(fd);
-    fd = -1;
+    buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", file, strerror(errno));
+        goto err;
+    }
 
-    /* Now we set the 0xFF if needed */
+    /* Now we set the 0xFF if needed, it's written back on the next sync */
     if (must_ff)
-        memset(buf, 0xFF, len);
+        flash_erase(buf, len);
 
-    return buf;
+    fl = calloc(1, sizeof(*fl));
+    if (!fl) {
+        fprintf(stderr, "Failed to allocate memory for flash.\n");
+        munmap(buf, len);
+        goto err;
+    }
+
+    fl->buf = buf;
+    fl->clean = clean;
+    fl->len = len;
+    fl->fd = fd;
+    fl->config = config;
+
+    return fl;
 
 err:
+    if (clean != MAP_FAILED)
+        munmap(clean, len);
     if (fd != -1)
         close(fd);
 
     return NULL;
 }
 
-int
-flash_load(const char *file, uint8_t *start, size_t len)
+/* Erased flash of our own, gone when we are */
+static struct flash *
+flash_open_private(const struct drumfish_cfg *config, off_t len)
+{
+    struct flash *fl;
+
+    fl = calloc(1, sizeof(*fl));
+    if (!fl) {
+        fprintf(stderr, "Failed to allocate memory for flash.\n");
+        return NULL;
+    }
+
+    fl->buf = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+            -1, 0);
+    if (fl->buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %zu bytes of flash: %s\n",
+                (size_t)len, strerror(errno));
+        free(fl);
+        return NULL;
+    }
+    memset(fl->buf, 0xFF, len);
+
+    fl->len = len;
+    fl->fd = -1;
+    fl->config = config;
+
+    return fl;
+}
+
+struct flash *
+flash_open_or_create(const struct drumfish_cfg *config, off_t len)
+{
+    if (config->pflash_private)
+        return flash_open_private(config, len);
+
+    if (config->pflash_base)
+        return flash_open_base(config, len);
+
+    return flash_open_file(config, len);
+}
+
+static int
+flash_load_ihex(const char *file, uint8_t *start, size_t len)
 {
     int items;
     ihex_chunk_p chunks;
@@ -166,7 +746,8 @@ flash_load(const char *file, uint8_t *start, size_t len)
                     len, chunks[i].baseaddr, chunks[i].size);
             goto cleanup;
         }
-        memcpy(start + chunks[i].baseaddr, chunks[i].data, chunks[i].size);
+        flash_copy(start, chunks[i].baseaddr, chunks[i].data,
+                chunks[i].size);
         printf("Loading '%s' into flash at %04x, size %d\n",
                 file, chunks[i].baseaddr, chunks[i].size);
 
@@ -183,18 +764,187 @@ cleanup:
     return retval;
 }
 
+/* A raw image is flash from address 0, straight out of the file */
+static int
+flash_load_raw(const char *file, const uint8_t *img, size_t img_len,
+        uint8_t *start, size_t len)
+{
+    if (img_len > len) {
+        fprintf(stderr, "Firmware file would exceed max size of flash. "
+                "Max size: %zu. Firmware baseaddr: 0000, size: %zu\n",
+                len, img_len);
+        return -1;
+    }
+
+    flash_copy(start, 0, img, img_len);
+    printf("Loading '%s' into flash at 0000, size %zu\n", file, img_len);
+
+    return 0;
+}
+
+static int
+flash_is_raw(const char *file)
+{
+    const char *ext = strrchr(file, '.');
+
+    return ext && !strcasecmp(ext, ".bin");
+}
 
+/*
+ * Load Intel HEX, an AVR ELF or, going by a '.bin' extension, a raw image
+ * into flash. ELF and raw images are copied from a mapping of the file.
+ */
 int
-flash_close(uint8_t *flash, size_t len)
+flash_load(const char *file, uint8_t *start, size_t len)
 {
-    if (!flash)
+    struct stat st;
+    uint8_t *img;
+    int fd;
+    int ret;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st)) {
+        fprintf(stderr, "Unable to get file info for '%s': %s\n",
+                file, strerror(errno));
+        close(fd);
         return -1;
+    }
 
-    if (munmap(flash, len)) {
-        fprintf(stderr, "Unable to cleanly close flash memory.\n");
+    if (!st.st_size) {
+        close(fd);
+        fprintf(stderr, "Firmware file '%s' is empty.\n", file);
         return -1;
     }
 
+    img = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s': %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (df_elf_is_elf(img, st.st_size))
+        ret = df_elf_load(file, img, st.st_size, start, len);
+    else if (flash_is_raw(file))
+        ret = flash_load_raw(file, img, st.st_size, start, len);
+    else
+        ret = flash_load_ihex(file, start, len);
+
+    munmap(img, st.st_size);
+
+    return ret;
+}
+
+static uint64_t
+flash_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+flash_sync(struct flash *fl)
+{
+    uint32_t *pages;
+    uint32_t n;
+    uint64_t hash;
+    int ret = 0;
+
+    fl->programmed = 0;
+    fl->last_sync_ms = flash_now_ms();
+
+    /* There's nowhere to write it */
+    if (fl->config->pflash_private)
+        return 0;
+
+    pages = malloc(fl->len / FLASH_PAGE_SIZE * sizeof(*pages));
+    if (!pages) {
+        fprintf(stderr, "Failed to allocate memory for flash sync.\n");
+        return -1;
+    }
+
+    /* A private mapping is only kept by what we write out */
+    n = flash_dirty(fl, pages, &hash);
+    if (fl->config->pflash_base) {
+        /* Unless the overlay pflash already holds is just as good */
+        if (hash == fl->overlay_hash)
+            goto cleanup;
+        ret = flash_overlay_save(fl, pages, n);
+        if (!ret)
+            fl->overlay_hash = hash;
+    } else if (n) {
+        ret = flash_writeback(fl, pages, n);
+    } else {
+        goto cleanup;
+    }
+
+    if (!ret)
+        df_log_msg(DF_LOG_DEBUG, "Wrote %u changed flash page(s) to '%s'\n",
+                n, fl->config->pflash);
+
+cleanup:
+    free(pages);
+
+    return ret;
+}
+
+/* The AVR programmed a page, which may call for a sync */
+void
+flash_programmed(struct flash *fl)
+{
+    fl->programmed = 1;
+}
+
+/* Called regularly by whoever runs the AVR, syncs as the policy says */
+int
+flash_tick(struct flash *fl)
+{
+    if (!fl->programmed)
+        return 0;
+
+    switch (fl->config->flash_sync) {
+        case DF_FLASH_SYNC_PAGE:
+            return flash_sync(fl);
+
+        case DF_FLASH_SYNC_PERIODIC:
+            if (flash_now_ms() - fl->last_sync_ms >=
+                    fl->config->flash_sync_ms)
+                return flash_sync(fl);
+            break;
+
+        case DF_FLASH_SYNC_EXIT:
+            break;
+    }
+
     return 0;
 }
 
+int
+flash_close(struct flash *fl)
+{
+    int ret;
+
+    if (!fl)
+        return -1;
+
+    ret = flash_sync(fl);
+
+    if (munmap(fl->buf, fl->len) ||
+            (fl->clean && munmap(fl->clean, fl->len))) {
+        fprintf(stderr, "Unable to cleanly close flash memory.\n");
+        ret = -1;
+    }
+
+    if (fl->fd != -1)
+        close(fl->fd);
+    free(fl);
+
+    return ret;
+}
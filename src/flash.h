@@ -22,12 +22,40 @@
 #ifndef __FLASH_H__
 #define __FLASH_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 struct drumfish_cfg;
 
-uint8_t * flash_open_or_create(const struct drumfish_cfg *config, off_t len);
+struct flash {
+    uint8_t *buf;               /**< what the AVR sees */
+    uint8_t *clean;             /**< base or pflash on disk, if any */
+    size_t len;
+    int fd;
+    const struct drumfish_cfg *config;
+    int programmed;             /**< pages written since the last sync */
+    uint64_t last_sync_ms;
+    uint64_t overlay_hash;      /**< of the overlay pflash holds */
+};
+
+struct flash * flash_open_or_create(const struct drumfish_cfg *config,
+        off_t len);
 
 int flash_load(const char *file, uint8_t *start, size_t len);
 
-int flash_close(uint8_t *flash, size_t len);
+/* Update flash, only touching the pages that change */
+void flash_copy(uint8_t *flash, size_t addr, const uint8_t *src, size_t n);
+
+void flash_erase(uint8_t *flash, size_t len);
+
+/* Write what the AVR programmed back to pflash */
+int flash_sync(struct flash *fl);
+
+void flash_programmed(struct flash *fl);
+
+int flash_tick(struct flash *fl);
+
+int flash_close(struct flash *fl);
 
 #endif /* __FLASH_H__ */
@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,59 +30,228 @@
 
 #include <sim_avr.h>
 #include "uart_pty.h"
+#include "trx24.h"
 
 #include "drumfish.h"
+#include "df_board.h"
 #include "flash.h"
+#include "df_clock.h"
 #include "df_cores.h"
+#include "df_decode.h"
+#include "df_input.h"
+#include "df_log.h"
+#include "df_snapshot.h"
+#include "df_uart_log.h"
 
 #define PC_START 0x1f800
 
-uart_pty_t uart_pty[2];
+/* Where each USART's registers start */
+#define UCSR0A      0xc0
+#define UCSR1A      0xc8
+
+/* Self programming, simavr's flash module does the work */
+#define SPMCSR      0x57
+#define SPMEN       (1 << 0)
+#define PGERS       (1 << 1)
+#define PGWRT       (1 << 2)
+/* The SPM has to follow its SPMCSR write within this many cycles */
+#define SPM_WINDOW  4
+
+/* Per board state, hung off of avr->special_data */
+struct m128rfa1 {
+    struct drumfish_cfg *config;
+    struct flash *flash;
+    struct df_clock clock;
+    uart_pty_t uart_pty[2];
+    trx24_t *trx24;     /**< owned by the core, not us */
+    struct df_uart_log *record; /**< both UARTs' bytes, as they go */
+    struct df_uart_log *replay; /**< stands in for both UARTs' host side */
+    struct df_uart_log *trace;  /**< both UARTs' bytes, as text */
+    struct df_input *input;     /**< what the UARTs get when deterministic */
+    struct df_decode *decode;   /**< flash pre-decoded, or NULL */
+    uint32_t spm_addr;          /**< RAMPZ:Z of the SPM under way */
+};
+
+/*
+ * The MAC from the config, or failing that one made up from the flash
+ * storage path so it's stable across runs and unique per board.
+ */
+static uint64_t
+m128rfa1_mac(const struct drumfish_cfg *config)
+{
+    uint64_t mac = 0xcbf29ce484222325ULL;
+    const char *p;
+    int octets;
+
+    if (config->mac && !df_mac_parse(config->mac, &mac, &octets))
+        return mac;
+
+    /* FNV-1a */
+    for (p = config->pflash; *p; p++) {
+        mac ^= (uint8_t)*p;
+        mac *= 0x100000001b3ULL;
+    }
+
+    return mac;
+}
+
+static avr_cycle_count_t
+m128rfa1_spm_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct m128rfa1 *board = param;
+
+    (void)avr;
+    (void)when;
+
+    flash_programmed(board->flash);
+    if (board->decode)
+        df_decode_invalidate(board->decode, board->spm_addr);
+    return 0;
+}
+
+/* Note page erases and writes, once the SPM has had its chance to run */
+static void
+m128rfa1_spmcsr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    struct m128rfa1 *board = param;
+
+    (void)addr;
+
+    if ((v & SPMEN) && (v & (PGERS | PGWRT))) {
+        board->spm_addr = (avr->data[avr->rampz] << 16) | avr->data[30] |
+            (avr->data[31] << 8);
+        avr_cycle_timer_register(avr, SPM_WINDOW + 1, m128rfa1_spm_done,
+                param);
+    }
+}
+
+/* The replay has caught up with where the recording stopped */
+static avr_cycle_count_t
+m128rfa1_replay_end(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    (void)when;
+    (void)param;
+
+    avr->state = cpu_Done;
+    return 0;
+}
+
+/* Point both UARTs at the board's logs, whether they're up or not */
+static void
+m128rfa1_uart_log(struct m128rfa1 *board)
+{
+    uart_pty_log(&board->uart_pty[0], board->record, board->replay,
+            board->trace);
+    uart_pty_log(&board->uart_pty[1], board->record, board->replay,
+            board->trace);
+}
+
+/* Apply the input due by now, then wait for the next */
+static avr_cycle_count_t
+m128rfa1_input(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct m128rfa1 *board = param;
+    const struct df_input_event *ev;
+    uart_pty_t *p;
+
+    (void)when;
+
+    while ((ev = df_input_next(board->input, avr->cycle))) {
+        p = &board->uart_pty[ev->target - DF_INPUT_UART0];
+        if (p->uart == '\0')
+            df_log_msg(DF_LOG_WARN, "Input for UART%d, which is off, at "
+                    "cycle %" PRIu64 "\n", ev->target - DF_INPUT_UART0,
+                    ev->cycle);
+        else
+            uart_pty_inject(p, ev->data, ev->len);
+    }
+
+    if (board->input->next == board->input->count)
+        return 0;
+
+    return board->input->ev[board->input->next].cycle;
+}
 
 static void
 m128rfa1_init(avr_t *avr, void *data)
 {
-    struct drumfish_cfg *config = (struct drumfish_cfg *)data;
+    struct m128rfa1 *board = data;
+    struct drumfish_cfg *config = board->config;
 
     if (avr->flash)
         free(avr->flash);
+    avr->flash = NULL;
 
-    avr->flash = flash_open_or_create(config, avr->flashend + 1);
+    board->flash = flash_open_or_create(config, avr->flashend + 1);
+    if (board->flash)
+        avr->flash = board->flash->buf;
 }
 
 static void
 m128rfa1_deinit(avr_t *avr, void *data)
 {
-    struct drumfish_cfg *config = (struct drumfish_cfg *)data;
+    struct m128rfa1 *board = data;
+    struct drumfish_cfg *config = board->config;
 
-    uart_pty_stop(&uart_pty[0], config->peripherals[DF_PERIPHERAL_UART0]);
-    uart_pty_stop(&uart_pty[1], config->peripherals[DF_PERIPHERAL_UART1]);
+    uart_pty_stop(&board->uart_pty[0],
+            config->peripherals[DF_PERIPHERAL_UART0]);
+    uart_pty_stop(&board->uart_pty[1],
+            config->peripherals[DF_PERIPHERAL_UART1]);
 
-    flash_close(avr->flash, avr->flashend + 1);
+    uart_pty_replay_report(&board->uart_pty[0]);
+    uart_pty_replay_report(&board->uart_pty[1]);
+    if (df_uart_log_close(board->record, avr->cycle))
+        fprintf(stderr, "Failed to save the UART recording '%s'.\n",
+                config->uart_record);
+    df_uart_log_close(board->replay, 0);
+    if (df_uart_log_close(board->trace, avr->cycle))
+        fprintf(stderr, "Failed to save the UART trace '%s'.\n",
+                config->uart_trace);
+    df_input_free(board->input);
+    df_decode_free(board->decode);
+
+    flash_close(board->flash);
+    board->flash = NULL;
     avr->flash = NULL;
+
+    free(board);
+    avr->special_data = NULL;
 }
 
 avr_t *
 m128rfa1_create(struct drumfish_cfg *config)
 {
     avr_t *avr;
+    struct m128rfa1 *board;
+    uint64_t mac;
+    int octets;
+
+    board = calloc(1, sizeof(*board));
+    if (!board) {
+        fprintf(stderr, "Failed to allocate memory for board.\n");
+        return NULL;
+    }
+    board->config = config;
 
     avr = avr_make_mcu_by_name("atmega128rfa1");
     if (!avr) {
         fprintf(stderr, "Failed to create AVR core 'atmega128rfa1'\n");
+        free(board);
         return NULL;
     }
 
     /* Setup any additional init/deinit routines */
     avr->special_init = m128rfa1_init;
     avr->special_deinit = m128rfa1_deinit;
-    avr->special_data = config;
+    avr->special_data = board;
 
     /* Initialize our AVR */
     avr_init(avr);
 
     /* Our chips always run at 16mhz */
     avr->frequency = 16000000;
+    board->clock.frequency = avr->frequency;
 
     /* Set our fuses */
     avr->fuse[0] = 0xE6; // low
@@ -101,26 +271,253 @@ m128rfa1_create(struct drumfish_cfg *config)
     avr->pc = PC_START;
     avr->codeend = avr->flashend;
 
+    avr_register_io_write(avr, SPMCSR, m128rfa1_spmcsr_write, board);
+
+    /* Unless something has to see every instruction go by */
+    if (config->decode_cache && !config->gdb && !config->profile &&
+            !config->coverage && config->fuzz < 0) {
+        board->decode = df_decode_create(avr);
+        if (!board->decode)
+            return NULL;
+    }
+
+    /* What goes through the UARTs, written down or played back */
+    if (config->uart_record &&
+            !(board->record = df_uart_log_record(config->uart_record)))
+        return NULL;
+    if (config->uart_replay) {
+        board->replay = df_uart_log_replay(config->uart_replay);
+        if (!board->replay)
+            return NULL;
+        avr_cycle_timer_register(avr, board->replay->end,
+                m128rfa1_replay_end, board);
+    }
+    if (config->uart_trace &&
+            !(board->trace = df_uart_log_trace(config->uart_trace)))
+        return NULL;
+
     /* Setup our UARTs, if enabled */
     if (strcmp(config->peripherals[DF_PERIPHERAL_UART0], "off")) {
-        memset(&uart_pty[0], 0, sizeof(uart_pty[0]));
-        if (uart_pty_init(avr, &uart_pty[0], '0')) {
+        if (uart_pty_init(avr, &board->uart_pty[0], '0',
+                    &board->clock)) {
+            fprintf(stderr, "Unable to start UART0.\n");
+            return NULL;
+        }
+        uart_pty_timing(&board->uart_pty[0], config->uart_timing[0], UCSR0A);
+        uart_pty_log(&board->uart_pty[0], board->record, board->replay,
+                board->trace);
+        if (config->deterministic)
+            uart_pty_deterministic(&board->uart_pty[0]);
+        if (uart_pty_connect(&board->uart_pty[0],
+                    config->peripherals[DF_PERIPHERAL_UART0])) {
             fprintf(stderr, "Unable to start UART0.\n");
             return NULL;
         }
-        uart_pty_connect(&uart_pty[0],
-                config->peripherals[DF_PERIPHERAL_UART0]);
     }
 
     if (strcmp(config->peripherals[DF_PERIPHERAL_UART1], "off")) {
-        memset(&uart_pty[1], 0, sizeof(uart_pty[1]));
-        if (uart_pty_init(avr, &uart_pty[1], '1')) {
+        if (uart_pty_init(avr, &board->uart_pty[1], '1',
+                    &board->clock)) {
+            fprintf(stderr, "Unable to start UART1.\n");
+            return NULL;
+        }
+        uart_pty_timing(&board->uart_pty[1], config->uart_timing[1], UCSR1A);
+        uart_pty_log(&board->uart_pty[1], board->record, board->replay,
+                board->trace);
+        if (config->deterministic)
+            uart_pty_deterministic(&board->uart_pty[1]);
+        if (uart_pty_connect(&board->uart_pty[1],
+                    config->peripherals[DF_PERIPHERAL_UART1])) {
             fprintf(stderr, "Unable to start UART1.\n");
             return NULL;
         }
-        uart_pty_connect(&uart_pty[1],
-                config->peripherals[DF_PERIPHERAL_UART1]);
+    }
+
+    /* Everything else from outside arrives at the cycles it's due */
+    if (config->input) {
+        board->input = df_input_load(config->input);
+        if (!board->input)
+            return NULL;
+        if (board->input->count)
+            avr_cycle_timer_register(avr, board->input->ev[0].cycle,
+                    m128rfa1_input, board);
+    }
+
+    /* And our radio */
+    if (strcmp(config->peripherals[DF_PERIPHERAL_RADIO], "off")) {
+        if (config->mac && df_mac_parse(config->mac, &mac, &octets)) {
+            fprintf(stderr, "Invalid MAC address '%s'\n", config->mac);
+            return NULL;
+        }
+
+        board->trx24 = trx24_create(avr,
+                config->peripherals[DF_PERIPHERAL_RADIO],
+                m128rfa1_mac(config));
+        if (!board->trx24)
+            fprintf(stderr, "Unable to start radio, continuing without.\n");
     }
 
     return avr;
 }
+
+/*
+ * Let go of the host resources behind the peripherals before the board
+ * is cloned with fork(), neither the threads nor the MAC carry over.
+ */
+void
+m128rfa1_unplug(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+    struct drumfish_cfg *config = board->config;
+
+    uart_pty_stop(&board->uart_pty[0],
+            config->peripherals[DF_PERIPHERAL_UART0]);
+    uart_pty_stop(&board->uart_pty[1],
+            config->peripherals[DF_PERIPHERAL_UART1]);
+
+    /* Each clone records from here on under its own name */
+    if (df_uart_log_close(board->record, avr->cycle))
+        fprintf(stderr, "Failed to save the UART recording '%s'.\n",
+                config->uart_record);
+    if (df_uart_log_close(board->trace, avr->cycle))
+        fprintf(stderr, "Failed to save the UART trace '%s'.\n",
+                config->uart_trace);
+    board->record = NULL;
+    board->trace = NULL;
+    m128rfa1_uart_log(board);
+
+    if (board->trx24)
+        trx24_unplug(board->trx24);
+}
+
+/* And get them back in a clone, which has been given its own config */
+int
+m128rfa1_replug(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+    struct drumfish_cfg *config = board->config;
+
+    if (config->uart_record) {
+        board->record = df_uart_log_record(config->uart_record);
+        if (!board->record)
+            return -1;
+    }
+    if (config->uart_trace) {
+        board->trace = df_uart_log_trace(config->uart_trace);
+        if (!board->trace)
+            return -1;
+    }
+    m128rfa1_uart_log(board);
+
+    if (uart_pty_reopen(&board->uart_pty[0],
+                config->peripherals[DF_PERIPHERAL_UART0]) ||
+            uart_pty_reopen(&board->uart_pty[1],
+                config->peripherals[DF_PERIPHERAL_UART1]))
+        return -1;
+
+    if (board->trx24 && trx24_replug(board->trx24,
+                config->peripherals[DF_PERIPHERAL_RADIO],
+                m128rfa1_mac(config)))
+        return -1;
+
+    return 0;
+}
+
+/* Our part of a snapshot, after the core's own state */
+int
+m128rfa1_save(avr_t *avr, FILE *f)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    if (uart_pty_save(&board->uart_pty[0], f) ||
+            uart_pty_save(&board->uart_pty[1], f))
+        return -1;
+
+    if (board->trx24 && trx24_save(board->trx24, f))
+        return -1;
+
+    return 0;
+}
+
+int
+m128rfa1_restore(avr_t *avr, FILE *f)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    if (uart_pty_restore(&board->uart_pty[0], f) ||
+            uart_pty_restore(&board->uart_pty[1], f))
+        return -1;
+
+    if (board->trx24 && trx24_restore(board->trx24, f))
+        return -1;
+
+    return 0;
+}
+
+/* Where the board is at, for threads that don't run it */
+struct df_clock *
+m128rfa1_clock(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    return &board->clock;
+}
+
+struct df_decode *
+m128rfa1_decode(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    return board->decode;
+}
+
+const uart_pty_t *
+m128rfa1_uart(avr_t *avr, int n)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    if (board->uart_pty[n].uart == '\0')
+        return NULL;
+
+    return &board->uart_pty[n];
+}
+
+int
+m128rfa1_uart_inject(avr_t *avr, int n, const uint8_t *buf, size_t len)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    if (board->uart_pty[n].uart == '\0')
+        return -1;
+
+    uart_pty_inject(&board->uart_pty[n], buf, len);
+    return 0;
+}
+
+/* Let the UARTs hand over bytes the AVR hasn't asked for */
+void
+m128rfa1_uart_tick(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    uart_pty_tick(&board->uart_pty[0]);
+    uart_pty_tick(&board->uart_pty[1]);
+}
+
+/* Write programmed flash back now, regardless of the sync policy */
+int
+m128rfa1_flash_sync(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    return flash_sync(board->flash);
+}
+
+/* Give the flash sync policy a look in, between slices of running */
+int
+m128rfa1_flash_tick(avr_t *avr)
+{
+    struct m128rfa1 *board = avr->special_data;
+
+    return flash_tick(board->flash);
+}
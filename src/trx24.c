@@ -0,0 +1,1194 @@
+/*
+ * trx24.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <sim_interrupts.h>
+#include <sim_cycle_timers.h>
+
+#include "trx24.h"
+#include "df_log.h"
+#include "df_medium.h"
+#include "df_snapshot.h"
+
+/* Register addresses (data space) */
+#define TRXPR           0x139
+#define TRX_STATUS      0x141
+#define TRX_STATE       0x142
+#define TRX_CTRL_0      0x143
+#define TRX_CTRL_1      0x144
+#define PHY_TX_PWR      0x145
+#define PHY_RSSI        0x146
+#define PHY_ED_LEVEL    0x147
+#define PHY_CC_CCA      0x148
+#define CCA_THRES       0x149
+#define IRQ_MASK        0x14E
+#define IRQ_STATUS      0x14F
+#define XAH_CTRL_1      0x157
+#define PART_NUM        0x15C
+#define VERSION_NUM     0x15D
+#define MAN_ID_0        0x15E
+#define MAN_ID_1        0x15F
+#define SHORT_ADDR_0    0x160
+#define SHORT_ADDR_1    0x161
+#define PAN_ID_0        0x162
+#define PAN_ID_1        0x163
+#define IEEE_ADDR_0     0x164
+#define XAH_CTRL_0      0x16C
+#define CSMA_SEED_0     0x16D
+#define CSMA_SEED_1     0x16E
+#define CSMA_BE         0x16F
+#define TST_RX_LENGTH   0x17B
+#define TRXFBST         0x180
+
+/* TRXPR */
+#define TRXRST          (1 << 0)
+#define SLPTR           (1 << 1)
+
+/* TRX_STATUS */
+#define CCA_STATUS      (1 << 6)
+#define CCA_DONE        (1 << 7)
+#define TRX_STATUS_MASK 0x1F
+
+/* TRX_STATUS states */
+#define P_ON                0x00
+#define BUSY_RX             0x01
+#define BUSY_TX             0x02
+#define RX_ON               0x06
+#define TRX_OFF             0x08
+#define PLL_ON              0x09
+#define SLEEP               0x0F
+#define BUSY_RX_AACK        0x11
+#define BUSY_TX_ARET        0x12
+#define RX_AACK_ON          0x16
+#define TX_ARET_ON          0x19
+#define STATE_TRANSITION    0x1F
+
+/* TRX_STATE commands */
+#define CMD_NOP             0x00
+#define CMD_TX_START        0x02
+#define CMD_FORCE_TRX_OFF   0x03
+#define CMD_FORCE_PLL_ON    0x04
+#define TRX_CMD_MASK        0x1F
+
+/* TRAC_STATUS, bits 7:5 of TRX_STATE */
+#define TRAC_SUCCESS                0
+#define TRAC_SUCCESS_DATA_PENDING   1
+#define TRAC_CHANNEL_ACCESS_FAILURE 3
+#define TRAC_NO_ACK                 5
+#define TRAC_INVALID                7
+
+/* TRX_CTRL_1 */
+#define TX_AUTO_CRC_ON      (1 << 5)
+
+/* PHY_RSSI */
+#define RX_CRC_VALID        (1 << 7)
+#define RSSI_MASK           0x1F
+
+/* PHY_CC_CCA */
+#define CCA_REQUEST         (1 << 7)
+#define CHANNEL_MASK        0x1F
+
+/* XAH_CTRL_1 */
+#define AACK_PROM_MODE      (1 << 1)
+
+/* CSMA_SEED_1 */
+#define AACK_I_AM_COORD     (1 << 3)
+#define AACK_DIS_ACK        (1 << 4)
+#define AACK_SET_PD         (1 << 5)
+
+/* Interrupt vectors, TRX24_PLL_LOCK_vect and on */
+#define TRX24_VECTOR_BASE   57
+
+/* 802.15.4 frame control */
+#define FCF_TYPE(fcf)       ((fcf) & 0x7)
+#define FCF_PENDING         (1 << 4)
+#define FCF_ACK_REQ         (1 << 5)
+#define FCF_DST_MODE(fcf)   (((fcf) >> 10) & 0x3)
+#define FRAME_BEACON        0
+#define FRAME_DATA          1
+#define FRAME_ACK           2
+#define FRAME_CMD           3
+#define ADDR_SHORT          2
+#define ADDR_LONG           3
+#define ACK_LEN             5
+
+/* O-QPSK at 250kb/s: 16us symbols, 2 symbols per byte, the SHR (preamble
+ * and SFD) and PHR take 6 bytes before the PSDU starts.
+ */
+#define SYMBOL_US           16
+#define BYTE_US             (2 * SYMBOL_US)
+#define SHR_PHR_BYTES       6
+#define CCA_US              (8 * SYMBOL_US)
+#define BACKOFF_US          (20 * SYMBOL_US)
+#define ACK_TURNAROUND_US   (12 * SYMBOL_US)
+#define ACK_WAIT_US         (54 * SYMBOL_US)
+#define PLL_LOCK_US         110
+#define WAKEUP_US           240
+
+/* How often we look at the medium while the PLL is running. Must stay well
+ * under the SHR so frames are seen before their RX_START is due.
+ */
+#define POLL_US             16
+
+/* What we report for every frame, there's no path loss model */
+#define RX_RSSI             28
+#define RX_ED_LEVEL         0x54
+#define RX_LQI              0xFF
+
+#define TRX24_SNAPSHOT      DF_SNAPSHOT_TAG('T', 'R', 'X', '2')
+#define TRX24_SNAPSHOT_OFF  offsetof(trx24_t, state)
+
+static avr_cycle_count_t trx24_poll(avr_t *avr, avr_cycle_count_t when,
+        void *param);
+static void trx24_command(trx24_t *t, uint8_t cmd);
+static void trx24_aret_attempt(trx24_t *t);
+
+static inline avr_cycle_count_t
+trx24_us(trx24_t *t, uint32_t us)
+{
+    return avr_usec_to_cycles(t->io.avr, us);
+}
+
+/* Cycles a PSDU of 'len' bytes takes on the air, headers included */
+static inline avr_cycle_count_t
+trx24_airtime(trx24_t *t, uint8_t len)
+{
+    return trx24_us(t, (SHR_PHR_BYTES + len) * BYTE_US);
+}
+
+/* Schedule 'timer' at the absolute cycle 'when', or right away if that's
+ * already behind us.
+ */
+static void
+trx24_at(trx24_t *t, avr_cycle_count_t when, avr_cycle_timer_t timer)
+{
+    avr_t *avr = t->io.avr;
+
+    avr_cycle_timer_register(avr, when > avr->cycle ? when - avr->cycle : 1,
+            timer, t);
+}
+
+static uint32_t
+trx24_random(trx24_t *t)
+{
+    /* xorshift32, seeded from the MAC so runs are repeatable */
+    t->rand ^= t->rand << 13;
+    t->rand ^= t->rand >> 17;
+    t->rand ^= t->rand << 5;
+    return t->rand;
+}
+
+/* 802.15.4 FCS, ITU-T CRC-16 sent LSB first */
+static uint16_t
+trx24_crc(const uint8_t *buf, uint8_t len)
+{
+    uint16_t crc = 0;
+    int i;
+
+    while (len--) {
+        crc ^= *buf++;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+
+    return crc;
+}
+
+static int
+trx24_crc_ok(const struct df_air_frame *f)
+{
+    if (f->len < 2)
+        return 0;
+
+    return trx24_crc(f->psdu, f->len - 2) ==
+        (f->psdu[f->len - 2] | (f->psdu[f->len - 1] << 8));
+}
+
+static void
+trx24_irq(trx24_t *t, int irq)
+{
+    avr_raise_interrupt(t->io.avr, &t->irq[irq]);
+}
+
+static uint8_t
+trx24_channel(trx24_t *t)
+{
+    uint8_t channel = t->io.avr->data[PHY_CC_CCA] & CHANNEL_MASK;
+
+    if (channel < DF_MEDIUM_CHANNEL_MIN || channel > DF_MEDIUM_CHANNEL_MAX)
+        channel = DF_MEDIUM_CHANNEL_MIN;
+
+    return channel;
+}
+
+/* Is the PLL up, i.e. are we on the channel hearing the air */
+static int
+trx24_tuned(uint8_t state)
+{
+    switch (state) {
+        case BUSY_RX:
+        case BUSY_TX:
+        case RX_ON:
+        case PLL_ON:
+        case BUSY_RX_AACK:
+        case BUSY_TX_ARET:
+        case RX_AACK_ON:
+        case TX_ARET_ON:
+            return 1;
+    }
+
+    return 0;
+}
+
+static int
+trx24_busy(uint8_t state)
+{
+    switch (state) {
+        case BUSY_RX:
+        case BUSY_TX:
+        case BUSY_RX_AACK:
+        case BUSY_TX_ARET:
+        case STATE_TRANSITION:
+            return 1;
+    }
+
+    return 0;
+}
+
+static void trx24_rx_abort(trx24_t *t);
+
+static void
+trx24_set_state(trx24_t *t, uint8_t state)
+{
+    avr_t *avr = t->io.avr;
+    uint8_t old = t->state;
+
+    t->state = state;
+    avr->data[TRX_STATUS] = (avr->data[TRX_STATUS] & ~TRX_STATUS_MASK) |
+        state;
+
+    if (trx24_tuned(state)) {
+        df_medium_tune(&t->port, trx24_channel(t), avr->cycle);
+        if (!trx24_tuned(old))
+            avr_cycle_timer_register(avr, trx24_us(t, POLL_US), trx24_poll, t);
+    } else {
+        df_medium_tune(&t->port, 0, avr->cycle);
+        avr_cycle_timer_cancel(avr, trx24_poll, t);
+        trx24_rx_abort(t);
+    }
+
+    /* Apply any command that arrived while we were busy */
+    if (!trx24_busy(state) && t->pending_cmd != CMD_NOP) {
+        uint8_t cmd = t->pending_cmd;
+
+        t->pending_cmd = CMD_NOP;
+        trx24_command(t, cmd);
+    }
+}
+
+static void
+trx24_set_trac(trx24_t *t, uint8_t trac)
+{
+    avr_t *avr = t->io.avr;
+
+    avr->data[TRX_STATE] = (avr->data[TRX_STATE] & TRX_CMD_MASK) |
+        (trac << 5);
+}
+
+/*
+ * Receive path
+ */
+
+static avr_cycle_count_t
+trx24_rx_start(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+
+    (void)when;
+
+    if (!t->rx_busy)
+        return 0;
+
+    avr->data[PHY_RSSI] = (avr->data[PHY_RSSI] & ~(RSSI_MASK | RX_CRC_VALID)) |
+        RX_RSSI;
+    avr->data[PHY_ED_LEVEL] = RX_ED_LEVEL;
+
+    /* While waiting for an ACK in TX_ARET_ON nothing is reported */
+    if (t->ack_wait)
+        return 0;
+
+    if (t->state == RX_ON)
+        trx24_set_state(t, BUSY_RX);
+    else if (t->state == RX_AACK_ON)
+        trx24_set_state(t, BUSY_RX_AACK);
+
+    trx24_irq(t, TRX24_IRQ_RX_START);
+
+    return 0;
+}
+
+/* Copy the received frame into the frame buffer */
+static void
+trx24_rx_upload(trx24_t *t, int crc_ok)
+{
+    avr_t *avr = t->io.avr;
+
+    memcpy(&avr->data[TRXFBST], t->rx.psdu, t->rx.len);
+    /* The LQI follows the PSDU */
+    if (t->rx.len < DF_AIR_MAX_PSDU)
+        avr->data[TRXFBST + t->rx.len] = RX_LQI;
+    avr->data[TST_RX_LENGTH] = t->rx.len;
+
+    if (crc_ok)
+        avr->data[PHY_RSSI] |= RX_CRC_VALID;
+    else
+        avr->data[PHY_RSSI] &= ~RX_CRC_VALID;
+}
+
+/* Does the frame in 'rx' pass RX_AACK_ON address filtering */
+static int
+trx24_rx_addr_match(trx24_t *t, int *broadcast)
+{
+    const uint8_t *data = t->io.avr->data;
+    const uint8_t *psdu = t->rx.psdu;
+    uint16_t fcf;
+    uint16_t pan;
+    uint16_t addr;
+
+    *broadcast = 0;
+
+    if (t->rx.len < ACK_LEN)
+        return 0;
+
+    if (data[XAH_CTRL_1] & AACK_PROM_MODE)
+        return 1;
+
+    fcf = psdu[0] | (psdu[1] << 8);
+
+    switch (FCF_DST_MODE(fcf)) {
+        case ADDR_SHORT:
+            if (t->rx.len < 3 + 4 + 2)
+                return 0;
+            pan = psdu[3] | (psdu[4] << 8);
+            addr = psdu[5] | (psdu[6] << 8);
+            if (pan != 0xFFFF && pan != (data[PAN_ID_0] | (data[PAN_ID_1] << 8)))
+                return 0;
+            if (addr == 0xFFFF) {
+                *broadcast = 1;
+                return 1;
+            }
+            return addr == (data[SHORT_ADDR_0] | (data[SHORT_ADDR_1] << 8));
+
+        case ADDR_LONG:
+            if (t->rx.len < 3 + 10 + 2)
+                return 0;
+            pan = psdu[3] | (psdu[4] << 8);
+            if (pan != 0xFFFF && pan != (data[PAN_ID_0] | (data[PAN_ID_1] << 8)))
+                return 0;
+            return memcmp(&psdu[5], &data[IEEE_ADDR_0], 8) == 0;
+
+        default:
+            /* No destination, only beacons or frames to a coordinator */
+            return FCF_TYPE(fcf) == FRAME_BEACON ||
+                (data[CSMA_SEED_1] & AACK_I_AM_COORD);
+    }
+}
+
+static avr_cycle_count_t
+trx24_ack_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+
+    (void)avr;
+    (void)when;
+
+    if (t->state == BUSY_RX_AACK)
+        trx24_set_state(t, RX_AACK_ON);
+
+    return 0;
+}
+
+static avr_cycle_count_t
+trx24_ack_send(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    struct df_air_frame *ack = &t->tx;
+    uint16_t crc;
+
+    (void)when;
+
+    if (t->state != BUSY_RX_AACK)
+        return 0;
+
+    ack->start = avr->cycle;
+    ack->src = t->mac;
+    ack->channel = trx24_channel(t);
+    ack->len = ACK_LEN;
+    ack->psdu[0] = FRAME_ACK |
+        ((avr->data[CSMA_SEED_1] & AACK_SET_PD) ? FCF_PENDING : 0);
+    ack->psdu[1] = 0;
+    ack->psdu[2] = t->rx.psdu[2];
+    crc = trx24_crc(ack->psdu, 3);
+    ack->psdu[3] = crc & 0xFF;
+    ack->psdu[4] = crc >> 8;
+
+    df_medium_send(&t->port, ack);
+    avr_cycle_timer_register(avr, trx24_airtime(t, ACK_LEN), trx24_ack_done, t);
+
+    return 0;
+}
+
+static void trx24_aret_done(trx24_t *t, uint8_t trac);
+
+static avr_cycle_count_t
+trx24_rx_end(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    int crc_ok;
+    int broadcast;
+    uint16_t fcf;
+
+    (void)when;
+
+    if (!t->rx_busy)
+        return 0;
+    t->rx_busy = 0;
+
+    crc_ok = !t->rx_collided && trx24_crc_ok(&t->rx);
+    fcf = t->rx.psdu[0] | (t->rx.psdu[1] << 8);
+
+    /* TX_ARET_ON, is this the ACK we're waiting for */
+    if (t->ack_wait) {
+        if (crc_ok && t->rx.len == ACK_LEN && FCF_TYPE(fcf) == FRAME_ACK &&
+                t->rx.psdu[2] == t->tx.psdu[2]) {
+            t->ack_wait = 0;
+            trx24_aret_done(t, (fcf & FCF_PENDING) ?
+                    TRAC_SUCCESS_DATA_PENDING : TRAC_SUCCESS);
+        }
+        return 0;
+    }
+
+    if (t->state == BUSY_RX) {
+        trx24_rx_upload(t, crc_ok);
+        trx24_set_state(t, RX_ON);
+        trx24_irq(t, TRX24_IRQ_RX_END);
+        return 0;
+    }
+
+    if (t->state != BUSY_RX_AACK)
+        return 0;
+
+    /* RX_AACK_ON silently drops bad and foreign frames */
+    if (!crc_ok || FCF_TYPE(fcf) == FRAME_ACK ||
+            !trx24_rx_addr_match(t, &broadcast)) {
+        trx24_set_state(t, RX_AACK_ON);
+        return 0;
+    }
+
+    trx24_rx_upload(t, crc_ok);
+    trx24_irq(t, TRX24_IRQ_AMI);
+    trx24_irq(t, TRX24_IRQ_RX_END);
+
+    if ((fcf & FCF_ACK_REQ) && !broadcast &&
+            !(avr->data[CSMA_SEED_1] & AACK_DIS_ACK) &&
+            (FCF_TYPE(fcf) == FRAME_DATA || FCF_TYPE(fcf) == FRAME_CMD)) {
+        /* stay BUSY_RX_AACK until the ACK is out */
+        avr_cycle_timer_register(avr, trx24_us(t, ACK_TURNAROUND_US),
+                trx24_ack_send, t);
+    } else {
+        trx24_set_state(t, RX_AACK_ON);
+    }
+
+    return 0;
+}
+
+static void
+trx24_rx_abort(trx24_t *t)
+{
+    avr_t *avr = t->io.avr;
+
+    t->rx_busy = 0;
+    avr_cycle_timer_cancel(avr, trx24_rx_start, t);
+    avr_cycle_timer_cancel(avr, trx24_rx_end, t);
+    avr_cycle_timer_cancel(avr, trx24_ack_send, t);
+    avr_cycle_timer_cancel(avr, trx24_ack_done, t);
+}
+
+/* A frame showed up in our inbox */
+static void
+trx24_hear(trx24_t *t, const struct df_air_frame *f)
+{
+    avr_cycle_count_t end = f->start + trx24_airtime(t, f->len);
+    int receiving;
+
+    if (f->channel != t->port.channel)
+        return;
+
+    /* Anything overlapping the frame we're receiving ruins it */
+    if (f->start < t->air_busy_until) {
+        if (t->rx_busy)
+            t->rx_collided = 1;
+        if (end > t->air_busy_until)
+            t->air_busy_until = end;
+        return;
+    }
+    t->air_busy_until = end;
+
+    receiving = t->state == RX_ON || t->state == RX_AACK_ON || t->ack_wait;
+    if (!receiving || t->rx_busy)
+        return;
+
+    memcpy(&t->rx, f, sizeof(*f));
+    t->rx_busy = 1;
+    t->rx_collided = 0;
+
+    trx24_at(t, f->start + trx24_us(t, SHR_PHR_BYTES * BYTE_US),
+            trx24_rx_start);
+    trx24_at(t, end, trx24_rx_end);
+}
+
+/*
+ * While the PLL is running, look for frames whose RX_START falls before
+ * our next look.
+ */
+static avr_cycle_count_t
+trx24_poll(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    const struct df_air_frame *f;
+    avr_cycle_count_t horizon = avr->cycle + trx24_us(t, POLL_US);
+
+    while ((f = df_medium_peek(&t->port, avr->cycle))) {
+        if (f->start + trx24_us(t, SHR_PHR_BYTES * BYTE_US) > horizon)
+            break;
+        trx24_hear(t, f);
+        df_medium_pop(&t->port);
+    }
+
+    return when + trx24_us(t, POLL_US);
+}
+
+static int
+trx24_channel_clear(trx24_t *t)
+{
+    return t->air_busy_until <= t->io.avr->cycle;
+}
+
+static avr_cycle_count_t
+trx24_cca_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+
+    (void)when;
+
+    avr->data[TRX_STATUS] |= CCA_DONE;
+    if (trx24_channel_clear(t))
+        avr->data[TRX_STATUS] |= CCA_STATUS;
+    else
+        avr->data[TRX_STATUS] &= ~CCA_STATUS;
+
+    trx24_irq(t, TRX24_IRQ_CCA_ED_DONE);
+
+    return 0;
+}
+
+static avr_cycle_count_t
+trx24_ed_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+
+    (void)when;
+
+    avr->data[PHY_ED_LEVEL] = trx24_channel_clear(t) ? 0 : RX_ED_LEVEL;
+    trx24_irq(t, TRX24_IRQ_CCA_ED_DONE);
+
+    return 0;
+}
+
+/*
+ * Transmit path
+ */
+
+static avr_cycle_count_t
+trx24_ack_timeout(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    uint8_t max_retries = avr->data[XAH_CTRL_0] >> 4;
+
+    (void)when;
+
+    if (!t->ack_wait)
+        return 0;
+    t->ack_wait = 0;
+
+    if (t->frame_retries < max_retries) {
+        t->frame_retries++;
+        t->csma_retries = 0;
+        t->be = avr->data[CSMA_BE] & 0xF;
+        trx24_aret_attempt(t);
+    } else {
+        trx24_aret_done(t, TRAC_NO_ACK);
+    }
+
+    return 0;
+}
+
+static avr_cycle_count_t
+trx24_tx_end(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    uint16_t fcf = t->tx.psdu[0] | (t->tx.psdu[1] << 8);
+
+    (void)when;
+
+    if (!t->aret) {
+        trx24_set_state(t, PLL_ON);
+        trx24_irq(t, TRX24_IRQ_TX_END);
+        return 0;
+    }
+
+    /* Broadcasts and frames not asking for one get no ACK */
+    if (t->tx.len >= ACK_LEN && (fcf & FCF_ACK_REQ) &&
+            !(FCF_DST_MODE(fcf) == ADDR_SHORT && t->tx.len >= 7 &&
+                t->tx.psdu[5] == 0xFF && t->tx.psdu[6] == 0xFF)) {
+        t->ack_wait = 1;
+        avr_cycle_timer_register(avr, trx24_us(t, ACK_WAIT_US),
+                trx24_ack_timeout, t);
+    } else {
+        trx24_aret_done(t, TRAC_SUCCESS);
+    }
+
+    return 0;
+}
+
+static void
+trx24_transmit(trx24_t *t)
+{
+    avr_t *avr = t->io.avr;
+
+    t->tx.start = avr->cycle;
+    t->tx.src = t->mac;
+    t->tx.channel = trx24_channel(t);
+
+    df_medium_send(&t->port, &t->tx);
+    avr_cycle_timer_register(avr, trx24_airtime(t, t->tx.len), trx24_tx_end,
+            t);
+}
+
+static avr_cycle_count_t
+trx24_csma_cca(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    uint8_t max_csma = (avr->data[XAH_CTRL_0] >> 1) & 0x7;
+    uint8_t max_be = avr->data[CSMA_BE] >> 4;
+
+    (void)when;
+
+    if (trx24_channel_clear(t)) {
+        trx24_transmit(t);
+        return 0;
+    }
+
+    if (++t->csma_retries > max_csma) {
+        trx24_aret_done(t, TRAC_CHANNEL_ACCESS_FAILURE);
+        return 0;
+    }
+
+    if (t->be < max_be)
+        t->be++;
+    trx24_aret_attempt(t);
+
+    return 0;
+}
+
+/* Random backoff, then CCA, then send. MAX_CSMA_RETRIES of 7 skips it. */
+static void
+trx24_aret_attempt(trx24_t *t)
+{
+    avr_t *avr = t->io.avr;
+    uint32_t slots;
+
+    if (((avr->data[XAH_CTRL_0] >> 1) & 0x7) == 7) {
+        trx24_transmit(t);
+        return;
+    }
+
+    slots = trx24_random(t) & ((1 << t->be) - 1);
+    avr_cycle_timer_register(avr,
+            trx24_us(t, slots * BACKOFF_US + CCA_US), trx24_csma_cca, t);
+}
+
+static void
+trx24_aret_done(trx24_t *t, uint8_t trac)
+{
+    avr_t *avr = t->io.avr;
+
+    avr_cycle_timer_cancel(avr, trx24_ack_timeout, t);
+    t->ack_wait = 0;
+    t->aret = 0;
+
+    trx24_set_trac(t, trac);
+    trx24_set_state(t, TX_ARET_ON);
+    trx24_irq(t, TRX24_IRQ_TX_END);
+}
+
+static void
+trx24_tx_start(trx24_t *t)
+{
+    avr_t *avr = t->io.avr;
+    uint8_t len = avr->data[TRXFBST] & 0x7F;
+    uint16_t crc;
+
+    memset(&t->tx, 0, sizeof(t->tx));
+    t->tx.len = len;
+    memcpy(t->tx.psdu, &avr->data[TRXFBST + 1], len);
+
+    if ((avr->data[TRX_CTRL_1] & TX_AUTO_CRC_ON) && len >= 2) {
+        crc = trx24_crc(t->tx.psdu, len - 2);
+        t->tx.psdu[len - 2] = crc & 0xFF;
+        t->tx.psdu[len - 1] = crc >> 8;
+    }
+
+    if (t->state == TX_ARET_ON) {
+        t->aret = 1;
+        t->frame_retries = 0;
+        t->csma_retries = 0;
+        t->be = avr->data[CSMA_BE] & 0xF;
+        trx24_set_trac(t, TRAC_INVALID);
+        trx24_set_state(t, BUSY_TX_ARET);
+        trx24_aret_attempt(t);
+    } else {
+        t->aret = 0;
+        trx24_set_state(t, BUSY_TX);
+        trx24_transmit(t);
+    }
+}
+
+/* Stop anything in flight, used by the FORCE commands and sleep */
+static void
+trx24_abort(trx24_t *t)
+{
+    avr_t *avr = t->io.avr;
+
+    trx24_rx_abort(t);
+    t->ack_wait = 0;
+    t->aret = 0;
+    t->pending_cmd = CMD_NOP;
+    avr_cycle_timer_cancel(avr, trx24_tx_end, t);
+    avr_cycle_timer_cancel(avr, trx24_csma_cca, t);
+    avr_cycle_timer_cancel(avr, trx24_ack_timeout, t);
+}
+
+/*
+ * State machine
+ */
+
+static avr_cycle_count_t
+trx24_pll_locked(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+    uint8_t state = t->pending_cmd;
+
+    (void)avr;
+    (void)when;
+
+    /* the state we were heading to was stashed as the pending command */
+    t->pending_cmd = CMD_NOP;
+    trx24_set_state(t, state);
+    trx24_irq(t, TRX24_IRQ_PLL_LOCK);
+
+    return 0;
+}
+
+static avr_cycle_count_t
+trx24_awake(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    trx24_t *t = param;
+
+    (void)avr;
+    (void)when;
+
+    trx24_set_state(t, TRX_OFF);
+    trx24_irq(t, TRX24_IRQ_AWAKE);
+
+    return 0;
+}
+
+static void
+trx24_command(trx24_t *t, uint8_t cmd)
+{
+    avr_t *avr = t->io.avr;
+
+    switch (cmd) {
+        case CMD_NOP:
+            break;
+
+        case CMD_TX_START:
+            if (t->state == PLL_ON || t->state == TX_ARET_ON)
+                trx24_tx_start(t);
+            break;
+
+        case CMD_FORCE_TRX_OFF:
+            if (t->state == SLEEP)
+                break;
+            trx24_abort(t);
+            avr_cycle_timer_cancel(avr, trx24_pll_locked, t);
+            trx24_set_state(t, TRX_OFF);
+            break;
+
+        case CMD_FORCE_PLL_ON:
+            if (!trx24_tuned(t->state))
+                break;
+            trx24_abort(t);
+            trx24_set_state(t, PLL_ON);
+            break;
+
+        case TRX_OFF:
+        case PLL_ON:
+        case RX_ON:
+        case RX_AACK_ON:
+        case TX_ARET_ON:
+            if (t->state == SLEEP || t->state == P_ON)
+                break;
+
+            /* Busy states finish first, then we get there */
+            if (trx24_busy(t->state)) {
+                t->pending_cmd = cmd;
+                break;
+            }
+
+            if (t->state == TRX_OFF && cmd != TRX_OFF) {
+                /* The PLL has to lock first */
+                t->pending_cmd = cmd;
+                trx24_set_state(t, STATE_TRANSITION);
+                avr_cycle_timer_register(avr, trx24_us(t, PLL_LOCK_US),
+                        trx24_pll_locked, t);
+                break;
+            }
+
+            trx24_set_state(t, cmd);
+            break;
+    }
+}
+
+static void
+trx24_write_trx_state(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    trx24_t *t = param;
+
+    avr->data[addr] = (avr->data[addr] & ~TRX_CMD_MASK) | (v & TRX_CMD_MASK);
+    trx24_command(t, v & TRX_CMD_MASK);
+}
+
+static void trx24_reset(avr_io_t *io);
+
+static void
+trx24_write_trxpr(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    trx24_t *t = param;
+    uint8_t slptr = !!(v & SLPTR);
+
+    avr->data[addr] = v & SLPTR;
+
+    if (v & TRXRST) {
+        trx24_reset(&t->io);
+        return;
+    }
+
+    if (slptr == t->slptr)
+        return;
+    t->slptr = slptr;
+
+    if (slptr) {
+        /* SLPTR starts a transmission or puts us to sleep */
+        if (t->state == PLL_ON || t->state == TX_ARET_ON)
+            trx24_tx_start(t);
+        else if (t->state == TRX_OFF)
+            trx24_set_state(t, SLEEP);
+    } else if (t->state == SLEEP) {
+        avr_cycle_timer_register(avr, trx24_us(t, WAKEUP_US), trx24_awake, t);
+    }
+}
+
+static void
+trx24_write_phy_cc_cca(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    trx24_t *t = param;
+
+    avr->data[addr] = v & ~CCA_REQUEST;
+
+    /* Follow channel changes while we're on the air */
+    if (trx24_tuned(t->state))
+        df_medium_tune(&t->port, trx24_channel(t), avr->cycle);
+
+    if ((v & CCA_REQUEST) && (t->state == RX_ON || t->state == RX_AACK_ON)) {
+        avr->data[TRX_STATUS] &= ~(CCA_DONE | CCA_STATUS);
+        avr_cycle_timer_register(avr, trx24_us(t, CCA_US), trx24_cca_done, t);
+    }
+}
+
+static void
+trx24_write_phy_ed_level(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    trx24_t *t = param;
+
+    (void)addr;
+    (void)v;
+
+    /* Any write starts a measurement */
+    if (t->state == RX_ON || t->state == RX_AACK_ON) {
+        avr->data[PHY_ED_LEVEL] = 0xFF;
+        avr_cycle_timer_register(avr, trx24_us(t, CCA_US), trx24_ed_done, t);
+    }
+}
+
+static uint8_t
+trx24_read_phy_rssi(avr_t *avr, avr_io_addr_t addr, void *param)
+{
+    trx24_t *t = param;
+
+    /* RND_VALUE is bits 6:5 */
+    return (avr->data[addr] & ~0x60) | ((trx24_random(t) & 0x3) << 5);
+}
+
+static void
+trx24_write_irq_status(avr_t *avr, avr_io_addr_t addr, uint8_t v,
+        void *param)
+{
+    trx24_t *t = param;
+    int i;
+
+    /* Write one to clear */
+    avr->data[addr] &= ~v;
+
+    for (i = 0; i < TRX24_IRQ_COUNT; i++) {
+        if ((v & (1 << i)) && avr_is_interrupt_pending(avr, &t->irq[i]))
+            avr_clear_interrupt(avr, &t->irq[i]);
+    }
+}
+
+static void
+trx24_write_irq_mask(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    trx24_t *t = param;
+    uint8_t enabled = v & ~avr->data[addr];
+    int i;
+
+    avr->data[addr] = v;
+
+    /* Unmasking an already flagged interrupt fires it */
+    for (i = 0; i < TRX24_IRQ_COUNT; i++) {
+        if ((enabled & (1 << i)) && (avr->data[IRQ_STATUS] & (1 << i)) &&
+                !avr_is_interrupt_pending(avr, &t->irq[i]))
+            trx24_irq(t, i);
+    }
+}
+
+static void
+trx24_reset(avr_io_t *io)
+{
+    trx24_t *t = (trx24_t *)io;
+    avr_t *avr = io->avr;
+    uint8_t *data = avr->data;
+    int i;
+
+    trx24_abort(t);
+    avr_cycle_timer_cancel(avr, trx24_pll_locked, t);
+    avr_cycle_timer_cancel(avr, trx24_awake, t);
+    avr_cycle_timer_cancel(avr, trx24_cca_done, t);
+    avr_cycle_timer_cancel(avr, trx24_ed_done, t);
+
+    t->slptr = 0;
+    t->air_busy_until = 0;
+    t->rand = (uint32_t)(t->mac ^ (t->mac >> 32)) | 1;
+
+    /* Reset values from the datasheet */
+    data[TRXPR] = 0;
+    data[TRX_STATE] = 0;
+    data[TRX_CTRL_0] = 0x19;
+    data[TRX_CTRL_1] = TX_AUTO_CRC_ON;
+    data[PHY_TX_PWR] = 0xC0;
+    data[PHY_RSSI] = 0;
+    data[PHY_ED_LEVEL] = 0xFF;
+    data[PHY_CC_CCA] = 0x20 | DF_MEDIUM_CHANNEL_MIN;
+    data[CCA_THRES] = 0xC7;
+    data[IRQ_MASK] = 0;
+    data[IRQ_STATUS] = 0;
+    data[XAH_CTRL_1] = 0;
+    data[PART_NUM] = 0x83;
+    data[VERSION_NUM] = 0x02;
+    data[MAN_ID_0] = 0x1F;
+    data[MAN_ID_1] = 0x00;
+    data[SHORT_ADDR_0] = data[SHORT_ADDR_1] = 0xFF;
+    data[PAN_ID_0] = data[PAN_ID_1] = 0xFF;
+    data[XAH_CTRL_0] = 0x38;
+    data[CSMA_SEED_0] = 0xEA;
+    data[CSMA_SEED_1] = 0x42;
+    data[CSMA_BE] = 0x53;
+
+    /* Preload our MAC so firmware can pick it up, LSB first */
+    for (i = 0; i < 8; i++)
+        data[IEEE_ADDR_0 + i] = t->mac >> (i * 8);
+
+    t->state = P_ON;
+    trx24_set_state(t, TRX_OFF);
+}
+
+static void
+trx24_dealloc(avr_io_t *io)
+{
+    trx24_t *t = (trx24_t *)io;
+
+    df_medium_detach(&t->port);
+    free(t);
+}
+
+/*
+ * The radio is owned by the core once this succeeds and is freed when
+ * simavr deallocates its I/O peripherals.
+ */
+trx24_t *
+trx24_create(avr_t *avr, const char *medium, uint64_t mac)
+{
+    trx24_t *t;
+    int i;
+
+    /* simavr only has room for so many I/O registers */
+    if (AVR_DATA_TO_IO(IRQ_STATUS) >= MAX_IOs) {
+        fprintf(stderr, "simavr was built with too few I/O registers "
+                "(%d) for the radio, disabling it.\n", (int)MAX_IOs);
+        return NULL;
+    }
+
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+        fprintf(stderr, "Failed to allocate memory for radio.\n");
+        return NULL;
+    }
+
+    if (df_medium_attach(&t->port, medium, mac)) {
+        free(t);
+        return NULL;
+    }
+
+    t->mac = mac;
+    t->io.kind = "trx24";
+    t->io.reset = trx24_reset;
+    t->io.dealloc = trx24_dealloc;
+
+    for (i = 0; i < TRX24_IRQ_COUNT; i++) {
+        t->irq[i].vector = TRX24_VECTOR_BASE + i;
+        t->irq[i].enable.reg = IRQ_MASK;
+        t->irq[i].enable.bit = i;
+        t->irq[i].enable.mask = 1;
+        t->irq[i].raised.reg = IRQ_STATUS;
+        t->irq[i].raised.bit = i;
+        t->irq[i].raised.mask = 1;
+        /* only cleared by writing IRQ_STATUS */
+        t->irq[i].raise_sticky = 1;
+    }
+
+    avr_register_io(avr, &t->io);
+    for (i = 0; i < TRX24_IRQ_COUNT; i++)
+        avr_register_vector(avr, &t->irq[i]);
+
+    avr_register_io_write(avr, TRXPR, trx24_write_trxpr, t);
+    avr_register_io_write(avr, TRX_STATE, trx24_write_trx_state, t);
+    avr_register_io_write(avr, PHY_CC_CCA, trx24_write_phy_cc_cca, t);
+    avr_register_io_write(avr, PHY_ED_LEVEL, trx24_write_phy_ed_level, t);
+    avr_register_io_write(avr, IRQ_MASK, trx24_write_irq_mask, t);
+    avr_register_io_write(avr, IRQ_STATUS, trx24_write_irq_status, t);
+    avr_register_io_read(avr, PHY_RSSI, trx24_read_phy_rssi, t);
+
+    trx24_reset(&t->io);
+
+    return t;
+}
+
+/* Leave the air before the board is cloned with fork() */
+void
+trx24_unplug(trx24_t *t)
+{
+    df_medium_detach(&t->port);
+}
+
+/*
+ * Join the air again as 'mac'. A clone keeps whatever the firmware set
+ * IEEE_ADDR to, unless it's still the address we preloaded.
+ */
+int
+trx24_replug(trx24_t *t, const char *medium, uint64_t mac)
+{
+    avr_t *avr = t->io.avr;
+    uint64_t addr = 0;
+    int i;
+
+    if (df_medium_attach(&t->port, medium, mac))
+        return -1;
+
+    for (i = 0; i < 8; i++)
+        addr |= (uint64_t)avr->data[IEEE_ADDR_0 + i] << (i * 8);
+    if (addr == t->mac) {
+        for (i = 0; i < 8; i++)
+            avr->data[IEEE_ADDR_0 + i] = mac >> (i * 8);
+    }
+    t->mac = mac;
+
+    if (trx24_tuned(t->state))
+        df_medium_tune(&t->port, trx24_channel(t), avr->cycle);
+
+    return 0;
+}
+
+int
+trx24_save(trx24_t *t, FILE *f)
+{
+    return df_snapshot_write(f, TRX24_SNAPSHOT,
+            (const uint8_t *)t + TRX24_SNAPSHOT_OFF,
+            sizeof(*t) - TRX24_SNAPSHOT_OFF);
+}
+
+/*
+ * The registers and our timers have been restored already. All that's
+ * left is our own state and getting back on the air if we were.
+ */
+int
+trx24_restore(trx24_t *t, FILE *f)
+{
+    avr_t *avr = t->io.avr;
+
+    if (df_snapshot_read(f, TRX24_SNAPSHOT, (uint8_t *)t + TRX24_SNAPSHOT_OFF,
+                sizeof(*t) - TRX24_SNAPSHOT_OFF))
+        return -1;
+
+    df_medium_tune(&t->port, trx24_tuned(t->state) ? trx24_channel(t) : 0,
+            avr->cycle);
+
+    return 0;
+}
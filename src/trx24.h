@@ -0,0 +1,85 @@
+/*
+ * trx24.h
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRX24_H__
+#define __TRX24_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_interrupts.h"
+
+#include "df_medium.h"
+
+/* TRX24 interrupts, in IRQ_STATUS bit order */
+enum {
+    TRX24_IRQ_PLL_LOCK = 0,
+    TRX24_IRQ_PLL_UNLOCK,
+    TRX24_IRQ_RX_START,
+    TRX24_IRQ_RX_END,
+    TRX24_IRQ_CCA_ED_DONE,
+    TRX24_IRQ_AMI,
+    TRX24_IRQ_TX_END,
+    TRX24_IRQ_AWAKE,
+    TRX24_IRQ_COUNT
+};
+
+/* The ATmega128RFA1's built in 802.15.4 transceiver */
+typedef struct trx24_t {
+    avr_io_t io;                /**< must be first, we're an avr_io_t */
+    struct df_radio_port port;
+    avr_int_vector_t irq[TRX24_IRQ_COUNT];
+
+    /* everything from here on is plain data kept in snapshots */
+    uint8_t state;              /**< TRX_STATUS we report */
+    uint8_t pending_cmd;        /**< TRX_CMD deferred until we're idle */
+    uint8_t slptr;
+    uint32_t rand;              /**< RND_VALUE and CSMA backoffs */
+    uint64_t mac;
+
+    /* receive side */
+    struct df_air_frame rx;
+    int rx_busy;
+    int rx_collided;
+    avr_cycle_count_t air_busy_until;   /**< end of the last frame heard */
+
+    /* transmit side */
+    struct df_air_frame tx;
+    int aret;                   /**< transmission started in TX_ARET_ON */
+    int ack_wait;
+    uint8_t frame_retries;
+    uint8_t csma_retries;
+    uint8_t be;
+} trx24_t;
+
+trx24_t *trx24_create(avr_t *avr, const char *medium, uint64_t mac);
+
+void trx24_unplug(trx24_t *t);
+
+int trx24_replug(trx24_t *t, const char *medium, uint64_t mac);
+
+int trx24_save(trx24_t *t, FILE *f);
+
+int trx24_restore(trx24_t *t, FILE *f);
+
+#endif /* __TRX24_H__ */
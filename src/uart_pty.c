@@ -21,13 +21,19 @@
 	along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #ifdef __APPLE__
@@ -38,11 +44,14 @@
 
 #include "uart_pty.h"
 #include "avr_uart.h"
+#include "sim_cycle_timers.h"
 #include "sim_hex.h"
 
+#include "df_clock.h"
 #include "df_log.h"
-
-DEFINE_FIFO(uint8_t, uart_pty_fifo);
+#include "df_snapshot.h"
+#include "df_trace.h"
+#include "df_uart_log.h"
 
 #define TRACE(_w) _w
 #ifndef TRACE
@@ -53,6 +62,116 @@ DEFINE_FIFO(uint8_t, uart_pty_fifo);
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+/* Slots in the pollfd array used by the UART thread */
+enum {
+    UART_PTY_POLL_TTY = 0,
+    UART_PTY_POLL_WAKE,
+    UART_PTY_POLL_COUNT
+};
+
+/* How often (in ms) to look for a new connection to the slave side of the
+ * pty while nobody has it open. The master reports POLLHUP constantly in
+ * that state so we can't simply wait on it.
+ */
+#define UART_PTY_HUP_RECHECK 250
+
+/* Clients of a socket UART waiting their turn */
+#define UART_PTY_BACKLOG 4
+
+#define UART_PTY_SNAPSHOT DF_SNAPSHOT_TAG('U', 'A', 'R', 'T')
+
+/* The megaAVR USART registers, relative to UCSRnA */
+#define UART_PTY_UCSRB  1
+#define UART_PTY_UCSRC  2
+#define UART_PTY_UBRRL  4
+#define UART_PTY_UBRRH  5
+
+#define UART_PTY_U2X    (1 << 1)    /* UCSRnA, double speed */
+#define UART_PTY_UCSZ2  (1 << 2)    /* UCSRnB, 9 data bits */
+#define UART_PTY_USBS   (1 << 3)    /* UCSRnC, 2 stop bits */
+#define UART_PTY_UPM1   (1 << 5)    /* UCSRnC, parity on */
+
+/* What a snapshot keeps of a UART, the pty itself is made anew */
+struct uart_pty_snapshot {
+    uint64_t rx_next;
+    uint32_t xon;
+    uint32_t len;       /**< bytes from the pty the AVR hadn't taken yet */
+    uint8_t buf[UART_PTY_RING_SIZE];
+};
+
+/*
+ * Wake the UART thread up, unless a wakeup is already outstanding. This
+ * keeps us to at most one write() per batch of bytes from the AVR.
+ */
+static void
+uart_pty_wake(uart_pty_t *p)
+{
+    const uint8_t c = 0;
+
+    if (__atomic_exchange_n(&p->wake_pending, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    /* The pipe is non-blocking and a full pipe means the thread has
+     * plenty of wakeups pending already, so the result doesn't matter.
+     */
+    if (write(p->wake[1], &c, sizeof(c)) < 0 && errno != EAGAIN)
+        df_log_msg(DF_LOG_WARN, "UART%c: failed to wake thread: %s\n",
+                p->uart, strerror(errno));
+}
+
+/*
+ * Consume any pending wakeups. This must happen before the thread looks
+ * at the FIFO so that a byte queued after we look always causes a new
+ * wakeup.
+ */
+static void
+uart_pty_wake_drain(uart_pty_t *p)
+{
+    uint8_t buf[64];
+
+    while (read(p->wake[0], buf, sizeof(buf)) > 0)
+        ;
+
+    __atomic_store_n(&p->wake_pending, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/* Write a byte that went through us down, if we're asked to */
+static void
+uart_pty_note(uart_pty_t *p, enum df_uart_dir dir, uint8_t byte)
+{
+    if (p->record)
+        df_uart_log_put(p->record, p->uart - '0', dir, p->avr->cycle, byte);
+    if (p->trace)
+        df_uart_log_put(p->trace, p->uart - '0', dir, p->avr->cycle, byte);
+}
+
+/* Does what the AVR sent match the recording we're replaying? */
+static void
+uart_pty_replay_check(uart_pty_t *p, uint8_t byte)
+{
+    struct df_uart_log_recs *r = &p->replay->recs[p->uart - '0'][DF_UART_TX];
+    const struct df_uart_log_rec *rec = NULL;
+
+    if (r->next < r->count)
+        rec = &r->rec[r->next++];
+
+    if (rec && rec->cycle == p->avr->cycle && rec->byte == byte)
+        return;
+
+    /* Everything after the first difference is likely off too */
+    if (!p->replay_diffs++) {
+        if (rec)
+            df_log_msg(DF_LOG_WARN, "UART%c: replay sent 0x%02x at cycle "
+                    "%" PRIu64 ", the recording 0x%02x at %" PRIu64 "\n",
+                    p->uart, byte, (uint64_t)p->avr->cycle, rec->byte,
+                    rec->cycle);
+        else
+            df_log_msg(DF_LOG_WARN, "UART%c: replay sent 0x%02x at cycle "
+                    "%" PRIu64 ", past the end of the recording\n", p->uart,
+                    byte, (uint64_t)p->avr->cycle);
+    }
+}
 
 /*
  * called when a byte is send via the uart on the AVR
@@ -66,24 +185,213 @@ uart_pty_in_hook(
     (void)irq;
 
     uart_pty_t *p = (uart_pty_t*)param;
-    df_log_msg(DF_LOG_DEBUG, "AVR UART%c -> out fifo (towards pty) %02x\n",
-            p->uart, value);
-    uart_pty_fifo_write(&p->port.in, value);
+    df_trace(DF_TRACE_UART_TX, p->avr->cycle, p->uart, value, 0);
+    p->tx_bytes++;
+
+    uart_pty_note(p, DF_UART_TX, value);
+    if (p->replay) {
+        uart_pty_replay_check(p, value);
+        return;
+    }
+    if (p->deterministic)
+        return;
+
+    if (!df_ring_put(&p->port.in, value)) {
+        df_trace(DF_TRACE_UART_TX_DROP, p->avr->cycle, p->uart, value, 0);
+        p->tx_drops++;
+    }
+    uart_pty_wake(p);
+}
+
+/* Give the AVR a byte from the host side */
+static void
+uart_pty_raise(uart_pty_t *p, uint8_t byte)
+{
+    df_trace(DF_TRACE_UART_RX, p->avr->cycle, p->uart, byte, 0);
+    uart_pty_note(p, DF_UART_RX, byte);
+    avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
+}
+
+/* Count 'n' bytes as having reached the AVR */
+static void
+uart_pty_delivered(uart_pty_t *p, uint32_t n)
+{
+    uint64_t now = df_log_host_ns();
+
+    if (!p->rx_bytes) {
+        p->rx_first_cycle = p->avr->cycle;
+        p->rx_first_ns = now;
+    }
+    p->rx_bytes += n;
+    p->rx_last_cycle = p->avr->cycle;
+    p->rx_last_ns = now;
 }
 
-// try to empty our fifo, the uart_pty_xoff_hook() will be called when
+/*
+ * If the thread stopped reading the pty because we were full, let it
+ * know there's room again.
+ */
+static void
+uart_pty_room(uart_pty_t *p)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->want_space, __ATOMIC_RELAXED) &&
+            !df_ring_isfull(&p->port.out) &&
+            __atomic_exchange_n(&p->want_space, 0, __ATOMIC_SEQ_CST))
+        uart_pty_wake(p);
+}
+
+// try to empty our ring, the uart_pty_xoff_hook() will be called when
 // other side is full
 static void
 uart_pty_flush_incoming(uart_pty_t *p)
 {
-    uint8_t byte;
+    uint8_t *src;
+    uint32_t len;
+    uint32_t i;
+
+    while (p->xon && (len = df_ring_peek_read(&p->port.out, &src))) {
+        /* The AVR takes one byte per IRQ and can xoff us part way */
+        for (i = 0; i < len && p->xon; i++)
+            uart_pty_raise(p, src[i]);
+        df_ring_commit_read(&p->port.out, i);
+        uart_pty_delivered(p, i);
+    }
+
+    uart_pty_room(p);
+}
+
+/* Cycles a frame takes at the baud rate and format the AVR programmed */
+static uint64_t
+uart_pty_frame_cycles(uart_pty_t *p)
+{
+    const uint8_t *r = p->avr->data + p->ucsra;
+    uint32_t ubrr = ((r[UART_PTY_UBRRH] & 0x0f) << 8) | r[UART_PTY_UBRRL];
+    uint32_t bits;
+
+    /* A start bit, 5 to 9 data bits, maybe parity and 1 or 2 stop bits */
+    bits = 1 + 5 + ((r[UART_PTY_UCSRC] >> 1) & 3);
+    if (r[UART_PTY_UCSRB] & UART_PTY_UCSZ2)
+        bits++;
+    if (r[UART_PTY_UCSRC] & UART_PTY_UPM1)
+        bits++;
+    bits += (r[UART_PTY_UCSRC] & UART_PTY_USBS) ? 2 : 1;
+
+    return (uint64_t)(ubrr + 1) * ((r[0] & UART_PTY_U2X) ? 8 : 16) * bits;
+}
+
+/*
+ * Accurate timing, hand the AVR a byte as its frame starts and come back
+ * for the next one a frame later. simavr raises RXC a byte time after it
+ * gets a byte, which is when the frame ends. With nothing left to send,
+ * or the AVR full, we stop until there's more.
+ */
+static avr_cycle_count_t
+uart_pty_rx_timer(struct avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    uart_pty_t *p = (uart_pty_t*)param;
+    uint8_t *src;
+
+    (void)avr;
+
+    if (!p->xon || !df_ring_peek_read(&p->port.out, &src))
+        return 0;
+
+    uart_pty_raise(p, *src);
+    df_ring_commit_read(&p->port.out, 1);
+    uart_pty_delivered(p, 1);
+    uart_pty_room(p);
+
+    p->rx_next = when + uart_pty_frame_cycles(p);
+
+    return df_ring_isempty(&p->port.out) ? 0 : p->rx_next;
+}
 
-    while (p->xon && !uart_pty_fifo_isempty(&p->port.out)) {
-        byte = uart_pty_fifo_read(&p->port.out);
-        df_log_msg(DF_LOG_DEBUG, "uart_pty_flush_incoming send r %03d:%02x\n",
-                p->port.out.read, byte);
-        avr_raise_irq(p->irq + IRQ_UART_PTY_BYTE_OUT, byte);
+/*
+ * While recording, turbo mode also only hands bytes over between
+ * instructions, from a cycle timer, just like a replay will.
+ */
+static avr_cycle_count_t
+uart_pty_record_timer(struct avr_t *avr, avr_cycle_count_t when,
+        void *param)
+{
+    (void)avr;
+    (void)when;
+
+    uart_pty_flush_incoming((uart_pty_t*)param);
+    return 0;
+}
+
+/* Hand the AVR the bytes recorded up to now, then wait for the next */
+static avr_cycle_count_t
+uart_pty_replay_timer(struct avr_t *avr, avr_cycle_count_t when,
+        void *param)
+{
+    uart_pty_t *p = (uart_pty_t*)param;
+    struct df_uart_log_recs *r = &p->replay->recs[p->uart - '0'][DF_UART_RX];
+
+    (void)when;
+
+    while (p->xon && r->next < r->count &&
+            r->rec[r->next].cycle <= avr->cycle) {
+        uart_pty_raise(p, r->rec[r->next].byte);
+        uart_pty_delivered(p, 1);
+        r->next++;
     }
+
+    /* Full, the xon hook gets us going again */
+    if (!p->xon || r->next == r->count)
+        return 0;
+
+    return r->rec[r->next].cycle;
+}
+
+static void
+uart_pty_replay_schedule(uart_pty_t *p)
+{
+    struct df_uart_log_recs *r = &p->replay->recs[p->uart - '0'][DF_UART_RX];
+    struct avr_t *avr = p->avr;
+    uint64_t when;
+
+    if (r->next == r->count ||
+            avr_cycle_timer_status(avr, uart_pty_replay_timer, p))
+        return;
+
+    when = r->rec[r->next].cycle;
+    avr_cycle_timer_register(avr, when > avr->cycle ? when - avr->cycle : 0,
+            uart_pty_replay_timer, p);
+}
+
+/* Get what the pty gave us moving towards the AVR */
+static void
+uart_pty_incoming(uart_pty_t *p)
+{
+    struct avr_t *avr = p->avr;
+
+    if (p->replay) {
+        uart_pty_replay_schedule(p);
+        return;
+    }
+
+    if (p->timing == DF_UART_TIMING_TURBO) {
+        if (!p->record) {
+            uart_pty_flush_incoming(p);
+        } else if (!df_ring_isempty(&p->port.out) &&
+                !avr_cycle_timer_status(avr, uart_pty_record_timer, p)) {
+            avr_cycle_timer_register(avr, 1, uart_pty_record_timer, p);
+        }
+        return;
+    }
+
+    if (df_ring_isempty(&p->port.out) ||
+            avr_cycle_timer_status(avr, uart_pty_rx_timer, p))
+        return;
+
+    /* On an idle line the next frame can start right away */
+    if (p->rx_next < avr->cycle)
+        p->rx_next = avr->cycle;
+    avr_cycle_timer_register(avr, p->rx_next - avr->cycle,
+            uart_pty_rx_timer, p);
 }
 
 /*
@@ -98,11 +406,13 @@ uart_pty_xon_hook(struct avr_irq_t *irq, uint32_t value, void *param)
 
 	uart_pty_t *p = (uart_pty_t*)param;
 
-    if (!p->xon)
+    if (!p->xon) {
         df_log_msg(DF_LOG_INFO, "UART%c xon\n", p->uart);
+        p->xon_count++;
+    }
 
     p->xon = 1;
-    uart_pty_flush_incoming(p);
+    uart_pty_incoming(p);
 }
 
 /*
@@ -116,91 +426,218 @@ uart_pty_xoff_hook(struct avr_irq_t *irq, uint32_t value, void *param)
 
 	uart_pty_t *p = (uart_pty_t*)param;
 
-    if (p->xon)
+    if (p->xon) {
         df_log_msg(DF_LOG_INFO, "UART%c xoff\n", p->uart);
+        p->xoff_count++;
+    }
 
     p->xon = 0;
 }
 
+/* Take the next client of a socket UART */
+static void
+uart_pty_accept(uart_pty_t *p)
+{
+    int one = 1;
+    int fd;
+
+    fd = accept(p->port.listen, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+            df_log_msg(DF_LOG_WARN, "UART%c: failed to accept: %s\n",
+                    p->uart, strerror(errno));
+        return;
+    }
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        df_log_msg(DF_LOG_WARN, "UART%c: failed to setup client: %s\n",
+                p->uart, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    /* Single bytes are the usual traffic, don't hold them back */
+    if (p->port.kind == UART_PTY_KIND_TCP)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    p->port.s = fd;
+    df_log_msg(DF_LOG_INFO, "UART%c connected\n", p->uart);
+}
+
+/* The socket UART's client went away, make way for the next one */
+static void
+uart_pty_hangup(uart_pty_t *p)
+{
+    df_log_msg(DF_LOG_INFO, "UART%c disconnected\n", p->uart);
+    close(p->port.s);
+    p->port.s = -1;
+    df_ring_discard(&p->port.in);
+}
+
 static void *
 uart_pty_thread(void *param)
 {
 	uart_pty_t *p = (uart_pty_t*)param;
     int ret;
+    int hup = 0;
+    int timeout;
     sigset_t set;
 
-    /* Setup our poll info. We'll always be checking the tty */
-    struct pollfd pfd = {
-        .fd = p->port.s,
+    df_log_set_clock(p->clock);
+
+    /* Setup our poll info. We'll always be checking the tty as well
+     * as our wakeup pipe, which tells us the AVR has sent bytes.
+     */
+    struct pollfd pfd[UART_PTY_POLL_COUNT] = {
+        [UART_PTY_POLL_TTY] = { .fd = p->port.s },
+        [UART_PTY_POLL_WAKE] = { .fd = p->wake[0], .events = POLLIN },
     };
 
     sigfillset(&set);
     sigprocmask(SIG_SETMASK, &set, NULL);
 
-	while (1) {
-        /* Reset the events we care about to just HUP */
-        pfd.events = POLLHUP;
+	while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        /* Queue what a restored snapshot left for the AVR */
+        if (__atomic_load_n(&p->restore_pending, __ATOMIC_ACQUIRE)) {
+            if (df_ring_write(&p->port.out, p->restore_buf,
+                        p->restore_len) != p->restore_len)
+                df_log_msg(DF_LOG_WARN, "UART%c: dropped bytes queued in "
+                        "the snapshot\n", p->uart);
+            __atomic_store_n(&p->restore_pending, 0, __ATOMIC_RELEASE);
+        }
+
+        /* POLLHUP is always reported, no need to ask for it */
+        pfd[UART_PTY_POLL_TTY].events = 0;
 
-        // read more only if buffer was empty
-        if (p->port.buffer_len == p->port.buffer_done) {
-            /* listen for if there's data to read */
-            pfd.events |= POLLIN;
+        /* read more only if there's room for it, otherwise ask the
+         * AVR side to wake us once it has drained some
+         */
+        if (!df_ring_isfull(&p->port.out)) {
+            pfd[UART_PTY_POLL_TTY].events |= POLLIN;
+        } else {
+            __atomic_store_n(&p->want_space, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!df_ring_isfull(&p->port.out)) {
+                __atomic_store_n(&p->want_space, 0, __ATOMIC_RELAXED);
+                pfd[UART_PTY_POLL_TTY].events |= POLLIN;
+            }
         }
 
-        /* If we have data in our outbound fifo, check that we can write */
-        if (!uart_pty_fifo_isempty(&p->port.in)) {
-            pfd.events |= POLLOUT;
+        /* If we have data in our outbound ring, check that we can write */
+        if (!df_ring_isempty(&p->port.in)) {
+            pfd[UART_PTY_POLL_TTY].events |= POLLOUT;
 		}
 
-        /* Something short but not too short */
-        ret = poll(&pfd, 1, 1);
+        /* While nobody is connected, park the tty so its constant
+         * POLLHUP doesn't spin us and only look at it periodically.
+         * Otherwise we sleep until the tty or the AVR needs us.
+         */
+        if (hup) {
+            pfd[UART_PTY_POLL_TTY].fd = -1;
+            timeout = UART_PTY_HUP_RECHECK;
+        } else if (p->port.s == -1) {
+            /* A socket without a client, wait for one */
+            pfd[UART_PTY_POLL_TTY].fd = p->port.listen;
+            pfd[UART_PTY_POLL_TTY].events = POLLIN;
+            timeout = -1;
+        } else {
+            pfd[UART_PTY_POLL_TTY].fd = p->port.s;
+            timeout = -1;
+        }
+
+        ret = poll(pfd, UART_PTY_POLL_COUNT, timeout);
 
-		if (!ret)
-			continue;
-		if (ret < 0)
+		if (ret < 0) {
+            if (errno == EINTR)
+                continue;
 			break;
+        }
 
-        /* If no one is connected to the UART, we don't want to
-         * cache data.
-         */
-        if (pfd.revents & POLLHUP) {
-            uart_pty_fifo_read(&p->port.in);
+        if (pfd[UART_PTY_POLL_WAKE].revents & POLLIN)
+            uart_pty_wake_drain(p);
+
+        if (hup) {
+            struct pollfd probe = {
+                .fd = p->port.s,
+            };
+
+            /* Still no one there? */
+            if (poll(&probe, 1, 0) < 0 || (probe.revents & POLLHUP)) {
+                df_ring_discard(&p->port.in);
+                continue;
+            }
+
+            df_log_msg(DF_LOG_INFO, "UART%c connected\n", p->uart);
+            hup = 0;
+            continue;
         }
 
-        if (pfd.revents & POLLIN) {
-            ssize_t r = read(p->port.s, p->port.buffer,
-                    sizeof(p->port.buffer) - 1);
-            p->port.buffer_len = r;
-            p->port.buffer_done = 0;
-            TRACE(hdump("pty recv", p->port.buffer, r);)
+        /* Like a pty nobody has open, nobody hears what the AVR sends */
+        if (p->port.s == -1) {
+            df_ring_discard(&p->port.in);
+            if (pfd[UART_PTY_POLL_TTY].revents & POLLIN)
+                uart_pty_accept(p);
+            continue;
         }
 
-        // write them in fifo
-        while (p->port.buffer_done < p->port.buffer_len &&
-                !uart_pty_fifo_isfull(&p->port.out)) {
-            int idx = p->port.buffer_done++;
-            uart_pty_fifo_write(&p->port.out, p->port.buffer[idx]);
+        /* If no one is connected to the UART, we don't want to
+         * cache data. A socket's client may have left us bytes to read
+         * first, it's gone once read() says so.
+         */
+        if (p->port.kind != UART_PTY_KIND_PTY) {
+            if ((pfd[UART_PTY_POLL_TTY].revents & (POLLHUP | POLLERR)) &&
+                    !(pfd[UART_PTY_POLL_TTY].revents & POLLIN)) {
+                uart_pty_hangup(p);
+                continue;
+            }
+        } else if (pfd[UART_PTY_POLL_TTY].revents & POLLHUP) {
+            df_log_msg(DF_LOG_INFO, "UART%c disconnected\n", p->uart);
+            df_ring_discard(&p->port.in);
+            hup = 1;
+            continue;
+        }
 
-            df_log_msg(DF_LOG_DEBUG, "w %3d:%02x\n", p->port.out.write,
-                    p->port.buffer[idx]);
+        /* Read straight into the ring headed for the AVR */
+        if (pfd[UART_PTY_POLL_TTY].revents & POLLIN) {
+            uint8_t *dst;
+            uint32_t len = df_ring_peek_write(&p->port.out, &dst);
+            ssize_t r = read(p->port.s, dst, len);
+
+            if (r > 0) {
+                TRACE(hdump("pty recv", dst, r);)
+                df_ring_commit_write(&p->port.out, r);
+                df_trace(DF_TRACE_UART_PTY_READ, df_clock_cycle(p->clock),
+                        p->uart, r, 0);
+            } else if (p->port.kind != UART_PTY_KIND_PTY && (r == 0 ||
+                        (errno != EAGAIN && errno != EINTR))) {
+                uart_pty_hangup(p);
+                continue;
+            }
         }
 
-        /* Can we write data to the TTY */
-        if (pfd.revents & POLLOUT) {
-            uint8_t buffer[512];
-            // write them in fifo
-            uint8_t *dst = buffer;
-            while (!uart_pty_fifo_isempty(&p->port.in) &&
-                    dst < (buffer + sizeof(buffer)))
-                *dst++ = uart_pty_fifo_read(&p->port.in);
-            size_t len = dst - buffer;
-            TRACE(size_t r =) write(p->port.s, buffer, len);
-            TRACE(hdump("pty send", buffer, r);)
+        /* Can we write data to the TTY, straight out of the ring */
+        if (pfd[UART_PTY_POLL_TTY].revents & POLLOUT) {
+            uint8_t *src;
+            uint32_t len = df_ring_peek_read(&p->port.in, &src);
+            ssize_t r;
+
+            /* A client leaving mustn't SIGPIPE us */
+            if (p->port.kind == UART_PTY_KIND_PTY)
+                r = write(p->port.s, src, len);
+            else
+                r = send(p->port.s, src, len, MSG_NOSIGNAL);
+
+            if (r > 0) {
+                TRACE(hdump("pty send", src, r);)
+                df_ring_commit_read(&p->port.in, r);
+            }
 		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
+
+		/* We still can't call uart_pty_flush_incoming() here. The ring
+		 * is safe to touch from both sides now, but the AVR's IRQs
+		 * must only ever be raised from the thread running the core.
+		 */
 	}
 	return NULL;
 }
@@ -210,23 +647,13 @@ static const char * irq_names[IRQ_UART_PTY_COUNT] = {
 	[IRQ_UART_PTY_BYTE_OUT] = "8>uart_pty.out",
 };
 
-int
-uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
+static int
+uart_pty_open_pty(uart_pty_t *p)
 {
     int m, s;
     struct termios tio;
-    int ret;
 
-    /* Clear our structure */
-	memset(p, 0, sizeof(*p));
-    p->port.s = -1;
-
-    /* Store the 'name' of the UART we are working with */
-    p->uart = uart;
-
-	p->avr = avr;
-	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
-	avr_irq_register_notify(p->irq + IRQ_UART_PTY_BYTE_IN, uart_pty_in_hook, p);
+    p->port.kind = UART_PTY_KIND_PTY;
 
     if (openpty(&m, &s, p->port.slavename, NULL, NULL) < 0) {
         fprintf(stderr, "Unable to create pty for UART%c: %s\n",
@@ -259,6 +686,146 @@ uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
      */
     close(s);
 
+    return 0;
+
+err:
+    close(m);
+    close(s);
+    return -1;
+}
+
+/* Listen on 'fd', bound to 'addr', for clients one after another */
+static int
+uart_pty_listen(uart_pty_t *p, int fd, const struct sockaddr *addr,
+        socklen_t len, const char *what)
+{
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+            bind(fd, addr, len) < 0 ||
+            listen(fd, UART_PTY_BACKLOG) < 0) {
+        fprintf(stderr, "Unable to listen on %s for UART%c: %s\n", what,
+                p->uart, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    p->port.listen = fd;
+    return 0;
+}
+
+static int
+uart_pty_open_unix(uart_pty_t *p, const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    p->port.kind = UART_PTY_KIND_UNIX;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "UART%c socket path '%s' is too long\n", p->uart,
+                path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create socket for UART%c: %s\n",
+                p->uart, strerror(errno));
+        return -1;
+    }
+
+    /* Unconditionally attempt to remove the old one */
+    unlink(path);
+
+    return uart_pty_listen(p, fd, (const struct sockaddr *)&addr,
+            sizeof(addr), path);
+}
+
+static int
+uart_pty_open_tcp(uart_pty_t *p, const char *port)
+{
+    struct sockaddr_in addr;
+    unsigned long val;
+    char *end;
+    int one = 1;
+    int fd;
+
+    p->port.kind = UART_PTY_KIND_TCP;
+
+    errno = 0;
+    val = strtoul(port, &end, 10);
+    if (errno || end == port || *end != '\0' || val == 0 || val > 65535) {
+        fprintf(stderr, "Invalid TCP port '%s' for UART%c\n", port,
+                p->uart);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(val);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create socket for UART%c: %s\n",
+                p->uart, strerror(errno));
+        return -1;
+    }
+
+    /* Restarting shouldn't have to wait out TIME_WAIT */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    return uart_pty_listen(p, fd, (const struct sockaddr *)&addr,
+            sizeof(addr), port);
+}
+
+/*
+ * Create the pty, or the socket, for 'uart_path' and the thread serving
+ * it. Kept apart from the AVR side since a board cloned with fork(),
+ * which only keeps the calling thread, needs a new one.
+ */
+static int
+uart_pty_open(uart_pty_t *p, const char *uart_path)
+{
+    int ret;
+
+    p->port.s = -1;
+    p->port.listen = -1;
+    p->wake[0] = p->wake[1] = -1;
+    p->wake_pending = 0;
+    p->want_space = 0;
+    p->stop = 0;
+    df_ring_init(&p->port.in, p->port.in_buf, sizeof(p->port.in_buf));
+    df_ring_init(&p->port.out, p->port.out_buf, sizeof(p->port.out_buf));
+
+    if (strncmp(uart_path, "unix:", 5) == 0)
+        ret = uart_pty_open_unix(p, uart_path + 5);
+    else if (strncmp(uart_path, "tcp:", 4) == 0)
+        ret = uart_pty_open_tcp(p, uart_path + 4);
+    else
+        ret = uart_pty_open_pty(p);
+    if (ret)
+        return -1;
+
+    /* Create the pipe the AVR side uses to wake the thread up */
+    if (pipe(p->wake) < 0) {
+        fprintf(stderr, "Unable to create wakeup pipe for UART%c: %s\n",
+                p->uart, strerror(errno));
+        goto err;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(p->wake[i], F_SETFL, O_NONBLOCK) < 0 ||
+                fcntl(p->wake[i], F_SETFD, FD_CLOEXEC) < 0) {
+            fprintf(stderr, "Unable to setup wakeup pipe for UART%c: %s\n",
+                    p->uart, strerror(errno));
+            goto err;
+        }
+    }
+
 	ret = pthread_create(&p->thread, NULL, uart_pty_thread, p);
     if (ret) {
         fprintf(stderr, "Failed to create thread for UART%c IRQ handling: %s\n",
@@ -269,51 +836,177 @@ uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart)
     return 0;
 
 err:
-    close(m);
+    if (p->port.s != -1) {
+        close(p->port.s);
+        p->port.s = -1;
+    }
+
+    if (p->port.listen != -1) {
+        close(p->port.listen);
+        p->port.listen = -1;
+    }
+
+    if (p->wake[0] != -1) {
+        close(p->wake[0]);
+        close(p->wake[1]);
+        p->wake[0] = p->wake[1] = -1;
+    }
 
     return -1;
 }
 
-void
-uart_pty_stop(uart_pty_t *p, const char *uart_path)
+/* Stop the thread and close the pty, leaving the AVR side wired up */
+static void
+uart_pty_close(uart_pty_t *p)
 {
 	void *ret;
-    char uart_link[1024];
     int join_status;
 
-    if (p->uart == '\0')
+    if (p->wake[0] == -1)
         return;
 
-    df_log_msg(DF_LOG_INFO, "Shutting down UART%c\n", p->uart);
+    /* Ask the thread to exit and kick it out of poll() */
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&p->wake_pending, 0, __ATOMIC_SEQ_CST);
+    uart_pty_wake(p);
+
+	if ((join_status = pthread_join(p->thread, &ret))) {
+        df_log_msg(DF_LOG_ERR, "Shutting down UART%c failed: %s\n",
+                p->uart, strerror(join_status));
+    }
+
+    if (p->port.s != -1) {
+        close(p->port.s);
+        p->port.s = -1;
+    }
+
+    if (p->port.listen != -1) {
+        close(p->port.listen);
+        p->port.listen = -1;
+    }
+
+    close(p->wake[0]);
+    close(p->wake[1]);
+    p->wake[0] = p->wake[1] = -1;
+}
+
+int
+uart_pty_init(struct avr_t *avr, uart_pty_t *p, char uart,
+        const struct df_clock *clock)
+{
+    /* Clear our structure */
+	memset(p, 0, sizeof(*p));
+    p->port.s = -1;
+    p->port.listen = -1;
+    p->wake[0] = p->wake[1] = -1;
+    df_ring_init(&p->port.in, p->port.in_buf, sizeof(p->port.in_buf));
+    df_ring_init(&p->port.out, p->port.out_buf, sizeof(p->port.out_buf));
+
+    /* Store the 'name' of the UART we are working with */
+    p->uart = uart;
+
+	p->avr = avr;
+    p->clock = clock;
+	p->irq = avr_alloc_irq(&avr->irq_pool, 0, IRQ_UART_PTY_COUNT, irq_names);
+	avr_irq_register_notify(p->irq + IRQ_UART_PTY_BYTE_IN, uart_pty_in_hook, p);
+
+    return 0;
+}
+
+static void
+uart_pty_unlink(uart_pty_t *p, const char *uart_path)
+{
+    char uart_link[1024];
 
     if (strcmp(uart_path, "on") == 0) {
         /* Remove our symlink, but don't care if its already gone */
         snprintf(uart_link, sizeof(uart_link), "/tmp/drumfish-%d-uart%c",
                 getpid(), p->uart);
         unlink(uart_link);
-    } else {
+    } else if (strncmp(uart_path, "unix:", 5) == 0) {
+        unlink(uart_path + 5);
+    } else if (strncmp(uart_path, "tcp:", 4) != 0) {
         unlink(uart_path);
     }
+}
 
-	pthread_cancel(p->thread);
+/* Say how a replay went, compared to the recording */
+void
+uart_pty_replay_report(uart_pty_t *p)
+{
+    struct df_uart_log_recs *rx;
+    struct df_uart_log_recs *tx;
 
-    if (p->port.s != -1) {
-        close(p->port.s);
-        p->port.s = -1;
+    if (p->uart == '\0' || !p->replay)
+        return;
+
+    rx = &p->replay->recs[p->uart - '0'][DF_UART_RX];
+    tx = &p->replay->recs[p->uart - '0'][DF_UART_TX];
+    if (p->replay_diffs || rx->next != rx->count || tx->next != tx->count)
+        df_log_msg(DF_LOG_WARN, "UART%c: replay differs from the recording, "
+                "%" PRIu64 " bytes sent didn't match, %zu of %zu bytes "
+                "received and %zu of %zu sent\n", p->uart, p->replay_diffs,
+                rx->next, rx->count, tx->next, tx->count);
+    else
+        df_log_msg(DF_LOG_INFO, "UART%c: replay matches the recording\n",
+                p->uart);
+}
+
+void
+uart_pty_stop(uart_pty_t *p, const char *uart_path)
+{
+    if (p->uart == '\0' || p->wake[0] == -1)
+        return;
+
+    df_log_msg(DF_LOG_INFO, "Shutting down UART%c\n", p->uart);
+
+    uart_pty_unlink(p, uart_path);
+    uart_pty_close(p);
+}
+
+/* Point the requested path at our pty */
+static void
+uart_pty_link(uart_pty_t *p, const char *uart_path)
+{
+    char uart_link[1024];
+
+    /* Sockets are already where they were asked to be */
+    if (p->port.kind != UART_PTY_KIND_PTY) {
+        printf("UART%c available at %s\n", p->uart, uart_path);
+        return;
     }
 
-	if ((join_status = pthread_join(p->thread, &ret))) {
-        df_log_msg(DF_LOG_ERR, "Shutting down UART%c failed: %s\n",
-                p->uart, strerror(join_status));
+    /* Build the symlink path for the UART */
+    if (strcmp(uart_path, "on") == 0) {
+        snprintf(uart_link, sizeof(uart_link), "/tmp/drumfish-%d-uart%c",
+                getpid(), p->uart);
+        /* Unconditionally attempt to remove the old one */
+        unlink(uart_link);
+
+        if (symlink(p->port.slavename, uart_link) != 0) {
+            fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s\n",
+                    p->uart, uart_link, p->port.slavename, strerror(errno));
+        } else {
+            printf("UART%c available at %s\n", p->uart, uart_link);
+        }
+    } else {
+        /* Unconditionally attempt to remove the old one */
+        unlink(uart_path);
+
+        if (symlink(p->port.slavename, uart_path) != 0) {
+            fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s\n",
+                    p->uart, uart_path, p->port.slavename, strerror(errno));
+        } else {
+            printf("UART%c available at %s\n", p->uart, uart_path);
+        }
     }
 }
 
-void
+int
 uart_pty_connect(uart_pty_t *p, const char *uart_path)
 {
 	uint32_t f = 0;
     avr_irq_t *src, *dst, *xon, *xoff;
-    char uart_link[1024];
 
     /* Disable stdio echoing of the UART since we are transmitting
      * binary data. (This feature should really be an opt-in rather
@@ -342,29 +1035,163 @@ uart_pty_connect(uart_pty_t *p, const char *uart_path)
 	if (xoff)
 		avr_irq_register_notify(xoff, uart_pty_xoff_hook, p);
 
-    /* Build the symlink path for the UART */
-    if (strcmp(uart_path, "on") == 0) {
-        snprintf(uart_link, sizeof(uart_link), "/tmp/drumfish-%d-uart%c",
-                getpid(), p->uart);
-        /* Unconditionally attempt to remove the old one */
-        unlink(uart_link);
+    /* A replay stands in for the host side */
+    if (p->replay) {
+        printf("UART%c replaying its recording\n", p->uart);
+        uart_pty_replay_schedule(p);
+        return 0;
+    }
+    if (p->deterministic) {
+        printf("UART%c takes its input from '--input'\n", p->uart);
+        return 0;
+    }
 
-        if (symlink(p->port.slavename, uart_link) != 0) {
-            fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s\n",
-                    p->uart, uart_link, p->port.slavename, strerror(errno));
-        } else {
-            printf("UART%c available at %s\n", p->uart, uart_link);
-        }
-    } else {
-        /* Unconditionally attempt to remove the old one */
-        unlink(uart_path);
+    if (uart_pty_open(p, uart_path))
+        return -1;
 
-        if (symlink(p->port.slavename, uart_path) != 0) {
-            fprintf(stderr, "UART%c: Can't create symlink to %s from %s: %s\n",
-                    p->uart, uart_path, p->port.slavename, strerror(errno));
-        } else {
-            printf("UART%c available at %s\n", p->uart, uart_path);
-        }
+    uart_pty_link(p, uart_path);
+
+    return 0;
+}
+
+void
+uart_pty_timing(uart_pty_t *p, enum df_uart_timing timing, uint16_t ucsra)
+{
+    p->timing = timing;
+    p->ucsra = ucsra;
+}
+
+void
+uart_pty_log(uart_pty_t *p, struct df_uart_log *record,
+        struct df_uart_log *replay, struct df_uart_log *trace)
+{
+    p->record = record;
+    p->replay = replay;
+    p->trace = trace;
+}
+
+void
+uart_pty_deterministic(uart_pty_t *p)
+{
+    p->deterministic = 1;
+}
+
+/*
+ * Called from a cycle timer, so like the rest of the board the bytes
+ * reach the AVR at the same cycles every run. Nothing else writes the
+ * ring without a host side.
+ */
+void
+uart_pty_inject(uart_pty_t *p, const uint8_t *buf, size_t len)
+{
+    size_t n;
+
+    n = df_ring_write(&p->port.out, buf, len);
+    if (n < len)
+        df_log_msg(DF_LOG_WARN, "UART%c: dropped %zu bytes of input the AVR "
+                "hasn't taken\n", p->uart, len - n);
+
+    uart_pty_incoming(p);
+}
+
+void
+uart_pty_tick(uart_pty_t *p)
+{
+    /* Slices end wherever the host's scheduling has them end */
+    if (p->deterministic)
+        return;
+
+    if (p->uart != '\0' && p->xon && !df_ring_isempty(&p->port.out))
+        uart_pty_incoming(p);
+}
+
+/*
+ * Give a board cloned with fork() a pty, or socket, of its own, after the
+ * one it was cloned from was stopped with uart_pty_stop(). The AVR side
+ * stays as is.
+ */
+int
+uart_pty_reopen(uart_pty_t *p, const char *uart_path)
+{
+    if (p->uart == '\0' || p->replay || p->deterministic)
+        return 0;
+
+    if (uart_pty_open(p, uart_path))
+        return -1;
+
+    uart_pty_link(p, uart_path);
+
+    return 0;
+}
+
+/*
+ * Save the AVR's side of the UART. Only called while the core isn't
+ * running, which makes us the ring's consumer, so we can look at what's
+ * queued for the AVR without taking it.
+ */
+int
+uart_pty_save(uart_pty_t *p, FILE *f)
+{
+    struct uart_pty_snapshot s;
+    df_ring_t *r = &p->port.out;
+    uint32_t tail;
+    uint32_t i;
+
+    memset(&s, 0, sizeof(s));
+
+    if (p->uart != '\0') {
+        s.rx_next = p->rx_next;
+        s.xon = p->xon;
+        s.len = df_ring_count(r);
+        tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        for (i = 0; i < s.len; i++)
+            s.buf[i] = r->buf[(tail + i) & r->mask];
     }
+
+    return df_snapshot_write(f, UART_PTY_SNAPSHOT, &s, sizeof(s));
 }
 
+int
+uart_pty_restore(uart_pty_t *p, FILE *f)
+{
+    struct uart_pty_snapshot s;
+
+    if (df_snapshot_read(f, UART_PTY_SNAPSHOT, &s, sizeof(s)))
+        return -1;
+
+    if (p->uart == '\0')
+        return 0;
+
+    p->rx_next = s.rx_next;
+    p->xon = s.xon;
+    if (s.len > UART_PTY_RING_SIZE) {
+        df_log_msg(DF_LOG_WARN, "UART%c: dropped bytes queued in the "
+                "snapshot\n", p->uart);
+        return 0;
+    }
+
+    /* Without a thread we're the ring's only writer */
+    if (p->wake[0] == -1) {
+        if (df_ring_write(&p->port.out, s.buf, s.len) != s.len)
+            df_log_msg(DF_LOG_WARN, "UART%c: dropped bytes queued in the "
+                    "snapshot\n", p->uart);
+        return 0;
+    }
+
+    /* Otherwise the thread writes 'out', hand the bytes over and let
+     * it queue them next time round its loop
+     */
+    if (s.len == 0)
+        return 0;
+    if (__atomic_load_n(&p->restore_pending, __ATOMIC_ACQUIRE)) {
+        df_log_msg(DF_LOG_WARN, "UART%c: dropped bytes queued in the "
+                "snapshot\n", p->uart);
+        return 0;
+    }
+    memcpy(p->restore_buf, s.buf, s.len);
+    p->restore_len = s.len;
+    __atomic_store_n(&p->restore_pending, 1, __ATOMIC_RELEASE);
+    uart_pty_wake(p);
+
+    return 0;
+}
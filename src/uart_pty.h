@@ -26,8 +26,14 @@
 #define __UART_PTY_H___
 
 #include <pthread.h>
+#include <stdio.h>
 #include "sim_irq.h"
-#include "fifo_declare.h"
+
+#include "drumfish.h"
+#include "df_ring.h"
+
+struct df_clock;
+struct df_uart_log;
 
 enum {
 	IRQ_UART_PTY_BYTE_IN = 0,
@@ -35,33 +41,114 @@ enum {
 	IRQ_UART_PTY_COUNT
 };
 
-DECLARE_FIFO(uint8_t, uart_pty_fifo, 512);
+/* Size of each direction's ring, must be a power of 2 */
+#define UART_PTY_RING_SIZE 4096
+
+/* What a UART's path asked for */
+enum uart_pty_kind {
+    UART_PTY_KIND_PTY,
+    UART_PTY_KIND_UNIX,     // unix:PATH, a Unix domain socket
+    UART_PTY_KIND_TCP,      // tcp:PORT, on the loopback
+};
 
 typedef struct uart_pty_port_t {
 	int 		s;			// socket we chat on
+    int         listen;     // clients connect here, -1 for a pty
+    enum uart_pty_kind kind;
 	char 		slavename[64];
-	uart_pty_fifo_t in;
-	uart_pty_fifo_t out;
-	uint8_t		buffer[512];
-	size_t		buffer_len;
-    size_t      buffer_done;
+    df_ring_t   in;         // AVR -> pty
+    df_ring_t   out;        // pty -> AVR
+    uint8_t     in_buf[UART_PTY_RING_SIZE];
+    uint8_t     out_buf[UART_PTY_RING_SIZE];
 } uart_pty_port_t;
 
 typedef struct uart_pty_t {
 	avr_irq_t *	irq;		// irq list
 	struct avr_t *avr;		// keep it around so we can pause it
+    const struct df_clock *clock;   // where the AVR is at, for our thread
 
 	pthread_t	thread;
 	int			xon;
     char        uart;
 
+    /* Self-pipe used by the AVR side to wake the thread when it has
+     * queued bytes for the pty or when we are shutting down.
+     */
+    int         wake[2];
+    int         wake_pending;
+    int         want_space;     // thread is waiting for room in 'out'
+    int         stop;
+
+    /* Bytes from a restored snapshot, handed to the thread to queue
+     * since it's the only writer of 'out' while it runs.
+     */
+    int         restore_pending;
+    uint32_t    restore_len;
+    uint8_t     restore_buf[UART_PTY_RING_SIZE];
+
+    /* Counted on the AVR side, for --stats */
+    uint64_t    tx_bytes;       // AVR -> pty
+    uint64_t    tx_drops;       // of those, lost to a full ring
+    uint64_t    rx_bytes;       // pty -> AVR
+    uint64_t    xon_count;
+    uint64_t    xoff_count;
+
+    /* When the bytes counted in rx_bytes got to the AVR, for how fast
+     * they actually went */
+    uint64_t    rx_first_cycle;
+    uint64_t    rx_last_cycle;
+    uint64_t    rx_first_ns;
+    uint64_t    rx_last_ns;
+
+    enum df_uart_timing timing;
+    uint16_t    ucsra;          // UCSRnA, the USART's registers follow it
+    uint64_t    rx_next;        // cycle the next frame can start, accurate
+
+    /* Writing down what goes through us, or playing back a recording
+     * in place of a host side */
+    struct df_uart_log *record;
+    struct df_uart_log *replay;
+    struct df_uart_log *trace;
+    uint64_t    replay_diffs;   // bytes sent that the recording didn't
+
+    /* No host side either, what the AVR gets comes from uart_pty_inject()
+     * at the cycles the board's input says */
+    int         deterministic;
+
     uart_pty_port_t port;
 } uart_pty_t;
 
-int uart_pty_init( struct avr_t *avr, uart_pty_t *b, char uart);
+int uart_pty_init( struct avr_t *avr, uart_pty_t *b, char uart,
+        const struct df_clock *clock);
 
 void uart_pty_stop(uart_pty_t *p, const char *uart_path);
 
-void uart_pty_connect(uart_pty_t *p, const char *uart_path);
+int uart_pty_connect(uart_pty_t *p, const char *uart_path);
+
+/* Pace bytes into the AVR by 'timing', using the USART at 'ucsra' */
+void uart_pty_timing(uart_pty_t *p, enum df_uart_timing timing,
+        uint16_t ucsra);
+
+/* Record to, replay from or trace to these logs. Set up before connecting. */
+void uart_pty_log(uart_pty_t *p, struct df_uart_log *record,
+        struct df_uart_log *replay, struct df_uart_log *trace);
+
+/* Go deterministic, before connecting */
+void uart_pty_deterministic(uart_pty_t *p);
+
+/* Queue bytes for the AVR, from the board's thread, deterministic only */
+void uart_pty_inject(uart_pty_t *p, const uint8_t *buf, size_t len);
+
+/* At the end of a replay */
+void uart_pty_replay_report(uart_pty_t *p);
+
+/* Hand over bytes that came in while the AVR wasn't asking for them */
+void uart_pty_tick(uart_pty_t *p);
+
+int uart_pty_reopen(uart_pty_t *p, const char *uart_path);
+
+int uart_pty_save(uart_pty_t *p, FILE *f);
+
+int uart_pty_restore(uart_pty_t *p, FILE *f);
 
 #endif /* __UART_PTY_H___ */
@@ -0,0 +1,383 @@
+#!/usr/bin/env python3
+#
+# Throughput benchmarks: runs canned firmware workloads under drumfish
+# flat out and prints a JSON object per workload on stdout.
+#
+#   sim_mhz        simulated cycles per wall clock second, in millions
+#   mips           instructions per wall clock second, in millions
+#   cpu_per_sim_s  host CPU seconds per simulated second
+#   max_rss_kb     peak resident memory
+#
+# The workloads are assembled here, there's no AVR toolchain needed.
+# BENCH_SECONDS sets how long each one runs, 5 by default. Options, e.g.
+# --no-decode-cache, are passed on to drumfish and workload names pick
+# which run.
+
+import json
+import os
+import select
+import signal
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+import tty
+
+DRUMFISH = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+        '..', 'src', 'drumfish')
+
+# drumfish boots the ATmega128RFA1 from its bootloader section
+BOOT_WORD = 0x1f800 // 2
+VECTORS = 72
+
+# I/O addresses (for in/out) and data addresses (for lds/sts)
+SREG = 0x3f
+SPL = 0x3d
+SPH = 0x3e
+SMCR = 0x33
+TCCR0A = 0x24
+TCCR0B = 0x25
+OCR0A = 0x27
+TIMSK0 = 0x6e
+UCSR1A = 0xc8
+UCSR1B = 0xc9
+UCSR1C = 0xca
+UBRR1L = 0xcc
+UBRR1H = 0xcd
+UDR1 = 0xce
+
+
+class Asm(object):
+    """Just enough of an AVR assembler for the workloads below"""
+
+    def __init__(self, org):
+        self.org = org
+        self.prog = []
+        self.labels = {}
+
+    def label(self, name):
+        self.labels[name] = self.org + sum(len(w) for w in self.prog)
+
+    def _emit(self, *words):
+        self.prog.append(list(words))
+
+    def _rel(self, index, target):
+        return self.labels[target] - (self.org + index + 1)
+
+    # Fixed up once every label is known
+    def _later(self, size, fn):
+        self.prog.append([fn] * size)
+
+    def ldi(self, d, k):
+        self._emit(0xe000 | ((k & 0xf0) << 4) | ((d - 16) << 4) | (k & 0x0f))
+
+    def subi(self, d, k):
+        self._emit(0x5000 | ((k & 0xf0) << 4) | ((d - 16) << 4) | (k & 0x0f))
+
+    def sbci(self, d, k):
+        self._emit(0x4000 | ((k & 0xf0) << 4) | ((d - 16) << 4) | (k & 0x0f))
+
+    def _rr(self, op, d, r):
+        self._emit(op | ((r & 0x10) << 5) | (d << 4) | (r & 0x0f))
+
+    def add(self, d, r):
+        self._rr(0x0c00, d, r)
+
+    def eor(self, d, r):
+        self._rr(0x2400, d, r)
+
+    def mul(self, d, r):
+        self._rr(0x9c00, d, r)
+
+    def inc(self, d):
+        self._emit(0x9403 | (d << 4))
+
+    def out(self, a, r):
+        self._emit(0xb800 | ((a & 0x30) << 5) | (r << 4) | (a & 0x0f))
+
+    def in_(self, d, a):
+        self._emit(0xb000 | ((a & 0x30) << 5) | (d << 4) | (a & 0x0f))
+
+    def sts(self, k, r):
+        self._emit(0x9200 | (r << 4), k)
+
+    def lds(self, d, k):
+        self._emit(0x9000 | (d << 4), k)
+
+    def sbrs(self, r, b):
+        self._emit(0xfe00 | (r << 4) | b)
+
+    def push(self, r):
+        self._emit(0x920f | (r << 4))
+
+    def pop(self, d):
+        self._emit(0x900f | (d << 4))
+
+    def sei(self):
+        self._emit(0x9478)
+
+    def cli(self):
+        self._emit(0x94f8)
+
+    def sleep(self):
+        self._emit(0x9588)
+
+    def reti(self):
+        self._emit(0x9518)
+
+    def rjmp(self, target):
+        i = sum(len(w) for w in self.prog)
+        self._later(1, lambda: 0xc000 | (self._rel(i, target) & 0xfff))
+
+    def brne(self, target):
+        i = sum(len(w) for w in self.prog)
+        self._later(1, lambda: 0xf401 | ((self._rel(i, target) & 0x7f) << 3))
+
+    def words(self):
+        out = []
+        for ins in self.prog:
+            if callable(ins[0]):
+                out.append(ins[0]())
+            else:
+                out.extend(ins)
+        return out
+
+
+def jmp(k):
+    return [0x940c | (((k >> 17) & 0x1f) << 4) | ((k >> 16) & 1), k & 0xffff]
+
+
+def ihex(chunks):
+    """Intel HEX of {byte address: bytes}, addressed like the bootloader"""
+    lines = []
+
+    def record(kind, addr, data):
+        body = bytes([len(data), addr >> 8, addr & 0xff, kind]) + data
+        lines.append(':%s%02X' % (body.hex().upper(),
+            (-sum(body)) & 0xff))
+
+    segment = None
+    for base, data in sorted(chunks.items()):
+        for off in range(0, len(data), 16):
+            addr = base + off
+            if addr >> 16 != segment:
+                segment = addr >> 16
+                record(2, 0, bytes([segment << 4, 0]))
+            record(0, addr & 0xffff, data[off:off + 16])
+    record(1, 0, b'')
+    return '\n'.join(lines) + '\n'
+
+
+def firmware(body):
+    """Every vector, reset included, jumps into 'body' at the boot section"""
+    a = Asm(BOOT_WORD)
+    a.label('start')
+    a.cli()
+    a.ldi(16, 0xff)
+    a.out(SPL, 16)
+    a.ldi(16, 0x41)
+    a.out(SPH, 16)
+    body(a)
+    # The one interrupt handler, counting in r24
+    a.label('isr')
+    a.push(16)
+    a.in_(16, SREG)
+    a.inc(24)
+    a.out(SREG, 16)
+    a.pop(16)
+    a.reti()
+
+    vectors = jmp(a.labels['start'])
+    for _ in range(1, VECTORS):
+        vectors += jmp(a.labels['isr'])
+
+    le = lambda words: b''.join(bytes([w & 0xff, w >> 8]) for w in words)
+    return ihex({0: le(vectors), BOOT_WORD * 2: le(a.words())})
+
+
+def alu(a):
+    a.ldi(16, 1)
+    a.ldi(17, 3)
+    a.label('loop')
+    a.add(18, 16)
+    a.eor(19, 18)
+    a.mul(18, 17)
+    a.add(20, 0)
+    a.inc(16)
+    a.subi(21, 1)
+    a.sbci(22, 0)
+    a.rjmp('loop')
+
+
+def timers(a):
+    # Timer0 in CTC mode, interrupting every 32 cycles
+    a.ldi(16, 0x02)
+    a.out(TCCR0A, 16)
+    a.ldi(16, 31)
+    a.out(OCR0A, 16)
+    a.ldi(16, 0x01)
+    a.out(TCCR0B, 16)
+    a.ldi(16, 0x02)
+    a.sts(TIMSK0, 16)
+    a.sei()
+    a.label('loop')
+    a.inc(20)
+    a.rjmp('loop')
+
+
+def uart_echo(a):
+    # USART1 at 1Mbaud, 8N1, echoing whatever comes in
+    a.ldi(16, 0)
+    a.sts(UBRR1H, 16)
+    a.sts(UBRR1L, 16)
+    a.ldi(16, 0x06)
+    a.sts(UCSR1C, 16)
+    a.ldi(16, 0x18)
+    a.sts(UCSR1B, 16)
+    a.label('loop')
+    a.lds(17, UCSR1A)
+    a.sbrs(17, 7)
+    a.rjmp('loop')
+    a.lds(18, UDR1)
+    a.label('wait')
+    a.lds(17, UCSR1A)
+    a.sbrs(17, 5)
+    a.rjmp('wait')
+    a.sts(UDR1, 18)
+    a.rjmp('loop')
+
+
+def duty_cycle(a):
+    # Wake from idle every Timer0 overflow at clk/1024, ~16ms, and do a
+    # ~12k cycle burst of work, about 5% duty
+    a.ldi(16, 0x05)
+    a.out(TCCR0B, 16)
+    a.ldi(16, 0x01)
+    a.sts(TIMSK0, 16)
+    a.out(SMCR, 16)
+    a.sei()
+    a.label('loop')
+    a.sleep()
+    a.ldi(26, 0)
+    a.ldi(27, 0x10)
+    a.label('work')
+    a.subi(26, 1)
+    a.sbci(27, 0)
+    a.brne('work')
+    a.rjmp('loop')
+
+
+def open_uart(path, proc):
+    """Wait for drumfish to create the UART's pty, returns a raw fd"""
+    deadline = time.time() + 10
+    while not os.path.exists(path):
+        if time.time() > deadline or proc.poll() is not None:
+            return None
+        time.sleep(0.05)
+
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    tty.setraw(fd, termios.TCSANOW)
+    return fd
+
+
+def feed_uart(path, proc, seconds):
+    """Keep the echo firmware's UART busy, returns bytes echoed"""
+    fd = open_uart(path, proc)
+    if fd is None:
+        return 0
+
+    chunk = bytes(range(256))
+    echoed = 0
+    end = time.time() + seconds
+    while time.time() < end:
+        r, w, _ = select.select([fd], [fd], [], 0.1)
+        if w:
+            try:
+                os.write(fd, chunk)
+            except BlockingIOError:
+                pass
+        if r:
+            try:
+                echoed += len(os.read(fd, 65536))
+            except BlockingIOError:
+                pass
+    os.close(fd)
+    return echoed
+
+
+def git_rev(path):
+    try:
+        return subprocess.check_output(['git', '-C', path, 'rev-parse',
+            'HEAD'], stderr=subprocess.DEVNULL).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run(name, body, seconds, tmp, uart=False, opts=()):
+    hexfile = os.path.join(tmp, name + '.hex')
+    stats = os.path.join(tmp, name + '.json')
+    with open(hexfile, 'w') as f:
+        f.write(firmware(body))
+
+    uart_path = os.path.join(tmp, name + '.uart')
+    cmd = [DRUMFISH, '-s', os.path.join(tmp, name + '.flash'), '-e',
+            '-f', hexfile, '--speed=max', '--stats=' + stats,
+            '-p', 'uart1=' + (uart_path if uart else 'off'),
+            '-p', 'radio=off'] + list(opts)
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+
+    echoed = None
+    if uart:
+        echoed = feed_uart(uart_path, proc, seconds)
+    else:
+        time.sleep(seconds)
+
+    proc.send_signal(signal.SIGTERM)
+    proc.wait()
+
+    with open(stats) as f:
+        s = json.load(f)
+
+    board = s['boards'][0]
+    wall = s['run_ns'] / 1e9
+    sim = board['cycles'] / board['frequency']
+    result = {
+        'workload': name,
+        'wall_s': round(wall, 3),
+        'cycles': board['cycles'],
+        'instructions': board['instructions'],
+        'sim_mhz': round(board['cycles'] / wall / 1e6, 3),
+        'mips': round(board['instructions'] / wall / 1e6, 3),
+        'cpu_per_sim_s': round(s['cpu_ns'] / 1e9 / sim, 4) if sim else None,
+        'max_rss_kb': s['max_rss_kb'],
+        'decode_cache': '--no-decode-cache' not in opts,
+    }
+    if echoed is not None:
+        result['uart_bytes_per_s'] = round(echoed / seconds)
+    return result
+
+
+WORKLOADS = [
+    ('alu', alu, False),
+    ('timers', timers, False),
+    ('uart_echo', uart_echo, True),
+    ('duty_cycle', duty_cycle, False),
+]
+
+if __name__ == '__main__':
+    seconds = float(os.environ.get('BENCH_SECONDS', '5'))
+    opts = [a for a in sys.argv[1:] if a.startswith('-')]
+    only = [a for a in sys.argv[1:] if not a.startswith('-')]
+    top = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+    revs = {'drumfish': git_rev(top),
+            'simavr': git_rev(os.path.join(top, 'simavr'))}
+
+    with tempfile.TemporaryDirectory(prefix='drumfish-bench-') as tmp:
+        for name, body, uart in WORKLOADS:
+            if only and name not in only:
+                continue
+            result = run(name, body, seconds, tmp, uart, opts)
+            result.update(revs)
+            print(json.dumps(result))
+            sys.stdout.flush()
@@ -0,0 +1,734 @@
+/*
+ * decode-test.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The pre-decoded flash against simavr. Every program is run on two
+ * cores, one by avr_run() alone and one through df_decode_run() the way
+ * df_board_slice() does it, and they have to end up the same: registers,
+ * SREG, PC, cycles, SRAM and the stack.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_cycle_timers.h>
+#include <sim_io.h>
+
+#include "df_decode.h"
+
+/* Where programs go, clear of the reset vector df_decode_run() avoids */
+#define BASE        0x100
+/* And the SPM test, both in the boot loader section */
+#define SPM_BASE    0x1f800
+#define SPM_PAGE    0x1f000
+#define PAGE_SIZE   256
+
+/* As m128rfa1.c has them */
+#define SPMCSR      0x57
+#define SPMEN       (1 << 0)
+#define PGERS       (1 << 1)
+#define PGWRT       (1 << 2)
+#define SPM_WINDOW  4
+
+/* I/O addresses, for OUT */
+#define IO_SPMCSR   (SPMCSR - 0x20)
+#define IO_RAMPZ    0x3b
+
+/* SRAM the programs may load and store, and the top of the stack */
+#define SRAM        0x200
+#define SRAM_SIZE   0x100
+#define STACK_SIZE  16
+
+#define MAX_WORDS   128
+#define MAX_STEPS   10000
+#define RANDOM_RUNS 2000
+
+struct core {
+    avr_t *avr;
+    struct df_decode *dc;       /**< NULL for the one simavr runs alone */
+    uint32_t spm_addr;
+    avr_cycle_count_t start;
+    unsigned int decoded;       /**< instructions df_decode_run() ran */
+};
+
+struct prog {
+    uint16_t w[MAX_WORDS];
+    unsigned int n;
+};
+
+/* What both cores start a program with */
+struct state {
+    uint8_t reg[32];
+    uint8_t sreg;               /**< bit per flag, I always clear */
+    uint8_t sram[SRAM_SIZE];
+};
+
+static struct core ref, dut;
+static unsigned int cases, failures;
+static uint32_t seed = 0x2014d3a5;
+
+static uint32_t
+rnd(void)
+{
+    /* xorshift32, the same on every libc */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void
+emit(struct prog *p, uint16_t w)
+{
+    if (p->n < MAX_WORDS)
+        p->w[p->n++] = w;
+}
+
+/* Rd, Rr */
+static uint16_t
+op_rr(uint16_t op, unsigned int d, unsigned int r)
+{
+    return op | ((r & 0x10) << 5) | ((d & 0x1f) << 4) | (r & 0x0f);
+}
+
+/* Rd of r16..r31, K */
+static uint16_t
+op_rk(uint16_t op, unsigned int d, uint8_t k)
+{
+    return op | ((k & 0xf0) << 4) | ((d - 16) << 4) | (k & 0x0f);
+}
+
+/* ADIW and SBIW, Rd of r24, r26, r28 or r30 */
+static uint16_t
+op_iw(uint16_t op, unsigned int d, uint8_t k)
+{
+    return op | ((k & 0x30) << 2) | (((d - 24) / 2) << 4) | (k & 0x0f);
+}
+
+static uint16_t
+op_out(uint8_t a, unsigned int r)
+{
+    return 0xb800 | ((a & 0x30) << 5) | (r << 4) | (a & 0x0f);
+}
+
+/* JMP or CALL, to a byte address */
+static void
+emit_jmp(struct prog *p, uint16_t op, uint32_t addr)
+{
+    uint32_t k = addr / 2;
+
+    emit(p, op | ((k >> 13) & 0x01f0) | ((k >> 16) & 0x01));
+    emit(p, k);
+}
+
+static void
+emit_ldi(struct prog *p, unsigned int d, uint8_t k)
+{
+    emit(p, op_rk(0xe000, d, k));
+}
+
+/* Write 'p' into both cores' flash at 'base' */
+static void
+put(const struct prog *p, uint32_t base)
+{
+    struct core *c[] = { &ref, &dut };
+    uint32_t a;
+    unsigned int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < p->n; j++) {
+            c[i]->avr->flash[base + j * 2] = p->w[j];
+            c[i]->avr->flash[base + j * 2 + 1] = p->w[j] >> 8;
+        }
+
+        /* What the last program left decoded isn't what's there now */
+        if (c[i]->dc)
+            for (a = base; a < base + p->n * 2 + PAGE_SIZE; a += PAGE_SIZE)
+                df_decode_invalidate(c[i]->dc, a);
+    }
+}
+
+/* And point them at it, fresh from reset */
+static void
+load(const struct prog *p, uint32_t base)
+{
+    struct core *c[] = { &ref, &dut };
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+        avr_reset(c[i]->avr);
+        c[i]->avr->state = cpu_Running;
+        c[i]->avr->pc = base;
+        c[i]->start = c[i]->avr->cycle;
+        c[i]->decoded = 0;
+    }
+
+    put(p, base);
+}
+
+static void
+set_state(const struct state *s)
+{
+    struct core *c[] = { &ref, &dut };
+    unsigned int i, b;
+
+    for (i = 0; i < 2; i++) {
+        avr_t *avr = c[i]->avr;
+
+        memcpy(avr->data, s->reg, sizeof(s->reg));
+        for (b = 0; b < 8; b++)
+            avr->sreg[b] = (s->sreg >> b) & 1;
+        avr->sreg[S_I] = 0;
+        memcpy(avr->data + SRAM, s->sram, sizeof(s->sram));
+        memset(avr->data + avr->ramend + 1 - STACK_SIZE, 0, STACK_SIZE);
+    }
+}
+
+static void
+random_state(struct state *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(s->reg); i++)
+        s->reg[i] = rnd();
+    s->sreg = rnd() & 0x7f;
+    for (i = 0; i < sizeof(s->sram); i++)
+        s->sram[i] = rnd();
+}
+
+/* Run a core until it gets to 'end', returns non-zero if it never does */
+static int
+run(struct core *c, uint32_t end)
+{
+    avr_t *avr = c->avr;
+    unsigned int steps;
+    int state;
+
+    for (steps = 0; avr->pc != end; steps++) {
+        if (steps > MAX_STEPS)
+            return -1;
+
+        if (c->dc) {
+            c->decoded += df_decode_run(c->dc, avr, 64);
+            if (avr->pc == end)
+                break;
+        }
+
+        state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+dump(const char *name, const struct prog *p)
+{
+    unsigned int i;
+
+    fprintf(stderr, "FAIL %s:", name);
+    for (i = 0; i < p->n; i++)
+        fprintf(stderr, " %04x", p->w[i]);
+    fprintf(stderr, "\n");
+}
+
+/* Run 'p' on both cores, they have to agree on everything */
+static void
+check(const char *name, const struct prog *p, uint32_t end,
+        unsigned int min_decoded)
+{
+    avr_t *a = ref.avr;
+    avr_t *b = dut.avr;
+    unsigned int i;
+
+    cases++;
+
+    if (run(&ref, end) || run(&dut, end)) {
+        dump(name, p);
+        fprintf(stderr, "  never got to 0x%" PRIx32 ", at 0x%x and 0x%x\n",
+                end, a->pc, b->pc);
+        goto fail;
+    }
+
+    for (i = 0; i < 32; i++) {
+        if (a->data[i] != b->data[i]) {
+            dump(name, p);
+            fprintf(stderr, "  r%u: simavr 0x%02x, decoded 0x%02x\n", i,
+                    a->data[i], b->data[i]);
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (a->sreg[i] != b->sreg[i]) {
+            dump(name, p);
+            fprintf(stderr, "  SREG bit %u: simavr %u, decoded %u\n", i,
+                    a->sreg[i], b->sreg[i]);
+            goto fail;
+        }
+    }
+
+    if (a->cycle - ref.start != b->cycle - dut.start) {
+        dump(name, p);
+        fprintf(stderr, "  cycles: simavr %" PRIu64 ", decoded %" PRIu64
+                "\n", (uint64_t)(a->cycle - ref.start),
+                (uint64_t)(b->cycle - dut.start));
+        goto fail;
+    }
+
+    if (a->data[R_SPL] != b->data[R_SPL] ||
+            a->data[R_SPH] != b->data[R_SPH] ||
+            memcmp(a->data + SRAM, b->data + SRAM, SRAM_SIZE) ||
+            memcmp(a->data + a->ramend + 1 - STACK_SIZE,
+                b->data + b->ramend + 1 - STACK_SIZE, STACK_SIZE)) {
+        dump(name, p);
+        fprintf(stderr, "  SRAM or the stack differ\n");
+        goto fail;
+    }
+
+    /* Or it's simavr against itself */
+    if (dut.decoded < min_decoded) {
+        dump(name, p);
+        fprintf(stderr, "  only %u instructions were decoded, not %u\n",
+                dut.decoded, min_decoded);
+        goto fail;
+    }
+
+    return;
+
+fail:
+    failures++;
+}
+
+/* One instruction and a 'rjmp .' to stop at, from 'st' */
+static void
+check_one(const char *name, uint16_t op, const struct state *st)
+{
+    struct prog p = { .n = 0 };
+
+    emit(&p, op);
+    emit(&p, 0xcfff);
+    load(&p, BASE);
+    set_state(st);
+    check(name, &p, BASE + 2, 1);
+}
+
+/* Every flag out of the ALU, from values either side of where they flip */
+static void
+test_sreg(void)
+{
+    static const uint8_t vals[] = {
+        0x00, 0x01, 0x0f, 0x10, 0x7f, 0x80, 0x81, 0xfe, 0xff,
+    };
+    static const uint8_t flags[] = { 0x00, 0x01, 0x02, 0x03, 0x7e, 0x7f };
+    static const struct {
+        const char *name;
+        uint16_t op;
+    } rr[] = {
+        { "ADD", 0x0c00 }, { "ADC", 0x1c00 }, { "SUB", 0x1800 },
+        { "SBC", 0x0800 }, { "CP", 0x1400 }, { "CPC", 0x0400 },
+        { "AND", 0x2000 }, { "EOR", 0x2400 }, { "OR", 0x2800 },
+        { "MUL", 0x9c00 },
+    }, rk[] = {
+        { "CPI", 0x3000 }, { "SBCI", 0x4000 }, { "SUBI", 0x5000 },
+        { "ORI", 0x6000 }, { "ANDI", 0x7000 },
+    }, one[] = {
+        { "COM", 0x9400 }, { "NEG", 0x9401 }, { "SWAP", 0x9402 },
+        { "INC", 0x9403 }, { "ASR", 0x9405 }, { "LSR", 0x9406 },
+        { "ROR", 0x9407 }, { "DEC", 0x940a },
+    };
+    struct state st;
+    unsigned int i, x, y, f;
+
+    memset(&st, 0, sizeof(st));
+
+    for (f = 0; f < sizeof(flags); f++) {
+        st.sreg = flags[f];
+        for (x = 0; x < sizeof(vals); x++) {
+            st.reg[16] = vals[x];
+
+            for (i = 0; i < sizeof(one) / sizeof(one[0]); i++)
+                check_one(one[i].name, one[i].op | (16 << 4), &st);
+
+            for (y = 0; y < sizeof(vals); y++) {
+                st.reg[17] = vals[y];
+
+                for (i = 0; i < sizeof(rr) / sizeof(rr[0]); i++)
+                    check_one(rr[i].name, op_rr(rr[i].op, 16, 17), &st);
+                for (i = 0; i < sizeof(rk) / sizeof(rk[0]); i++)
+                    check_one(rk[i].name, op_rk(rk[i].op, 16, vals[y]),
+                            &st);
+                check_one("MULS", 0x0201, &st);
+                check_one("MULSU", 0x0301, &st);
+            }
+        }
+    }
+}
+
+/* ADIW and SBIW on every pair, across the carry and overflow edges */
+static void
+test_adiw(void)
+{
+    static const uint16_t words[] = {
+        0x0000, 0x0001, 0x003e, 0x003f, 0x00ff, 0x7fc1, 0x7fff,
+        0x8000, 0x8001, 0xffc1, 0xffff,
+    };
+    static const uint8_t ks[] = { 0x00, 0x01, 0x20, 0x3f };
+    static const uint8_t flags[] = { 0x00, 0x7f };
+    struct state st;
+    unsigned int d, w, k, f;
+
+    memset(&st, 0, sizeof(st));
+
+    for (d = 24; d <= 30; d += 2) {
+        for (w = 0; w < sizeof(words) / sizeof(words[0]); w++) {
+            st.reg[d] = words[w];
+            st.reg[d + 1] = words[w] >> 8;
+            for (k = 0; k < sizeof(ks); k++) {
+                for (f = 0; f < sizeof(flags); f++) {
+                    st.sreg = flags[f];
+                    check_one("ADIW", op_iw(0x9600, d, ks[k]), &st);
+                    check_one("SBIW", op_iw(0x9700, d, ks[k]), &st);
+                }
+            }
+        }
+    }
+}
+
+/* What a skip can land on: LDS, STS, JMP, CALL, or a one word LDI */
+static void
+emit_skipped(struct prog *p, uint32_t base, unsigned int kind)
+{
+    switch (kind) {
+    case 0:
+        emit(p, 0x9000 | (18 << 4));
+        emit(p, SRAM);
+        break;
+    case 1:
+        emit(p, 0x9200 | (19 << 4));
+        emit(p, SRAM + 1);
+        break;
+    case 2:
+    case 3:
+        /* To just past itself, so not skipping it carries on the same */
+        emit_jmp(p, kind == 2 ? 0x940c : 0x940e, base + (p->n + 2) * 2);
+        break;
+    default:
+        emit_ldi(p, 18, 0x5a);
+        break;
+    }
+}
+
+/* CPSE, SBRC and SBRS, taken and not, over one and two word instructions */
+static void
+test_skip(void)
+{
+    static const struct {
+        const char *name;
+        uint16_t op;
+        uint8_t skip, stay;     /**< r16 for each, r17 is 0x08 */
+    } skips[] = {
+        { "CPSE", 0, 0x08, 0x09 },
+        { "SBRC", 0xfc00 | (16 << 4) | 3, 0x00, 0x08 },
+        { "SBRS", 0xfe00 | (16 << 4) | 3, 0x08, 0x00 },
+    };
+    struct state st;
+    struct prog p;
+    unsigned int i, kind, taken;
+
+    memset(&st, 0, sizeof(st));
+    st.reg[17] = 0x08;
+    st.reg[19] = 0xc3;
+
+    for (i = 0; i < sizeof(skips) / sizeof(skips[0]); i++) {
+        for (kind = 0; kind < 5; kind++) {
+            for (taken = 0; taken < 2; taken++) {
+                p.n = 0;
+                emit(&p, skips[i].op ? skips[i].op : op_rr(0x1000, 16, 17));
+                emit_skipped(&p, BASE, kind);
+                emit_ldi(&p, 20, 0xa5);
+                emit(&p, 0xcfff);
+
+                st.reg[16] = taken ? skips[i].skip : skips[i].stay;
+                load(&p, BASE);
+                set_state(&st);
+                check(skips[i].name, &p, BASE + (p.n - 1) * 2, 1);
+            }
+        }
+    }
+}
+
+/* A random instruction df_decode_run() runs itself */
+static uint16_t
+random_alu(void)
+{
+    static const struct {
+        uint16_t op, mask;
+    } alu[] = {
+        { 0x0000, 0x0000 },     /* NOP */
+        { 0x0100, 0x00ff },     /* MOVW */
+        { 0x0200, 0x00ff },     /* MULS */
+        { 0x0300, 0x0077 },     /* MULSU */
+        { 0x0400, 0x03ff },     /* CPC */
+        { 0x0800, 0x03ff },     /* SBC */
+        { 0x0c00, 0x03ff },     /* ADD */
+        { 0x1400, 0x03ff },     /* CP */
+        { 0x1800, 0x03ff },     /* SUB */
+        { 0x1c00, 0x03ff },     /* ADC */
+        { 0x2000, 0x03ff },     /* AND */
+        { 0x2400, 0x03ff },     /* EOR */
+        { 0x2800, 0x03ff },     /* OR */
+        { 0x2c00, 0x03ff },     /* MOV */
+        { 0x3000, 0x0fff },     /* CPI */
+        { 0x4000, 0x0fff },     /* SBCI */
+        { 0x5000, 0x0fff },     /* SUBI */
+        { 0x6000, 0x0fff },     /* ORI */
+        { 0x7000, 0x0fff },     /* ANDI */
+        { 0xe000, 0x0fff },     /* LDI */
+        { 0x9400, 0x01f0 },     /* COM */
+        { 0x9401, 0x01f0 },     /* NEG */
+        { 0x9402, 0x01f0 },     /* SWAP */
+        { 0x9403, 0x01f0 },     /* INC */
+        { 0x9405, 0x01f0 },     /* ASR */
+        { 0x9406, 0x01f0 },     /* LSR */
+        { 0x9407, 0x01f0 },     /* ROR */
+        { 0x940a, 0x01f0 },     /* DEC */
+        { 0x9408, 0x0070 },     /* BSET */
+        { 0x9488, 0x0070 },     /* BCLR */
+        { 0x9600, 0x00ff },     /* ADIW */
+        { 0x9700, 0x00ff },     /* SBIW */
+        { 0x9c00, 0x03ff },     /* MUL */
+        { 0xf800, 0x01f7 },     /* BLD */
+        { 0xfa00, 0x01f7 },     /* BST */
+    };
+    unsigned int i;
+    uint16_t w;
+
+    do {
+        i = rnd() % (sizeof(alu) / sizeof(alu[0]));
+        w = alu[i].op | (rnd() & alu[i].mask);
+    } while (w == 0x9478 || w == 0x94f8);   /* no SEI or CLI */
+
+    return w;
+}
+
+/* Straight line runs of the above, with skips and branches over them */
+static void
+test_random(void)
+{
+    struct state st;
+    struct prog p;
+    unsigned int i, decoded = 0;
+    uint16_t r;
+
+    for (i = 0; i < RANDOM_RUNS; i++) {
+        p.n = 0;
+        while (p.n < 32) {
+            r = rnd() % 10;
+            if (r < 7) {
+                emit(&p, random_alu());
+            } else if (r == 7) {
+                /* CPSE, SBRC or SBRS, over anything */
+                switch (rnd() % 3) {
+                case 0: emit(&p, 0x1000 | (rnd() & 0x03ff)); break;
+                case 1: emit(&p, 0xfc00 | (rnd() & 0x01f7)); break;
+                case 2: emit(&p, 0xfe00 | (rnd() & 0x01f7)); break;
+                }
+                if (rnd() & 1)
+                    emit_skipped(&p, BASE, rnd() % 4);
+                else
+                    emit(&p, random_alu());
+            } else if (r == 8) {
+                /* BRBS or BRBC over one instruction */
+                emit(&p, ((rnd() & 1) ? 0xf400 : 0xf000) | (1 << 3) |
+                        (rnd() & 0x07));
+                emit(&p, random_alu());
+            } else {
+                emit_skipped(&p, BASE, rnd() % 4);
+            }
+        }
+        emit(&p, 0xcfff);
+
+        random_state(&st);
+        load(&p, BASE);
+        set_state(&st);
+        check("random", &p, BASE + (p.n - 1) * 2, 0);
+        decoded += dut.decoded;
+    }
+
+    if (!decoded) {
+        fprintf(stderr, "FAIL random: nothing was decoded\n");
+        failures++;
+    }
+}
+
+/* As m128rfa1_spmcsr_write() and m128rfa1_spm_done() do it */
+static avr_cycle_count_t
+spm_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    struct core *c = param;
+
+    (void)avr;
+    (void)when;
+
+    df_decode_invalidate(c->dc, c->spm_addr);
+    return 0;
+}
+
+static void
+spmcsr_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    struct core *c = param;
+
+    (void)addr;
+
+    if ((v & SPMEN) && (v & (PGERS | PGWRT))) {
+        c->spm_addr = (avr->data[avr->rampz] << 16) | avr->data[30] |
+            (avr->data[31] << 8);
+        avr_cycle_timer_register(avr, SPM_WINDOW + 1, spm_done, param);
+    }
+}
+
+/* SPM from r16, with Z and RAMPZ already set */
+static void
+emit_spm(struct prog *p, uint8_t spmcsr)
+{
+    emit_ldi(p, 16, spmcsr);
+    emit(p, op_out(IO_SPMCSR, 16));
+    emit(p, 0x95e8);
+}
+
+static void
+emit_z(struct prog *p, uint32_t addr)
+{
+    emit_ldi(p, 16, addr >> 16);
+    emit(p, op_out(IO_RAMPZ, 16));
+    emit_ldi(p, 30, addr);
+    emit_ldi(p, 31, addr >> 8);
+}
+
+/*
+ * Jump to SPM_PAGE, then back at 'back' rewrite it with 'with' and jump
+ * to it again, which has to come back to the 'rjmp .' at the end.
+ */
+static void
+spm_prog(struct prog *p, struct prog *with, uint32_t end)
+{
+    unsigned int i;
+
+    p->n = 0;
+    emit_jmp(p, 0x940c, SPM_PAGE);
+
+    with->n = 0;
+    emit_ldi(with, 20, 0x22);
+    emit(with, 0x940a | (20 << 4));         /* DEC r20 */
+    emit_jmp(with, 0x940c, end);
+
+    emit_z(p, SPM_PAGE);
+    emit_spm(p, PGERS | SPMEN);
+
+    /* The page buffer, a word at a time from r0:r1 */
+    for (i = 0; i < with->n; i++) {
+        emit_ldi(p, 16, with->w[i]);
+        emit(p, op_rr(0x2c00, 0, 16));      /* MOV r0, r16 */
+        emit_ldi(p, 16, with->w[i] >> 8);
+        emit(p, op_rr(0x2c00, 1, 16));      /* MOV r1, r16 */
+        emit_spm(p, SPMEN);
+        emit(p, op_iw(0x9600, 30, 2));      /* ADIW r30, 2 */
+    }
+
+    emit_z(p, SPM_PAGE);
+    emit_spm(p, PGWRT | SPMEN);
+    for (i = 0; i < SPM_WINDOW; i++)
+        emit(p, 0x0000);
+    emit_jmp(p, 0x940c, SPM_PAGE);
+    emit(p, 0xcfff);
+}
+
+/*
+ * Run a page above 64K so it's decoded, rewrite it with SPM and run it
+ * again. Only if RAMPZ:Z picked the right page to drop does the new code
+ * run rather than what was decoded before.
+ */
+static void
+test_spm(void)
+{
+    struct prog p, with, old = { .n = 0 };
+    struct state st;
+    uint32_t end;
+
+    /* Once to find where it ends, then again jumping back there */
+    spm_prog(&p, &with, 0);
+    end = SPM_BASE + (p.n - 1) * 2;
+    spm_prog(&p, &with, end);
+
+    emit_ldi(&old, 20, 0x11);
+    emit(&old, 0x9403 | (20 << 4));         /* INC r20 */
+    emit_jmp(&old, 0x940c, SPM_BASE + 4);
+
+    memset(&st, 0, sizeof(st));
+    load(&p, SPM_BASE);
+    put(&old, SPM_PAGE);
+    set_state(&st);
+    check("SPM", &p, end, 1);
+}
+
+int
+main(void)
+{
+    struct core *c[] = { &ref, &dut };
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+        c[i]->avr = avr_make_mcu_by_name("atmega128rfa1");
+        if (!c[i]->avr) {
+            fprintf(stderr, "Failed to create AVR core 'atmega128rfa1'\n");
+            return 1;
+        }
+        avr_init(c[i]->avr);
+        c[i]->avr->frequency = 16000000;
+        c[i]->avr->codeend = c[i]->avr->flashend;
+    }
+
+    dut.dc = df_decode_create(dut.avr);
+    if (!dut.dc)
+        return 1;
+    avr_register_io_write(dut.avr, SPMCSR, spmcsr_write, &dut);
+
+    test_sreg();
+    test_adiw();
+    test_skip();
+    test_random();
+    test_spm();
+
+    printf("decode-test: %u cases, %u failed\n", cases, failures);
+
+    df_decode_free(dut.dc);
+    avr_terminate(ref.avr);
+    avr_terminate(dut.avr);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * snapshot-test.c
+ *
+ *  Copyright (c) 2014 Doug Goldstein <cardoe@cardoe.com>
+ *
+ *  This file is part of drumfish.
+ *
+ *  drumfish is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  drumfish is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with drumfish.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A snapshot against the core it was taken from. A program with Timer0
+ * running and UART0 sending is stopped part way, saved, and restored
+ * onto a fresh core. Both then run on and have to see the same: the
+ * cycles Timer0 overflows at, the bytes the UART sends and when, and
+ * the registers they end up with.
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_io.h>
+#include <sim_irq.h>
+#include <avr_uart.h>
+
+#include "drumfish.h"
+#include "df_cores.h"
+#include "df_log.h"
+#include "df_snapshot.h"
+
+/* Steps before the snapshot, and after it on both cores */
+#define STEPS_BEFORE    5000
+#define STEPS_AFTER     20000
+#define MAX_EVENTS      1024
+
+/* I/O addresses, for IN and OUT */
+#define IO_TIFR0    0x15
+#define IO_TCCR0B   0x25
+#define IO_TCNT0    0x26
+/* And data addresses, for LDS and STS */
+#define TIFR0       (IO_TIFR0 + 0x20)
+#define UCSR0A      0xc0
+#define UCSR0B      0xc1
+#define UBRR0L      0xc4
+#define UBRR0H      0xc5
+#define UDR0        0xc6
+
+#define TOV0        (1 << 0)
+#define UDRE0       5
+#define TXEN0       (1 << 3)
+#define CS01        (1 << 1)
+
+struct event {
+    char kind;                  /**< 'T' for an overflow, 'U' for a byte */
+    uint8_t value;
+    avr_cycle_count_t cycle;
+};
+
+struct core {
+    avr_t *avr;
+    struct event ev[MAX_EVENTS];
+    unsigned int count;
+};
+
+static struct core ref, dut;
+
+/* The snapshot has no board of its own to save */
+int
+m128rfa1_save(avr_t *avr, FILE *f)
+{
+    (void)avr;
+    (void)f;
+    return 0;
+}
+
+int
+m128rfa1_restore(avr_t *avr, FILE *f)
+{
+    (void)avr;
+    (void)f;
+    return 0;
+}
+
+void
+df_log_msg(enum df_log_lvl level, const char *format, ...)
+{
+    va_list ap;
+
+    (void)level;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+static void
+record(struct core *c, char kind, uint8_t value)
+{
+    if (c->count < MAX_EVENTS) {
+        c->ev[c->count].kind = kind;
+        c->ev[c->count].value = value;
+        c->ev[c->count].cycle = c->avr->cycle;
+        c->count++;
+    }
+}
+
+static void
+uart_out(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    (void)irq;
+    record(param, 'U', value);
+}
+
+/*
+ * Set Timer0 going at clk/8, then send a count on UART0 as fast as it
+ * goes, reading TCNT0 and clearing TOV0 while it waits.
+ */
+static const uint16_t prog[] = {
+    0xe000 | ((CS01 & 0xf0) << 4) | (CS01 & 0x0f),  /* ldi r16, CS01 */
+    0xb900 | ((IO_TCCR0B & 0x30) << 5) | (IO_TCCR0B & 0x0f),
+                                                    /* out TCCR0B, r16 */
+    0xe000,                                         /* ldi r16, 0 */
+    0x9300, UBRR0H,                                 /* sts UBRR0H, r16 */
+    0xe003,                                         /* ldi r16, 3 */
+    0x9300, UBRR0L,                                 /* sts UBRR0L, r16 */
+    0xe000 | TXEN0,                                 /* ldi r16, TXEN0 */
+    0x9300, UCSR0B,                                 /* sts UCSR0B, r16 */
+    0xe010,                                         /* ldi r17, 0 */
+    /* loop: */
+    0xb130 | ((IO_TCNT0 & 0x30) << 5) | (IO_TCNT0 & 0x0f),
+                                                    /* in r19, TCNT0 */
+    0xb140 | ((IO_TIFR0 & 0x30) << 5) | (IO_TIFR0 & 0x0f),
+                                                    /* in r20, TIFR0 */
+    0xb940 | ((IO_TIFR0 & 0x30) << 5) | (IO_TIFR0 & 0x0f),
+                                                    /* out TIFR0, r20 */
+    0x9120, UCSR0A,                                 /* lds r18, UCSR0A */
+    0xff20 | UDRE0,                                 /* sbrs r18, UDRE0 */
+    0xc000 | (-7 & 0xfff),                          /* rjmp loop */
+    0x9310, UDR0,                                   /* sts UDR0, r17 */
+    0x9513,                                         /* inc r17 */
+    0xc000 | (-11 & 0xfff),                         /* rjmp loop */
+};
+
+static int
+core_init(struct core *c)
+{
+    avr_irq_t *irq;
+    uint32_t f;
+    unsigned int i;
+
+    c->avr = avr_make_mcu_by_name("atmega128rfa1");
+    if (!c->avr) {
+        fprintf(stderr, "Failed to create AVR core 'atmega128rfa1'\n");
+        return -1;
+    }
+    avr_init(c->avr);
+    c->avr->frequency = 16000000;
+    c->avr->state = cpu_Running;
+
+    avr_ioctl(c->avr, AVR_IOCTL_UART_GET_FLAGS('0'), &f);
+    f &= ~(AVR_UART_FLAG_STDIO|AVR_UART_FLAG_POOL_SLEEP);
+    avr_ioctl(c->avr, AVR_IOCTL_UART_SET_FLAGS('0'), &f);
+
+    irq = avr_io_getirq(c->avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT);
+    avr_irq_register_notify(irq, uart_out, c);
+
+    for (i = 0; i < sizeof(prog) / sizeof(prog[0]); i++) {
+        c->avr->flash[i * 2] = prog[i];
+        c->avr->flash[i * 2 + 1] = prog[i] >> 8;
+    }
+
+    return 0;
+}
+
+/* Overflows are seen by the flag, which the program soon clears */
+static void
+run(struct core *c, unsigned int steps)
+{
+    int tov = 0;
+    unsigned int i;
+
+    for (i = 0; i < steps; i++) {
+        avr_run(c->avr);
+        if ((c->avr->data[TIFR0] & TOV0) && !tov)
+            record(c, 'T', 0);
+        tov = !!(c->avr->data[TIFR0] & TOV0);
+    }
+}
+
+static const struct event *
+first(const struct core *c, char kind)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++) {
+        if (c->ev[i].kind == kind)
+            return &c->ev[i];
+    }
+
+    return NULL;
+}
+
+static unsigned int
+compare(void)
+{
+    const struct event *a, *b;
+    unsigned int failures = 0;
+    unsigned int i;
+
+    a = first(&ref, 'T');
+    b = first(&dut, 'T');
+    if (!a || !b) {
+        fprintf(stderr, "FAIL: Timer0 never overflowed after the snapshot\n");
+        failures++;
+    } else if (a->cycle != b->cycle) {
+        fprintf(stderr, "FAIL: next overflow at cycle %" PRIu64
+                ", restored at %" PRIu64 "\n", a->cycle, b->cycle);
+        failures++;
+    }
+
+    if (!first(&ref, 'U')) {
+        fprintf(stderr, "FAIL: UART0 sent nothing after the snapshot\n");
+        failures++;
+    }
+
+    if (ref.count != dut.count) {
+        fprintf(stderr, "FAIL: %u events, restored saw %u\n",
+                ref.count, dut.count);
+        failures++;
+    }
+
+    for (i = 0; i < ref.count && i < dut.count; i++) {
+        a = &ref.ev[i];
+        b = &dut.ev[i];
+        if (a->kind != b->kind || a->value != b->value ||
+                a->cycle != b->cycle) {
+            fprintf(stderr, "FAIL: event %u is %c 0x%02x at %" PRIu64
+                    ", restored %c 0x%02x at %" PRIu64 "\n", i,
+                    a->kind, a->value, a->cycle,
+                    b->kind, b->value, b->cycle);
+            failures++;
+            break;
+        }
+    }
+
+    if (ref.avr->cycle != dut.avr->cycle || ref.avr->pc != dut.avr->pc ||
+            memcmp(ref.avr->data, dut.avr->data, 32)) {
+        fprintf(stderr, "FAIL: cores differ at the end, cycle %" PRIu64
+                " pc 0x%04x, restored cycle %" PRIu64 " pc 0x%04x\n",
+                ref.avr->cycle, ref.avr->pc, dut.avr->cycle, dut.avr->pc);
+        failures++;
+    }
+
+    return failures;
+}
+
+int
+main(void)
+{
+    char path[] = "/tmp/snapshot-test.XXXXXX";
+    unsigned int failures;
+    int fd;
+
+    if (core_init(&ref) || core_init(&dut))
+        return 1;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    run(&ref, STEPS_BEFORE);
+    if (df_snapshot_save(ref.avr, path) ||
+            df_snapshot_restore(dut.avr, path)) {
+        unlink(path);
+        return 1;
+    }
+    unlink(path);
+
+    ref.count = 0;
+    run(&ref, STEPS_AFTER);
+    run(&dut, STEPS_AFTER);
+
+    failures = compare();
+    printf("snapshot-test: %u events, %u failed\n", ref.count, failures);
+
+    avr_terminate(ref.avr);
+    avr_terminate(dut.avr);
+
+    return failures ? 1 : 0;
+}
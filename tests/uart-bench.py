@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+#
+# UART benchmarks: runs small firmware on both UARTs of several boards
+# at once and prints a JSON object per UART and test on stdout.
+#
+#   avr_to_host    bytes/s read from a firmware that sends flat out
+#   host_to_avr    bytes/s written to a firmware that drops what it gets
+#   latency        round trip percentiles of single bytes through an echo
+#
+# Each line also has the xon/xoff, byte and drop counts drumfish kept for
+# that UART. BENCH_SECONDS sets how long each test runs, 5 by default,
+# UART_BENCH_BOARDS the number of boards, 2 by default,
+# UART_BENCH_SPEED the --speed to run them at, realtime by default,
+# UART_BENCH_TIMING the --uart-timing, turbo by default, and
+# UART_BENCH_BACKEND what the UARTs are: 'pty' (the default), 'unix'
+# sockets or 'tcp' sockets from UART_BENCH_PORT, 47000 by default, up.
+
+import json
+import os
+import select
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+from bench import DRUMFISH, firmware, git_rev, open_uart
+
+# Data addresses of the USARTs' registers
+UART_REGS = {
+    '0': {'UCSRA': 0xc0, 'UCSRB': 0xc1, 'UCSRC': 0xc2, 'UBRRL': 0xc4,
+          'UBRRH': 0xc5, 'UDR': 0xc6},
+    '1': {'UCSRA': 0xc8, 'UCSRB': 0xc9, 'UCSRC': 0xca, 'UBRRL': 0xcc,
+          'UBRRH': 0xcd, 'UDR': 0xce},
+}
+RXC = 7
+UDRE = 5
+
+# Seconds to let drumfish settle before counting
+WARMUP_S = 0.5
+
+
+def uart_spec(backend, port, tmp, name, n):
+    """What to give '-p uartN=', boards count up from it"""
+    path = os.path.join(tmp, '%s.uart%s' % (name, n))
+    if backend == 'unix':
+        return 'unix:' + path
+    if backend == 'tcp':
+        return 'tcp:%d' % (port + 100 * int(n))
+    return path
+
+
+def board_spec(spec, board, boards):
+    if boards == 1:
+        return spec
+    if spec.startswith('tcp:'):
+        return 'tcp:%d' % (int(spec[4:]) + board)
+    return spec + '.%d' % board
+
+
+def open_socket(spec, proc):
+    """Connect to a socket UART, returns a non-blocking fd"""
+    deadline = time.time() + 10
+    while True:
+        try:
+            if spec.startswith('unix:'):
+                s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                try:
+                    s.connect(spec[5:])
+                except OSError:
+                    s.close()
+                    raise
+            else:
+                s = socket.create_connection(('127.0.0.1', int(spec[4:])))
+            break
+        except OSError:
+            if time.time() > deadline or proc.poll() is not None:
+                return None
+            time.sleep(0.05)
+    s.setblocking(False)
+    return s.detach()
+
+
+def uart_setup(a):
+    # Both USARTs at 1Mbaud, 8N1
+    a.ldi(16, 0)
+    a.ldi(17, 0x06)
+    a.ldi(18, 0x18)
+    for regs in UART_REGS.values():
+        a.sts(regs['UBRRH'], 16)
+        a.sts(regs['UBRRL'], 16)
+        a.sts(regs['UCSRC'], 17)
+        a.sts(regs['UCSRB'], 18)
+
+
+def echo(a):
+    uart_setup(a)
+    a.label('loop')
+    for n, regs in sorted(UART_REGS.items()):
+        a.lds(17, regs['UCSRA'])
+        a.sbrs(17, RXC)
+        a.rjmp('next' + n)
+        a.lds(18, regs['UDR'])
+        a.label('wait' + n)
+        a.lds(17, regs['UCSRA'])
+        a.sbrs(17, UDRE)
+        a.rjmp('wait' + n)
+        a.sts(regs['UDR'], 18)
+        a.label('next' + n)
+    a.rjmp('loop')
+
+
+def sink(a):
+    uart_setup(a)
+    a.label('loop')
+    for n, regs in sorted(UART_REGS.items()):
+        a.lds(17, regs['UCSRA'])
+        a.sbrs(17, RXC)
+        a.rjmp('next' + n)
+        a.lds(18, regs['UDR'])
+        a.label('next' + n)
+    a.rjmp('loop')
+
+
+def source(a):
+    uart_setup(a)
+    a.label('loop')
+    for n, regs in sorted(UART_REGS.items()):
+        a.lds(17, regs['UCSRA'])
+        a.sbrs(17, UDRE)
+        a.rjmp('next' + n)
+        a.sts(regs['UDR'], 20)
+        a.inc(20)
+        a.label('next' + n)
+    a.rjmp('loop')
+
+
+def percentile_us(samples, q):
+    """'samples' sorted, in ns"""
+    if not samples:
+        return None
+    return round(samples[min(len(samples) - 1, int(q * len(samples)))] / 1e3,
+            1)
+
+
+def avr_to_host(fds, seconds):
+    counts = dict.fromkeys(fds, 0)
+    start = time.monotonic() + WARMUP_S
+    end = start + seconds
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+        r, _, _ = select.select(fds, [], [], 0.1)
+        for fd in r:
+            try:
+                n = len(os.read(fd, 65536))
+            except BlockingIOError:
+                continue
+            if now >= start:
+                counts[fd] += n
+    return {fd: {'bytes_per_s': round(n / seconds)}
+            for fd, n in counts.items()}
+
+
+def host_to_avr(fds, seconds):
+    counts = dict.fromkeys(fds, 0)
+    chunk = bytes(range(256))
+    start = time.monotonic() + WARMUP_S
+    end = start + seconds
+    while True:
+        now = time.monotonic()
+        if now >= end:
+            break
+        _, w, _ = select.select([], fds, [], 0.1)
+        for fd in w:
+            try:
+                n = os.write(fd, chunk)
+            except BlockingIOError:
+                continue
+            if now >= start:
+                counts[fd] += n
+    return {fd: {'bytes_per_s': round(n / seconds)}
+            for fd, n in counts.items()}
+
+
+def latency(fds, seconds):
+    """One byte in flight per UART, timed from write to its echo"""
+    samples = {fd: [] for fd in fds}
+    sent = {}
+    start = time.monotonic() + WARMUP_S
+    end = start + seconds
+    lost = dict.fromkeys(fds, 0)
+
+    def send(fd):
+        os.write(fd, b'\x55')
+        sent[fd] = time.perf_counter_ns()
+
+    for fd in fds:
+        send(fd)
+    while time.monotonic() < end:
+        r, _, _ = select.select(fds, [], [], 0.1)
+        now = time.perf_counter_ns()
+        for fd in r:
+            try:
+                os.read(fd, 64)
+            except BlockingIOError:
+                continue
+            if time.monotonic() >= start:
+                samples[fd].append(now - sent[fd])
+            send(fd)
+        # Never heard back, the byte was lost somewhere
+        for fd in fds:
+            if fd not in r and now - sent[fd] > 1000000000:
+                lost[fd] += 1
+                send(fd)
+
+    result = {}
+    for fd, s in samples.items():
+        s.sort()
+        result[fd] = {
+            'samples': len(s),
+            'p50_us': percentile_us(s, 0.5),
+            'p99_us': percentile_us(s, 0.99),
+            'p999_us': percentile_us(s, 0.999),
+            'lost': lost[fd],
+        }
+    return result
+
+
+def run(name, body, test, seconds, boards, speed, timing, backend, port,
+        tmp):
+    hexfile = os.path.join(tmp, name + '.hex')
+    stats = os.path.join(tmp, name + '.json')
+    with open(hexfile, 'w') as f:
+        f.write(firmware(body))
+
+    uart = {n: uart_spec(backend, port, tmp, name, n) for n in UART_REGS}
+    cmd = [DRUMFISH, '-s', os.path.join(tmp, name + '.flash'), '-e',
+            '-f', hexfile, '-n', str(boards), '--speed=' + speed,
+            '--uart-timing=' + timing, '--stats=' + stats,
+            '-p', 'radio=off']
+    for n, path in sorted(uart.items()):
+        cmd += ['-p', 'uart%s=%s' % (n, path)]
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+
+    ports = {}
+    for board in range(boards):
+        for n, spec in sorted(uart.items()):
+            spec = board_spec(spec, board, boards)
+            if backend == 'pty':
+                fd = open_uart(spec, proc)
+            else:
+                fd = open_socket(spec, proc)
+            if fd is None:
+                proc.kill()
+                proc.wait()
+                raise RuntimeError('drumfish never created ' + spec)
+            ports[fd] = (board, n)
+
+    measured = test(list(ports), seconds)
+
+    proc.send_signal(signal.SIGTERM)
+    proc.wait()
+    for fd in ports:
+        os.close(fd)
+
+    with open(stats) as f:
+        s = json.load(f)
+
+    counts = {}
+    for b in s['boards']:
+        for u in b['uarts']:
+            counts[(b['id'], str(u['uart']))] = u
+
+    results = []
+    for fd, (board, n) in sorted(ports.items(), key=lambda p: p[1]):
+        result = {'test': name, 'speed': speed, 'timing': timing,
+                'backend': backend, 'board': board, 'uart': n}
+        result.update(measured[fd])
+        c = counts.get((board, n), {})
+        for key in ('tx_bytes', 'tx_drops', 'rx_bytes', 'rx_bytes_per_s',
+                'rx_bytes_per_sim_s', 'xon', 'xoff'):
+            result[key] = c.get(key)
+        results.append(result)
+    return results
+
+
+TESTS = [
+    ('avr_to_host', source, avr_to_host),
+    ('host_to_avr', sink, host_to_avr),
+    ('latency', echo, latency),
+]
+
+if __name__ == '__main__':
+    seconds = float(os.environ.get('BENCH_SECONDS', '5'))
+    boards = int(os.environ.get('UART_BENCH_BOARDS', '2'))
+    speed = os.environ.get('UART_BENCH_SPEED', 'realtime')
+    timing = os.environ.get('UART_BENCH_TIMING', 'turbo')
+    backend = os.environ.get('UART_BENCH_BACKEND', 'pty')
+    port = int(os.environ.get('UART_BENCH_PORT', '47000'))
+    only = sys.argv[1:]
+    top = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+    revs = {'drumfish': git_rev(top),
+            'simavr': git_rev(os.path.join(top, 'simavr'))}
+
+    with tempfile.TemporaryDirectory(prefix='drumfish-uart-bench-') as tmp:
+        for name, body, test in TESTS:
+            if only and name not in only:
+                continue
+            for result in run(name, body, test, seconds, boards, speed,
+                    timing, backend, port, tmp):
+                result.update(revs)
+                print(json.dumps(result))
+            sys.stdout.flush()